@@ -13,11 +13,13 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <fts.h>
+#include <grp.h>
 #include <hdf5.h>
 #include <hiredis/hiredis.h>
 #include <hiredis/async.h>
 #include <jansson.h>
 #include <jpeglib.h>
+#include <limits.h>
 #include <math.h>
 #include <mcheck.h>
 #include <netdb.h>
@@ -35,9 +37,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <tiffio.h>
 #include <time.h>
@@ -45,6 +53,12 @@
 #include <unistd.h>
 #include <zmq.h>
 
+//! Build our AVX2 paths.  They are compiled for AVX2 whatever CFLAGS say and only run when the CPU has it.
+#if defined(__x86_64__) || defined(__i386__)
+#define IS_AVX2 1
+#include <immintrin.h>
+#endif
+
 #include "isBitmapFont.h"
 
 /** Make use of assert function to try an catch programming errors.
@@ -59,6 +73,15 @@
 //! TCP Port of the aforementioned redis server
 #define REMOTE_SERVER_REDIS_PORT 6379
 
+//! Believe a session still exists for this long (seconds) before asking the remote redis again
+#define IS_AUTH_TTL 60
+
+//! Ask the remote redis about every session we remember this often (seconds)
+#define IS_AUTH_REVALIDATE 20
+
+//! Publish a session id here on the remote redis to have us forget it right away
+#define IS_AUTH_CHANNEL "isAuthInvalidate"
+
 //! The redis store needs some debugging:  Ignore it for now.
 #define IS_IGNORE_REDIS_STORE
 
@@ -72,6 +95,9 @@
 //! Keep about this many images in memory.
 #define N_IMAGE_BUFFERS 4096
 
+//! Image buffer cache byte budget.  Prefetching stops once the buffers hold this much (requests are never refused).
+#define IS_DATA_CACHE_BYTES (2L * 1024L * 1024L * 1024L)
+
 //! Each user/esaf combination gets this many threads.
 #define N_WORKER_THREADS 16
 
@@ -81,6 +107,18 @@
 //! There is some overhead for jpegs, this should allow enough overhead for output buffer allocation purposes.
 #define MIN_JPEG_BUFFER 2048
 
+//! Keep at most this many encoded placeholder images per process
+#define IS_JPEG_BLANK_CACHE_SIZE 64
+
+//! Keep at most this many rendered labels per process
+#define IS_LABEL_CACHE_SIZE 256
+
+//! Width of the quick preview published before a full render
+#define IS_PREVIEW_WIDTH 128
+
+//! Don't wait longer than this to connect to a job's progress redis server
+#define IS_PROGRESS_CONNECT_TIMEOUT_MS 100
+
 //! Default size (width) of the spot finder image
 #define IS_DEFAULT_SPOT_IMAGE_WIDTH 384
 
@@ -93,15 +131,244 @@
 #define ERR_REP        "inproc://#err_rep"
 #define ERR_DEV_REP    "inproc://#err_dev_rep"
 
+//! Broker: requests from is_proxy handed by the router thread to the main loop
+#define BROKER_REQUESTS     "inproc://#is_requests"
+
+//! Broker: replies from the forwarding threads (and the main loop) on their way to is_proxy
+#define BROKER_REPLIES      "inproc://#is_replies"
+
+//! Broker: commands for forwarding thread %d
+#define BROKER_FORWARD      "inproc://#is_forward_%d"
+
 //! Spot sensor sensitivity
 //!
 //! Pixel value above a std dev to delcare a spot found
 #define IS_SPOT_SENSITIVITY 1.5
 
-//! Output image bins for spot finder and, eventually, ice detection
+//! Full resolution spot finder: threads (row bands) per frame
+#define IS_SPOT_FINDER_THREADS 8
+
+//! Full resolution spot finder: background rings around the beam center
+#define IS_SPOT_FINDER_BINS 64
+
+//! Full resolution spot finder: default standard deviations above background for a spot pixel
+#define IS_SPOT_FINDER_SIGMA 3.0
+
+//! Full resolution spot finder: pixels this many standard deviations above the mean are left out of the background
+#define IS_SPOT_FINDER_CLIP 3.0
+
+//! Full resolution spot finder: default minimum number of pixels in a spot
+#define IS_SPOT_FINDER_MIN_PIXELS 3
+
+//! Full resolution spot finder: default maximum number of spots in the returned list
+#define IS_SPOT_FINDER_MAX_LIST 1000
+
+//! Dataset sweep: frames read at once by each sweep
+#define IS_SWEEP_THREADS 4
+
+//! Dataset sweep: longest frame range we'll take on
+#define IS_SWEEP_MAX_FRAMES 100000
+
+//! Dataset sweep: keep per-frame results in our local redis this long (seconds)
+#define IS_SWEEP_TTL 604800
+
+//! Async jobs: executor threads per user process
+#define IS_ASYNC_THREADS 4
+
+//! Async jobs: most jobs waiting for an executor
+#define IS_ASYNC_QUEUE_LENGTH 32
+
+//! Async jobs: forget results not collected after this long (seconds)
+#define IS_ASYNC_TTL 600
+
+//! Async jobs: states
+#define IS_ASYNC_QUEUED  0
+#define IS_ASYNC_RUNNING 1
+#define IS_ASYNC_DONE    2
+
+//! Worker threads allowed to run long jobs (index, sweep) at once.  The rest are kept for interactive jobs.
+#define IS_WORKER_MAX_LONG 4
+
+//! Main loop: an optional frame ahead of the request, "is-route <pid> <esaf>", saves us looking inside it
+#define IS_ROUTE_PREFIX "is-route "
+
+//! Main loop: most routing messages, or request parts, we take from is_proxy per request
+#define IS_PARKED_PARTS 16
+
+//! Broker: most sockets handed back by isPollWait at once
+#define IS_POLL_EVENTS 64
+
+//! Broker: most messages forwarded from one socket before the others get a turn
+#define IS_POLL_BATCH 32
+
+//! Broker: threads forwarding replies from user processes
+#define IS_BROKER_FORWARDERS 4
+
+//! Broker: log traffic counts this often (seconds), when there has been any
+#define IS_BROKER_STATS_SECONDS 60
+
+//! Broker: our figures go to this hash in our local redis every IS_BROKER_STATS_SECONDS
+#define IS_BROKER_STATS_KEY     "is-broker-stats"
+#define IS_BROKER_DEV_STATS_KEY "is-dev-broker-stats"
+
+//! Admission: most requests in all our user processes at once.  More get a "busy" reply.  The environment variable IS_QUEUE_GLOBAL overrides.
+#define IS_QUEUE_GLOBAL 1024
+
+//! Admission: most requests in one user process at once (IS_QUEUE_PROCESS overrides)
+#define IS_QUEUE_PROCESS 128
+
+//! High water mark for the sockets requests queue on, well above the admission limits so it is only a backstop (IS_QUEUE_HWM overrides)
+#define IS_QUEUE_HWM 8192
+
+//! User processes forked and warmed up before anyone needs them, waiting to be told whose they are (IS_ZYGOTES overrides, 0 for none)
+#define IS_ZYGOTES 2
+
+//! Seconds between looks for zygotes that died waiting
+#define IS_ZYGOTE_CHECK_SECS 5
+
+//! Supervisor: update our traffic figures in redis (KEY-stats) this often (seconds)
+#define IS_SUPERVISOR_STATS_SECONDS 15
+
+//! Scheduler: priority classes, best first
+#define IS_SCHED_VIEW      0
+#define IS_SCHED_THUMBNAIL 1
+#define IS_SCHED_SPOTS     2
+#define IS_SCHED_INDEX     3
+#define IS_SCHED_IDLE      4
+#define IS_SCHED_CLASSES   5
+
+//! Scheduler: jpegs no larger than this (either way) are thumbnails
+#define IS_SCHED_THUMBNAIL_SIZE 256
+
+//! Scheduler: thumbnails not started within this many milliseconds get an error instead (the README's budget)
+#define IS_SCHED_THUMBNAIL_DEADLINE_MS 500
+
+//! Scheduler: most frames (routing, delimiter, request) we hold per job
+#define IS_SCHED_PARTS 32
+
+//! Scheduler: try a worker that was not connected yet again after this many milliseconds
+#define IS_SCHED_RETRY_MS 10
+
+//! Prefetch: main view requests for successive frames before we start reading ahead
+#define IS_PREFETCH_RUN 2
+
+//! Prefetch: read and reduce this many frames ahead of the user
+#define IS_PREFETCH_FRAMES 4
+
+//! Prefetch: most worker threads prefetching at once
+#define IS_PREFETCH_WORKERS 2
+
+//! Reductions: rows between checks for a superseded job
+#define IS_REDUCE_BAND_ROWS 32
+
+//! Subprocesses: keep the final status in redis this long (seconds)
+#define IS_SUBPROCESS_STATUS_TTL 86400
+
+//! Subprocesses: bytes read from a child's pipe at a time
+#define IS_SUBPROCESS_READ_SIZE 65536
+
+//! Subprocesses: most events the reactor takes from epoll at once
+#define IS_SUBPROCESS_EVENTS 64
+
+//! Subprocesses: seconds to let redis finish up after a child exits
+#define IS_SUBPROCESS_REDIS_GRACE 5
+
+//! Indexing: jobs running at once on this node, all users together
+#define IS_INDEX_MAX_RUNNING 4
+
+//! Indexing: one lock file per slot lives here.  The kernel lets go of a slot whose holder dies.
+#define IS_INDEX_SLOT_DIR "/run/is-index"
+
+//! Indexing: group that may open the slot files, given to every user process (the IS_INDEX_SLOT_GROUP environment variable overrides this).  Without it the server's own group.
+#define IS_INDEX_SLOT_GROUP "is-index"
+
+//! Indexing: sent to a runner waiting for a slot when its job is cancelled
+#define IS_INDEX_SLOT_SIGNAL (SIGRTMIN+1)
+
+//! Indexing: threads per user process that take jobs off the queue, and the most indexers a user process runs at once
+#define IS_INDEX_RUNNERS 2
+
+//! Indexing: most jobs waiting to run in a user process
+#define IS_INDEX_QUEUE_LENGTH 8
+
+//! Indexing: the indexer (the IS_INDEX_COMMAND environment variable overrides this, say for is_index_stub.sh)
+#define IS_INDEX_COMMAND "/pf/local/rapd/bin/rapd.index"
+
+//! Indexing: sourced once per process to learn the environment the indexer needs
+#define IS_INDEX_SETUP "/usr/local/bin/is_indexing_setup.sh"
+
+//! Indexing: put ahead of the setup script's PATH
+#define IS_INDEX_PATH "/pf/local/rapd/bin"
+
+//! Indexing: keep results in our local redis this long (seconds)
+#define IS_INDEX_CACHE_TTL 2592000
+
+//! Indexing: working directory for each job
+#define IS_INDEX_TMP_TEMPLATE "/pf/tmp/isIndex-XXXXXX"
+
+//! Indexing: the indexer's file descriptors for its json result and its progress reports
+#define IS_INDEX_JSON_FD     3
+#define IS_INDEX_PROGRESS_FD 4
+
+//! Radial profile: threads per frame
+#define IS_PROFILE_THREADS 8
+
+//! Radial profile: default number of resolution bins
+#define IS_PROFILE_BINS 500
+
+//! Radial profile: most resolution bins we'll hand out
+#define IS_PROFILE_MAX_BINS 4000
+
+//! Overlays: layer values (and overlay palette entries) for each kind of mark
+#define IS_OVERLAY_NONE      0
+#define IS_OVERLAY_RING      1
+#define IS_OVERLAY_CROSSHAIR 2
+#define IS_OVERLAY_SPOT      3
+#define IS_OVERLAY_KINDS     4
+
+//! Overlays: most resolution rings we'll draw
+#define IS_OVERLAY_MAX_RINGS 16
+
+//! Overlays: rings bigger than this (in output pixels) can't be on the image
+#define IS_OVERLAY_MAX_RADIUS 1.0e6
+
+//! Overlays: most points plotted around one ring
+#define IS_OVERLAY_MAX_RING_STEPS (1 << 20)
+
+//! Overlays: length of each arm of the beam center crosshair in output pixels
+#define IS_OVERLAY_CROSSHAIR_ARM 8
+
+//! Overlays: half the width of the box drawn around a spot in output pixels
+#define IS_OVERLAY_SPOT_BOX 3
+
+//! Overlays: most spots we'll mark
+#define IS_OVERLAY_MAX_SPOTS 1000
+
+//! Output image bins for spot finder and ice detection
 //!
 #define IS_OUTPUT_IMAGE_BINS 16
 
+//! Cells in the squared distance lookup table used by get_bin_number (a multiple of IS_OUTPUT_IMAGE_BINS)
+#define IS_BIN_LUT_SIZE 4096
+
+//! Lookup table entry for a cell that is partly in an ice ring: check the bin's ice ring list
+#define IS_BIN_LUT_MIXED 0xff
+
+//! Room for ice ring list entries (a ring that straddles bins needs one entry per bin)
+#define IS_ICE_RING_NODES 32
+
+//! Pixel value histogram: bins for each power of 2 (must be 8 to match histogram_bin)
+#define IS_HISTOGRAM_BINS_PER_OCTAVE 8
+
+//! Pixel value histogram: zeros plus 32 octaves
+#define IS_HISTOGRAM_BINS (1 + 32 * IS_HISTOGRAM_BINS_PER_OCTAVE)
+
+//! Automatic contrast: percentile of the non-zero pixels that are rendered white
+#define IS_AUTO_WVAL_PERCENTILE 50.0
+
+//! Automatic contrast: percentile of the non-zero pixels that are rendered black
+#define IS_AUTO_BVAL_PERCENTILE 99.5
+
 /** The access we've determined by fstat as the uid/gid that will be
  ** trying to read the file.
  */
@@ -126,11 +393,11 @@ typedef struct ice_ring_struct {
   double low;   //!< Outer part of ice ring in Å
 } ice_ring_t;
 
-/** List of ice rings converted into distance from direct beam in mm                                    */
+/** List of ice rings converted into distance from direct beam in output image pixels                   */
 typedef struct ice_ring_list_struct {
   struct ice_ring_list_struct *next;    //!< Next item in our list
-  double dist2_low;                     //!< minimum distance in mm to beam center
-  double dist2_high;                    //!< maximum distance in mm to beam center
+  double dist2_low;                     //!< minimum distance^2, in pixels, to beam center
+  double dist2_high;                    //!< maximum distance^2, in pixels, to beam center
 } ice_ring_list_t;
 
 /** Statistics accumulated for an ring of image data                                                    */
@@ -170,21 +437,123 @@ typedef struct isImageBufStruct {
   void (*destroy_extra)(void *);        //!< Function to destroy the extra stuff
   void *buf;                            //!< Our buffer
   bin_t bins[IS_OUTPUT_IMAGE_BINS+1];   //!< stats for our spot finder
+  uint32_t histogram[IS_HISTOGRAM_BINS]; //!< log binned pixel values (see histogram_bin)
   double beam_center_x;                 //!< beam_center_x scaled to current image
   double beam_center_y;                 //!< beam_center_x scaled to current image
   double min_dist2;                     //!< square of the minimum possible distance from a pixel to the beam center
   double max_dist2;                     //!< square of the maximum possible distance from a pixel to the beam center
+  double box_w;                         //!< source image pixels per pixel of this image horizontally (reduced images)
+  double box_h;                         //!< source image pixels per pixel of this image vertically (reduced images)
+  int n_ice_rings;                      //!< number of ice rings that fall on this image
+  ice_ring_list_t ice_ring_nodes[IS_ICE_RING_NODES]; //!< storage for the bins' ice ring lists
+  uint8_t bin_lut[IS_BIN_LUT_SIZE];     //!< bin number by squared distance (see set_up_bins)
 } isImageBufType;
 
+/** A spot found by isSpotFinder                                                                        */
+typedef struct isSpotStruct {
+  double x;                             //!< intensity weighted column
+  double y;                             //!< intensity weighted row
+  double intensity;                     //!< background subtracted sum of the pixels
+  int npix;                             //!< number of pixels in the spot
+  uint32_t peak;                        //!< largest pixel value in the spot
+} isSpotType;
+
+/** A placeholder jpeg encoded once and shared by all the replies that need it */
+typedef struct isJpegBlankStruct {
+  struct isJpegBlankStruct *next;       //!< The next blank in our list, most recently used first
+  char *key;                            //!< width, label height, and label text that made this image
+  unsigned char *buf;                   //!< The encoded jpeg
+  int buf_size;                         //!< Length of buf in bytes
+  int refs;                             //!< One for the cache plus one per zmq message still sending buf.  Change atomically.
+} isJpegBlankType;
+
+/** A dataset sweep in progress.  Lets sweep_cancel find it by tag.                                      */
+typedef struct isSweepStruct {
+  struct isSweepStruct *next;           //!< The next sweep in our list
+  char *tag;                            //!< The tag of the job that started the sweep
+  volatile int cancelled;               //!< Set by sweep_cancel, checked by the sweep's reader threads
+} isSweepType;
+
+/** An indexing job, queued or running.  The worker thread that took
+ ** the request waits on cond for done and sends the reply.
+ */
+typedef struct isIndexJobStruct {
+  struct isIndexJobStruct *next;        //!< The next job in our list (oldest first)
+  char *tag;                            //!< The tag of the request, used by index_cancel
+  char *fn1;                            //!< First file to index
+  char *fn2;                            //!< Second file to index (may be NULL)
+  int frame1;                           //!< First frame (HDF5)
+  int frame2;                           //!< Second frame (HDF5)
+  char *detector;                       //!< --detector argument for the indexer (may be NULL)
+  char *cache_key;                      //!< Where the result goes in our local redis.  Identical requests join this job.
+  int waiters;                          //!< Worker threads waiting for this job.  The last one frees it.
+  int cacheable;                        //!< The result is worth keeping
+  char *progressPublisher;              //!< Redis channel for progress reports (may be NULL)
+  char *progressAddress;                //!< Redis server for progress reports (NULL for our local one)
+  int progressPort;                     //!< Port for progressAddress
+  char *controlPublisher;               //!< Redis channel isSubProcess listens to for {"sig":n}
+  char *controlAddress;                 //!< Redis server for controlPublisher
+  int controlPort;                      //!< Port for controlAddress
+  volatile int cancelled;               //!< Set by index_cancel
+  int running;                          //!< A runner has taken the job
+  pthread_t runner;                     //!< That runner
+  int slot_wait;                        //!< The runner is blocked waiting for an indexing slot
+  int done;                             //!< Result is ready
+  pid_t pid;                            //!< The indexer, once started (0 before)
+  json_t *result;                       //!< What the indexer had to say
+  pthread_cond_t cond;                  //!< Signaled (with indexMutex) when done
+} isIndexJobType;
+
+/** A job run by an async executor, and what it sent back
+ */
+typedef struct isAsyncJobStruct {
+  struct isAsyncJobStruct *next;        //!< The next job in our list (oldest first)
+  char jobid[64];                       //!< What the user asks for with "result"
+  char *job_type;                       //!< The job's type
+  json_t *job;                          //!< The job itself
+  int state;                            //!< IS_ASYNC_QUEUED, IS_ASYNC_RUNNING, or IS_ASYNC_DONE
+  time_t finished;                      //!< When the job finished
+  zmq_msg_t *parts;                     //!< The reply the job sent
+  int nparts;                           //!< Number of parts in the reply
+} isAsyncJobType;
+
 /** Managed by isSupervisor (in isWorker.c)                                                             */
 typedef struct isWorkerContextStruct {
   isImageBufType *first;                //!< The first image buffer in our linked list
-  const char *key;                      //!< same as the process list key but accessible to the threads: this is the redis key for the job list
+  char key[128];                        //!< same as the process list key but accessible to the threads.  A zygote starts with its own name: isDataConnect overwrites it in place while the threads run
+  char inprocKey[128];                  //!< Names our inproc endpoints.  Never changes: a zygote's keep the zygote name
   int n_buffers;                        //!< The number of buffers in the list (so we know when to remake the hash table
   int max_buffers;                      //!< Maximum number of buffers allowed in the hash table
   pthread_mutex_t ctxMutex;             //!< Lock access to the image buffers
   pthread_mutex_t metaMutex;            //!< control access to json functions, particularly dumps
   struct hsearch_data bufTable;         //!< Hash table to find the correct buffer quickly
+  isJpegBlankType *blanks;              //!< Cache of encoded placeholder images
+  pthread_mutex_t blankMutex;           //!< Lock access to the blanks list
+  isSweepType *sweeps;                  //!< Dataset sweeps in progress
+  pthread_mutex_t sweepMutex;           //!< Lock access to the sweeps list
+  isIndexJobType *indexJobs;            //!< Indexing jobs queued or running, oldest first
+  int indexWaiting;                     //!< Number of indexJobs not yet running
+  int indexStop;                        //!< Tells the indexing runners to quit
+  int indexRunners;                     //!< Number of indexing runner threads started
+  int indexRunning;                     //!< Number of indexers started and not yet finished
+  pthread_t indexThreads[IS_INDEX_RUNNERS]; //!< Our indexing runners
+  pthread_mutex_t indexMutex;           //!< Lock access to the index members here
+  pthread_cond_t indexCond;             //!< Signaled when there is a job for a runner, an indexer finishes, or indexStop
+  pthread_mutex_t indexEnvMutex;        //!< Lock access to indexEnv (held while the setup script runs)
+  char **indexEnv;                      //!< Environment left by the indexing setup script (NULL until needed)
+  time_t indexEnvTime;                  //!< Modification time of the setup script when indexEnv was made
+  isAsyncJobType *asyncJobs;            //!< Async jobs queued, running, or waiting to be collected
+  int asyncWaiting;                     //!< Number of asyncJobs not yet running
+  int asyncStop;                        //!< Tells the executors to quit
+  int asyncRunners;                     //!< Number of executors started
+  pthread_t asyncThreads[IS_ASYNC_THREADS]; //!< Our executors
+  pthread_mutex_t asyncMutex;           //!< Lock access to the async members here
+  pthread_cond_t asyncCond;             //!< Signaled when there is a job for an executor (or asyncStop)
+  long jobsTaken;                       //!< Requests picked up by the worker threads.  Change atomically.
+  long jobsDone;                        //!< and answered.  Change atomically.
+  int workerSerial;                     //!< Numbers the worker threads.  Change atomically.
+  pthread_t schedThread;                //!< Our scheduler (isSched)
+  int superseded[N_WORKER_THREADS];     //!< Set by isSched when worker n's job has been superseded.  Change atomically.
   void *zctx;                           //!< zmq context to transmit data hither and yon
   void *router;                         //!< zmq socket to talk to our parent process
   void *dealer;                         //!< zmq socket to talk to our threads
@@ -197,6 +566,45 @@ typedef struct isThreadContextStruct {
 } isThreadContextType;
 
 /** Managed by isMain                                                                                           */
+/** One socket serviced by a broker thread.  See isPollWait.                                            */
+typedef struct isPollEntryStruct {
+  struct isPollEntryStruct *next;       //!< Next socket that may have something for us
+  struct isPollerStruct *poller;        //!< Poller we belong to
+  void *socket;                         //!< The ZMQ socket (NULL for redis)
+  void *data;                           //!< Whatever isPollAdd was given
+  redisAsyncContext *ac;                //!< Or the redis connection (NULL once hiredis is done with it)
+  int fd;                               //!< Its ZMQ_FD or redis socket, watched by our epoll set
+  uint32_t events;                      //!< Redis: what hiredis wants to hear about
+  int registered;                       //!< fd is in our epoll set
+  int sticky;                           //!< Always check this one: we send on it too and that can eat its ZMQ_FD wake up
+  int listed;                           //!< On the list of sockets to check
+} isPollEntryType;
+
+/** The sockets one broker thread waits on                                                             */
+typedef struct isPollerStruct {
+  int fd;                               //!< Our epoll set
+  isPollEntryType *list;                //!< Sockets that may have something to read
+  isPollEntryType *dead;                //!< Redis entries hiredis is done with, freed before we next wait
+} isPollerType;
+
+/** A request from is_proxy waiting to hear from the remote redis whether its session is still good      */
+typedef struct isParkedStruct {
+  struct isParkedStruct *next;          //!< Next request, in the order they came in
+  zmq_msg_t envelope_msgs[IS_PARKED_PARTS]; //!< Routing messages
+  int n_envelope_msgs;                  //!< Number of routing messages not yet sent
+  zmq_msg_t parts[IS_PARKED_PARTS];     //!< The request itself and any parts that came with it
+  int nparts;                           //!< Number of parts not yet sent
+  char *pid;                            //!< Session
+  int esaf;                             //!< ESAF wanted
+  int known;                            //!< We already run this session: just ask whether it still exists
+  int waiting;                          //!< Still waiting for redis
+  int reply_type;                       //!< Redis reply type, -1 if the connection went away
+  long long reply_integer;              //!< Answer to EXISTS
+  char *reply_str;                      //!< Redis error message
+  int auth_type;                        //!< Reply type for isAuth
+  char *auth_str;                       //!< isAuth itself
+} isParkedType;
+
 typedef struct isProcessListStruct {
   struct isProcessListStruct *next;     //!< Linked list of of processes running as a specific user in a specific group
   const char *key;                      //!< Unique key to identify this user/esaf combination
@@ -204,7 +612,13 @@ typedef struct isProcessListStruct {
   int esaf;                             //!< Our esaf
   pid_t processID;                      //!< The process id returned to the parent by fork
   json_t *isAuth;                       //!< Authenticated user name, role, and list of allowed esafs
-  void *parent_dealer;                  //!< parent side of parent/child proxy (ipc)
+  void *parent_dealer;                  //!< parent side of parent/child proxy (ipc), owned by our forwarding thread
+  int forwarder;                        //!< Forwarding thread that owns parent_dealer
+  isPollEntryType *poll;                //!< parent_dealer's place in the forwarding thread's poller
+  long long replies;                    //!< Reply messages forwarded to is_proxy (forwarding thread's count)
+  long long reply_bytes;                //!< and their size
+  int queued;                           //!< Requests sent to the process and not answered yet.  Change atomically.
+  long long shed;                       //!< Requests answered "busy" instead (main loop's count)
 } isProcessListType;
 
 
@@ -224,10 +638,10 @@ typedef struct isSubProcessFD_struct {
   int fd;                                 // child's file descriptor we want to pipe
   int is_out;                             // 0 = we write to (like stdin), 1 = we read from (like stdout)
   int read_lines;                         // 1 = send full lines only to onProgress, 0 = whatever we have
-  int (*onProgress)(char *);              // if not null this function handles the progress updates.  Returns progress in percent from 0 to 100 or -1 if none present
-  void (*onDone)(char *);                 // if not null this function handles the final result
+  int (*onProgress)(void *, char *);      // if not null this function handles the progress updates.  Returns progress in percent from 0 to 100 or -1 if none present
+  void (*onDone)(void *, char *);         // if not null this function handles the final result
   int _piped_fd;                          // (private) parent's version of fd
-  int _event;                             // (private) our poll event (POLLIN or POLLOUT)
+  int _event;                             // (private) our epoll event (EPOLLIN or EPOLLOUT)
   int _pipe[2];                           // (private) pipe between parent and child
   char *_buf;                             // our reading buffer
   char *_buf_end;                         // end of _s
@@ -246,10 +660,17 @@ typedef struct isSubProcess_struct {
   const char *controlAddress;           // host that publishes signals and input via redis
   int   controlPort;                    // redis port
   const char *controlPublisher;         // Name of publisher to subscribe to
+  const char *progressAddress;          // redis host for isSubProcessPublish (NULL for our local one)
+  int   progressPort;                   // its port
+  const char *progressPublisher;        // channel isSubProcessPublish sends to (NULL for none)
+  const char *cwd;                      // directory to run in (NULL to stay put)
   isSubProcessFD_type *fds;             // list of fds we are asked to manage
   int nfds;                             // number of fds in list
-  void (*onLaunch)(char *msg, int pid); // Launch CB: msg error messessage for failed launch (or NULL if OK), pid of child process
+  void (*onLaunch)(void *data, char *msg, int pid); // Launch CB: msg error messessage for failed launch (or NULL if OK), pid of child process
+  void (*onExit)(void *data);           // Exit CB: child is gone and its output handed over.  spt is the caller's again.
+  void *data;                           // passed to each of the callbacks
   int rtn;                              // return value of sub process
+  void *_child;                         // (private) the reactor's record of the child
 } isSubProcess_type;
 
 /** h5 to json equivalencies.  We read HDF5 properties and convert
@@ -261,31 +682,76 @@ struct h5_json_property {
 };
 
 char *file_name_component(const char *parent_id, const char *path);
+char *isZygoteWait(int fd);
 double get_double_from_json_object(const char *cid,  const json_t *j, const char *key);
+double isHistogramPercentile(const uint32_t *histogram, double pct);
+const char *isColormapName(int cmap);
+const uint8_t *isToneMapLut16(int32_t wval, int32_t bval);
 image_access_type isFindFile(const char *fn);
 image_file_type isFileType(const char *fn);
 int get_integer_from_json_object(const char *cid, json_t *j, char *key);
+int isAsyncIsLong(const char *job_type);
+int isAuthAsk(isPollerType *pp, isParkedType *pk);
+int isAuthCacheValid(const char *pid);
+int isQueueHwm();
+int isQueueSetting(const char *name, int def);
+int isBrokerReply(void *socket);
+int isRouteFrame(const char *buf, size_t len, const char **pid, int *pid_len, int *esaf);
+int isRouteScan(const char *buf, size_t len, const char **pid, int *pid_len, int *esaf);
+int isColormapFind(const char *name);
 int isH5GetData(const char *fn, isImageBufType* imb);
+int isImageFileData(const char *fn, isImageBufType *imb);
+int isJpegPreview(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job);
 int isNProcesses();
+int isPollWait(isPollerType *pp, isPollEntryType **ready, int max);
 int isRayonixGetData(const char *fn, isImageBufType* imb);
+int isReducedImageCached(isWorkerContext_t *wctx, json_t *job);
+int isSchedSuperseded(isWorkerContext_t *wctx);
+int isSpotFinder(isImageBufType *raw, double sigma, int min_pixels, isSpotType **spotsp);
 int isCbfGetData(const char *fn, isImageBufType* imb);
 int isTiffGetData(const char *fn, isImageBufType* imb);
 int is_h5_error_handler(hid_t estack_id, void *dummy);
 isImageBufType *isGetImageBufFromKey(isWorkerContext_t *ibctx, char *key);
 isImageBufType *isGetRawImageBuf(isWorkerContext_t *ibctx, json_t *job);
 isImageBufType *isReduceImage(isWorkerContext_t *ibctx, json_t *job);
+isPollEntryType *isPollAdd(isPollerType *pp, void *socket, int sticky, void *data);
+isPollerType *isPollerNew();
 isProcessListType *isFindProcess(const char *pid, int esaf);
 isProcessListType *isRun(void *zctx, redisContext *rc, json_t *isAuth, int esaf, int dev_mode);
+isSpotType *isSpotsFind(isWorkerContext_t *wctx, json_t *job, const char *fn, int frame, double sigma, int min_pixels, int *nspotsp, json_t **metap, isImageBufType **imbp);
 isWorkerContext_t  *isDataInit(const char *key);
 json_t *isH5GetMeta(const char *fn);
+json_t *isImageFileMeta(const char *fn);
 json_t *isRayonixGetMeta(const char *fn);
 json_t *isCbfGetMeta(const char *fn);
 json_t *isTiffGetMeta(const char *fn);
+long isDataCacheBytes(isWorkerContext_t *wctx);
+redisContext *isProgressRedis(isThreadContextType *tcp, const char *address, int port);
+uint32_t isColormapOverlayColor(int cmap, int kind);
+unsigned char *isJpegEncode(isWorkerContext_t *wctx, json_t *job, isImageBufType *imb, int *jpeg_len);
+void *isBrokerInit(void *zctx, void *router, int dev_mode);
 void destroyImageBuffer(isWorkerContext_t *wctx, isImageBufType *p);
+void isColormapApply(const uint8_t *idx, int n, int cmap, unsigned char *rgb);
+void isColormapRow16(const uint16_t *src, int n, const uint8_t *lut, int cmap, unsigned char *rgb);
+void isDataConnect(isWorkerContext_t *wctx, const char *key);
 void isDataDestroy(isWorkerContext_t *c);
+void isFindSpots(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job);
+void isAsyncDestroy(isWorkerContext_t *wctx);
+void isAsyncResult(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job);
+void isAsyncSubmit(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job, const char *job_type);
+void isForkServerInit();
 void isIndex( isWorkerContext_t *ibctx, isThreadContextType *tcp, json_t *job);
+void isIndexCancel(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job);
+void isIndexDestroy(isWorkerContext_t *wctx);
+void isIndexInit();
+gid_t isIndexSlotGroup();
+void isH5DestroyExtra(void *voidp);
 void isInit(int dev_mode);
 void isJpeg( isWorkerContext_t *ibctx, isThreadContextType *tcp, json_t *job);
+void isJpegPrefetch(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job);
+void isJpegBlankRelease(void *data, void *hint);
+void isLabelComposite(const char *text, int width, int height, unsigned char *dst, int stride, int components);
+void isLabelInit();
 void isLogging_alert(char *fmt, ...);
 void isLogging_crit(char *fmt, ...);
 void isLogging_debug(char *fmt, ...);
@@ -295,10 +761,31 @@ void isLogging_info(char *fmt, ...);
 void isLogging_init();
 void isLogging_notice(char *fmt, ...);
 void isLogging_warning(char *fmt, ...);
+void isOverlayComposite(isWorkerContext_t *wctx, json_t *job, isImageBufType *imb, int cmap, unsigned char *rgb);
+void isAuthCacheDrop(const char *pid);
+void isBrokerAdd(isProcessListType *p);
+void isBrokerForward(isParkedType *pk, isProcessListType *p);
+void isBrokerRemove(isProcessListType *p);
+void isAuthCacheInit();
+void isAuthCacheSet(const char *pid);
+void isAuthRemote(const char **address, int *port);
+void isPollList(isPollerType *pp, isPollEntryType *pe);
+void isPollRedis(isPollerType *pp, redisAsyncContext *ac);
+void isPollRemove(isPollerType *pp, isPollEntryType *pe);
 void isProcessListInit();
+void isProfile(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job);
+void isSchedInit(isWorkerContext_t *wctx);
+void isSchedSetWorker(int n);
+void isSchedWorkerId(int n, char *buf, int len);
 void isSpots( isWorkerContext_t *ibctx, isThreadContextType *tcp, json_t *job);
-void isSubProcess(const char *cid, isSubProcess_type *spt, pthread_mutex_t *mutex);
-void isSupervisor(const char *key);
+void isSweep(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job);
+void isSweepCancel(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job);
+void isSpotsReply(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job, json_t *meta);
+void isSubProcess(const char *cid, isSubProcess_type *spt);
+void isSubProcessPublish(isSubProcess_type *spt, const char *msg);
+void isSupervisor(const char *key, int zygote_fd);
+void isWorkerDispatch(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job, const char *job_type, const char *jobstr);
+void isToneMap32(const uint32_t *src, int n, int32_t wval, int32_t bval, uint8_t *idx);
 void isWriteImageBufToRedis(isWorkerContext_t *wctx, isImageBufType *imb, redisContext *rc);
 void is_zmq_error_reply(zmq_msg_t *msgs, int n_msgs, void *err_dealer, char *fmt, ...);
 void is_zmq_free_fn(void *data, void *hint);
@@ -307,8 +794,6 @@ void set_json_object_float_array_2d(const char *cid, json_t *j, const char *k, f
 void set_json_object_integer(const char *cid, json_t *j, const char *key, int value);
 void set_json_object_real(const char *cid, json_t *j, const char *key, double value);
 void set_json_object_string(const char *cid, json_t *j, const char *key, const char *fmt, ...);
-zmq_pollitem_t *isGetZMQPollItems();
-zmq_pollitem_t *isRemakeZMQPollItems(void *parent_router, void *err_rep, void *err_dealer);
 
 /**
  * Converts an HDF5 Dataset (a single property within a .h5 file) into a JSON object.
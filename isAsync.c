@@ -0,0 +1,464 @@
+/*! @file isAsync.c
+ *  @copyright 2018 by Northwestern University
+ *  @author Keith Brister
+ *  @brief Run long jobs away from the worker threads and hand back their results later
+ *
+ *  A job sent with "async":true is answered right away with a job id.
+ *  One of our executor threads then runs it exactly as a worker
+ *  would, except that its "rep" socket is one end of an inproc PAIR.
+ *  The executor keeps whatever the job sent on the other end until
+ *  a "result" job with that id asks for it.  The reply to "result"
+ *  is then, frame for frame, the reply the job would have sent
+ *  without "async".
+ *
+ *  When the job names a progressPublisher we also publish
+ *  {"jobid":..., "tag":..., "async":true, "done":true} there once the
+ *  result is ready.
+ */
+#include "is.h"
+
+/** Job types that tie up a worker thread for a long time.  Only
+ ** IS_WORKER_MAX_LONG worker threads may run these at once: the rest
+ ** are kept for the interactive jobs.
+ */
+static const char *long_job_types[] = {
+  "index",
+  "sweep",
+  NULL
+};
+
+/** Is this one of the job types that can run for a long time?
+ */
+int isAsyncIsLong(const char *job_type) {
+  int i;
+
+  for (i=0; long_job_types[i] != NULL; i++) {
+    if (strcasecmp(long_job_types[i], job_type) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/** Free an async job and any result frames it still holds.
+ ** Call with asyncMutex held, after the executors are gone, or for a
+ ** job that never made it onto the list.  We take metaMutex for the
+ ** json_decref ourselves so never call this with metaMutex held.
+ */
+static void isAsyncJobFree(isWorkerContext_t *wctx, isAsyncJobType *ap) {
+  int i;
+
+  for (i=0; i<ap->nparts; i++) {
+    zmq_msg_close(&ap->parts[i]);
+  }
+  free(ap->parts);
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  json_decref(ap->job);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  free(ap->job_type);
+  free(ap);
+}
+
+/** Forget results nobody came back for.  Call with asyncMutex held.
+ */
+static void isAsyncExpire(isWorkerContext_t *wctx) {
+  static const char *id = FILEID "isAsyncExpire";
+  isAsyncJobType **app;
+  isAsyncJobType *ap;
+  time_t now;
+
+  now = time(NULL);
+  app = &wctx->asyncJobs;
+  while (*app != NULL) {
+    ap = *app;
+    if (ap->state == IS_ASYNC_DONE && ap->finished + IS_ASYNC_TTL < now) {
+      isLogging_info("%s: Dropping unclaimed result for job %s\n", id, ap->jobid);
+      *app = ap->next;
+      isAsyncJobFree(wctx, ap);
+      continue;
+    }
+    app = &ap->next;
+  }
+}
+
+/** Tell whoever is listening that the result is ready
+ */
+static void isAsyncPublish(isWorkerContext_t *wctx, isThreadContextType *tcp, const char *jobid, json_t *job) {
+  static const char *id = FILEID "isAsyncPublish";
+  const char *progressPublisher;
+  const char *progressAddress;
+  const char *tag;
+  int progressPort;
+  redisContext *rrc;
+  redisReply *reply;
+  json_t *msg;
+  char *msg_str;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  progressPublisher = json_string_value(json_object_get(job, "progressPublisher"));
+  progressAddress   = json_string_value(json_object_get(job, "progressAddress"));
+  progressPort      = json_integer_value(json_object_get(job, "progressPort"));
+  tag               = json_string_value(json_object_get(job, "tag"));
+  msg = json_pack("{s:s,s:s,s:b,s:b}", "jobid", jobid, "tag", tag ? tag : "", "async", 1, "done", 1);
+  msg_str = msg ? json_dumps(msg, JSON_COMPACT) : NULL;
+  json_decref(msg);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  if (progressPublisher == NULL || msg_str == NULL) {
+    free(msg_str);
+    return;
+  }
+
+  rrc = isProgressRedis(tcp, progressAddress, progressPort);
+  if (rrc != NULL) {
+    reply = redisCommand(rrc, "PUBLISH %s %s", progressPublisher, msg_str);
+    if (reply == NULL) {
+      isLogging_info("%s: redis progress publisher %s returned error %s", id, progressPublisher, rrc->errstr);
+    } else {
+      freeReplyObject(reply);
+    }
+    if (rrc != tcp->rc) {
+      redisFree(rrc);
+    }
+  }
+  free(msg_str);
+}
+
+/** An executor: run async jobs until isAsyncDestroy says stop
+ **
+ ** @param voidp  opaque pointer to our worker context
+ */
+static void *isAsyncExecutor(void *voidp) {
+  static const char *id = FILEID "isAsyncExecutor";
+  static int serial = 0;
+  isWorkerContext_t *wctx;
+  isThreadContextType tc;
+  isAsyncJobType *ap;
+  void *collector;              // the other end of tc.rep: what the job sends lands here
+  char endpoint[128];
+  char jobid[sizeof(ap->jobid)];  // ap may be collected as soon as it is done
+  char *jobstr;
+  json_t *job;                    // our reference to ap->job for the same reason
+  int nparts;
+  zmq_msg_t zmsg;
+  int socket_option;
+  int err;
+
+  wctx = voidp;
+
+  snprintf(endpoint, sizeof(endpoint)-1, "inproc://#async-%s-%d", wctx->inprocKey, __sync_add_and_fetch(&serial, 1));
+  endpoint[sizeof(endpoint)-1] = 0;
+
+  collector = zmq_socket(wctx->zctx, ZMQ_PAIR);
+  tc.rep    = zmq_socket(wctx->zctx, ZMQ_PAIR);
+  if (collector == NULL || tc.rep == NULL) {
+    isLogging_err("%s: failed to create zmq socket: %s\n", id, zmq_strerror(errno));
+    exit (-1);
+  }
+
+  //
+  // Never block the job on a full pipe: we only read after it returns
+  //
+  socket_option = 0;
+  zmq_setsockopt(collector, ZMQ_RCVHWM, &socket_option, sizeof(socket_option));
+  zmq_setsockopt(tc.rep,    ZMQ_SNDHWM, &socket_option, sizeof(socket_option));
+
+  err = zmq_bind(collector, endpoint);
+  if (err == -1) {
+    isLogging_err("%s: Could not bind %s: %s\n", id, endpoint, zmq_strerror(errno));
+    exit (-1);
+  }
+
+  err = zmq_connect(tc.rep, endpoint);
+  if (err == -1) {
+    isLogging_err("%s: Failed to connect to %s: %s\n", id, endpoint, zmq_strerror(errno));
+    exit (-1);
+  }
+
+  //
+  // setup redis
+  //
+  tc.rc = redisConnect("127.0.0.1", 6379);
+  if (tc.rc == NULL || tc.rc->err) {
+    if (tc.rc != NULL) {
+      isLogging_err("%s: Failed to connect to redis: %s\n", id, tc.rc->errstr);
+    } else {
+      isLogging_err("%s: Failed to get redis context\n", id);
+    }
+    fflush(stderr);
+    exit (-1);
+  }
+
+  pthread_mutex_lock(&wctx->asyncMutex);
+  while (1) {
+    for (ap=wctx->asyncJobs; ap != NULL && ap->state != IS_ASYNC_QUEUED; ap=ap->next);
+    if (wctx->asyncStop) {
+      break;
+    }
+    if (ap == NULL) {
+      pthread_cond_wait(&wctx->asyncCond, &wctx->asyncMutex);
+      continue;
+    }
+    ap->state = IS_ASYNC_RUNNING;
+    wctx->asyncWaiting--;
+    pthread_mutex_unlock(&wctx->asyncMutex);
+
+    pthread_mutex_lock(&wctx->metaMutex);
+    jobstr = json_dumps(ap->job, JSON_INDENT(0) | JSON_COMPACT | JSON_SORT_KEYS);
+    pthread_mutex_unlock(&wctx->metaMutex);
+
+    isLogging_info("%s: Running job %s: %s\n", id, ap->jobid, jobstr);
+    isWorkerDispatch(wctx, &tc, ap->job, ap->job_type, jobstr);
+    free(jobstr);
+
+    pthread_mutex_lock(&wctx->asyncMutex);
+    while (1) {
+      zmq_msg_init(&zmsg);
+      if (zmq_msg_recv(&zmsg, collector, ZMQ_DONTWAIT) == -1) {
+        zmq_msg_close(&zmsg);
+        break;
+      }
+      ap->parts = realloc(ap->parts, (ap->nparts + 1) * sizeof(*ap->parts));
+      if (ap->parts == NULL) {
+        isLogging_crit("%s: Out of memory\n", id);
+        exit (-1);
+      }
+      zmq_msg_init(&ap->parts[ap->nparts]);
+      zmq_msg_move(&ap->parts[ap->nparts], &zmsg);
+      zmq_msg_close(&zmsg);
+      ap->nparts++;
+    }
+    ap->state    = IS_ASYNC_DONE;
+    ap->finished = time(NULL);
+    strcpy(jobid, ap->jobid);
+    nparts = ap->nparts;
+    pthread_mutex_lock(&wctx->metaMutex);
+    job = json_incref(ap->job);
+    pthread_mutex_unlock(&wctx->metaMutex);
+    pthread_mutex_unlock(&wctx->asyncMutex);
+
+    isLogging_info("%s: Job %s done, %d part result\n", id, jobid, nparts);
+    isAsyncPublish(wctx, &tc, jobid, job);
+
+    pthread_mutex_lock(&wctx->metaMutex);
+    json_decref(job);
+    pthread_mutex_unlock(&wctx->metaMutex);
+
+    pthread_mutex_lock(&wctx->asyncMutex);
+  }
+  pthread_mutex_unlock(&wctx->asyncMutex);
+
+  zmq_close(tc.rep);
+  zmq_close(collector);
+  redisFree(tc.rc);
+  return NULL;
+}
+
+/** Queue a job for our executors and reply with its id
+ **
+ ** @param wctx Worker context
+ **   @li @c wctx->asyncMutex  Keeps the job list in line
+ **
+ ** @param tcp Thread data
+ **   @li @c tcp->rep  ZMQ Response socket into which to throw our response.
+ **
+ ** @param job       The job to run later (we keep our own reference)
+ **
+ ** @param job_type  The job's type
+ */
+void isAsyncSubmit(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job, const char *job_type) {
+  static const char *id = FILEID "isAsyncSubmit";
+  static int serial = 0;
+  isAsyncJobType *ap;
+  isAsyncJobType **app;
+  json_t *meta;
+  char jobid[sizeof(ap->jobid)];
+  int waiting;
+  int err;
+  int i;
+
+  ap = calloc(1, sizeof(*ap));
+  if (ap == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  snprintf(ap->jobid, sizeof(ap->jobid), "%d-%ld-%d", (int)getpid(), (long)time(NULL), __sync_add_and_fetch(&serial, 1));
+  ap->job_type = strdup(job_type);
+  ap->state    = IS_ASYNC_QUEUED;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  ap->job = json_incref(job);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  pthread_mutex_lock(&wctx->asyncMutex);
+  isAsyncExpire(wctx);
+
+  if (wctx->asyncWaiting >= IS_ASYNC_QUEUE_LENGTH) {
+    pthread_mutex_unlock(&wctx->asyncMutex);
+    isAsyncJobFree(wctx, ap);
+    isLogging_info("%s: Async queue is full, refusing %s job\n", id, job_type);
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Async queue is full (%d jobs waiting)", id, IS_ASYNC_QUEUE_LENGTH);
+    return;
+  }
+
+  //
+  // Executors start with our first async job
+  //
+  for (i=wctx->asyncRunners; i<IS_ASYNC_THREADS; i++) {
+    err = pthread_create(&wctx->asyncThreads[i], NULL, isAsyncExecutor, wctx);
+    if (err != 0) {
+      isLogging_err("%s: Could not start executor %d: %s\n", id, i, strerror(err));
+      break;
+    }
+    wctx->asyncRunners++;
+  }
+
+  if (wctx->asyncRunners == 0) {
+    pthread_mutex_unlock(&wctx->asyncMutex);
+    isAsyncJobFree(wctx, ap);
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Could not start async executors", id);
+    return;
+  }
+
+  for (app=&wctx->asyncJobs; *app != NULL; app=&(*app)->next);
+  *app = ap;
+  waiting = ++wctx->asyncWaiting;
+  strcpy(jobid, ap->jobid);
+  pthread_cond_signal(&wctx->asyncCond);
+  pthread_mutex_unlock(&wctx->asyncMutex);
+
+  //
+  // ap belongs to the executors now: use our copy of the id
+  //
+  isLogging_info("%s: Queued %s job %s (%d waiting)\n", id, job_type, jobid, waiting);
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  meta = json_pack("{s:s,s:b,s:i}", "jobid", jobid, "async", 1, "waiting", waiting);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  isSpotsReply(wctx, tcp, job, meta);
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  json_decref(meta);
+  pthread_mutex_unlock(&wctx->metaMutex);
+}
+
+/** Hand back the result of an async job
+ **
+ ** Once the job is done we send exactly what it sent and forget it.
+ ** Until then we reply with {"jobid":..., "done":false, "state":...}.
+ **
+ ** @param wctx Worker context
+ **   @li @c wctx->asyncMutex  Keeps the job list in line
+ **
+ ** @param tcp Thread data
+ **   @li @c tcp->rep  ZMQ Response socket into which to throw our response.
+ **
+ ** @param job  What the user asked us to do
+ **   @li @c job->jobid  The id isAsyncSubmit replied with
+ */
+void isAsyncResult(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
+  static const char *id = FILEID "isAsyncResult";
+  const char *jobid;
+  isAsyncJobType **app;
+  isAsyncJobType *ap;
+  json_t *meta;
+  int state;
+  int err;
+  int i;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  jobid = json_string_value(json_object_get(job, "jobid"));
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  if (jobid == NULL) {
+    isLogging_err("%s: No jobid in job\n", id);
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: No jobid in job", id);
+    return;
+  }
+
+  pthread_mutex_lock(&wctx->asyncMutex);
+  isAsyncExpire(wctx);
+
+  ap = NULL;
+  for (app=&wctx->asyncJobs; *app != NULL; app=&(*app)->next) {
+    if (strcmp((*app)->jobid, jobid) == 0) {
+      ap = *app;
+      break;
+    }
+  }
+
+  if (ap == NULL) {
+    pthread_mutex_unlock(&wctx->asyncMutex);
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: No such job %s (already collected or expired?)", id, jobid);
+    return;
+  }
+
+  if (ap->state != IS_ASYNC_DONE || ap->nparts == 0) {
+    state = ap->state;
+    pthread_mutex_unlock(&wctx->asyncMutex);
+
+    if (state == IS_ASYNC_DONE) {
+      is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Job %s finished without a reply", id, jobid);
+      return;
+    }
+
+    pthread_mutex_lock(&wctx->metaMutex);
+    meta = json_pack("{s:s,s:b,s:s}", "jobid", jobid, "done", 0, "state", state == IS_ASYNC_QUEUED ? "queued" : "running");
+    pthread_mutex_unlock(&wctx->metaMutex);
+
+    isSpotsReply(wctx, tcp, job, meta);
+
+    pthread_mutex_lock(&wctx->metaMutex);
+    json_decref(meta);
+    pthread_mutex_unlock(&wctx->metaMutex);
+    return;
+  }
+
+  *app = ap->next;
+  pthread_mutex_unlock(&wctx->asyncMutex);
+
+  for (i=0; i<ap->nparts; i++) {
+    err = zmq_msg_send(&ap->parts[i], tcp->rep, i < ap->nparts - 1 ? ZMQ_SNDMORE : 0);
+    if (err == -1) {
+      isLogging_err("%s: Could not send part %d of job %s: %s\n", id, i, ap->jobid, zmq_strerror(errno));
+      break;
+    }
+  }
+
+  isAsyncJobFree(wctx, ap);
+}
+
+/** Stop our executors and drop any results not collected.  Jobs
+ ** already running are allowed to finish.  Called from isDataDestroy
+ ** once the worker threads are gone.
+ */
+void isAsyncDestroy(isWorkerContext_t *wctx) {
+  static const char *id = FILEID "isAsyncDestroy";
+  isAsyncJobType *ap;
+  isAsyncJobType *next;
+  int i;
+  int err;
+
+  pthread_mutex_lock(&wctx->asyncMutex);
+  wctx->asyncStop = 1;
+  pthread_cond_broadcast(&wctx->asyncCond);
+  pthread_mutex_unlock(&wctx->asyncMutex);
+
+  for (i=0; i<wctx->asyncRunners; i++) {
+    err = pthread_join(wctx->asyncThreads[i], NULL);
+    if (err != 0) {
+      isLogging_err("%s: Could not join executor %d: %s\n", id, i, strerror(err));
+    }
+  }
+  wctx->asyncRunners = 0;
+
+  for (ap=wctx->asyncJobs; ap != NULL; ap=next) {
+    next = ap->next;
+    isAsyncJobFree(wctx, ap);
+  }
+  wctx->asyncJobs = NULL;
+}
@@ -0,0 +1,539 @@
+/*! @file isAuth.c
+ *  @copyright 2018 by Northwestern University
+ *  @author Keith Brister
+ *  @brief Remember which sessions are still logged in so the main loop need not ask every time
+ *
+ *  The main loop used to ask the remote server's redis whether a
+ *  session ("pid") still exists for every request it passed on.  Now
+ *  a yes is remembered for IS_AUTH_TTL seconds in a hash table local
+ *  to the broker.
+ *
+ *  A thread of ours keeps the table honest:
+ *
+ *  @li It listens on the remote redis for keyspace notifications of
+ *  deleted or expired keys (when the server has them turned on) and
+ *  for session ids published on IS_AUTH_CHANNEL.  Those sessions are
+ *  forgotten immediately.
+ *
+ *  @li Every IS_AUTH_REVALIDATE seconds it asks the remote redis about
+ *  every session we remember, refreshing the ones that still exist
+ *  and forgetting the rest.  Should the remote redis be unreachable
+ *  nothing is refreshed and the sessions age out on their own.
+ *
+ *  Whatever the cache cannot answer goes to the remote redis over a
+ *  hiredis async connection serviced by the main loop poller
+ *  (isAuthAsk) so one user's trip to the remote redis does not hold
+ *  up everyone else.
+ *
+ *  Set IS_REMOTE_REDIS_ADDRESS and IS_REMOTE_REDIS_PORT in the
+ *  environment to use some other redis (a local redis-server, say)
+ *  in place of the remote server's.
+ */
+#include "is.h"
+
+/** Number of hash buckets.  Plenty for the sessions we see in a day. */
+#define IS_AUTH_BUCKETS 1024
+
+/** A session we believe in */
+typedef struct isAuthCacheStruct {
+  struct isAuthCacheStruct *next;       //!< Next in our bucket
+  char *pid;                            //!< Session id
+  time_t valid_until;                   //!< Ask the remote redis again after this
+  unsigned long gen;                    //!< auth_drop_gen when we made this entry
+} isAuthCacheType;
+
+static isAuthCacheType *auth_table[IS_AUTH_BUCKETS];
+static pthread_mutex_t auth_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t auth_thread;
+
+/** Bumped every time a session is forgotten (protected by auth_mutex) */
+static unsigned long auth_drop_gen = 0;
+/** The main loop's connection to the remote redis                */
+static redisAsyncContext *auth_ac = NULL;
+
+/** Which redis has our sessions
+ **
+ ** @param address Returned address of the remote redis
+ **
+ ** @param port    Returned port of the remote redis
+ */
+void isAuthRemote(const char **address, int *port) {
+  const char *s;
+
+  s = getenv("IS_REMOTE_REDIS_ADDRESS");
+  *address = (s != NULL && *s != 0) ? s : REMOTE_SERVER_REDIS_ADDRESS;
+
+  s = getenv("IS_REMOTE_REDIS_PORT");
+  *port = (s != NULL && atoi(s) > 0) ? atoi(s) : REMOTE_SERVER_REDIS_PORT;
+}
+
+/** Our bucket for this session
+ */
+static isAuthCacheType **isAuthBucket(const char *pid) {
+  unsigned int h;
+
+  for (h=5381; *pid; pid++) {
+    h = h * 33 + (unsigned char)*pid;
+  }
+  return &auth_table[h % IS_AUTH_BUCKETS];
+}
+
+/** Is this session known to be logged in?  This is the main loop's
+ ** hot path: no trip to the remote redis.
+ **
+ ** @param pid Session id
+ **
+ ** @returns 1 if so, 0 if we need to ask
+ */
+int isAuthCacheValid(const char *pid) {
+  isAuthCacheType *ap;
+  int rtn;
+
+  rtn = 0;
+  pthread_mutex_lock(&auth_mutex);
+  for (ap = *isAuthBucket(pid); ap != NULL; ap = ap->next) {
+    if (strcmp(ap->pid, pid) == 0) {
+      rtn = ap->valid_until > time(NULL);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&auth_mutex);
+  return rtn;
+}
+
+/** The remote redis says this session exists: believe it for a while.
+ **
+ ** @param pid Session id
+ */
+void isAuthCacheSet(const char *pid) {
+  static const char *id = FILEID "isAuthCacheSet";
+  isAuthCacheType **bucket;
+  isAuthCacheType *ap;
+
+  pthread_mutex_lock(&auth_mutex);
+  bucket = isAuthBucket(pid);
+  for (ap = *bucket; ap != NULL; ap = ap->next) {
+    if (strcmp(ap->pid, pid) == 0) {
+      break;
+    }
+  }
+
+  if (ap == NULL) {
+    ap = calloc(1, sizeof(*ap));
+    if (ap == NULL) {
+      isLogging_crit("%s: Out of memory\n", id);
+      exit (-1);
+    }
+    ap->pid = strdup(pid);
+    if (ap->pid == NULL) {
+      isLogging_crit("%s: Out of memory\n", id);
+      exit (-1);
+    }
+    ap->gen  = auth_drop_gen;
+    ap->next = *bucket;
+    *bucket  = ap;
+  }
+  ap->valid_until = time(NULL) + IS_AUTH_TTL;
+  pthread_mutex_unlock(&auth_mutex);
+}
+
+/** Forget a session.  The next request for it goes to the remote redis.
+ **
+ ** @param pid Session id
+ */
+void isAuthCacheDrop(const char *pid) {
+  static const char *id = FILEID "isAuthCacheDrop";
+  isAuthCacheType **app;
+  isAuthCacheType *ap;
+
+  pthread_mutex_lock(&auth_mutex);
+  for (app = isAuthBucket(pid); *app != NULL; app = &(*app)->next) {
+    ap = *app;
+    if (strcmp(ap->pid, pid) == 0) {
+      *app = ap->next;
+      free(ap->pid);
+      free(ap);
+      auth_drop_gen++;
+      isLogging_info("%s: Forgot session %s\n", id, pid);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&auth_mutex);
+}
+
+/** The remote redis said, some time ago, that this session exists.
+ ** Refresh it only if it has not been forgotten since we asked:
+ ** should the main loop have dropped it in the meantime the old
+ ** answer must not bring it back.
+ **
+ ** @param pid Session id
+ **
+ ** @param gen auth_drop_gen when we asked
+ */
+static void isAuthCacheRefresh(const char *pid, unsigned long gen) {
+  isAuthCacheType *ap;
+
+  pthread_mutex_lock(&auth_mutex);
+  for (ap = *isAuthBucket(pid); ap != NULL; ap = ap->next) {
+    if (strcmp(ap->pid, pid) == 0) {
+      //
+      // An entry made after we asked was dropped and set again by
+      // someone with a fresher answer than ours: leave it be
+      //
+      if (ap->gen <= gen) {
+        ap->valid_until = time(NULL) + IS_AUTH_TTL;
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(&auth_mutex);
+}
+
+/** Ask the remote redis about every session we remember
+ **
+ ** @param rc Connection to the remote redis
+ **
+ ** @returns 0 on success, -1 when rc is no longer usable
+ */
+static int isAuthRevalidate(redisContext *rc) {
+  static const char *id = FILEID "isAuthRevalidate";
+  isAuthCacheType *ap;
+  redisReply *reply;
+  unsigned long gen;
+  char **pids;
+  int npids;
+  int maxpids;
+  int rtn;
+  int i;
+
+  //
+  // Copy out our sessions so the main loop is not kept waiting
+  // while we talk to redis
+  //
+  npids   = 0;
+  maxpids = 0;
+  pids    = NULL;
+  pthread_mutex_lock(&auth_mutex);
+  for (i=0; i<IS_AUTH_BUCKETS; i++) {
+    for (ap=auth_table[i]; ap != NULL; ap = ap->next) {
+      if (npids == maxpids) {
+        maxpids = maxpids ? 2*maxpids : 64;
+        pids = realloc(pids, maxpids * sizeof(*pids));
+        if (pids == NULL) {
+          isLogging_crit("%s: Out of memory\n", id);
+          exit (-1);
+        }
+      }
+      pids[npids] = strdup(ap->pid);
+      if (pids[npids] == NULL) {
+        isLogging_crit("%s: Out of memory\n", id);
+        exit (-1);
+      }
+      npids++;
+    }
+  }
+  gen = auth_drop_gen;
+  pthread_mutex_unlock(&auth_mutex);
+
+  //
+  // One round trip for the lot
+  //
+  for (i=0; i<npids; i++) {
+    redisAppendCommand(rc, "EXISTS %s", pids[i]);
+  }
+
+  rtn = 0;
+  for (i=0; i<npids; i++) {
+    reply = NULL;
+    if (rtn == 0 && redisGetReply(rc, (void **)&reply) != REDIS_OK) {
+      isLogging_err("%s: Redis error: %s\n", id, rc->errstr);
+      rtn = -1;
+    }
+
+    if (reply != NULL && reply->type == REDIS_REPLY_INTEGER) {
+      if (reply->integer == 1) {
+        isAuthCacheRefresh(pids[i], gen);
+      } else {
+        isAuthCacheDrop(pids[i]);
+      }
+    }
+
+    if (reply != NULL) {
+      freeReplyObject(reply);
+    }
+    free(pids[i]);
+  }
+  free(pids);
+  return rtn;
+}
+
+/** Act on a message from our subscription
+ */
+static void isAuthMessage(redisReply *reply) {
+  redisReply *payload;
+
+  if (reply->type != REDIS_REPLY_ARRAY || reply->elements < 3 || reply->element[0]->type != REDIS_REPLY_STRING) {
+    return;
+  }
+
+  //
+  // ["message", channel, pid] or ["pmessage", pattern, channel, key]
+  //
+  payload = NULL;
+  if (strcmp(reply->element[0]->str, "message") == 0) {
+    payload = reply->element[2];
+  } else if (strcmp(reply->element[0]->str, "pmessage") == 0 && reply->elements >= 4) {
+    payload = reply->element[3];
+  }
+
+  if (payload != NULL && payload->type == REDIS_REPLY_STRING) {
+    isAuthCacheDrop(payload->str);
+  }
+}
+
+/** Connect to the remote redis
+ */
+static redisContext *isAuthConnect() {
+  static const char *id = FILEID "isAuthConnect";
+  redisContext *rtn;
+  const char *address;
+  int port;
+  struct timeval timeout;
+
+  isAuthRemote(&address, &port);
+
+  timeout.tv_sec  = IS_AUTH_REVALIDATE;
+  timeout.tv_usec = 0;
+  rtn = redisConnectWithTimeout(address, port, timeout);
+  if (rtn == NULL || rtn->err) {
+    isLogging_err("%s: Could not connect to redis at %s:%d: %s\n", id, address, port, rtn ? rtn->errstr : "no context");
+    if (rtn != NULL) {
+      redisFree(rtn);
+    }
+    return NULL;
+  }
+  return rtn;
+}
+
+/** Watch the remote redis for sessions that go away.  Runs for the life
+ ** of the broker.
+ */
+static void *isAuthWatch(void *dummy) {
+  static const char *id = FILEID "isAuthWatch";
+  redisContext *sub;            // subscribed to the invalidations
+  redisContext *rc;             // for EXISTS
+  redisReply *reply;
+  struct pollfd pfd;
+  time_t next_check;
+  time_t now;
+  int err;
+
+  sub = NULL;
+  rc  = NULL;
+  next_check = 0;
+  while (1) {
+    if (sub == NULL || rc == NULL) {
+      if (sub != NULL) {
+        redisFree(sub);
+      }
+      if (rc != NULL) {
+        redisFree(rc);
+      }
+
+      sub = isAuthConnect();
+      rc  = isAuthConnect();
+      if (sub == NULL || rc == NULL) {
+        // Meanwhile everything we remember ages out on its own
+        sleep(IS_AUTH_REVALIDATE);
+        continue;
+      }
+
+      reply = redisCommand(sub, "PSUBSCRIBE __keyevent@*__:del __keyevent@*__:expired __keyevent@*__:evicted");
+      if (reply != NULL) {
+        freeReplyObject(reply);
+        // The other two confirmations
+        for (err=0; err<2 && redisGetReply(sub, (void **)&reply) == REDIS_OK; err++) {
+          freeReplyObject(reply);
+        }
+        reply = redisCommand(sub, "SUBSCRIBE %s", IS_AUTH_CHANNEL);
+      }
+      if (reply == NULL) {
+        isLogging_err("%s: Could not subscribe: %s\n", id, sub->errstr);
+        redisFree(sub);
+        sub = NULL;
+        sleep(IS_AUTH_REVALIDATE);
+        continue;
+      }
+      freeReplyObject(reply);
+      isLogging_info("%s: Watching for sessions that go away\n", id);
+
+      // We could have missed something while we were away
+      next_check = 0;
+    }
+
+    now = time(NULL);
+    if (now >= next_check) {
+      if (isAuthRevalidate(rc) == -1) {
+        redisFree(rc);
+        rc = NULL;
+        continue;
+      }
+      next_check = now + IS_AUTH_REVALIDATE;
+    }
+
+    //
+    // Anything already read comes first, then wait for more until
+    // it is time to check again
+    //
+    reply = NULL;
+    if (redisGetReplyFromReader(sub, (void **)&reply) != REDIS_OK) {
+      redisFree(sub);
+      sub = NULL;
+      continue;
+    }
+    if (reply != NULL) {
+      isAuthMessage(reply);
+      freeReplyObject(reply);
+      continue;
+    }
+
+    pfd.fd      = sub->fd;
+    pfd.events  = POLLIN;
+    pfd.revents = 0;
+    err = poll(&pfd, 1, (next_check - now) * 1000);
+    if (err == -1 && errno != EINTR) {
+      isLogging_err("%s: poll failed: %s\n", id, strerror(errno));
+      sleep(1);
+      continue;
+    }
+
+    if (err > 0 && redisBufferRead(sub) != REDIS_OK) {
+      isLogging_err("%s: Lost our subscription: %s\n", id, sub->errstr);
+      redisFree(sub);
+      sub = NULL;
+    }
+  }
+  return NULL;
+}
+
+static void isAuthConnectCB(const redisAsyncContext *ac, int status) {
+  static const char *id = FILEID "isAuthConnectCB";
+
+  if (status != REDIS_OK) {
+    isLogging_err("%s: Could not connect to the remote redis: %s\n", id, ac->errstr);
+    if (ac == auth_ac) {
+      auth_ac = NULL;           // hiredis frees it
+    }
+  }
+}
+
+static void isAuthDisconnectCB(const redisAsyncContext *ac, int status) {
+  static const char *id = FILEID "isAuthDisconnectCB";
+
+  if (status != REDIS_OK) {
+    isLogging_err("%s: Lost the remote redis: %s\n", id, ac->errstr);
+  }
+  if (ac == auth_ac) {
+    auth_ac = NULL;
+  }
+}
+
+/** Note the answer for a parked request.  The main loop picks it up.
+ */
+static void isAuthReplyCB(redisAsyncContext *ac, void *reply, void *privdata) {
+  static const char *id = FILEID "isAuthReplyCB";
+  isParkedType *pk;
+  redisReply *r;
+
+  pk = privdata;
+  r  = reply;
+
+  pk->waiting = 0;
+  if (r == NULL) {
+    pk->reply_type = -1;
+    return;
+  }
+
+  pk->reply_type    = r->type;
+  pk->reply_integer = r->integer;
+  if (r->type == REDIS_REPLY_ERROR && r->str != NULL) {
+    pk->reply_str = strdup(r->str);
+    if (pk->reply_str == NULL) {
+      isLogging_crit("%s: Out of memory\n", id);
+      exit (-1);
+    }
+  }
+
+  if (r->type == REDIS_REPLY_ARRAY && r->elements > 0) {
+    pk->auth_type = r->element[0]->type;
+    if (pk->auth_type == REDIS_REPLY_STRING) {
+      pk->auth_str = strdup(r->element[0]->str);
+      if (pk->auth_str == NULL) {
+        isLogging_crit("%s: Out of memory\n", id);
+        exit (-1);
+      }
+    }
+  }
+}
+
+/** Ask the remote redis about a parked request's session: for isAuth
+ ** when we do not run the session yet, otherwise whether it still
+ ** exists.  Replies come back in the order asked.
+ **
+ ** @param pp Poller that services our connection to the remote redis
+ **
+ ** @param pk Parked request.  pk->waiting is cleared once the answer
+ **           is in.
+ **
+ ** @returns 0 on success, -1 if we could not ask
+ */
+int isAuthAsk(isPollerType *pp, isParkedType *pk) {
+  static const char *id = FILEID "isAuthAsk";
+  const char *address;
+  int port;
+  int err;
+
+  if (auth_ac == NULL) {
+    isAuthRemote(&address, &port);
+    auth_ac = redisAsyncConnect(address, port);
+    if (auth_ac == NULL || auth_ac->err) {
+      isLogging_err("%s: Could not connect to redis at %s:%d: %s\n", id, address, port, auth_ac ? auth_ac->errstr : "no context");
+      if (auth_ac != NULL) {
+        redisAsyncFree(auth_ac);
+        auth_ac = NULL;
+      }
+      return -1;
+    }
+    isPollRedis(pp, auth_ac);
+    redisAsyncSetConnectCallback(auth_ac, isAuthConnectCB);
+    redisAsyncSetDisconnectCallback(auth_ac, isAuthDisconnectCB);
+  }
+
+  pk->waiting = 1;
+  if (pk->known) {
+    err = redisAsyncCommand(auth_ac, isAuthReplyCB, pk, "EXISTS %s", pk->pid);
+  } else {
+    err = redisAsyncCommand(auth_ac, isAuthReplyCB, pk, "HMGET %s isAuth isAuthSig", pk->pid);
+  }
+  if (err != REDIS_OK) {
+    isLogging_err("%s: Could not ask about %s\n", id, pk->pid);
+    pk->waiting = 0;
+    return -1;
+  }
+  return 0;
+}
+
+/** Start watching for sessions that go away.  Called once by the main
+ ** loop before it takes its first request.
+ */
+void isAuthCacheInit() {
+  static const char *id = FILEID "isAuthCacheInit";
+  int err;
+
+  err = pthread_create(&auth_thread, NULL, isAuthWatch, NULL);
+  if (err != 0) {
+    isLogging_err("%s: Could not start session watcher: %s\n", id, strerror(err));
+    exit (-1);
+  }
+  pthread_detach(auth_thread);
+}
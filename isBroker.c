@@ -0,0 +1,606 @@
+/*! @file isBroker.c
+ *  @copyright 2018 by Northwestern University
+ *  @author Keith Brister
+ *  @brief Move requests and replies between is_proxy and our user processes on more than one core
+ *
+ *  The main loop used to copy every frame of every reply from every
+ *  user process back to is_proxy itself, between checking sessions
+ *  and starting processes.  One user's stream of large jpegs held up
+ *  everyone else's requests.  Now the traffic is spread over threads
+ *  of its own and the main loop only sees requests:
+ *
+ *  @li The router thread owns the ROUTER connected to is_proxy.
+ *  Requests go on to the main loop over BROKER_REQUESTS; replies
+ *  arriving on BROKER_REPLIES go back out to is_proxy.  It is
+ *  the only thread to touch the ROUTER so nothing needs a lock.
+ *
+ *  @li IS_BROKER_FORWARDERS forwarding threads share the user
+ *  processes' parent_dealer sockets between them, round robin.  Each
+ *  sends the requests the main loop gives it on to the user
+ *  processes and pushes their replies to the router thread.
+ *
+ *  A forwarding thread takes commands from the main loop over a PAIR
+ *  of its own: add a process, forward a request to one, or close one
+ *  (we wait for that to be done).  Since the commands arrive in the
+ *  order sent a request never reaches a process before it is added
+ *  nor after it is gone.
+ *
+ *  The router thread counts the traffic.  We log the counts every
+ *  IS_BROKER_STATS_SECONDS and put them in the hash
+ *  IS_BROKER_STATS_KEY in our local redis.
+ *
+ *  A request goes on to its process only while fewer than
+ *  IS_QUEUE_PROCESS of that process's, and IS_QUEUE_GLOBAL of
+ *  everyone's, are waiting for their replies.  Otherwise it is
+ *  answered "busy" right away: under a burst the users see quick
+ *  errors rather than everyone's latency (and our memory) growing
+ *  without bound.
+ *
+ *  zmq_proxy_steerable does not fit here: there is one ROUTER for
+ *  both directions and a DEALER backend would spread requests over
+ *  the forwarding threads without regard for which process they are
+ *  meant for.
+ */
+#include "is.h"
+
+/** Forwarding thread commands.  The first frame of each.          */
+typedef struct isBrokerCommandStruct {
+  int cmd;                              //!< 'a' add, 'r' request, 'd' close
+  isProcessListType *p;                 //!< Process concerned
+} isBrokerCommandType;
+
+/** One forwarding thread                                          */
+typedef struct isBrokerForwarderStruct {
+  int index;                            //!< Which one we are
+  void *control;                        //!< Our end of the command PAIR
+  void *push;                           //!< Replies to the router thread
+  int n_processes;                      //!< Processes we have
+  long long replies;                    //!< Replies forwarded since last logged
+  long long reply_bytes;                //!< and their size
+} isBrokerForwarderType;
+
+static isBrokerForwarderType broker_forwarders[IS_BROKER_FORWARDERS];
+
+/** Main loop's end of each forwarding thread's command PAIR       */
+static void *broker_control[IS_BROKER_FORWARDERS];
+
+/** Next forwarding thread to get a process                        */
+static int broker_next = 0;
+
+/** Main loop's way to is_proxy for its own (error) replies        */
+static void *broker_push = NULL;
+
+/** Admission limits (see isBrokerInit)                           */
+static int broker_max_queued;
+static int broker_max_process;
+
+/** Requests sent on to our processes and not answered yet.  Change atomically. */
+static int broker_queued = 0;
+
+/** Requests answered "busy" instead, ever.  Change atomically.    */
+static long long broker_shed = 0;
+
+/** Where our figures go in redis                                  */
+static const char *broker_stats_key = IS_BROKER_STATS_KEY;
+
+/** Router thread's sockets                                        */
+static void *broker_router   = NULL;
+static void *broker_requests = NULL;
+static void *broker_replies  = NULL;
+
+/** Make a socket with no high water marks.  These only join our own
+ ** threads, which drain each other: a send blocked at a high water
+ ** mark could leave two of them waiting on each other.  What they
+ ** hold is bounded by our admission limits instead.
+ **
+ ** @param zctx     ZMQ context
+ **
+ ** @param type     Socket type
+ **
+ ** @param endpoint Bind to this (or NULL)
+ **
+ ** @param connect  Or connect to this (or NULL)
+ */
+static void *isBrokerSocket(void *zctx, int type, const char *endpoint, const char *connect) {
+  static const char *id = FILEID "isBrokerSocket";
+  void *rtn;
+  int socket_option;
+  int err;
+
+  rtn = zmq_socket(zctx, type);
+  if (rtn == NULL) {
+    isLogging_err("%s: Could not create socket for %s: %s\n", id, endpoint ? endpoint : connect, zmq_strerror(errno));
+    exit (-1);
+  }
+
+  socket_option = 0;
+  err = zmq_setsockopt(rtn, ZMQ_RCVHWM, &socket_option, sizeof(socket_option));
+  if (err == -1) {
+    isLogging_err("%s: Could not set RCVHWM for %s: %s\n", id, endpoint ? endpoint : connect, zmq_strerror(errno));
+    exit (-1);
+  }
+
+  socket_option = 0;
+  err = zmq_setsockopt(rtn, ZMQ_SNDHWM, &socket_option, sizeof(socket_option));
+  if (err == -1) {
+    isLogging_err("%s: Could not set SNDHWM for %s: %s\n", id, endpoint ? endpoint : connect, zmq_strerror(errno));
+    exit (-1);
+  }
+
+  if (endpoint != NULL) {
+    err = zmq_bind(rtn, endpoint);
+    if (err == -1) {
+      isLogging_err("%s: Could not bind to %s: %s\n", id, endpoint, zmq_strerror(errno));
+      exit (-1);
+    }
+  }
+
+  if (connect != NULL) {
+    err = zmq_connect(rtn, connect);
+    if (err == -1) {
+      isLogging_err("%s: Could not connect to %s: %s\n", id, connect, zmq_strerror(errno));
+      exit (-1);
+    }
+  }
+  return rtn;
+}
+
+/** Move one whole message, if there is one, from one socket to another
+ **
+ ** @param from    Socket to read
+ **
+ ** @param to      Socket to write
+ **
+ ** @param bytes   Add the message's size here (or NULL)
+ **
+ ** @returns 0 if we moved a message, -1 if there was none
+ */
+static int isBrokerMessage(void *from, void *to, long long *bytes) {
+  zmq_msg_t zmsg;
+  int nreceived;
+  int more;
+  int flags;
+
+  flags = ZMQ_DONTWAIT;         // only the first frame might not be there
+  do {
+    zmq_msg_init(&zmsg);
+    nreceived = zmq_msg_recv(&zmsg, from, flags);
+    if (nreceived == -1) {
+      zmq_msg_close(&zmsg);
+      return -1;
+    }
+    flags = 0;
+
+    if (bytes != NULL) {
+      *bytes += nreceived;
+    }
+
+    more = zmq_msg_more(&zmsg);
+    zmq_msg_send(&zmsg, to, more ? ZMQ_SNDMORE : 0);
+    zmq_msg_close(&zmsg);
+  } while (more);
+
+  return 0;
+}
+
+/** Router thread: is_proxy's requests to the main loop and everyone's
+ ** replies to is_proxy
+ */
+static void *isBrokerRouter(void *dummy) {
+  static const char *id = FILEID "isBrokerRouter";
+  isPollerType *pp;
+  isPollEntryType *ready[IS_POLL_EVENTS];
+  redisContext *rc;
+  redisReply *reply;
+  long long requests;
+  long long request_bytes;
+  long long replies;
+  long long reply_bytes;
+  long long shed;
+  long long last_shed;
+  int queued;
+  time_t last;
+  time_t now;
+  int n_ready;
+  int batch;
+  int i;
+
+  pp = isPollerNew();
+  isPollAdd(pp, broker_router, 1, NULL);       // we send replies on it too
+  isPollAdd(pp, broker_replies, 0, NULL);
+
+  //
+  // Without redis we still log our figures
+  //
+  rc = redisConnect("127.0.0.1", 6379);
+  if (rc == NULL || rc->err) {
+    isLogging_err("%s: Failed to connect to redis: %s\n", id, rc ? rc->errstr : "no context");
+    if (rc != NULL) {
+      redisFree(rc);
+      rc = NULL;
+    }
+  }
+
+  requests      = 0;
+  request_bytes = 0;
+  replies       = 0;
+  reply_bytes   = 0;
+  last_shed     = 0;
+  last          = time(NULL);
+
+  while (1) {
+    n_ready = isPollWait(pp, ready, IS_POLL_EVENTS);
+
+    //
+    // A batch at a time from each so neither direction starves the other
+    //
+    for (i=0; i<n_ready; i++) {
+      if (ready[i]->socket == broker_router) {
+        for (batch=0; batch<IS_POLL_BATCH; batch++) {
+          if (isBrokerMessage(broker_router, broker_requests, &request_bytes) == -1) {
+            break;
+          }
+          requests++;
+        }
+        continue;
+      }
+
+      for (batch=0; batch<IS_POLL_BATCH; batch++) {
+        if (isBrokerMessage(broker_replies, broker_router, &reply_bytes) == -1) {
+          break;
+        }
+        replies++;
+      }
+    }
+
+    now = time(NULL);
+    if (now - last >= IS_BROKER_STATS_SECONDS) {
+      queued = __sync_add_and_fetch(&broker_queued, 0);
+      shed   = __sync_add_and_fetch(&broker_shed, 0);
+      if (requests || replies) {
+        isLogging_info("%s: %lld requests (%lld bytes) and %lld replies (%lld bytes) in %d seconds, %d waiting, %lld busy\n",
+                       id, requests, request_bytes, replies, reply_bytes, (int)(now - last), queued, shed - last_shed);
+      }
+
+      if (rc != NULL) {
+        redisAppendCommand(rc, "HMSET %s requests_per_s %f replies_per_s %f queue_depth %d queue_limit %d shed %lld shed_per_s %f",
+                           broker_stats_key, (double)requests / (now - last), (double)replies / (now - last),
+                           queued, broker_max_queued, shed, (double)(shed - last_shed) / (now - last));
+        redisAppendCommand(rc, "EXPIRE %s %d", broker_stats_key, 3 * IS_BROKER_STATS_SECONDS);
+        for (i=0; i<2; i++) {
+          if (redisGetReply(rc, (void **)&reply) != REDIS_OK) {
+            isLogging_err("%s: Lost redis: %s\n", id, rc->errstr);
+            redisFree(rc);
+            rc = NULL;
+            break;
+          }
+          freeReplyObject(reply);
+        }
+      }
+
+      last_shed     = shed;
+      requests      = 0;
+      request_bytes = 0;
+      replies       = 0;
+      reply_bytes   = 0;
+      last          = now;
+    }
+  }
+  return NULL;
+}
+
+/** Carry out a command from the main loop, if there is one
+ **
+ ** @param fp Our forwarding thread
+ **
+ ** @param pp Its poller
+ **
+ ** @returns 0 if we had a command, -1 if not
+ */
+static int isBrokerCommand(isBrokerForwarderType *fp, isPollerType *pp) {
+  static const char *id = FILEID "isBrokerCommand";
+  isBrokerCommandType c;
+  isProcessListType *p;
+  zmq_msg_t zmsg;
+  int nreceived;
+  int more;
+  int err;
+
+  nreceived = zmq_recv(fp->control, &c, sizeof(c), ZMQ_DONTWAIT);
+  if (nreceived == -1) {
+    return -1;
+  }
+  if (nreceived != sizeof(c)) {
+    isLogging_err("%s: Forwarder %d got a command of %d bytes\n", id, fp->index, nreceived);
+    exit (-1);
+  }
+  p = c.p;
+
+  switch (c.cmd) {
+  case 'a':
+    p->poll = isPollAdd(pp, p->parent_dealer, 0, p);
+    fp->n_processes++;
+    break;
+
+  case 'r':
+    //
+    // The rest of the frames go to the process as they are
+    //
+    do {
+      zmq_msg_init(&zmsg);
+      zmq_msg_recv(&zmsg, fp->control, 0);
+      more = zmq_msg_more(&zmsg);
+      zmq_msg_send(&zmsg, p->parent_dealer, more ? ZMQ_SNDMORE : 0);
+      zmq_msg_close(&zmsg);
+    } while (more);
+
+    // Sending may have eaten the wake up for its reply
+    isPollList(pp, p->poll);
+    break;
+
+  case 'd':
+    isPollRemove(pp, p->poll);
+    p->poll = NULL;
+
+    err = zmq_close(p->parent_dealer);
+    if (err == -1) {
+      isLogging_err("%s: Could not close parent_dealer for %s: %s\n", id, p->key, zmq_strerror(errno));
+    }
+    p->parent_dealer = NULL;
+    fp->n_processes--;
+
+    // The main loop is waiting to free p
+    zmq_send(fp->control, &c, sizeof(c), 0);
+    break;
+
+  default:
+    isLogging_err("%s: Forwarder %d got unknown command %d\n", id, fp->index, c.cmd);
+    exit (-1);
+  }
+  return 0;
+}
+
+/** Forwarding thread: requests to our user processes and their replies
+ ** to the router thread
+ **
+ ** @param voidp Our isBrokerForwarderType
+ */
+static void *isBrokerForwarder(void *voidp) {
+  static const char *id = FILEID "isBrokerForwarder";
+  isBrokerForwarderType *fp;
+  isPollerType *pp;
+  isPollEntryType *ready[IS_POLL_EVENTS];
+  isProcessListType *p;
+  long long bytes;
+  time_t last;
+  time_t now;
+  int control_ready;
+  int n_ready;
+  int batch;
+  int i;
+
+  fp = voidp;
+  pp = isPollerNew();
+  isPollAdd(pp, fp->control, 1, NULL);         // we send on it too
+
+  last = time(NULL);
+  while (1) {
+    n_ready = isPollWait(pp, ready, IS_POLL_EVENTS);
+
+    control_ready = 0;
+    for (i=0; i<n_ready; i++) {
+      if (ready[i]->socket == fp->control) {
+        control_ready = 1;
+        continue;
+      }
+
+      //
+      // A batch at a time so one busy process does not keep the
+      // others waiting; the poller gives us the rest next time
+      // around.
+      //
+      p = ready[i]->data;
+      for (batch=0; batch<IS_POLL_BATCH; batch++) {
+        bytes = 0;
+        if (isBrokerMessage(p->parent_dealer, fp->push, &bytes) == -1) {
+          break;
+        }
+        p->replies++;
+        p->reply_bytes  += bytes;
+        __sync_sub_and_fetch(&p->queued, 1);
+        __sync_sub_and_fetch(&broker_queued, 1);
+        fp->replies++;
+        fp->reply_bytes += bytes;
+      }
+    }
+
+    //
+    // Commands last: closing a process frees its entry in ready
+    //
+    if (control_ready) {
+      for (batch=0; batch<IS_POLL_BATCH; batch++) {
+        if (isBrokerCommand(fp, pp) == -1) {
+          break;
+        }
+      }
+    }
+
+    now = time(NULL);
+    if (now - last >= IS_BROKER_STATS_SECONDS) {
+      if (fp->replies) {
+        isLogging_info("%s: Forwarder %d: %lld replies (%lld bytes) from %d processes in %d seconds\n",
+                       id, fp->index, fp->replies, fp->reply_bytes, fp->n_processes, (int)(now - last));
+      }
+      fp->replies     = 0;
+      fp->reply_bytes = 0;
+      last            = now;
+    }
+  }
+  return NULL;
+}
+
+/** Send a command to a process's forwarding thread
+ **
+ ** @param cmd   'a', 'r', or 'd'
+ **
+ ** @param p     The process
+ **
+ ** @param flags ZMQ_SNDMORE when frames for the process follow
+ */
+static void isBrokerSend(int cmd, isProcessListType *p, int flags) {
+  static const char *id = FILEID "isBrokerSend";
+  isBrokerCommandType c;
+
+  c.cmd = cmd;
+  c.p   = p;
+  if (zmq_send(broker_control[p->forwarder], &c, sizeof(c), flags) == -1) {
+    isLogging_err("%s: Could not send command to forwarder %d: %s\n", id, p->forwarder, zmq_strerror(errno));
+    exit (-1);
+  }
+}
+
+/** Hand a new process's parent_dealer to a forwarding thread.  We do
+ ** not touch the socket after this.
+ **
+ ** @param p The process
+ */
+void isBrokerAdd(isProcessListType *p) {
+  p->forwarder = broker_next;
+  broker_next  = (broker_next + 1) % IS_BROKER_FORWARDERS;
+
+  isBrokerSend('a', p, 0);
+}
+
+/** Send a request on to its process, or answer "busy" when too many
+ ** are waiting already
+ **
+ ** @param pk The request.  Its messages are sent and closed.
+ **
+ ** @param p  Its process
+ */
+void isBrokerForward(isParkedType *pk, isProcessListType *p) {
+  static const char *id = FILEID "isBrokerForward";
+  int i;
+
+  if (__sync_add_and_fetch(&p->queued, 0) >= broker_max_process || __sync_add_and_fetch(&broker_queued, 0) >= broker_max_queued) {
+    p->shed++;
+    __sync_add_and_fetch(&broker_shed, 1);
+    is_zmq_error_reply(pk->envelope_msgs, pk->n_envelope_msgs, broker_push, "%s: Busy, please try again", id);
+    pk->n_envelope_msgs = 0;
+    return;
+  }
+  __sync_add_and_fetch(&p->queued, 1);
+  __sync_add_and_fetch(&broker_queued, 1);
+
+  isBrokerSend('r', p, ZMQ_SNDMORE);
+
+  for (i=0; i<pk->n_envelope_msgs; i++) {
+    zmq_msg_send(&pk->envelope_msgs[i], broker_control[p->forwarder], ZMQ_SNDMORE);
+    zmq_msg_close(&pk->envelope_msgs[i]);
+  }
+  pk->n_envelope_msgs = 0;
+
+  for (i=0; i<pk->nparts; i++) {
+    zmq_msg_send(&pk->parts[i], broker_control[p->forwarder], i < pk->nparts-1 ? ZMQ_SNDMORE : 0);
+    zmq_msg_close(&pk->parts[i]);
+  }
+  pk->nparts = 0;
+}
+
+/** Have the forwarding thread close a process's parent_dealer.  Returns
+ ** once it has.
+ **
+ ** @param p The process
+ */
+void isBrokerRemove(isProcessListType *p) {
+  static const char *id = FILEID "isBrokerRemove";
+  isBrokerCommandType c;
+  int nreceived;
+
+  isBrokerSend('d', p, 0);
+
+  do {
+    nreceived = zmq_recv(broker_control[p->forwarder], &c, sizeof(c), 0);
+  } while (nreceived == -1 && errno == EINTR);
+
+  if (nreceived != sizeof(c) || c.p != p) {
+    isLogging_err("%s: Forwarder %d did not confirm closing %s\n", id, p->forwarder, p->key);
+    exit (-1);
+  }
+
+  //
+  // Whatever it had not answered will not be
+  //
+  __sync_sub_and_fetch(&broker_queued, p->queued);
+
+  isLogging_info("%s: %s sent %lld replies (%lld bytes), %lld requests answered busy\n", id, p->key, p->replies, p->reply_bytes, p->shed);
+}
+
+/** Pass one message from the main loop's own sockets (err_dealer) on
+ ** to is_proxy
+ **
+ ** @param socket Socket to read
+ **
+ ** @returns 0 if there was a message, -1 if not
+ */
+int isBrokerReply(void *socket) {
+  return isBrokerMessage(socket, broker_push, NULL);
+}
+
+/** Set up our sockets and start our threads
+ **
+ ** @param zctx     ZMQ context
+ **
+ ** @param router   ROUTER connected to is_proxy.  It belongs to the
+ **                 router thread from now on.
+ **
+ ** @param dev_mode Use the development stats key
+ **
+ ** @returns Socket the main loop reads requests from, as it did the router
+ */
+void *isBrokerInit(void *zctx, void *router, int dev_mode) {
+  static const char *id = FILEID "isBrokerInit";
+  char endpoint[64];
+  void *rtn;
+  pthread_t thread;
+  int err;
+  int i;
+
+  broker_max_queued  = isQueueSetting("IS_QUEUE_GLOBAL",  IS_QUEUE_GLOBAL);
+  broker_max_process = isQueueSetting("IS_QUEUE_PROCESS", IS_QUEUE_PROCESS);
+  broker_stats_key   = dev_mode ? IS_BROKER_DEV_STATS_KEY : IS_BROKER_STATS_KEY;
+  isLogging_info("%s: at most %d requests waiting, %d per process\n", id, broker_max_queued, broker_max_process);
+
+  broker_router   = router;
+  broker_requests = isBrokerSocket(zctx, ZMQ_PAIR, BROKER_REQUESTS, NULL);
+  broker_replies  = isBrokerSocket(zctx, ZMQ_PULL, BROKER_REPLIES, NULL);
+
+  rtn         = isBrokerSocket(zctx, ZMQ_PAIR, NULL, BROKER_REQUESTS);
+  broker_push = isBrokerSocket(zctx, ZMQ_PUSH, NULL, BROKER_REPLIES);
+
+  for (i=0; i<IS_BROKER_FORWARDERS; i++) {
+    snprintf(endpoint, sizeof(endpoint)-1, BROKER_FORWARD, i);
+    endpoint[sizeof(endpoint)-1] = 0;
+
+    broker_control[i]            = isBrokerSocket(zctx, ZMQ_PAIR, endpoint, NULL);
+    broker_forwarders[i].index   = i;
+    broker_forwarders[i].control = isBrokerSocket(zctx, ZMQ_PAIR, NULL, endpoint);
+    broker_forwarders[i].push    = isBrokerSocket(zctx, ZMQ_PUSH, NULL, BROKER_REPLIES);
+
+    err = pthread_create(&thread, NULL, isBrokerForwarder, &broker_forwarders[i]);
+    if (err != 0) {
+      isLogging_err("%s: Could not start forwarder %d: %s\n", id, i, strerror(err));
+      exit (-1);
+    }
+    pthread_detach(thread);
+  }
+
+  err = pthread_create(&thread, NULL, isBrokerRouter, NULL);
+  if (err != 0) {
+    isLogging_err("%s: Could not start router thread: %s\n", id, strerror(err));
+    exit (-1);
+  }
+  pthread_detach(thread);
+
+  return rtn;
+}
@@ -0,0 +1,351 @@
+/*! @file isColormap.c
+ *  @copyright 2017 by Northwestern University
+ *  @author Keith Brister
+ *  @brief Tone mapping and false color palettes for the LS-CAT Image Server Version 2
+ *
+ *  Pixels are first tone mapped to an 8 bit palette index and then
+ *  looked up in a 256 entry RGB palette.  Indices 0 through
+ *  IS_COLORMAP_LEVELS-1 run from the white value to the black value,
+ *  the last entry (IS_COLORMAP_SATURATED) is reserved for saturated
+ *  pixels.
+ */
+#include "is.h"
+
+//! Palette index reserved for saturated pixels
+#define IS_COLORMAP_SATURATED 255
+
+//! Number of palette entries used for image data
+#define IS_COLORMAP_LEVELS 255
+
+/** A named palette.  Entries are packed as red | green << 8 | blue << 16
+ ** so that four bytes can be fetched at once.
+ */
+typedef struct isColormapStruct {
+  const char *name;             //!< what the user puts in job.colormap
+  uint32_t rgb[256];            //!< the palette
+  uint32_t overlay[IS_OVERLAY_KINDS]; //!< colors for overlay marks that stand out against this palette
+} isColormapType;
+
+static isColormapType colormaps[] = {
+  { "gray",     {0}, {0}},      // the original: white background with black spots
+  { "inverted", {0}, {0}},      // black background with white spots
+  { "hot",      {0}, {0}},      // black, red, yellow, white
+  { "viridis",  {0}, {0}}       // perceptually uniform blue, green, yellow
+};
+
+static const int n_colormaps = sizeof(colormaps)/sizeof(colormaps[0]);
+
+static pthread_once_t colormapOnce = PTHREAD_ONCE_INIT;
+
+/** 16 bit tone map last used by this thread.  Successive images
+ ** usually have the same contrast settings.
+ */
+static __thread uint8_t *lut16 = NULL;
+static __thread int32_t lut16_wval = -1;
+static __thread int32_t lut16_bval = -1;
+
+/** Pack a color into a palette entry
+ **
+ ** @param[in] r red in the range 0 to 1
+ ** @param[in] g green in the range 0 to 1
+ ** @param[in] b blue in the range 0 to 1
+ */
+static uint32_t isColormapRGB(double r, double g, double b) {
+  r = r < 0.0 ? 0.0 : (r > 1.0 ? 1.0 : r);
+  g = g < 0.0 ? 0.0 : (g > 1.0 ? 1.0 : g);
+  b = b < 0.0 ? 0.0 : (b > 1.0 ? 1.0 : b);
+
+  return (uint32_t)lround(r * 255.0) | ((uint32_t)lround(g * 255.0) << 8) | ((uint32_t)lround(b * 255.0) << 16);
+}
+
+/** Fill in the palettes.
+ **
+ ** Viridis is computed from a polynomial fit to the matplotlib table
+ ** which is good to well under one gray level.
+ */
+static void isColormapMakePalettes() {
+  static const double vc[7][3] = {
+    { 0.2777273272234177,  0.005407344544966578,  0.3340998053353061},
+    { 0.1050930431085774,  1.404613529898575,     1.384590162594685},
+    {-0.3308618287255563,  0.214847559468213,     0.09509516302823659},
+    {-4.634230498983486,  -5.799100973351585,   -19.33244095627987},
+    { 6.228269936347081,  14.17993336680509,     56.69055260068105},
+    { 4.776384997670288, -13.74514537774601,    -65.35303263337234},
+    {-5.435455855934631,   4.645852612178535,    26.3124352495832}
+  };
+  double t;
+  double v[3];
+  int i, j, k;
+
+  for (i=0; i<IS_COLORMAP_LEVELS; i++) {
+    t = (double)i / (double)(IS_COLORMAP_LEVELS - 1);
+
+    colormaps[0].rgb[i] = isColormapRGB(1.0 - t, 1.0 - t, 1.0 - t);
+    colormaps[1].rgb[i] = isColormapRGB(t, t, t);
+    colormaps[2].rgb[i] = isColormapRGB(3.0 * t, 3.0 * t - 1.0, 3.0 * t - 2.0);
+
+    for (k=0; k<3; k++) {
+      v[k] = vc[6][k];
+      for (j=5; j>=0; j--) {
+        v[k] = vc[j][k] + t * v[k];
+      }
+    }
+    colormaps[3].rgb[i] = isColormapRGB(v[0], v[1], v[2]);
+  }
+
+  colormaps[0].rgb[IS_COLORMAP_SATURATED] = isColormapRGB(1.0, 0.0, 0.0);
+  colormaps[1].rgb[IS_COLORMAP_SATURATED] = isColormapRGB(1.0, 0.0, 0.0);
+  colormaps[2].rgb[IS_COLORMAP_SATURATED] = isColormapRGB(0.0, 1.0, 1.0);
+  colormaps[3].rgb[IS_COLORMAP_SATURATED] = isColormapRGB(1.0, 0.0, 0.0);
+
+  colormaps[0].overlay[IS_OVERLAY_RING]      = isColormapRGB(0.0, 0.4, 1.0);
+  colormaps[0].overlay[IS_OVERLAY_CROSSHAIR] = isColormapRGB(1.0, 0.5, 0.0);
+  colormaps[0].overlay[IS_OVERLAY_SPOT]      = isColormapRGB(0.0, 0.7, 0.0);
+
+  colormaps[1].overlay[IS_OVERLAY_RING]      = isColormapRGB(0.3, 0.7, 1.0);
+  colormaps[1].overlay[IS_OVERLAY_CROSSHAIR] = isColormapRGB(1.0, 0.6, 0.0);
+  colormaps[1].overlay[IS_OVERLAY_SPOT]      = isColormapRGB(0.0, 1.0, 0.0);
+
+  colormaps[2].overlay[IS_OVERLAY_RING]      = isColormapRGB(0.3, 0.5, 1.0);
+  colormaps[2].overlay[IS_OVERLAY_CROSSHAIR] = isColormapRGB(0.0, 1.0, 0.0);
+  colormaps[2].overlay[IS_OVERLAY_SPOT]      = isColormapRGB(1.0, 0.0, 1.0);
+
+  colormaps[3].overlay[IS_OVERLAY_RING]      = isColormapRGB(1.0, 1.0, 1.0);
+  colormaps[3].overlay[IS_OVERLAY_CROSSHAIR] = isColormapRGB(1.0, 0.5, 0.0);
+  colormaps[3].overlay[IS_OVERLAY_SPOT]      = isColormapRGB(1.0, 0.0, 1.0);
+}
+
+/** Find a colormap by name
+ **
+ ** @param[in] name  the colormap the user asked for.  NULL or empty gets the default.
+ **
+ ** @returns colormap number or -1 if there is no such map
+ */
+int isColormapFind(const char *name) {
+  int i;
+
+  pthread_once(&colormapOnce, isColormapMakePalettes);
+
+  if (name == NULL || *name == 0) {
+    return 0;
+  }
+
+  for (i=0; i<n_colormaps; i++) {
+    if (strcasecmp(name, colormaps[i].name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/** Name of a colormap
+ **
+ ** @param[in] cmap  colormap number from isColormapFind
+ */
+const char *isColormapName(int cmap) {
+  return colormaps[cmap].name;
+}
+
+/** Color for an overlay mark
+ **
+ ** @param[in] cmap  colormap number from isColormapFind
+ **
+ ** @param[in] kind  IS_OVERLAY_RING, IS_OVERLAY_CROSSHAIR, or IS_OVERLAY_SPOT
+ **
+ ** @returns the color packed as a palette entry
+ */
+uint32_t isColormapOverlayColor(int cmap, int kind) {
+  return colormaps[cmap].overlay[kind];
+}
+
+/** Get the tone map for 16 bit data
+ **
+ ** The table is 4 bytes longer than needed so that it can be read
+ ** 32 bits at a time.
+ **
+ ** @param[in] wval  values at or below this map to 0
+ **
+ ** @param[in] bval  values at or above this map to IS_COLORMAP_LEVELS-1
+ **
+ ** @returns table of palette indices, owned by this thread
+ */
+const uint8_t *isToneMapLut16(int32_t wval, int32_t bval) {
+  static const char *id = FILEID "isToneMapLut16";
+  int32_t v;
+
+  if (lut16 != NULL && lut16_wval == wval && lut16_bval == bval) {
+    return lut16;
+  }
+
+  if (lut16 == NULL) {
+    lut16 = calloc(65536 + 4, sizeof(*lut16));
+    if (lut16 == NULL) {
+      isLogging_crit("%s: Out of memory\n", id);
+      exit (-1);
+    }
+  }
+
+  for (v=0; v<0xffff; v++) {
+    if (v <= wval) {
+      lut16[v] = 0;
+    } else if (v >= bval) {
+      lut16[v] = IS_COLORMAP_LEVELS - 1;
+    } else {
+      lut16[v] = (uint8_t)((int64_t)(v - wval) * (IS_COLORMAP_LEVELS - 1) / (bval - wval));
+    }
+  }
+  lut16[0xffff] = IS_COLORMAP_SATURATED;
+
+  lut16_wval = wval;
+  lut16_bval = bval;
+  return lut16;
+}
+
+/** Tone map a row of 32 bit data
+ **
+ ** @param[in] src   the data
+ **
+ ** @param[in] n     number of pixels
+ **
+ ** @param[in] wval  values at or below this map to 0
+ **
+ ** @param[in] bval  values at or above this map to IS_COLORMAP_LEVELS-1
+ **
+ ** @param[out] idx  n palette indices
+ */
+void isToneMap32(const uint32_t *src, int n, int32_t wval, int32_t bval, uint8_t *idx) {
+  uint64_t scale;       // 32.32 fixed point levels per count
+  uint32_t w, b;
+  uint32_t v;
+  int i;
+
+  w = wval;
+  b = bval;
+  scale = ((uint64_t)(IS_COLORMAP_LEVELS - 1) << 32) / (b - w);
+
+  for (i=0; i<n; i++) {
+    v = src[i];
+    v = v < w ? w : v;
+    if (src[i] == 0xffffffff) {
+      idx[i] = IS_COLORMAP_SATURATED;
+    } else if (v >= b) {
+      idx[i] = IS_COLORMAP_LEVELS - 1;
+    } else {
+      idx[i] = ((uint64_t)(v - w) * scale) >> 32;
+    }
+  }
+}
+
+#ifdef IS_AVX2
+/** The AVX2 part of isColormapApply: 8 pixels at a time
+ **
+ ** @returns Number of pixels done.  The caller does the rest.
+ */
+__attribute__((target("avx2")))
+static int isColormapApplyAvx2(const uint8_t *idx, int n, const uint32_t *pal, unsigned char *rgb) {
+  const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  __m256i ix, c;
+  int i;
+
+  //
+  // Each 16 byte store spills 4 junk bytes that the next store
+  // overwrites so stop while there is room.
+  //
+  for (i=0; i + 10 <= n; i += 8) {
+    ix = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(idx + i)));
+    c  = _mm256_i32gather_epi32((const int *)pal, ix, 4);
+    _mm_storeu_si128((__m128i *)(rgb + 3*i),      _mm_shuffle_epi8(_mm256_castsi256_si128(c), pack));
+    _mm_storeu_si128((__m128i *)(rgb + 3*i + 12), _mm_shuffle_epi8(_mm256_extracti128_si256(c, 1), pack));
+  }
+  return i;
+}
+#endif
+
+/** Color a row of palette indices
+ **
+ ** @param[in] idx   palette indices
+ **
+ ** @param[in] n     number of pixels
+ **
+ ** @param[in] cmap  colormap number from isColormapFind
+ **
+ ** @param[out] rgb  3*n bytes
+ */
+void isColormapApply(const uint8_t *idx, int n, int cmap, unsigned char *rgb) {
+  const uint32_t *pal;
+  int i;
+
+  pal = colormaps[cmap].rgb;
+  i = 0;
+
+#ifdef IS_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    i = isColormapApplyAvx2(idx, n, pal, rgb);
+  }
+#endif
+
+  for (; i<n; i++) {
+    rgb[3*i]     = pal[idx[i]];
+    rgb[3*i + 1] = pal[idx[i]] >> 8;
+    rgb[3*i + 2] = pal[idx[i]] >> 16;
+  }
+}
+
+#ifdef IS_AVX2
+/** The AVX2 part of isColormapRow16: 8 pixels at a time.  The lut
+ ** gather reads 4 bytes per pixel; isToneMapLut16 leaves room for
+ ** that past its last entry.
+ **
+ ** @returns Number of pixels done.  The caller does the rest.
+ */
+__attribute__((target("avx2")))
+static int isColormapRow16Avx2(const uint16_t *src, int n, const uint8_t *lut, const uint32_t *pal, unsigned char *rgb) {
+  const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  const __m256i low  = _mm256_set1_epi32(0xff);
+  __m256i ix, c;
+  int i;
+
+  for (i=0; i + 10 <= n; i += 8) {
+    ix = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(src + i)));
+    ix = _mm256_and_si256(_mm256_i32gather_epi32((const int *)lut, ix, 1), low);
+    c  = _mm256_i32gather_epi32((const int *)pal, ix, 4);
+    _mm_storeu_si128((__m128i *)(rgb + 3*i),      _mm_shuffle_epi8(_mm256_castsi256_si128(c), pack));
+    _mm_storeu_si128((__m128i *)(rgb + 3*i + 12), _mm_shuffle_epi8(_mm256_extracti128_si256(c, 1), pack));
+  }
+  return i;
+}
+#endif
+
+/** Tone map and color a row of 16 bit data in one go
+ **
+ ** @param[in] src   the data
+ **
+ ** @param[in] n     number of pixels
+ **
+ ** @param[in] lut   tone map from isToneMapLut16
+ **
+ ** @param[in] cmap  colormap number from isColormapFind
+ **
+ ** @param[out] rgb  3*n bytes
+ */
+void isColormapRow16(const uint16_t *src, int n, const uint8_t *lut, int cmap, unsigned char *rgb) {
+  const uint32_t *pal;
+  int i;
+
+  pal = colormaps[cmap].rgb;
+  i = 0;
+
+#ifdef IS_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    i = isColormapRow16Avx2(src, n, lut, pal, rgb);
+  }
+#endif
+
+  for (; i<n; i++) {
+    uint32_t c;
+    c = pal[lut[src[i]]];
+    rgb[3*i]     = c;
+    rgb[3*i + 1] = c >> 8;
+    rgb[3*i + 2] = c >> 16;
+  }
+}
@@ -37,6 +37,10 @@ void destroyImageBuffer(isWorkerContext_t *wctx, isImageBufType *p) {
       p->bad_pixel_map = NULL;
     }
   }
+  if (p->extra && p->destroy_extra) {
+    p->destroy_extra(p->extra);
+    p->extra = NULL;
+  }
   free((char *)p->key);
   pthread_rwlock_destroy(&p->buflock);
   if (p->meta) {
@@ -49,14 +53,14 @@ void destroyImageBuffer(isWorkerContext_t *wctx, isImageBufType *p) {
   isLogging_info("%s: done\n", id);
 }
 
-/** Initialize an process's image buffer context
+/** Initialize an process's image buffer context.  isDataConnect
+ ** connects it to our parent.
  */
 isWorkerContext_t  *isDataInit(const char *key) {
   static const char *id = FILEID "isDataInit";
   pthread_mutexattr_t matt;
   isWorkerContext_t *rtn;
   int err;
-  char router_endpoint[128];
   char dealer_endpoint[128];
   int socket_option;
 
@@ -66,11 +70,8 @@ isWorkerContext_t  *isDataInit(const char *key) {
     exit (-1);
   }
 
-  rtn->key = strdup(key);
-  if (rtn->key == NULL) {
-    isLogging_crit("%s: Out of memory\n", id);
-    exit (-1);
-  }
+  snprintf(rtn->key, sizeof(rtn->key)-1, "%s", key);
+  snprintf(rtn->inprocKey, sizeof(rtn->inprocKey)-1, "%s", key);
 
   rtn->n_buffers   = 0;
   rtn->max_buffers = 2 * N_IMAGE_BUFFERS;
@@ -83,50 +84,41 @@ isWorkerContext_t  *isDataInit(const char *key) {
     exit (-1);
   }
 
-  socket_option = 0;
+  socket_option = isQueueHwm();
   err = zmq_setsockopt(rtn->router, ZMQ_RCVHWM, &socket_option, sizeof(socket_option));
   if (err == -1) {
     isLogging_crit("%s: Could not set RCVHWM for router: %s\n", id, zmq_strerror(errno));
     exit (-1);
   }
 
-  socket_option = 0;
+  socket_option = isQueueHwm();
   err = zmq_setsockopt(rtn->router, ZMQ_SNDHWM, &socket_option, sizeof(socket_option));
   if (err == -1) {
     isLogging_crit("%s: Could not set SNDHWM for router: %s\n", id, zmq_strerror(errno));
     exit (-1);
   }
 
-  snprintf(router_endpoint, sizeof(router_endpoint)-1, "ipc://@%s", key);
-  router_endpoint[sizeof(router_endpoint)-1] = 0;
-
-  err = zmq_connect(rtn->router, router_endpoint);
-  if (err == -1) {
-    isLogging_crit("%s: failed to connect to endpoint %s: %s\n", id, router_endpoint, strerror(errno));
-    exit (-1);
-  }
-                    
   rtn->dealer = zmq_socket(rtn->zctx, ZMQ_DEALER);
   if (rtn->dealer == NULL) {
     isLogging_crit("%s: Could not create dealer socket: %s\n", id, zmq_strerror(errno));
     exit (-1);
   }
 
-  socket_option = 0;
+  socket_option = isQueueHwm();
   err = zmq_setsockopt(rtn->dealer, ZMQ_RCVHWM, &socket_option, sizeof(socket_option));
   if (err == -1) {
     isLogging_crit("%s: Could not set RCVHWM for dealer: %s\n", id, zmq_strerror(errno));
     exit (-1);
   }
 
-  socket_option = 0;
+  socket_option = isQueueHwm();
   err = zmq_setsockopt(rtn->dealer, ZMQ_SNDHWM, &socket_option, sizeof(socket_option));
   if (err == -1) {
     isLogging_crit("%s: Could not set SNDHWM for dealer: %s\n", id, zmq_strerror(errno));
     exit (-1);
   }
 
-  snprintf(dealer_endpoint, sizeof(dealer_endpoint)-1, "inproc://#%s", key);
+  snprintf(dealer_endpoint, sizeof(dealer_endpoint)-1, "inproc://#%s", rtn->inprocKey);
   dealer_endpoint[sizeof(dealer_endpoint)-1] = 0;
   err = zmq_bind(rtn->dealer, dealer_endpoint);
   if (err == -1) {
@@ -141,6 +133,13 @@ isWorkerContext_t  *isDataInit(const char *key) {
   pthread_mutexattr_destroy(&matt);
 
   pthread_mutex_init(&rtn->metaMutex, NULL);
+  pthread_mutex_init(&rtn->blankMutex, NULL);
+  pthread_mutex_init(&rtn->sweepMutex, NULL);
+  pthread_mutex_init(&rtn->indexMutex, NULL);
+  pthread_mutex_init(&rtn->indexEnvMutex, NULL);
+  pthread_cond_init(&rtn->indexCond, NULL);
+  pthread_mutex_init(&rtn->asyncMutex, NULL);
+  pthread_cond_init(&rtn->asyncCond, NULL);
 
   err = hcreate_r( 2*N_IMAGE_BUFFERS, &rtn->bufTable);
   if (err == 0) {
@@ -151,11 +150,45 @@ isWorkerContext_t  *isDataInit(const char *key) {
   return rtn;
 }
 
+/** Connect our router to the parent's dealer for our process.  A
+ ** zygote's context is made under a key of its own: we take on the
+ ** real one here, for the logs.  Our inproc endpoints are already
+ ** bound and keep the zygote name: threads find them through
+ ** wctx->inprocKey, which does not change.
+ **
+ ** @param wctx Our worker context
+ **
+ ** @param key  Unique identifer for this user in this ESAF group
+ */
+void isDataConnect(isWorkerContext_t *wctx, const char *key) {
+  static const char *id = FILEID "isDataConnect";
+  char router_endpoint[128];
+  int err;
+
+  //
+  // Our threads may be logging wctx->key as we go.  The last byte
+  // stays 0 so they always find the end of it.
+  //
+  if (strcmp(wctx->key, key) != 0) {
+    snprintf(wctx->key, sizeof(wctx->key)-1, "%s", key);
+  }
+
+  snprintf(router_endpoint, sizeof(router_endpoint)-1, "ipc://@%s", key);
+  router_endpoint[sizeof(router_endpoint)-1] = 0;
+
+  err = zmq_connect(wctx->router, router_endpoint);
+  if (err == -1) {
+    isLogging_crit("%s: failed to connect to endpoint %s: %s\n", id, router_endpoint, strerror(errno));
+    exit (-1);
+  }
+}
+
 /** Recycle resources garnered by isDataInit
  */
 void isDataDestroy(isWorkerContext_t *c) {
   static const char *id = FILEID "isDataDestroy";
   isImageBufType *p, *next;
+  isJpegBlankType *bp, *bnext;
   (void)id;
 
   isLogging_info("%s: start\n", id);
@@ -165,6 +198,13 @@ void isDataDestroy(isWorkerContext_t *c) {
   // lock anything.
   //
 
+  //
+  // Executors and indexing runners are ours too: wait for them
+  // here.  Executors first as they may be waiting on an indexer.
+  //
+  isAsyncDestroy(c);
+  isIndexDestroy(c);
+
   hdestroy_r(&c->bufTable);
 
   next = NULL;
@@ -174,9 +214,25 @@ void isDataDestroy(isWorkerContext_t *c) {
   }
   c->n_buffers = 0;
   c->first = NULL;
+
+  //
+  // Blanks still being sent by zmq are freed when zmq is done with them
+  //
+  for (bp=c->blanks; bp!=NULL; bp=bnext) {
+    bnext = bp->next;
+    isJpegBlankRelease(NULL, bp);
+  }
+  c->blanks = NULL;
+
   pthread_mutex_destroy(&c->ctxMutex);
   pthread_mutex_destroy(&c->metaMutex);
-  free((char *)c->key);
+  pthread_mutex_destroy(&c->blankMutex);
+  pthread_mutex_destroy(&c->sweepMutex);
+  pthread_mutex_destroy(&c->indexMutex);
+  pthread_mutex_destroy(&c->indexEnvMutex);
+  pthread_cond_destroy(&c->indexCond);
+  pthread_mutex_destroy(&c->asyncMutex);
+  pthread_cond_destroy(&c->asyncCond);
   free(c);
   isLogging_info("%s: Done\n", id);
 }
@@ -476,6 +532,27 @@ isImageBufType *createNewImageBuf(isWorkerContext_t *wctx, const char *key) {
   return rtn;
 }
 
+/** How much image data our buffer cache holds right now
+ **
+ ** @param wctx Worker context
+ **
+ ** @returns Bytes in the buffers that have been filled
+ */
+long isDataCacheBytes(isWorkerContext_t *wctx) {
+  isImageBufType *p;
+  long rtn;
+
+  rtn = 0;
+  pthread_mutex_lock(&wctx->ctxMutex);
+  for (p=wctx->first; p != NULL; p=p->next) {
+    if (p->buf != NULL) {
+      rtn += p->buf_size;
+    }
+  }
+  pthread_mutex_unlock(&wctx->ctxMutex);
+  return rtn;
+}
+
 /**
  * Look to see if the data are already available to us from the image
  * buffer hash table. We will wait for the data to appear if another
@@ -509,6 +586,19 @@ isImageBufType *isGetImageBufFromKey(isWorkerContext_t *wctx, char *key) {
     rtn->in_use++; // flag to keep our buffer in scope while we need it
     pthread_mutex_unlock(&wctx->ctxMutex);
     pthread_rwlock_rdlock(&rtn->buflock);
+
+    if (rtn->buf == NULL) {
+      //
+      // Whoever was filling it failed or gave up on a superseded job.
+      // It is ours to fill unless someone beats us to it.
+      //
+      pthread_rwlock_unlock(&rtn->buflock);
+      pthread_rwlock_wrlock(&rtn->buflock);
+      if (rtn->buf != NULL) {
+        pthread_rwlock_unlock(&rtn->buflock);
+        pthread_rwlock_rdlock(&rtn->buflock);
+      }
+    }
   } else {  
     //
     // Create a new entry then read some data into it.  We still have
@@ -523,6 +613,76 @@ isImageBufType *isGetImageBufFromKey(isWorkerContext_t *wctx, char *key) {
   return rtn;
 }
 
+/** Read the meta data from an image file of any type we know about
+ **
+ ** @param fn  the file
+ **
+ ** @returns new meta data object or NULL on failure
+ */
+json_t *isImageFileMeta(const char *fn) {
+  static const char *id = FILEID "isImageFileMeta";
+  image_file_type ft;
+
+  ft = isFileType(fn);
+  switch (ft) {
+  case LSCAT_IMG_NEXUSV1_HDF5:
+    return isH5GetMeta(fn);
+
+  case LSCAT_IMG_GENERIC_CBF:
+    return isCbfGetMeta(fn);
+
+  case LSCAT_IMG_GENERIC_TIFF:
+    return isTiffGetMeta(fn);
+
+  case LSCAT_IMG_RAYONIX:
+  case LSCAT_IMG_RAYONIX_BS:
+    return isRayonixGetMeta(fn);
+
+  case LSCAT_IMG_UNKNOWN:
+  default:
+    isLogging_crit("%s: unknown file type '%d' for file %s\n", id, ft, fn);
+  }
+  return NULL;
+}
+
+/** Read frame imb->frame of an image file into imb->buf
+ **
+ ** Buffers used to read several frames of the same file keep
+ ** imb->extra (and the bad pixel map) between calls so the file
+ ** layout is only worked out once.
+ **
+ ** @param fn   the file
+ **
+ ** @param imb  where to put the data
+ **
+ ** @returns 0 on success
+ */
+int isImageFileData(const char *fn, isImageBufType *imb) {
+  static const char *id = FILEID "isImageFileData";
+  image_file_type ft;
+
+  ft = isFileType(fn);
+  switch (ft) {
+  case LSCAT_IMG_NEXUSV1_HDF5:
+    return isH5GetData(fn, imb);
+
+  case LSCAT_IMG_GENERIC_CBF:
+    return isCbfGetData(fn, imb);
+
+  case LSCAT_IMG_GENERIC_TIFF:
+    return isTiffGetData(fn, imb);
+
+  case LSCAT_IMG_RAYONIX:
+  case LSCAT_IMG_RAYONIX_BS:
+    return isRayonixGetData(fn, imb);
+
+  case LSCAT_IMG_UNKNOWN:
+  default:
+    isLogging_crit("%s: unknown file type '%d' for file %s\n", id, ft, fn);
+  }
+  return -1;
+}
+
 /** Get the unreduced image
  */
 isImageBufType *isGetRawImageBuf(isWorkerContext_t *wctx, json_t *job) {
@@ -535,7 +695,6 @@ isImageBufType *isGetRawImageBuf(isWorkerContext_t *wctx, json_t *job) {
   int gid_strlen = 0;
   char *key      = NULL;
   int key_strlen = 0;
-  image_file_type ft;
   int err        = -1;
   json_t* meta   = NULL;
 
@@ -588,54 +747,12 @@ isImageBufType *isGetRawImageBuf(isWorkerContext_t *wctx, json_t *job) {
   // We need to fetch both the metadata and data.
   // Do it as atomically as possible to avoid holding a lock forever.
   err = -1;
-  ft = isFileType(fn);
-  switch (ft) {
-  case LSCAT_IMG_NEXUSV1_HDF5:
-    meta = isH5GetMeta(fn);
-    if (!meta) {
-      break;
-    }
-    pthread_mutex_lock(&wctx->metaMutex);
-    rtn->meta = meta;
-    pthread_mutex_unlock(&wctx->metaMutex);
-    err = isH5GetData(fn, rtn);
-    break;
-  case LSCAT_IMG_GENERIC_CBF:
-    meta = isCbfGetMeta(fn);  
-    if (!meta) {
-      break;
-    }
+  meta = isImageFileMeta(fn);
+  if (meta != NULL) {
     pthread_mutex_lock(&wctx->metaMutex);
     rtn->meta = meta;
     pthread_mutex_unlock(&wctx->metaMutex);
-    err = isCbfGetData(fn, rtn);
-    break;
-  case LSCAT_IMG_GENERIC_TIFF:
-    meta = isTiffGetMeta(fn);
-    if (!meta) {
-      break;
-    }
-    pthread_mutex_lock(&wctx->metaMutex);
-    rtn->meta = meta;
-    pthread_mutex_unlock(&wctx->metaMutex);
-    err = isTiffGetData(fn, rtn);
-    break;
-  case LSCAT_IMG_RAYONIX:
-  case LSCAT_IMG_RAYONIX_BS:
-    meta = isRayonixGetMeta(fn);
-    if (!meta) {
-      break;
-    }
-    pthread_mutex_lock(&wctx->metaMutex);
-    rtn->meta = meta;
-    pthread_mutex_unlock(&wctx->metaMutex);
-    err = isRayonixGetData(fn, rtn);
-    break;
-      
-  case LSCAT_IMG_UNKNOWN:
-  default:
-    isLogging_crit("%s: unknown file type '%d' for file %s\n", id, ft, fn);
-    err = -1;
+    err = isImageFileData(fn, rtn);
   }
 
   if (err != 0) {
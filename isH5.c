@@ -389,6 +389,9 @@ static int discovery_cb(hid_t lid, const char *name, const H5L_info_t *info, voi
 
   // Initialize these_frames
   these_frames->next = NULL;
+  these_frames->data_set   = -1;
+  these_frames->file_space = -1;
+  these_frames->file_type  = -1;
   if (fpp == NULL) {
     extra->frame_discovery_base = these_frames;
   } else {
@@ -467,6 +470,36 @@ static int discovery_cb(hid_t lid, const char *name, const H5L_info_t *info, voi
   return 0;
 }
 
+/** Release our frame discovery list and the data sets it holds open.
+ **
+ ** @param[in] voidp  the isH5extra_t that isH5GetData hung on the image buffer
+ */
+void isH5DestroyExtra(void *voidp) {
+  isH5extra_t *extra;
+  frame_discovery_t *fp, *next;
+
+  extra = voidp;
+  if (extra == NULL) {
+    return;
+  }
+
+  for (fp = extra->frame_discovery_base; fp != NULL; fp = next) {
+    next = fp->next;
+    if (fp->file_space >= 0) {
+      H5Sclose(fp->file_space);
+    }
+    if (fp->file_type >= 0) {
+      H5Tclose(fp->file_type);
+    }
+    if (fp->data_set >= 0) {
+      H5Dclose(fp->data_set);
+    }
+    free(fp->done_list);
+    free(fp);
+  }
+  free(extra);
+}
+
 /** Find a single frame in the named file.
  **
  ** @param[in,out] imb frame buffer to place our info in
@@ -573,12 +606,16 @@ static int get_one_frame(isImageBufType* imb) {
   herr = H5Sselect_hyperslab(fp->file_space, H5S_SELECT_SET, start, stride, count, block);
   if (herr < 0) {
     isLogging_err("%s: Could not set hyperslab for frame %d\n", id, imb->frame);
+    H5Sclose(mem_space);
+    free(data_buffer);
     return -1;
   }
     
   herr = H5Dread(fp->data_set, fp->file_type, mem_space, fp->file_space, H5P_DEFAULT, data_buffer);
+  H5Sclose(mem_space);
   if (herr < 0) {
     isLogging_err("%s: Could not read frame %d\n", id, imb->frame);
+    free(data_buffer);
     return -1;
   }
 
@@ -618,6 +655,10 @@ int isH5GetData(const char *fn, isImageBufType* imb) {
   failed = 0;
   extra = imb->extra;
 
+  // Only opened when we read the bad pixel map
+  data_set   = -1;
+  data_space = -1;
+
   //
   // Open up the master file
   //
@@ -636,6 +677,7 @@ int isH5GetData(const char *fn, isImageBufType* imb) {
     extra->frame_discovery_base = NULL;
 
     imb->extra = extra;
+    imb->destroy_extra = isH5DestroyExtra;
     //
     // Find which frame is where
     //
@@ -643,6 +685,7 @@ int isH5GetData(const char *fn, isImageBufType* imb) {
     herr = H5Lvisit_by_name(master_file, "/entry/data", H5_INDEX_NAME, H5_ITER_INC, discovery_cb, extra, H5P_DEFAULT);
     if (herr < 0) {
       isLogging_err("%s: Could not discover which frame is where for file %s\n", id, fn);
+      H5Fclose(master_file);
       return -1;
     }
     
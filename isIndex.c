@@ -5,440 +5,1101 @@
  */
 #include "is.h"
 
-json_t *isIndexImages(redisContext *rrc, const char *progressPublisher, const char *tag, const char *f1, const char *f2, const int frame1, const int frame2) {
-  static const char *id = FILEID "isIndexImages";
-  char *f1_local;               // f1 without dir component
-  char *f2_local;               // f2 without dir component
-  char *json_output;            // json formated output from called program
-  char *json_output_end;        // Place to add json new output 
-  char *s_err;                  // stderr output from called program
-  char *s_err_end;              // Place to add new stderr output
-  char *tmp_dir_template;       // our temporary directory name template
-  char *tmp_dir;                // our temporary directory name
-  char child_progress[256];     // short progress string to return out-of-band
-  int bytes_read;               // generic bytes read from a file descriptor
-  int c;                        // returned by fork: 0 = in child, >0 = in parent, -1 = fork error
-  int err;                      // returned by waitpid: 0 = still running, > 0 done, -1 error
-  int i;                        // loop over poll events
-  int json_output_size;         // size of json_output
-  int keep_on_truckin;          // flag to keep polling
-  int npoll;                    // number of fd for poll to listen for
-  int pipeerr[2];               // Our stderr pipes
-  int pipein[2];                // Our stdin pipes
-  int pipejson[2];              // Our json pipes
-  int pipeout[2];               // Our stdout pipes
-  int pipeprogress[2];          // Our progress pipes
-  int pollstat;                 // result of poll command
-  int s_err_size;               // size of s_err
-  FILE *shell_script;           // shell script file we are creating (then running)
-  int status;                   // status returned by waitpid
-  json_error_t jerr;            // error returned when creating json object
-  json_t *rtn;                  // our return value
-  redisReply *reply;            // returned by redisCommand when we publish our progress
-  struct pollfd pollerr;        // poll for stderr 
-  struct pollfd polljson;       // poll for json fd
-  struct pollfd polllist[5];    // list of fd's we're polling
-  struct pollfd pollout;        // poll for stdout
-  struct pollfd pollprogress;   // poll for progress
-  char   dcu_version[16];       // Eiger detector software version, if applicable.
-  char*  detector_arg;          // Optional
-
-  // Infer the detector setup that produced the HDF5-based image set
-  // based on the DCU software version. This is specific to LS-CAT's
-  // setup as of Jan 2023-Apr 2023, but that's ok. There are only 2
-  // detectors in our lab, and both have used and will continue to use
-  // the same software versions they always have until image server is
-  // abandoned.
-  get_dcu_version_str(f1, dcu_version, sizeof(dcu_version));
-  detector_arg = (strcmp(dcu_version, "1.8.0") == 0) ?
-    "lscat_dectris_eiger2_16m" : NULL;
-
-  rtn = NULL;
-
-  /***************************************
-   *    Set up pipes to child process    *
-   ***************************************/
-  pipe2(pipein,       O_CLOEXEC);  // Future use: setup child in anticipation then send command via stdin
-  pipe2(pipeout,      O_CLOEXEC);  // We'll be throwing this out by, well, not saving it.
-  pipe2(pipeerr,      O_CLOEXEC);  // At some point we'll parse this for errors.  No API developed yet
-  pipe2(pipeprogress, 0);          // Progress report to be sent out-of-band to the user
-  pipe2(pipejson,     0);          // The result we are looking for as a response to the original request
-
-  char * const index_args[] = {
-    "indexing_script.sh",
+//
+// Node wide limit on running indexers, shared by all our user
+// processes: a flock on one of the IS_INDEX_MAX_RUNNING lock files
+// in IS_INDEX_SLOT_DIR is a slot.  isIndexInit makes them before any
+// user process is forked.  Only members of index_slot_gid may open
+// them: isProcessBecome gives that group to every user process.
+//
+static int index_slots = 0;
+static gid_t index_slot_gid = (gid_t)-1;
+static pthread_once_t index_slot_once = PTHREAD_ONCE_INIT;
+
+/** Name of the lock file for an indexing slot
+ */
+static void isIndexSlotPath(int slot, char *path, int len) {
+  snprintf(path, len-1, "%s/slot-%d", IS_INDEX_SLOT_DIR, slot);
+  path[len-1] = 0;
+}
+
+/** Make the lock files for the node wide indexing slots.  Call as
+ ** root before forking user processes: they run as other users and
+ ** need to open them too.  Without them indexing runs uncapped.
+ */
+void isIndexInit() {
+  static const char *id = FILEID "isIndexInit";
+  struct group *grp;
+  const char *group;
+  char path[256];
+  gid_t gid;
+  int fd;
+  int i;
+
+  group = getenv("IS_INDEX_SLOT_GROUP");
+  if (group == NULL || *group == 0) {
+    group = IS_INDEX_SLOT_GROUP;
+  }
+
+  grp = getgrnam(group);
+  if (grp != NULL) {
+    gid = grp->gr_gid;
+  } else {
+    gid = getgid();
+    isLogging_info("%s: No group %s, indexing slots belong to group %d\n", id, group, (int)gid);
+  }
+
+  if (mkdir(IS_INDEX_SLOT_DIR, 0750) == -1 && errno != EEXIST) {
+    isLogging_err("%s: Could not make %s: %s\n", id, IS_INDEX_SLOT_DIR, strerror(errno));
+    return;
+  }
+
+  if (chown(IS_INDEX_SLOT_DIR, 0, gid) == -1 || chmod(IS_INDEX_SLOT_DIR, 0750) == -1) {
+    isLogging_err("%s: Could not set owner of %s: %s\n", id, IS_INDEX_SLOT_DIR, strerror(errno));
+    return;
+  }
+
+  for (i=0; i<IS_INDEX_MAX_RUNNING; i++) {
+    isIndexSlotPath(i, path, sizeof(path));
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0660);
+    if (fd == -1 || fchown(fd, 0, gid) == -1 || fchmod(fd, 0660) == -1) {
+      isLogging_err("%s: Could not make indexing slot %s: %s\n", id, path, strerror(errno));
+      if (fd != -1) {
+        close(fd);
+      }
+      return;
+    }
+    close(fd);
+  }
+  index_slot_gid = gid;
+  index_slots    = 1;
+}
+
+/** The group a user process needs to take indexing slots
+ **
+ ** @returns the group or (gid_t)-1 when there are no slots
+ */
+gid_t isIndexSlotGroup() {
+  return index_slots ? index_slot_gid : (gid_t)-1;
+}
+
+/** Nothing to do: IS_INDEX_SLOT_SIGNAL is only there to interrupt flock
+ */
+static void isIndexSlotWake(int sig) {
+  (void)sig;
+}
+
+/** Let IS_INDEX_SLOT_SIGNAL interrupt a runner's flock.  No SA_RESTART.
+ */
+static void isIndexSlotSignalInit() {
+  struct sigaction sa;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = isIndexSlotWake;
+  sigemptyset(&sa.sa_mask);
+  sigaction(IS_INDEX_SLOT_SIGNAL, &sa, NULL);
+}
+
+/** Wait for a node wide indexing slot.  Call from the job's runner.
+ **
+ ** Each try opens the lock file afresh: a flock belongs to the open
+ ** file, and the ones we inherited across fork would be shared with
+ ** every other user process.
+ **
+ ** When every slot is taken we block on one of them.  isIndexCancel
+ ** interrupts the wait with IS_INDEX_SLOT_SIGNAL.  A signal that
+ ** lands just before we block is lost, in which case we notice the
+ ** cancel once we get the slot and give it straight back.
+ **
+ ** @param wctx    Worker context
+ **   @li @c wctx->indexMutex  Protects jp->slot_wait
+ **
+ ** @param jp      The job that wants the slot
+ **
+ ** @param slot_fd Returned lock file to close when done with the slot
+ **
+ ** @returns 1 when we hold a slot, 0 when there is no limit to
+ ** honor, -1 when the job was cancelled while waiting
+ */
+static int isIndexSlotTake(isWorkerContext_t *wctx, isIndexJobType *jp, int *slot_fd) {
+  static const char *id = FILEID "isIndexSlotTake";
+  static int next_slot = 0;
+  char path[256];
+  int fd;
+  int err;
+  int i;
+
+  *slot_fd = -1;
+  if (!index_slots) {
+    return 0;
+  }
+  pthread_once(&index_slot_once, isIndexSlotSignalInit);
+
+  //
+  // Any free slot will do
+  //
+  for (i=0; i<IS_INDEX_MAX_RUNNING; i++) {
+    isIndexSlotPath(i, path, sizeof(path));
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd == -1) {
+      isLogging_err("%s: Could not open %s, running without a slot: %s\n", id, path, strerror(errno));
+      return 0;
+    }
+
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+      *slot_fd = fd;
+      return 1;
+    }
+    err = errno;
+    close(fd);
+
+    if (err != EWOULDBLOCK && err != EINTR) {
+      isLogging_err("%s: flock failed on %s, running without a slot: %s\n", id, path, strerror(err));
+      return 0;
+    }
+  }
+
+  //
+  // None: queue up behind one of them.  Spread our runners (and the
+  // other user processes) over the slots.
+  //
+  isIndexSlotPath((getpid() + __sync_fetch_and_add(&next_slot, 1)) % IS_INDEX_MAX_RUNNING, path, sizeof(path));
+  fd = open(path, O_RDWR | O_CLOEXEC);
+  if (fd == -1) {
+    isLogging_err("%s: Could not open %s, running without a slot: %s\n", id, path, strerror(errno));
+    return 0;
+  }
+
+  while (1) {
+    pthread_mutex_lock(&wctx->indexMutex);
+    jp->slot_wait = !jp->cancelled;
+    pthread_mutex_unlock(&wctx->indexMutex);
+
+    if (!jp->slot_wait) {
+      close(fd);
+      return -1;
+    }
+
+    err = flock(fd, LOCK_EX) == 0 ? 0 : errno;
+
+    pthread_mutex_lock(&wctx->indexMutex);
+    jp->slot_wait = 0;
+    pthread_mutex_unlock(&wctx->indexMutex);
+
+    if (err == 0) {
+      if (jp->cancelled) {
+        close(fd);
+        return -1;
+      }
+      *slot_fd = fd;
+      return 1;
+    }
+
+    if (err != EINTR) {
+      isLogging_err("%s: flock failed on %s, running without a slot: %s\n", id, path, strerror(err));
+      close(fd);
+      return 0;
+    }
+  }
+}
+
+/** Connect to the redis server for progress or control, our local
+ ** one when address is not given.
+ */
+static redisContext *isIndexRedis(const char *address, int port) {
+  static const char *id = FILEID "isIndexRedis";
+  redisContext *rtn;
+  struct timeval timeout;
+
+  if (address == NULL || port <= 0) {
+    address = "127.0.0.1";
+    port    = 6379;
+  }
+
+  timeout.tv_sec  = 0;
+  timeout.tv_usec = IS_PROGRESS_CONNECT_TIMEOUT_MS * 1000;
+  rtn = redisConnectWithTimeout(address, port, timeout);
+  if (rtn == NULL || rtn->err) {
+    if (rtn) {
+      isLogging_info("%s: Failed to connect to redis %s:%d: %s", id, address, port, rtn->errstr);
+      redisFree(rtn);
+    } else {
+      isLogging_info("%s: Failed to connect to redis %s:%d", id, address, port);
+    }
+    return NULL;
+  }
+  return rtn;
+}
+
+/** Make a progress report for an indexing job
+ **
+ ** @param progress  Text to send, or NULL to announce we are done
+ **
+ ** @returns the message for the caller to free, NULL if we could not make one
+ */
+static char *isIndexProgressString(isWorkerContext_t *wctx, isIndexJobType *jp, const char *progress) {
+  json_t *msg;
+  char *rtn;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  if (progress == NULL) {
+    msg = json_pack("{s:b,s:s}", "done", 1, "tag", jp->tag);
+  } else {
+    msg = json_pack("{s:s,s:b,s:s}", "progress", progress, "done", 0, "tag", jp->tag);
+  }
+  rtn = msg ? json_dumps(msg, JSON_COMPACT) : NULL;
+  json_decref(msg);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  return rtn;
+}
+
+/** Send a progress report for an indexing job and wait for redis to
+ ** take it.  Not for the isSubProcess callbacks: they have
+ ** isSubProcessPublish.
+ **
+ ** @param progress  Text to send, or NULL to announce we are done
+ */
+static void isIndexPublish(isWorkerContext_t *wctx, redisContext *rrc, isIndexJobType *jp, const char *progress) {
+  static const char *id = FILEID "isIndexPublish";
+  char *msg_str;
+  redisReply *reply;
+
+  if (rrc == NULL || jp->progressPublisher == NULL) {
+    return;
+  }
+
+  msg_str = isIndexProgressString(wctx, jp, progress);
+  if (msg_str == NULL) {
+    return;
+  }
+
+  reply = redisCommand(rrc, "PUBLISH %s %s", jp->progressPublisher, msg_str);
+  if (reply == NULL) {
+    isLogging_info("%s: redis progress publisher %s returned error %s", id, jp->progressPublisher, rrc->errstr);
+  } else {
+    freeReplyObject(reply);
+  }
+  free(msg_str);
+}
+
+/** Make a NULL terminated list of copies of env entries
+ */
+static char **isIndexEnvDup(char **env) {
+  static const char *id = FILEID "isIndexEnvDup";
+  char **rtn;
+  int n;
+  int i;
+
+  for (n=0; env[n] != NULL; n++);
+
+  rtn = calloc(n+1, sizeof(*rtn));
+  if (rtn == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  for (i=0; i<n; i++) {
+    rtn[i] = strdup(env[i]);
+    if (rtn[i] == NULL) {
+      isLogging_crit("%s: Out of memory\n", id);
+      exit (-1);
+    }
+  }
+  return rtn;
+}
+
+static void isIndexEnvFree(char **env) {
+  int i;
+
+  if (env == NULL) {
+    return;
+  }
+  for (i=0; env[i] != NULL; i++) {
+    free(env[i]);
+  }
+  free(env);
+}
+
+/** What isIndexEnv waits on while the setup script runs
+ */
+typedef struct isIndexSetupStruct {
+  pthread_mutex_t mutex;        //!< Protects done
+  pthread_cond_t cond;          //!< Signaled when done
+  int done;                     //!< The script has exited
+  char *env_str;                //!< What it wrote to stdout
+} isIndexSetupType;
+
+/** isSubProcess onProgress for output we have no use for (but must drain)
+ */
+static int isIndexDiscard(void *data, char *buf) {
+  return -1;
+}
+
+/** isSubProcess onDone for the setup script's stdout
+ */
+static void isIndexSetupOut(void *data, char *buf) {
+  isIndexSetupType *sp;
+
+  sp = data;
+  sp->env_str = strdup(buf);
+}
+
+/** isSubProcess onExit for the setup script
+ */
+static void isIndexSetupExit(void *data) {
+  isIndexSetupType *sp;
+
+  sp = data;
+  pthread_mutex_lock(&sp->mutex);
+  sp->done = 1;
+  pthread_cond_signal(&sp->cond);
+  pthread_mutex_unlock(&sp->mutex);
+}
+
+/** Run the setup script and keep the environment it leaves behind
+ **
+ ** Sourcing DIALS, PHENIX, CCP4 and friends takes a while.  We do it
+ ** once per process (and again should the script change) instead of
+ ** once per job.  The runner calling us has nothing to start without
+ ** the environment so, unlike the indexers, we wait for the script.
+ **
+ ** @returns a copy of the environment for the caller to free with isIndexEnvFree
+ */
+static char **isIndexEnv(isWorkerContext_t *wctx) {
+  static const char *id = FILEID "isIndexEnv";
+  static char *fallback[] = {
+    "BASH_ENV=" IS_INDEX_SETUP,
+    "PATH=" IS_INDEX_PATH ":/usr/bin:/bin",
     NULL
   };
-
-  char * env[] = {
-    "BASH_ENV=/usr/local/bin/is_indexing_setup.sh",
+  char *setup_argv[] = {
+    "bash",
+    "-c",
+    ". " IS_INDEX_SETUP " >/dev/null 2>&1; export PATH=" IS_INDEX_PATH ":$PATH; exec /usr/bin/env",
     NULL
   };
+  char *setup_envp[] = {
+    "PATH=/usr/bin:/bin",
+    NULL
+  };
+  char control[64];
+  char **env;
+  char **rtn;
+  char *line;
+  char *next;
+  int n;
+  struct stat st;
+  isSubProcess_type spt;
+  isSubProcessFD_type fds[2];
+  isIndexSetupType setup;
 
-  c = fork();
-  if (c == -1) {
-    isLogging_err( "%s: fork 2 failed: %s\n", id, strerror(errno));
-    exit (-1);
+  if (stat(IS_INDEX_SETUP, &st) == -1) {
+    st.st_mtime = 0;
   }
 
-  if (c == 0) {
-    /*************  In Child *****************/  
-    //
-    // Make use of the O_CLOEXEC option in pipe2, above, so we don't
-    // explicitly close the descriptors in the pipes here.
-    //
-    dup2(pipein[0],    0);      // stdin comes from pipein
-    dup2(pipeout[1],   1);      // stdout goes to pipeout
-    dup2(pipeerr[1],   2);      // stderr goes to pipeerr
+  pthread_mutex_lock(&wctx->indexEnvMutex);
+  if (wctx->indexEnv != NULL && wctx->indexEnvTime == st.st_mtime) {
+    rtn = isIndexEnvDup(wctx->indexEnv);
+    pthread_mutex_unlock(&wctx->indexEnvMutex);
+    return rtn;
+  }
 
-    //close(pipeprogress[0]);     // close unneeded end of pipe
-    //close(pipejson[0]);         // close unneeded end of pipe
+  isLogging_info("%s: Running %s\n", id, IS_INDEX_SETUP);
 
-    //
-    // Make tmp directory
-    //
-    tmp_dir_template = strdup("/pf/tmp/isIndex-XXXXXX");
-    tmp_dir = mkdtemp(tmp_dir_template);
-    if (tmp_dir == NULL) {
-      isLogging_err("%s: failed to create temp directory from template %s: %s", id, tmp_dir_template, strerror(errno));
+  snprintf(control, sizeof(control), "%d:index-setup", (int)getegid());
+
+  memset(&setup, 0, sizeof(setup));
+  pthread_mutex_init(&setup.mutex, NULL);
+  pthread_cond_init(&setup.cond, NULL);
+
+  memset(fds, 0, sizeof(fds));
+  fds[0].fd         = 1;
+  fds[0].is_out     = 1;
+  fds[0].onDone     = isIndexSetupOut;
+  fds[1].fd         = 2;
+  fds[1].is_out     = 1;
+  fds[1].onProgress = isIndexDiscard;
+
+  memset(&spt, 0, sizeof(spt));
+  spt.cmd              = "/bin/bash";
+  spt.argv             = setup_argv;
+  spt.envp             = setup_envp;
+  spt.controlAddress   = "127.0.0.1";
+  spt.controlPort      = 6379;
+  spt.controlPublisher = control;
+  spt.fds              = fds;
+  spt.nfds             = 2;
+  spt.onExit           = isIndexSetupExit;
+  spt.data             = &setup;
+
+  isSubProcess(id, &spt);
+
+  pthread_mutex_lock(&setup.mutex);
+  while (!setup.done) {
+    pthread_cond_wait(&setup.cond, &setup.mutex);
+  }
+  pthread_mutex_unlock(&setup.mutex);
+  pthread_mutex_destroy(&setup.mutex);
+  pthread_cond_destroy(&setup.cond);
+
+  //
+  // Keep NAME=value lines: continuation lines of multi-line values
+  // and exported shell functions (BASH_FUNC_x%%) don't qualify.
+  //
+  env = NULL;
+  n   = 0;
+  for (line=setup.env_str; spt.rtn == 0 && line != NULL && *line; line=next) {
+    next = strchr(line, '\n');
+    if (next != NULL) {
+      *next++ = 0;
+    }
+    if (*line == 0 || strchr("0123456789=", *line) != NULL || line[strspn(line, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_")] != '=') {
+      continue;
+    }
+    env = realloc(env, (n+2) * sizeof(*env));
+    if (env == NULL) {
+      isLogging_crit("%s: Out of memory\n", id);
       exit (-1);
     }
+    env[n++] = strdup(line);
+    env[n]   = NULL;
+  }
+  free(setup.env_str);
+
+  if (env == NULL) {
+    isLogging_err("%s: %s gave us no environment (status %d), indexer will source it itself\n", id, IS_INDEX_SETUP, spt.rtn);
+    env = isIndexEnvDup(fallback);
+  } else {
+    isLogging_info("%s: %d environment variables from %s\n", id, n, IS_INDEX_SETUP);
+  }
 
-    isLogging_info("%s: Using temp directory %s", id, tmp_dir);
+  isIndexEnvFree(wctx->indexEnv);
+  wctx->indexEnv     = env;
+  wctx->indexEnvTime = st.st_mtime;
 
-    //
-    // Change to tmp directory
-    //
-    err = chdir(tmp_dir);
-    if (err == -1) {
-      isLogging_err("%s: failed to change to temp directory %s: %s", id, tmp_dir, strerror(errno));
-      exit (-1);
+  rtn = isIndexEnvDup(wctx->indexEnv);
+  pthread_mutex_unlock(&wctx->indexEnvMutex);
+  return rtn;
+}
+
+/** The indexer we run: IS_INDEX_COMMAND unless the environment says otherwise
+ */
+static const char *isIndexCommand() {
+  const char *rtn;
+
+  rtn = getenv("IS_INDEX_COMMAND");
+  if (rtn == NULL || *rtn == 0) {
+    rtn = IS_INDEX_COMMAND;
+  }
+  return rtn;
+}
+
+/** Infer the detector setup that produced the HDF5-based image set
+ ** based on the DCU software version. This is specific to LS-CAT's
+ ** setup as of Jan 2023-Apr 2023, but that's ok. There are only 2
+ ** detectors in our lab, and both have used and will continue to use
+ ** the same software versions they always have until image server is
+ ** abandoned.
+ **
+ ** @returns the --detector argument for the indexer or NULL for none
+ */
+static const char *isIndexDetector(const char *fn) {
+  char dcu_version[16];         // Eiger detector software version, if applicable.
+
+  get_dcu_version_str(fn, dcu_version, sizeof(dcu_version));
+  return strcmp(dcu_version, "1.8.0") == 0 ? "lscat_dectris_eiger2_16m" : NULL;
+}
+
+/** Where an indexing result lives in our local redis.  Everything that
+ ** changes the answer is in the key: the files (resolved, with their
+ ** size and modification time), the frames, the detector argument and
+ ** the indexer itself.
+ */
+static char *isIndexCacheKey(const char *fn1, const char *fn2, int frame1, int frame2, const char *detector) {
+  static const char *id = FILEID "isIndexCacheKey";
+  char real1[PATH_MAX];
+  char real2[PATH_MAX];
+  struct stat st1;
+  struct stat st2;
+  char *rtn;
+
+  if (realpath(fn1, real1) == NULL) {
+    snprintf(real1, sizeof(real1), "%s", fn1);
+  }
+  if (stat(real1, &st1) == -1) {
+    memset(&st1, 0, sizeof(st1));
+  }
+
+  if (fn2 == NULL || realpath(fn2, real2) == NULL) {
+    snprintf(real2, sizeof(real2), "%s", fn2 ? fn2 : "");
+  }
+  if (stat(real2, &st2) == -1) {
+    memset(&st2, 0, sizeof(st2));
+  }
+
+  if (asprintf(&rtn, "%d:%s-%ld-%ld-%s-%ld-%ld-%d-%d-%s-%s-index", getegid(),
+               real1, (long)st1.st_mtime, (long)st1.st_size,
+               real2, (long)st2.st_mtime, (long)st2.st_size,
+               frame1, frame2, detector ? detector : "", isIndexCommand()) == -1) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  return rtn;
+}
+
+/** An indexing job from isIndexRun until its indexer is done
+ */
+typedef struct isIndexRunStruct {
+  isWorkerContext_t *wctx;      //!< Whose job it is
+  isIndexJobType *jp;           //!< The job
+  const char *cmd;              //!< Indexer to run
+  char *tmp_dir;                //!< Our working directory
+  char *f1_local;               //!< fn1 without dir component
+  char *f2_local;               //!< fn2 without dir component
+  char json_fd[16];             //!< IS_INDEX_JSON_FD as a string
+  char progress_fd[16];         //!< IS_INDEX_PROGRESS_FD as a string
+  char range[64];               //!< Argument for --hdf5_image_range
+  char *argv[16];               //!< Indexer arguments
+  char **envp;                  //!< Indexer environment
+  char *json_str;               //!< What the indexer sent to IS_INDEX_JSON_FD
+  char *err_str;                //!< What the indexer sent to stderr
+  int slot;                     //!< Result of isIndexSlotTake
+  int slot_fd;                  //!< And the lock file we hold
+  int launched;                 //!< The indexer was started
+  isSubProcess_type spt;        //!< How to run the indexer
+  isSubProcessFD_type fds[4];   //!< stdout, stderr, json, and progress
+} isIndexRunType;
+
+/** Done with an indexing job: leave the result in jp->result, let
+ ** the job's waiters go, and make room for the next indexer.  Frees
+ ** rp.
+ **
+ ** @param status  Indexer's exit status (-1 if it never ran)
+ */
+static void isIndexRunFinish(isIndexRunType *rp, int status) {
+  static const char *id = FILEID "isIndexRunFinish";
+  isWorkerContext_t *wctx;
+  isIndexJobType *jp;
+  isIndexJobType **jpp;
+  json_error_t jerr;            // error returned when parsing the result
+  json_t *rtn;                  // our result
+
+  wctx = rp->wctx;
+  jp   = rp->jp;
+  rtn  = NULL;
+
+  if (rp->slot == 1) {
+    close(rp->slot_fd);
+  }
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  //
+  // Sometimes rapd forgets to send us the json.  Don't bother trying
+  // to parse.
+  //
+  if (rp->json_str != NULL && *rp->json_str) {
+    rtn = json_loads(rp->json_str, 0, &jerr);
+    if (rtn == NULL ) {
+      isLogging_info("%s: json decode error for string '%s': %s line %d  column %d", id, rp->json_str, jerr.text, jerr.line, jerr.column);
     }
+  }
 
-    //
-    // Make symlinks in tmp directory to data files in lustre.
-    //
-    // Note: Because both locations are in the "same" filesystem, normally we could
-    // use hard links. However, hard links on lustre have given us problems, likely
-    // because it's not a local filesystem, and it's also a filesystem on top of a
-    // filesystem, i.e. lustre -> ext4.
-    //
-    f1_local = NULL;
-    if (f1 && strlen(f1)) {
-      f1_local = file_name_component(id, f1);
-      err = symlink(f1, f1_local);
-      if (err == -1) {
-        isLogging_err("%s: failed to link file %s: %s", id, f1, strerror(errno));
-        // Should we exit here?
-      }
+  //
+  // Only a clean run is worth repeating to the next person who asks
+  //
+  jp->cacheable = rtn != NULL && status == 0 && !jp->cancelled;
+
+  //
+  // If we did happen to get something from stderr then we'll add that
+  // to the output as it might help us sort things out.
+  //
+  if (rp->err_str != NULL && *rp->err_str) {
+    if (rtn == NULL) {
+      rtn = json_object();
     }
+    json_object_set_new(rtn, "stderr", json_string(rp->err_str));
+  }
 
-    f2_local = NULL;
-    if (f2 && strlen(f2) && strcmp(f1,f2) != 0) {
-      f2_local = file_name_component(id, f2);
-      err = symlink(f2, f2_local);
-      if (err == -1) {
-        isLogging_err("%s: failed to link file %s: %s", id, f2, strerror(errno));
-        // Should we exit or return here?
-      }
+  if (jp->cancelled) {
+    if (rtn == NULL) {
+      rtn = json_object();
     }
+    json_object_set_new(rtn, "cancelled", json_true());
+  }
+  pthread_mutex_unlock(&wctx->metaMutex);
 
-    shell_script = fopen("indexing_script.sh", "w");
-    if (shell_script == NULL) {
-      isLogging_err("%s: could not open indexing_script: %s", id, strerror(errno));
-      exit (-1);
+  isIndexEnvFree(rp->envp);
+  free(rp->json_str);
+  free(rp->err_str);
+  free(rp->f1_local);
+  free(rp->f2_local);
+  free(rp->tmp_dir);
+  free(rp);
+
+  pthread_mutex_lock(&wctx->indexMutex);
+  jp->pid    = 0;       // gone now, don't let index_cancel signal someone else
+  jp->result = rtn;
+  for (jpp=&wctx->indexJobs; *jpp != NULL; jpp=&(*jpp)->next) {
+    if (*jpp == jp) {
+      *jpp = jp->next;
+      break;
     }
-    fprintf(shell_script,
-	    "#! /bin/bash\n"
-	    "export PATH=/pf/local/rapd/bin:$PATH\n");
-    if (detector_arg != NULL) {
-      fprintf(shell_script,
-	      "rapd.index --json --json-fd %d --progress-fd %d --detector %s ",
-	      pipejson[1], pipeprogress[1], detector_arg);
-    } else {
-      fprintf(shell_script,
-	      "rapd.index --json --json-fd %d --progress-fd %d ",
-	      pipejson[1], pipeprogress[1]);
-    }
-    fflush(shell_script);
-
-    // Always need f1 but not always f2
-    if (f2==NULL || strlen(f2)==0 || strcmp(f1,f2)==0) {
-      if (frame1==0) {
-        // Just go for it
-        fprintf(shell_script, "%s", f1_local);
-      } else {
-        // use the requested frames
-        fprintf(shell_script, "--hdf5_image_range %d,%d %s", frame1, frame2, f1_local);
-      }
-    } else {
-      // Here f1 and f2 are specified (and different).  We have to
-      // assume these files specify a single frame
-      fprintf(shell_script, "%s %s", f1_local, f2_local);
+  }
+  jp->done = 1;
+  pthread_cond_broadcast(&jp->cond);
+
+  wctx->indexRunning--;
+  pthread_cond_broadcast(&wctx->indexCond);
+  pthread_mutex_unlock(&wctx->indexMutex);
+}
+
+/** Publish a progress report from the isSubProcess callbacks
+ **
+ ** @param progress  Text to send, or NULL to announce we are done
+ */
+static void isIndexRunPublish(isIndexRunType *rp, const char *progress) {
+  char *msg_str;
+
+  if (rp->jp->progressPublisher == NULL) {
+    return;
+  }
+
+  msg_str = isIndexProgressString(rp->wctx, rp->jp, progress);
+  if (msg_str != NULL) {
+    isSubProcessPublish(&rp->spt, msg_str);
+    free(msg_str);
+  }
+}
+
+/** isSubProcess onLaunch for the indexer
+ */
+static void isIndexRunLaunch(void *data, char *msg, int pid) {
+  static const char *id = FILEID "isIndexRunLaunch";
+  isIndexRunType *rp;
+
+  rp = data;
+  if (msg != NULL) {
+    isLogging_err("%s: Could not start %s: %s\n", id, rp->cmd, msg);
+    return;
+  }
+  rp->launched = 1;
+
+  pthread_mutex_lock(&rp->wctx->indexMutex);
+  rp->jp->pid = pid;
+  pthread_mutex_unlock(&rp->wctx->indexMutex);
+}
+
+/** isSubProcess onProgress for the indexer's progress lines
+ */
+static int isIndexRunProgress(void *data, char *line) {
+  isIndexRunType *rp;
+  char child_progress[256];
+  int i;
+  int j;
+
+  rp = data;
+  for (i=0, j=0; line[j] && i < sizeof(child_progress)-1; j++) {
+    if (line[j] >= 32 && line[j] < 127) {
+      child_progress[i++] = line[j];
     }
+  }
+  child_progress[i] = 0;
+  if (i > 0) {
+    isIndexRunPublish(rp, child_progress);
+  }
+  return -1;
+}
 
-    fflush(shell_script);
-    fprintf(shell_script, "\nexit 0\n");
-    fflush(shell_script);
-    fclose(shell_script);
-    err = chmod("indexing_script.sh", S_IXUSR | S_IRUSR | S_IWUSR);
-    if (err == -1) {
-      isLogging_err("%s: could not set mode for script: %s", id, strerror(errno));
-      exit (-1);
+/** isSubProcess onDone for the indexer's json result
+ */
+static void isIndexRunJson(void *data, char *buf) {
+  isIndexRunType *rp;
+
+  rp = data;
+  rp->json_str = strdup(buf);
+}
+
+/** isSubProcess onDone for the indexer's stderr
+ */
+static void isIndexRunErr(void *data, char *buf) {
+  isIndexRunType *rp;
+
+  rp = data;
+  rp->err_str = strdup(buf);
+}
+
+/** isSubProcess onExit for the indexer
+ **
+ ** Normally called on the reactor thread, where we must not wait on
+ ** redis: the done message goes out over the reactor's connection.
+ ** A failed fork calls us from the runner in isSubProcess itself,
+ ** before there is any such connection.
+ */
+static void isIndexRunExit(void *data) {
+  static const char *id = FILEID "isIndexRunExit";
+  isIndexRunType *rp;
+  redisContext *rrc;
+
+  rp = data;
+  isLogging_info("%s: %s exited with status %d", id, rp->cmd, rp->spt.rtn);
+
+  if (rp->launched) {
+    isIndexRunPublish(rp, NULL);
+  } else {
+    rrc = rp->jp->progressPublisher ? isIndexRedis(rp->jp->progressAddress, rp->jp->progressPort) : NULL;
+    isIndexPublish(rp->wctx, rrc, rp->jp, NULL);
+    if (rrc != NULL) {
+      redisFree(rrc);
     }
-    
-    execve( index_args[0], index_args, env);
-  
-    // We only get here on failure
-    printf("execve 2 failed: %s\n", strerror(errno));
+  }
+
+  isIndexRunFinish(rp, rp->spt.rtn);
+}
+
+/** Start one indexing job
+ **
+ ** Each job gets its own directory with links to its files.  The
+ ** indexer writes its json result to IS_INDEX_JSON_FD and progress
+ ** lines to IS_INDEX_PROGRESS_FD.  isSubProcess listens on
+ ** jp->controlPublisher so {"sig":15} published there stops the job.
+ **
+ ** We return once the indexer is started: isIndexRunExit finishes
+ ** the job when it exits.  Jobs that never get that far are finished
+ ** here.
+ */
+static void isIndexRun(isWorkerContext_t *wctx, isIndexJobType *jp) {
+  static const char *id = FILEID "isIndexRun";
+  isIndexRunType *rp;           // the job from here on
+  char link_path[PATH_MAX];     // symlink to make in tmp_dir
+  int argc;                     // number of arguments in rp->argv
+  redisContext *rrc;            // progress reports until the indexer starts go here
+
+  rp = calloc(1, sizeof(*rp));
+  if (rp == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
     exit (-1);
   }
+  rp->wctx    = wctx;
+  rp->jp      = jp;
+  rp->slot_fd = -1;
+
+  rrc = jp->progressPublisher ? isIndexRedis(jp->progressAddress, jp->progressPort) : NULL;
+
+  isIndexPublish(wctx, rrc, jp, "Waiting for an indexing slot");
+  rp->slot = isIndexSlotTake(wctx, jp, &rp->slot_fd);
+
+  if (rp->slot != -1) {
+    isIndexPublish(wctx, rrc, jp, "Starting indexer");
+
+    //
+    // Make tmp directory
+    //
+    rp->tmp_dir = strdup(IS_INDEX_TMP_TEMPLATE);
+    if (mkdtemp(rp->tmp_dir) == NULL) {
+      isLogging_err("%s: failed to create temp directory from template %s: %s", id, IS_INDEX_TMP_TEMPLATE, strerror(errno));
+      rp->err_str = strdup("Could not create a directory to index in");
+    }
+  }
+
+  if (rp->slot == -1 || rp->err_str != NULL) {
+    isIndexPublish(wctx, rrc, jp, NULL);
+    if (rrc != NULL) {
+      redisFree(rrc);
+    }
+    isIndexRunFinish(rp, -1);
+    return;
+  }
+
+  if (rrc != NULL) {
+    redisFree(rrc);
+  }
+  isLogging_info("%s: Using temp directory %s", id, rp->tmp_dir);
+
+  //
+  // Make symlinks in tmp directory to data files in lustre.
+  //
+  // Note: Because both locations are in the "same" filesystem, normally we could
+  // use hard links. However, hard links on lustre have given us problems, likely
+  // because it's not a local filesystem, and it's also a filesystem on top of a
+  // filesystem, i.e. lustre -> ext4.
+  //
+  rp->f1_local = file_name_component(id, jp->fn1);
+  snprintf(link_path, sizeof(link_path), "%s/%s", rp->tmp_dir, rp->f1_local);
+  if (symlink(jp->fn1, link_path) == -1) {
+    isLogging_err("%s: failed to link file %s: %s", id, jp->fn1, strerror(errno));
+  }
+
+  if (jp->fn2 && strlen(jp->fn2) && strcmp(jp->fn1, jp->fn2) != 0) {
+    rp->f2_local = file_name_component(id, jp->fn2);
+    snprintf(link_path, sizeof(link_path), "%s/%s", rp->tmp_dir, rp->f2_local);
+    if (symlink(jp->fn2, link_path) == -1) {
+      isLogging_err("%s: failed to link file %s: %s", id, jp->fn2, strerror(errno));
+    }
+  }
+
+  rp->cmd = isIndexCommand();
+
+  snprintf(rp->json_fd,     sizeof(rp->json_fd),     "%d", IS_INDEX_JSON_FD);
+  snprintf(rp->progress_fd, sizeof(rp->progress_fd), "%d", IS_INDEX_PROGRESS_FD);
+
+  argc = 0;
+  rp->argv[argc++] = (char *)rp->cmd;
+  rp->argv[argc++] = "--json";
+  rp->argv[argc++] = "--json-fd";
+  rp->argv[argc++] = rp->json_fd;
+  rp->argv[argc++] = "--progress-fd";
+  rp->argv[argc++] = rp->progress_fd;
+
+  if (jp->detector != NULL) {
+    rp->argv[argc++] = "--detector";
+    rp->argv[argc++] = jp->detector;
+  }
+
+  // Always need f1 but not always f2
+  if (rp->f2_local == NULL) {
+    if (jp->frame1 != 0) {
+      // use the requested frames
+      snprintf(rp->range, sizeof(rp->range), "%d,%d", jp->frame1, jp->frame2);
+      rp->argv[argc++] = "--hdf5_image_range";
+      rp->argv[argc++] = rp->range;
+    }
+    rp->argv[argc++] = rp->f1_local;
+  } else {
+    // Here f1 and f2 are specified (and different).  We have to
+    // assume these files specify a single frame
+    rp->argv[argc++] = rp->f1_local;
+    rp->argv[argc++] = rp->f2_local;
+  }
+  rp->argv[argc] = NULL;
 
-  /*************  In Parent *****************/  
-  json_output     = NULL;
-  json_output_end = NULL;
-  json_output_size = 0;
-  s_err            = NULL;
-  s_err_end        = NULL;
-  s_err_size       = 0;
+  rp->envp = isIndexEnv(wctx);
 
-  pollout.fd = pipeout[0];
-  pollout.events = POLLIN;
+  //
+  // We ignore stdout but still need to drain it so the child does
+  // not hang with a full pipe.
+  //
+  rp->fds[0].fd         = 1;
+  rp->fds[0].is_out     = 1;
+  rp->fds[0].onProgress = isIndexDiscard;
+  rp->fds[1].fd         = 2;
+  rp->fds[1].is_out     = 1;
+  rp->fds[1].onDone     = isIndexRunErr;
+  rp->fds[2].fd         = IS_INDEX_JSON_FD;
+  rp->fds[2].is_out     = 1;
+  rp->fds[2].onDone     = isIndexRunJson;
+  rp->fds[3].fd         = IS_INDEX_PROGRESS_FD;
+  rp->fds[3].is_out     = 1;
+  rp->fds[3].read_lines = 1;
+  rp->fds[3].onProgress = isIndexRunProgress;
 
-  pollerr.fd = pipeerr[0];
-  pollerr.events = POLLIN;
+  rp->spt.cmd               = (char *)rp->cmd;
+  rp->spt.argv              = rp->argv;
+  rp->spt.envp              = rp->envp;
+  rp->spt.cwd               = rp->tmp_dir;
+  rp->spt.controlAddress    = jp->controlAddress;
+  rp->spt.controlPort       = jp->controlPort;
+  rp->spt.controlPublisher  = jp->controlPublisher;
+  rp->spt.progressAddress   = jp->progressAddress;
+  rp->spt.progressPort      = jp->progressPort;
+  rp->spt.progressPublisher = jp->progressPublisher;
+  rp->spt.fds               = rp->fds;
+  rp->spt.nfds              = 4;
+  rp->spt.onLaunch          = isIndexRunLaunch;
+  rp->spt.onExit            = isIndexRunExit;
+  rp->spt.data              = rp;
 
-  pollprogress.fd = pipeprogress[0];
-  pollprogress.events = POLLIN;
+  //
+  // rp belongs to isIndexRunExit from here on
+  //
+  isSubProcess(id, &rp->spt);
+}
 
-  polljson.fd     = pipejson[0];
-  polljson.events = POLLIN;
+/** Take indexing jobs off the queue, oldest first, until told to
+ ** stop.  No more than IS_INDEX_RUNNERS indexers run at once.
+ */
+static void *isIndexRunner(void *arg) {
+  isWorkerContext_t *wctx;
+  isIndexJobType *jp;
 
-  close(pipeprogress[1]);       // close unneeded end of pipe
-  close(pipejson[1]);           // close unneeded end of pipe
+  wctx = arg;
 
   //
-  // Ignore pollin for now
+  // Warm up the environment before the first job wants it
   //
-  keep_on_truckin = 1;
-  isLogging_info("%s: starting poll loop", id);
-  do {
-    npoll = 0;;
-    if (pollout.fd >= 0) {
-      polllist[npoll++] = pollout;
-    }
-    if (pollerr.fd >= 0) {
-      polllist[npoll++] = pollerr;
-    }
-    if (polljson.fd >= 0) {
-      polllist[npoll++] = polljson;
-    }
-    if (pollprogress.fd >= 0) {
-      polllist[npoll++] = pollprogress;
-    }
+  isIndexEnvFree(isIndexEnv(wctx));
 
-    pollstat = poll( polllist, npoll, 100);
-    if (pollstat == -1) {
-      printf("poll exited with error: %s\n", strerror(errno));
-      exit (-1);
+  pthread_mutex_lock(&wctx->indexMutex);
+  while (1) {
+    for (jp=wctx->indexJobs; jp != NULL && jp->running; jp=jp->next);
+    if (wctx->indexStop) {
+      break;
     }
-
-    if (pollstat == 0) {
-      //
-      // Check to see if our process is still running
-      //
-      err = waitpid(c, &status, WNOHANG);
-      if (err == c) {
-        keep_on_truckin = 0;
-        break;
-      }
-      if (err == -1) {
-        isLogging_info("%s: waitpid 2 failed: %s\n", id, strerror(errno));
-        keep_on_truckin = 0;
-        break;
-      }
+    if (jp == NULL || wctx->indexRunning >= IS_INDEX_RUNNERS) {
+      pthread_cond_wait(&wctx->indexCond, &wctx->indexMutex);
       continue;
     }
+    jp->running = 1;
+    jp->runner  = pthread_self();
+    wctx->indexWaiting--;
+    wctx->indexRunning++;
+    pthread_mutex_unlock(&wctx->indexMutex);
 
-    for (i=0; i<npoll; i++) {
-      // check for errors
-      if (polllist[i].revents & (POLLERR | POLLHUP)) {
-        isLogging_info("%s: Error or hangup on fd %d\n", id, polllist[i].fd);
+    isIndexRun(wctx, jp);
 
-        if (polllist[i].fd == pollout.fd) {
-          close(polllist[i].fd);
-          pollout.fd = -1;
-        }
+    pthread_mutex_lock(&wctx->indexMutex);
+  }
+  pthread_mutex_unlock(&wctx->indexMutex);
+  return NULL;
+}
 
-        if (polllist[i].fd == pollerr.fd) {
-          close(polllist[i].fd);
-          pollerr.fd = -1;
-        }
+/** Stop our indexing runners.  Jobs already running are allowed to
+ ** finish and we wait for them.  Called from isDataDestroy once the
+ ** worker threads are gone.
+ */
+void isIndexDestroy(isWorkerContext_t *wctx) {
+  static const char *id = FILEID "isIndexDestroy";
+  int i;
+  int err;
 
-        if (polllist[i].fd == polljson.fd) {
-          close(polllist[i].fd);
-          polljson.fd = -1;
-          isLogging_err("%s: Closing json pipe after reading %d bytes", id, json_output_size);
-        }
+  pthread_mutex_lock(&wctx->indexMutex);
+  wctx->indexStop = 1;
+  pthread_cond_broadcast(&wctx->indexCond);
+  pthread_mutex_unlock(&wctx->indexMutex);
 
-        if (polllist[i].fd == pollprogress.fd) {
-          close(polllist[i].fd);
-          pollprogress.fd = -1;
-          isLogging_err("%s: Closing progress pipe", id);
-        }
-      }
+  for (i=0; i<wctx->indexRunners; i++) {
+    err = pthread_join(wctx->indexThreads[i], NULL);
+    if (err != 0) {
+      isLogging_err("%s: Could not join indexing runner %d: %s\n", id, i, strerror(err));
+    }
+  }
+  wctx->indexRunners = 0;
 
-      // stdout service
-      // 
-      // We plan to ignore stdout but we at least need to service
-      // the socket so the clild does not hang with a full buffer.
-      //
-      if ((polllist[i].revents & POLLIN) && polllist[i].fd == pollout.fd) {
-        do {
-          char tmp[256];
-
-          bytes_read = read(pollout.fd, tmp, sizeof(tmp));
-          if (bytes_read == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
-            isLogging_info("%s: stdout read with error %s", id, strerror(errno));
-          }
-          //} while(bytes_read > 0);
-        } while(0);
-      }
+  //
+  // Their indexers finish on the isSubProcess reactor thread
+  //
+  pthread_mutex_lock(&wctx->indexMutex);
+  while (wctx->indexRunning > 0) {
+    pthread_cond_wait(&wctx->indexCond, &wctx->indexMutex);
+  }
+  pthread_mutex_unlock(&wctx->indexMutex);
 
-      // stderr service
-      //
-      // How exactly we handle errors is not fully designed at this
-      // point in time.  For now we'll pass back the errors in the
-      // return value so at least it's all handled in-band.
-      //
-      if ((polllist[i].revents & POLLIN) && polllist[i].fd == pollerr.fd) {
-        do {
-          char tmp[256];
-
-          tmp[0] = 0;
-          bytes_read = read(pollerr.fd, tmp, sizeof(tmp));
-          if (bytes_read > 0) {
-            // new stderr area
-            s_err = realloc(s_err, s_err_size + bytes_read);
-
-            // place to add the new stuff
-            s_err_end = s_err + s_err_size;
-
-            // add it
-            memcpy(s_err_end, tmp, bytes_read);
-
-            // new size of our stderr string
-            s_err_size += bytes_read;
-          }
-          if (bytes_read == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
-            isLogging_info("%s: stderr read with error %s", id, strerror(errno));
-          }
-          //} while(bytes_read > 0);
-        } while(0);
-      }
+  isIndexEnvFree(wctx->indexEnv);
+  wctx->indexEnv = NULL;
+}
 
-      // progress service
-      if ((polllist[i].revents & POLLIN) && polllist[i].fd == pollprogress.fd) {
-        do {
-          char tmp[256];
-          int i, j;
-
-          bytes_read = read(pollprogress.fd, tmp, sizeof(tmp)-1);
-          if (bytes_read > -1) {
-            tmp[bytes_read] = 0;
-            child_progress[0] = 0;
-            for (i=0, j=0; j<bytes_read; j++) {
-              if (tmp[j] >= 32 && tmp[j] < 128) {
-                child_progress[i++] = tmp[j];
-              }
-            }
-            child_progress[i] = 0;
-
-            if (rrc && progressPublisher) {
-              reply = redisCommand(rrc, "PUBLISH %s {\"progress\":\"%s\",\"done\":false,\"tag\":\"%s\"}", progressPublisher, child_progress, tag);
-              if (reply == NULL) {
-                isLogging_info("%s: redis progress publisher %s returned error %s when publishing \"%*s\"", id, progressPublisher, rrc->errstr, strlen(child_progress), child_progress);
-              } else {
-                freeReplyObject(reply);
-              }
-            }
-          }
-          if (bytes_read == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
-            isLogging_info("%s: progress read error: %s", id, strerror(errno));
-          }
-          //} while(bytes_read > 0);
-        } while(0);
-      }
+static void isIndexJobFree(isWorkerContext_t *wctx, isIndexJobType *jp) {
+  free(jp->tag);
+  free(jp->detector);
+  free(jp->cache_key);
+  free(jp->fn1);
+  free(jp->fn2);
+  free(jp->progressPublisher);
+  free(jp->progressAddress);
+  free(jp->controlPublisher);
+  free(jp->controlAddress);
+  pthread_cond_destroy(&jp->cond);
+  if (jp->result != NULL) {
+    pthread_mutex_lock(&wctx->metaMutex);
+    json_decref(jp->result);
+    pthread_mutex_unlock(&wctx->metaMutex);
+  }
+  free(jp);
+}
 
-      // json service
-      if ((polllist[i].revents & POLLIN) && polllist[i].fd == polljson.fd) {
-        do {
-          char tmp[256];
-          
-          tmp[0] = 0;
-          bytes_read = read(polljson.fd, tmp, sizeof(tmp));
-          if (bytes_read > 0) {
-            json_output = realloc(json_output, json_output_size + bytes_read);
-            
-            // location to start writing new data
-            json_output_end = json_output + json_output_size;
-            
-            // move read data to the json buffer
-            memcpy(json_output_end, tmp, bytes_read);
-            
-            // save the new json_output buffer size
-            json_output_size += bytes_read;
-          }
-          if (bytes_read == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
-            isLogging_info("json read with error %s", strerror(errno));
-          }
-          //} while(bytes_read > 0);
-        } while( 0);
-      }
-    }
-  } while (npoll && keep_on_truckin);
-    
-  reply = redisCommand(rrc, "PUBLISH %s {\"done\":true,\"tag\":\"%s\"}", progressPublisher, tag);
-  if (reply == NULL) {
-    isLogging_info("%s: redis progress publisher %s returned error %s", id, progressPublisher, rrc->errstr);
-  } else {
-    freeReplyObject(reply);
+static char *isIndexStrdup(const char *s) {
+  static const char *id = FILEID "isIndexStrdup";
+  char *rtn;
+
+  if (s == NULL) {
+    return NULL;
+  }
+  rtn = strdup(s);
+  if (rtn == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
   }
+  return rtn;
+}
 
-  //
-  // Sometimes rapd forgets to send us the json.  Don't bother trying
-  // to parse.
-  //
-  if (json_output_size == 0) {
-    rtn = NULL;
+/** Send the indexing result back: empty error, job, result.
+ **
+ ** @param index_str  Result to send.  We take ownership.
+ */
+static void isIndexReply(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job, char *index_str) {
+  static const char *id = FILEID "isIndexReply";
+  char *job_str;                // stringified version of job
+  int err;                      // error code from routies that return integers
+  zmq_msg_t err_msg;            // error message to send via zmq
+  zmq_msg_t job_msg;            // the job message
+  zmq_msg_t index_msg;          // the indexing result message to send via zmq
+
+  // Err message part
+  zmq_msg_init(&err_msg);
+
+  // Job message part
+  job_str = NULL;
+  if (job != NULL) {
+    pthread_mutex_lock(&wctx->metaMutex);
+    job_str = json_dumps(job, JSON_SORT_KEYS | JSON_INDENT(0) | JSON_COMPACT);
+    pthread_mutex_unlock(&wctx->metaMutex);
   } else {
-    rtn = json_loadb(json_output, json_output_size, 0, &jerr);
-    if (rtn == NULL ) {
-      isLogging_info("%s: json decode error for string '%s': %s line %d  column %d", id, json_output, jerr.text, jerr.line, jerr.column);
-    }
+    job_str = strdup("");
   }
 
-  //
-  // If we did happen to get something from stderr then we'll add that
-  // to the output as it might help us sort things out.
-  //
-  if (s_err_size > 0) {
-    json_t *j_stderr;
+  // Hey! we already have the job, so lets add it now
+  err = zmq_msg_init_data(&job_msg, job_str, strlen(job_str), is_zmq_free_fn, NULL);
+  if (err != 0) {
+    isLogging_err("%s: zmq_msg_init failed (job_str): %s\n", id, zmq_strerror(errno));
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Could not initialize reply message (job_str)", id);
+    pthread_exit (NULL);
+  }
 
-    if (rtn == NULL) {
-      rtn = json_object();
-    }
-    j_stderr = json_stringn(s_err, s_err_size);
-    free(s_err);
-    json_object_set_new(rtn, "stderr", j_stderr);
+  err = zmq_msg_init_data(&index_msg, index_str, strlen(index_str), is_zmq_free_fn, NULL);
+  if (err == -1) {
+    isLogging_err("%s: zmq_msg_init failed (index_str): %s\n", id, zmq_strerror(errno));
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Could not initialize reply message (index_str)", id);
+    pthread_exit (NULL);
   }
 
-  return rtn;
+  // Send them out
+  do {
+    // Error Message
+    err = zmq_msg_send(&err_msg, tcp->rep, ZMQ_SNDMORE);
+    if (err == -1) {
+      isLogging_err("%s: Could not send empty error frame: %s\n", id, zmq_strerror(errno));
+      break;
+    }
+
+    // Job 
+    err = zmq_msg_send(&job_msg, tcp->rep, ZMQ_SNDMORE);
+    if (err < 0) {
+      isLogging_err("%s: sending job_str failed: %s\n", id, zmq_strerror(errno));
+      break;
+    }
+
+    // Meta
+    err = zmq_msg_send(&index_msg, tcp->rep, 0);
+    if (err == -1) {
+      isLogging_err("%s: sending index_str failed: %s\n", id, zmq_strerror(errno));
+      break;
+    }
+  } while (0);
 }
 
 /** Index diffraction pattern(s)
+ **
+ ** The job waits its turn in our queue (at most
+ ** IS_INDEX_QUEUE_LENGTH deep) for one of our runners and then for
+ ** one of the IS_INDEX_MAX_RUNNING slots this node allows.  Clean
+ ** results are kept in our local redis (IS_INDEX_CACHE_TTL) keyed by
+ ** the resolved files with their size and mtime, the frames, the
+ ** detector and the indexer; asking again returns the same answer
+ ** with "cached": true.  Asking while an identical job is still
+ ** queued or running joins that job.
  **
  ** @param wctx Worker context
- **   @li @c wctx->ctxMutex Keeps worker threads from colliding
+ **   @li @c wctx->indexMutex Keeps the queue in line
  **
  ** @param tcp Thread data
  **   @li @c tcp->rep ZMQ Response socket into return result or error
@@ -448,6 +1109,10 @@ json_t *isIndexImages(redisContext *rrc, const char *progressPublisher, const ch
  **   @li @c job->fn2     Our second file name to index
  **   @li @c job->frame1  Frame to use in file fn1
  **   @li @c job->frame2  Frame to use in file fn2
+ **   @li @c job->controlPublisher  Redis channel to listen to for {"sig":n} (default "egid:index-tag")
+ **   @li @c job->controlAddress    Redis server with controlPublisher (default our local one)
+ **   @li @c job->controlPort       Port for controlAddress
+ **   @li @c job->nocache           true to ignore any earlier result
  **
  **   @note: Rayonix files we are expecting frame1 and frame2 to both be 1 and the file names be different
  **          H5 file we are expecting fn1 and fn2 to be the same and the frame numbers to be different
@@ -460,17 +1125,26 @@ void isIndex(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
   const char *tag;
   const char *progressPublisher;
   const char *progressAddress;
+  const char *controlPublisher;
+  const char *controlAddress;
   int   progressPort;
-  redisContext *remote_redis;
+  int   controlPort;
   int  frame1;
   int  frame2;
-  char *job_str;                // stringified version of job
+  char control[256];            // default control publisher
   char *index_str;               // stringified version of meta
+  char *cache_key;              // where the answer is kept in our local redis
+  const char *detector;         // --detector argument, if any
+  int nocache;                  // don't look for an earlier answer
+  int owner;                    // we queued the job (and so keep its result)
+  int last;                     // we are the last one waiting for the job
   int err;                      // error code from routies that return integers
-  json_t *index;                // result object
-  zmq_msg_t err_msg;            // error message to send via zmq
-  zmq_msg_t job_msg;            // the job message
-  zmq_msg_t index_msg;          // the indexing result message to send via zmq
+  int i;                        // loop over runners
+  isIndexJobType *jp;           // our place in the queue
+  isIndexJobType **jpp;         // end of the queue
+  redisReply *reply;            // cache lookup/store
+  json_t *cached;               // earlier answer
+  json_error_t jerr;            // parse error in the earlier answer
 
   pthread_mutex_lock(&wctx->metaMutex);
   tag               = json_string_value(json_object_get(job,  "tag"));
@@ -481,88 +1155,333 @@ void isIndex(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
   progressPublisher = json_string_value(json_object_get(job,  "progressPublisher"));
   progressAddress   = json_string_value(json_object_get(job,  "progressAddress"));
   progressPort      = json_integer_value(json_object_get(job, "progressPort"));
+  controlPublisher  = json_string_value(json_object_get(job,  "controlPublisher"));
+  controlAddress    = json_string_value(json_object_get(job,  "controlAddress"));
+  controlPort       = json_integer_value(json_object_get(job, "controlPort"));
+  nocache           = json_is_true(json_object_get(job,       "nocache"));
   pthread_mutex_unlock(&wctx->metaMutex);
 
+  if (fn1 == NULL || *fn1 == 0) {
+    isLogging_err("%s: No fn1 in job\n", id);
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: No fn1 in job", id);
+    return;
+  }
+
+  detector  = isIndexDetector(fn1);
+  cache_key = isIndexCacheKey(fn1, fn2, frame1, frame2, detector);
+
   //
-  // Set up progress reporting if requested.  Not an error if this
-  // does not work but log it anyway.
+  // Someone may have already asked this exact question
   //
-  remote_redis = NULL;
-  if (progressPublisher != NULL && progressAddress != NULL && progressPort > 0) {
-    remote_redis = redisConnect(progressAddress, progressPort);
-    if (remote_redis == NULL || remote_redis->err) {
-      if (remote_redis) {
-        isLogging_info("%s: Failed to connect to remote redis %s:%d: %s", id, progressAddress, progressPort, remote_redis->err);
-      } else {
-        isLogging_info("%s: Failed to connect to remote redis %s:%d", id, progressAddress, progressPort);
+  index_str = NULL;
+  if (!nocache && tcp->rc != NULL) {
+    reply = redisCommand(tcp->rc, "GET %s", cache_key);
+    if (reply != NULL && reply->type == REDIS_REPLY_STRING) {
+      pthread_mutex_lock(&wctx->metaMutex);
+      cached = json_loads(reply->str, 0, &jerr);
+      if (cached != NULL) {
+        json_object_set_new(cached, "cached", json_true());
+        index_str = json_dumps(cached, JSON_SORT_KEYS | JSON_INDENT(0) | JSON_COMPACT);
+        json_decref(cached);
       }
+      pthread_mutex_unlock(&wctx->metaMutex);
+    }
+    if (reply == NULL) {
+      isLogging_err("%s: Redis error looking up %s: %s\n", id, cache_key, tcp->rc->errstr);
+    } else {
+      freeReplyObject(reply);
     }
   }
 
-  // Err message part
-  zmq_msg_init(&err_msg);
+  if (index_str != NULL) {
+    isLogging_info("%s: Using earlier result for job %s\n", id, tag);
+    free(cache_key);
+    isIndexReply(wctx, tcp, job, index_str);
+    return;
+  }
 
-  // Job message part
-  job_str = NULL;
-  if (job != NULL) {
-    pthread_mutex_lock(&wctx->metaMutex);
-    job_str = json_dumps(job, JSON_SORT_KEYS | JSON_INDENT(0) | JSON_COMPACT);
-    pthread_mutex_unlock(&wctx->metaMutex);
-  } else {
-    job_str = strdup("");
+  if (tag == NULL) {
+    tag = "Tag_Not_Found";
   }
 
-  // Hey! we already have the job, so lets add it now
-  err = zmq_msg_init_data(&job_msg, job_str, strlen(job_str), is_zmq_free_fn, NULL);
-  if (err != 0) {
-    isLogging_err("%s: zmq_msg_init failed (job_str): %s\n", id, zmq_strerror(errno));
-    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Could not initialize reply message (job_str)", id);
-    pthread_exit (NULL);
+  if (controlPublisher == NULL) {
+    snprintf(control, sizeof(control), "%d:index-%s", (int)getegid(), tag);
+    controlPublisher = control;
+  }
+
+  if (controlAddress == NULL || controlPort <= 0) {
+    controlAddress = "127.0.0.1";
+    controlPort    = 6379;
+  }
+
+  pthread_mutex_lock(&wctx->indexMutex);
+
+  //
+  // The same question is already being worked on: wait for its answer
+  // rather than run the indexer twice
+  //
+  owner = 0;
+  for (jp=wctx->indexJobs; jp != NULL; jp=jp->next) {
+    if (!jp->cancelled && !jp->done && strcmp(jp->cache_key, cache_key) == 0) {
+      jp->waiters++;
+      isLogging_info("%s: Job %s joins indexing job %s\n", id, tag, jp->tag);
+      free(cache_key);
+      break;
+    }
+  }
+
+  if (jp == NULL) {
+    owner = 1;
+    jp = calloc(1, sizeof(*jp));
+    if (jp == NULL) {
+      isLogging_crit("%s: Out of memory\n", id);
+      exit (-1);
+    }
+    jp->tag               = isIndexStrdup(tag);
+    jp->fn1               = isIndexStrdup(fn1);
+    jp->fn2               = isIndexStrdup(fn2);
+    jp->frame1            = frame1;
+    jp->frame2            = frame2;
+    jp->progressPublisher = isIndexStrdup(progressPublisher);
+    jp->progressAddress   = isIndexStrdup(progressAddress);
+    jp->progressPort      = progressPort;
+    jp->controlPublisher  = isIndexStrdup(controlPublisher);
+    jp->controlAddress    = isIndexStrdup(controlAddress);
+    jp->controlPort       = controlPort;
+    jp->detector          = isIndexStrdup(detector);
+    jp->cache_key         = cache_key;
+    jp->waiters           = 1;
+    pthread_cond_init(&jp->cond, NULL);
   }
 
-  // The actual work is done here
-  index = isIndexImages(remote_redis, progressPublisher, tag ? tag : "Tag_Not_Found", fn1, fn2, frame1, frame2);
+  if (owner) {
+    if (wctx->indexWaiting >= IS_INDEX_QUEUE_LENGTH) {
+      pthread_mutex_unlock(&wctx->indexMutex);
+      isIndexJobFree(wctx, jp);
+      isLogging_info("%s: Indexing queue is full, refusing job %s\n", id, tag);
+      is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Indexing queue is full (%d jobs waiting)", id, IS_INDEX_QUEUE_LENGTH);
+      return;
+    }
+
+    //
+    // Runners start with our first indexing job
+    //
+    for (i=wctx->indexRunners; i<IS_INDEX_RUNNERS; i++) {
+      err = pthread_create(&wctx->indexThreads[i], NULL, isIndexRunner, wctx);
+      if (err != 0) {
+        isLogging_err("%s: Could not start indexing runner %d: %s\n", id, i, strerror(err));
+        break;
+      }
+      wctx->indexRunners++;
+    }
+
+    if (wctx->indexRunners == 0) {
+      pthread_mutex_unlock(&wctx->indexMutex);
+      isIndexJobFree(wctx, jp);
+      is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Could not start indexing", id);
+      return;
+    }
+
+    for (jpp=&wctx->indexJobs; *jpp != NULL; jpp=&(*jpp)->next);
+    *jpp = jp;
+    wctx->indexWaiting++;
+    isLogging_info("%s: Queued job %s (%d waiting)\n", id, tag, wctx->indexWaiting);
+    pthread_cond_signal(&wctx->indexCond);
+  }
 
-  redisFree(remote_redis);
+  while (!jp->done) {
+    pthread_cond_wait(&jp->cond, &wctx->indexMutex);
+  }
+  pthread_mutex_unlock(&wctx->indexMutex);
 
   // Indexing result message part
   index_str = NULL;
-  if (index != NULL) {
+  if (jp->result != NULL) {
     pthread_mutex_lock(&wctx->metaMutex);
-    index_str = json_dumps(index, JSON_SORT_KEYS | JSON_INDENT(0) | JSON_COMPACT);
+    index_str = json_dumps(jp->result, JSON_SORT_KEYS | JSON_INDENT(0) | JSON_COMPACT);
     pthread_mutex_unlock(&wctx->metaMutex);
   } else {
     index_str = strdup("");
   }
 
-  err = zmq_msg_init_data(&index_msg, index_str, strlen(index_str), is_zmq_free_fn, NULL);
-  if (err == -1) {
-    isLogging_err("%s: zmq_msg_init failed (index_str): %s\n", id, zmq_strerror(errno));
-    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Could not initialize reply message (index_str)", id);
-    pthread_exit (NULL);
+  //
+  // Keep a good answer for the next person who asks
+  //
+  if (owner && jp->cacheable && tcp->rc != NULL) {
+    reply = redisCommand(tcp->rc, "SET %s %s EX %d", jp->cache_key, index_str, IS_INDEX_CACHE_TTL);
+    if (reply == NULL) {
+      isLogging_err("%s: Redis error saving %s: %s\n", id, jp->cache_key, tcp->rc->errstr);
+    } else {
+      freeReplyObject(reply);
+    }
   }
 
-  // Send them out
-  do {
-    // Error Message
-    err = zmq_msg_send(&err_msg, tcp->rep, ZMQ_SNDMORE);
-    if (err == -1) {
-      isLogging_err("%s: Could not send empty error frame: %s\n", id, zmq_strerror(errno));
-      break;
+  pthread_mutex_lock(&wctx->indexMutex);
+  last = --jp->waiters == 0;
+  pthread_mutex_unlock(&wctx->indexMutex);
+  if (last) {
+    isIndexJobFree(wctx, jp);
+  }
+
+  isIndexReply(wctx, tcp, job, index_str);
+}
+
+/** Cancel indexing jobs by tag.  Queued jobs are dropped and their
+ ** requesters answered with {"cancelled":true}, runners waiting for an
+ ** indexing slot are woken, and running ones are sent SIGTERM through
+ ** their isSubProcess control channel.
+ **
+ ** @param job
+ **   @li @c job->index_tag  Tag of the index job(s) to cancel
+ */
+void isIndexCancel(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
+  static const char *id = FILEID "isIndexCancel";
+  const char *index_tag;
+  isIndexJobType *jp;
+  isIndexJobType **jpp;
+  isIndexJobType *dropped;      // queued jobs we took off the list
+  json_t *result;
+  redisContext *rrc;
+  redisReply *reply;
+  json_t *meta;
+  struct {
+    pid_t pid;                  // indexer to stop
+    char *address;              // copy of jp->controlAddress
+    char *publisher;            // copy of jp->controlPublisher
+    int port;                   // jp->controlPort
+  } sigs[IS_INDEX_RUNNERS];
+  int nsig;
+  int n;
+  int i;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  index_tag = json_string_value(json_object_get(job, "index_tag"));
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  if (index_tag == NULL) {
+    isLogging_err("%s: No index_tag in job\n", id);
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: No index_tag in job", id);
+    return;
+  }
+
+  //
+  // Mark the jobs under indexMutex but talk to redis without it: the
+  // runners need the mutex too and the control server may be slow
+  // to answer.  Only running jobs have an indexer to stop, and no
+  // more than IS_INDEX_RUNNERS of them can be running.
+  //
+  n = 0;
+  nsig = 0;
+  dropped = NULL;
+  pthread_mutex_lock(&wctx->indexMutex);
+  for (jpp=&wctx->indexJobs; *jpp!=NULL; ) {
+    jp = *jpp;
+    if (strcmp(jp->tag, index_tag) != 0 || jp->cancelled) {
+      jpp = &jp->next;
+      continue;
     }
+    jp->cancelled = 1;
+    n++;
 
-    // Job 
-    err = zmq_msg_send(&job_msg, tcp->rep, ZMQ_SNDMORE);
-    if (err < 0) {
-      isLogging_err("%s: sending job_str failed: %s\n", id, zmq_strerror(errno));
-      break;
+    if (!jp->running) {
+      //
+      // No runner will see it now
+      //
+      *jpp = jp->next;
+      jp->next = dropped;
+      dropped  = jp;
+      wctx->indexWaiting--;
+      continue;
     }
+    jpp = &jp->next;
 
-    // Meta
-    err = zmq_msg_send(&index_msg, tcp->rep, 0);
-    if (err == -1) {
-      isLogging_err("%s: sending index_str failed: %s\n", id, zmq_strerror(errno));
-      break;
+    if (jp->slot_wait) {
+      //
+      // Get its runner out of flock
+      //
+      pthread_kill(jp->runner, IS_INDEX_SLOT_SIGNAL);
+      continue;
     }
-  } while (0);
+
+    if (jp->pid <= 0 || nsig >= IS_INDEX_RUNNERS) {
+      continue;
+    }
+    sigs[nsig].pid        = jp->pid;
+    sigs[nsig].port       = jp->controlPort;
+    sigs[nsig].address    = jp->controlAddress   ? strdup(jp->controlAddress)   : NULL;
+    sigs[nsig].publisher  = jp->controlPublisher ? strdup(jp->controlPublisher) : NULL;
+    nsig++;
+  }
+  pthread_mutex_unlock(&wctx->indexMutex);
+
+  //
+  // Let the dropped jobs' requesters go.  Until done is set the jobs
+  // are still ours.
+  //
+  while (dropped != NULL) {
+    jp      = dropped;
+    dropped = jp->next;
+
+    rrc = jp->progressPublisher ? isIndexRedis(jp->progressAddress, jp->progressPort) : NULL;
+    isIndexPublish(wctx, rrc, jp, NULL);
+    if (rrc != NULL) {
+      redisFree(rrc);
+    }
+
+    pthread_mutex_lock(&wctx->metaMutex);
+    result = json_pack("{s:b}", "cancelled", 1);
+    pthread_mutex_unlock(&wctx->metaMutex);
+
+    pthread_mutex_lock(&wctx->indexMutex);
+    jp->result = result;
+    jp->done   = 1;
+    pthread_cond_broadcast(&jp->cond);
+    pthread_mutex_unlock(&wctx->indexMutex);
+  }
+
+  for (i=0; i<nsig; i++) {
+    //
+    // Go through the same channel anyone else would use.  Should we
+    // not reach it, signal the indexer ourselves.
+    //
+    reply = NULL;
+    rrc = sigs[i].publisher ? isIndexRedis(sigs[i].address, sigs[i].port) : NULL;
+    if (rrc != NULL) {
+      reply = redisCommand(rrc, "PUBLISH %s {\"sig\":%d}", sigs[i].publisher, SIGTERM);
+    }
+    if (reply == NULL || reply->type != REDIS_REPLY_INTEGER || reply->integer == 0) {
+      //
+      // Only if the indexer is still ours: its pid may have been
+      // reused since we let go of the mutex
+      //
+      pthread_mutex_lock(&wctx->indexMutex);
+      for (jp=wctx->indexJobs; jp!=NULL; jp=jp->next) {
+        if (jp->pid == sigs[i].pid) {
+          kill(jp->pid, SIGTERM);
+          break;
+        }
+      }
+      pthread_mutex_unlock(&wctx->indexMutex);
+    }
+    if (reply != NULL) {
+      freeReplyObject(reply);
+    }
+    if (rrc != NULL) {
+      redisFree(rrc);
+    }
+    free(sigs[i].address);
+    free(sigs[i].publisher);
+  }
+
+  isLogging_info("%s: cancelled %d indexing job(s) with tag %s\n", id, n, index_tag);
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  meta = json_pack("{s:i}", "cancelled", n);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  isSpotsReply(wctx, tcp, job, meta);
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  json_decref(meta);
+  pthread_mutex_unlock(&wctx->metaMutex);
 }
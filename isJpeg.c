@@ -5,110 +5,28 @@
  */
 #include "is.h"
 
-/** Put a label on the image.
+/** Hand a complete image to libjpeg.
  **
- ** @param[in] label  pointer to the label text
+ ** @param[in,out] cinfop  jpeg creation structure, already started
  **
- ** @param[in] width  width of label in pixels
+ ** @param[in] image  the pixels: cinfop->image_height rows of stride bytes
  **
- ** @param[in] height  height of label in pixels
- **
- ** @param[in,out] cinfop  jpeg creation structure
- **
- ** @todo Select the correct font to best fit the label in the height and width constraints.
+ ** @param[in] stride bytes from one row to the next
  **
  */
-void isJpegLabel(const char *label, int width, int height, struct jpeg_compress_struct *cinfop) {
-  static const char *id = FILEID "isJpegLabel";
-  const isBitmapFontType *bmp;  // Our chosen bitmap font
-  uint16_t mask;                // used to find bit in font
-  int sbc;                      // the "sub" byte in the font needed for font width > 8
-  int bpc;                      // bytes per character.  ie, 1 for 6x13, 2 for 9x15
-  int bmc;                      // the current byte in the font
-  int cy;                       // current scan line within the bitmap font
-  int label_ymin;               // start scan line for the top of the text
-  int label_ymax;               // bottom scan line for, well, the bottom of the text
-  int label_xmax;               // RHS of text
-  int ib;                       // index in bitmap of current char
-  int ix;                       // x position in scan line of current char
-  unsigned char *red, *blue, *green;    // separate pointers to the pixel colors (all in row_buffer)
-  unsigned char *row_buffer;    // a single row of pixels
-  int i;                        // counter to be sure the label does not extend beyond its given height
-  int ci;                       // index into label to select which character we are working on
-  size_t row_buffer_size;       // size of row_buffer, of course
-
-  row_buffer_size = width * sizeof(*row_buffer) * 3;
-
-  row_buffer = calloc(1, row_buffer_size);
-  if (row_buffer == NULL) {
-    isLogging_crit("%s: Out of memory (row_buffer)\n", id);
-    pthread_exit (NULL);
-  }
-
-  // Write the label
-  //
-  bmp = &isBitmapFontBitmaps[3];
-  bpc = bmp->width / 8 + 1;             // bytes per character in this font
-    
-  //
-  // Placement of the label within the banner.  At this point we only
-  // support left justified text.  TODO: truncate the beginning of the
-  // string if the label is too long to fit since it's the end of the
-  // string that distingushes one frame from another.
-  //
-  label_ymin = 0;
-  label_ymax = height > bmp->height ? bmp->height : height;
-  label_xmax = width;
-    
-  // i loops over scan lines
-  // cy loops over character scan lines
-  // ci loops over character columns
-  //
-    
-  for (cy=0, i=label_ymin; i<=label_ymax; cy++, i++) {
-    red   = row_buffer;
-    green = row_buffer + 1;
-    blue  = row_buffer + 2;
-    
-    memset( row_buffer, 0xff, row_buffer_size);
-    
-    for (ci=0; label[ci] != 0; ci++) {
-      if (label[ci] < 32) {
-        // Ignore control characters
-        continue;
-      }
-      if (ci * bmp->width >= label_xmax) {
-        // No room on line for this character
-        break;
-      }
-      sbc = 0;
-      bmc = bmp->bitmap[(bmp->height*(label[ci] - 32) + cy) * bpc];
-      mask = 0x80;
-      for (ib=0; ib<bmp->width; ib++) {
-        ix = ci * bmp->width + ib;
-        if (ix > label_xmax) {
-          break;
-        }
-        if (mask & bmc) {
-          *red = *green = *blue = 0;
-        } else {
-          *red = *green = *blue = 0xff;
-        }
-        
-        mask >>= 1;
-        if (!mask) {
-          mask = 0x80;
-          sbc++;
-          bmc = bmp->bitmap[(bmp->height*(label[ci] - 32) + cy) * bpc + sbc];
-        }
-        red   += 3;
-        green += 3;
-        blue  += 3;
-      }
+void isJpegWriteImage(struct jpeg_compress_struct *cinfop, unsigned char *image, int stride) {
+  JSAMPROW rows[32];            // row pointers for a bunch of scan lines at a time
+  int n;                        // number of rows we are handing off this time
+  int i;
+
+  while (cinfop->next_scanline < cinfop->image_height) {
+    n = cinfop->image_height - cinfop->next_scanline;
+    n = n > 32 ? 32 : n;
+    for (i=0; i<n; i++) {
+      rows[i] = image + (size_t)(cinfop->next_scanline + i) * stride;
     }
-    jpeg_write_scanlines(cinfop, &row_buffer, 1);
+    jpeg_write_scanlines(cinfop, rows, n);
   }
-  free(row_buffer);
 }
 
 
@@ -130,13 +48,12 @@ void isJpegLabel(const char *label, int width, int height, struct jpeg_compress_
  **
  ** @param[in] meta  The JSON object representing the meta data from our image
  **
- ** @param[in] out_buffer The jpeg image we are about to send
- **
- ** @param[in] jpeg_len The length of out_buffer
+ ** @param[in] jpeg_msg An initialized zmq message holding the jpeg.  Ownership passes to zmq;
+ **                     we close it whether or not it could be sent.
  **
 */
-void isJpegSend(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job, json_t *meta, unsigned char *out_buffer, int jpeg_len) {
-  static const char *id = FILEID "isJpegSend";
+void isJpegSendMsg(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job, json_t *meta, zmq_msg_t *jpeg_msg) {
+  static const char *id = FILEID "isJpegSendMsg";
 
   char *job_str;                // stringified version of job
   char *meta_str;               // stringified version of meta
@@ -144,9 +61,8 @@ void isJpegSend(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job,
   zmq_msg_t err_msg;            // error message to send via zmq
   zmq_msg_t job_msg;            // the job message to send via zmq
   zmq_msg_t meta_msg;           // the metadata to send via zmq
-  zmq_msg_t jpeg_msg;           // the jpeg as a zmq message
 
-  isLogging_info("%s: jpeg_len: %d\n", id, jpeg_len);
+  isLogging_info("%s: jpeg_len: %d\n", id, (int)zmq_msg_size(jpeg_msg));
 
   // Compose messages
 
@@ -168,6 +84,9 @@ void isJpegSend(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job,
   if (err != 0) {
     isLogging_err("%s: zmq_msg_init failed (job_str): %s\n", id, zmq_strerror(errno));
     is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Could not initialize reply message (job_str)", id);
+    free(job_str);
+    zmq_msg_close(&err_msg);
+    zmq_msg_close(jpeg_msg);
     pthread_exit (NULL);
   }
 
@@ -186,15 +105,10 @@ void isJpegSend(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job,
   if (err == -1) {
     isLogging_err("%s: zmq_msg_init failed (meta_str): %s\n", id, zmq_strerror(errno));
     is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Could not initialize reply message (meta_str)", id);
-    pthread_exit (NULL);
-  }
-
-
-  // JPEG
-  err = zmq_msg_init_data(&jpeg_msg, out_buffer, jpeg_len, is_zmq_free_fn, NULL);
-  if (err == -1) {
-    isLogging_err("%s: zmq_msg_init failed (jpeg): %s\n", id, zmq_strerror(errno));
-    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Could not initialize reply message (jpeg)", id);
+    free(meta_str);
+    zmq_msg_close(&err_msg);
+    zmq_msg_close(&job_msg);
+    zmq_msg_close(jpeg_msg);
     pthread_exit (NULL);
   }
 
@@ -222,71 +136,90 @@ void isJpegSend(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job,
     }
 
     // Jpeg
-    err = zmq_msg_send(&jpeg_msg, tcp->rep, 0);
+    err = zmq_msg_send(jpeg_msg, tcp->rep, 0);
     if (err == -1) {
       isLogging_err("%s: sending jpeg failed: %s\n", id, zmq_strerror(errno));
       break;
     }
   } while (0);
+
+  //
+  // Sent messages are already empty.  Those we did not get to still
+  // hold their data (and perhaps a reference to a cached blank).
+  //
+  zmq_msg_close(&err_msg);
+  zmq_msg_close(&job_msg);
+  zmq_msg_close(&meta_msg);
+  zmq_msg_close(jpeg_msg);
 }
 
-/** Send a blank image used as a placeholder.
+/** Send a freshly encoded jpeg.  See isJpegSendMsg for the message parts.
  **
- ** @param[in] wctx  info for this worker
+ ** @param[in] tcp   Our thread context
  **
- ** @param[in] tcp   info for this thread
+ ** @param[in] job   The JSON object sent from the client
  **
- ** @param[in] job   the job that we are responding to
+ ** @param[in] meta  The JSON object representing the meta data from our image
+ **
+ ** @param[in] out_buffer The jpeg image we are about to send.  zmq frees it when it is done.
+ **
+ ** @param[in] jpeg_len The length of out_buffer
+ **
+*/
+void isJpegSend(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job, json_t *meta, unsigned char *out_buffer, int jpeg_len) {
+  static const char *id = FILEID "isJpegSend";
+  zmq_msg_t jpeg_msg;           // the jpeg as a zmq message
+  int err;
+
+  err = zmq_msg_init_data(&jpeg_msg, out_buffer, jpeg_len, is_zmq_free_fn, NULL);
+  if (err == -1) {
+    isLogging_err("%s: zmq_msg_init failed (jpeg): %s\n", id, zmq_strerror(errno));
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Could not initialize reply message (jpeg)", id);
+    free(out_buffer);
+    pthread_exit (NULL);
+  }
+
+  isJpegSendMsg(wctx, tcp, job, meta, &jpeg_msg);
+}
+
+/** Encode a blank image used as a placeholder.
+ **
+ ** @param[in] width        width of the image in pixels
+ **
+ ** @param[in] label        text to put above the image (ignored when labelHeight is 0)
+ **
+ ** @param[in] labelHeight  height of the label in pixels
+ **
+ ** @param[out] jpeg_len    length of the returned jpeg
  **
+ ** @returns malloc'ed jpeg or NULL on error
  */
-void isJpegBlank(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
-  static const char *id = FILEID "isJpegBlank";
+unsigned char *isJpegBlankEncode(int width, const char *label, int labelHeight, int *jpeg_len) {
+  static const char *id = FILEID "isJpegBlankEncode";
   struct jpeg_compress_struct cinfo;            // jpeg context
   int cinfoSetup;                               // flag so we only destroy cinfo if it had been set up
   jmp_buf j_jumpHere;                           // Yeah, libjpeg likes long jumps.
   struct jpeg_error_mgr jerr;                   // libjpeg error handline
   struct jpeg_destination_mgr dmgr;             // support for libjpeg
-  unsigned char *row_buffer;                    // a single row of pixels
+  unsigned char *image_buffer;                  // the label and image pixels
   unsigned char *out_buffer;                    // a place to put the rows as they are completed
-  int labelHeight;                              // The height of the requested label (if any)
-  int col;                                      // loop over the width of the image
-  int row;                                      // loop over the height of the image
   int height;                                   // the image height
-  int width;                                    // the image width
-  unsigned char *red, *blue, *green;            // pointers to the pixel color components
-  const char *label;                            // a string version of our label (extracted from job)
-  size_t row_buffer_size;                       // the size of row_buffer
+  size_t image_buffer_size;                     // the size of image_buffer
   size_t out_buffer_size;                       // the size of out_buffer
 
-  pthread_mutex_lock(&wctx->metaMutex);
-  width = json_integer_value(json_object_get(job, "xsize"));
-  pthread_mutex_unlock(&wctx->metaMutex);
-
-  width = width < 8 ? 8 : width;
   height = width;
 
-  labelHeight = 0;
-  pthread_mutex_lock(&wctx->metaMutex);
-  label = json_string_value(json_object_get(job, "label"));
-  pthread_mutex_unlock(&wctx->metaMutex);
-
-  if (label != NULL && *label) {
-    pthread_mutex_lock(&wctx->metaMutex);
-    labelHeight = json_integer_value(json_object_get(job, "labelHeight"));
-    pthread_mutex_unlock(&wctx->metaMutex);
-
-    labelHeight = labelHeight < 0  ?  0 : labelHeight;    // labels can't have negative height
-    labelHeight = labelHeight > 64 ?  0 : labelHeight;    // ignore requests for really big labels
-  }
-
-  row_buffer_size = width * sizeof(*row_buffer) * 3;
+  image_buffer_size = width * (height + labelHeight) * sizeof(*image_buffer) * 3;
 
-  row_buffer = calloc(1, row_buffer_size);
-  if (row_buffer == NULL) {
-    isLogging_crit("%s: Out of memory (row_buffer)\n", id);
-    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Out of memory (row_buffer)", id);
+  image_buffer = malloc(image_buffer_size);
+  if (image_buffer == NULL) {
+    isLogging_crit("%s: Out of memory (image_buffer)\n", id);
     exit (-1);
   }
+  memset(image_buffer, 0xf0, image_buffer_size);
+  if (labelHeight) {
+    isLabelComposite(label, width, labelHeight, image_buffer, width * 3, 3);
+  }
 
   out_buffer_size = width * (height + labelHeight) * sizeof(*out_buffer) * 3;
   if (out_buffer_size < MIN_JPEG_BUFFER) {
@@ -296,7 +229,6 @@ void isJpegBlank(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job)
   out_buffer = calloc(1, out_buffer_size);
   if (out_buffer == NULL) {
     isLogging_crit("%s: Out of memory (out_buffer)\n", id);
-    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Out of memory (out_buffer)", id);
     exit (-1);
   }
 
@@ -309,11 +241,10 @@ void isJpegBlank(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job)
     if( cinfoSetup) {
       jpeg_destroy_compress( &cinfo);
     }
-    free(row_buffer);
+    free(image_buffer);
     free(out_buffer);
     isLogging_err("%s: jpeg compression error\n", id);
-    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Jpeg creation failed", id);
-    return;
+    return NULL;
   }
 
   void jerror_handler( j_common_ptr cp) {
@@ -347,71 +278,188 @@ void isJpegBlank(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job)
   jpeg_set_defaults(&cinfo);
   jpeg_set_quality( &cinfo, 100, TRUE);
   jpeg_start_compress(&cinfo, TRUE);
+  isJpegWriteImage(&cinfo, image_buffer, width * 3);
+  jpeg_finish_compress(&cinfo);
 
-  if (labelHeight) {
-    isJpegLabel(label, width, labelHeight, &cinfo);
+  *jpeg_len = (int)(cinfo.dest->next_output_byte - out_buffer);
+  jpeg_destroy_compress(&cinfo);
+  free(image_buffer);
+
+  return out_buffer;
+}
+
+/** zmq free function for messages sharing a cached blank.  The
+ ** buffer goes away when neither the cache nor any message in flight
+ ** still refers to it.
+ **
+ ** @param[in] data  the jpeg (unused, it belongs to hint)
+ **
+ ** @param[in] hint  the cached blank
+ */
+void isJpegBlankRelease(void *data, void *hint) {
+  isJpegBlankType *blank;
+
+  blank = hint;
+  if (__sync_sub_and_fetch(&blank->refs, 1) == 0) {
+    free(blank->buf);
+    free(blank->key);
+    free(blank);
   }
+}
 
-  for (row=0; row<height; row++) {
-    red   = row_buffer;
-    green = row_buffer + 1;
-    blue  = row_buffer + 2;
+/** Send a blank image used as a placeholder.
+ **
+ ** Blanks are encoded once per (xsize, labelHeight, label) and the
+ ** encoded image is then shared by every reply that needs it.  These
+ ** are requested a lot while clients poll for frames that have not
+ ** been written yet so they should cost next to nothing.
+ **
+ ** @param[in] wctx  info for this worker
+ **  @li @c wctx->blankMutex  protects the blank cache list
+ **
+ ** @param[in] tcp   info for this thread
+ **
+ ** @param[in] job   the job that we are responding to
+ **
+ */
+void isJpegBlank(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
+  static const char *id = FILEID "isJpegBlank";
+  isJpegBlankType *blank;                       // our cached image
+  isJpegBlankType *p;                           // loop over the cache
+  isJpegBlankType *last;                        // item before p in the cache
+  zmq_msg_t jpeg_msg;                           // the blank as a zmq message
+  unsigned char *out_buffer;                    // a freshly encoded blank
+  int jpeg_len;                                 // length of out_buffer
+  int labelHeight;                              // The height of the requested label (if any)
+  int width;                                    // the image width
+  int n;                                        // count the cache entries
+  int err;
+  const char *label;                            // a string version of our label (extracted from job)
+  char *key;                                    // identifies our blank in the cache
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  width = json_integer_value(json_object_get(job, "xsize"));
+  pthread_mutex_unlock(&wctx->metaMutex);
 
-    for (col=0; col<width; col++) {
-      *red   = 0xf0;
-      *green = 0xf0;
-      *blue  = 0xf0;
+  width = width < 8 ? 8 : width;
 
-      red   += 3;
-      green += 3;
-      blue  += 3;
-    }
-    jpeg_write_scanlines(&cinfo, &row_buffer, 1);
+  labelHeight = 0;
+  pthread_mutex_lock(&wctx->metaMutex);
+  label = json_string_value(json_object_get(job, "label"));
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  if (label != NULL && *label) {
+    pthread_mutex_lock(&wctx->metaMutex);
+    labelHeight = json_integer_value(json_object_get(job, "labelHeight"));
+    pthread_mutex_unlock(&wctx->metaMutex);
+
+    labelHeight = labelHeight < 0  ?  0 : labelHeight;    // labels can't have negative height
+    labelHeight = labelHeight > 64 ?  0 : labelHeight;    // ignore requests for really big labels
+  }
+
+  if (asprintf(&key, "%d-%d-%s", width, labelHeight, labelHeight ? label : "") == -1) {
+    isLogging_crit("%s: Out of memory (key)\n", id);
+    exit (-1);
   }
-  jpeg_finish_compress(&cinfo);
 
-  isJpegSend(wctx, tcp, job, NULL, out_buffer, (int)(cinfo.dest->next_output_byte - out_buffer));
-  free(row_buffer);
   //
-  //  out_buffer is freed by zmq whenever it is done with it
+  // Look for it in the cache.  Found items move to the front of the
+  // list so the least recently used ones drift toward the end.
   //
-  //  free(out_buffer);
+  pthread_mutex_lock(&wctx->blankMutex);
+  for (last=NULL, blank=wctx->blanks; blank != NULL; last=blank, blank=blank->next) {
+    if (strcmp(blank->key, key) == 0) {
+      if (last != NULL) {
+        last->next  = blank->next;
+        blank->next = wctx->blanks;
+        wctx->blanks = blank;
+      }
+      __sync_add_and_fetch(&blank->refs, 1);      // our message's reference
+      break;
+    }
+  }
+  pthread_mutex_unlock(&wctx->blankMutex);
+
+  if (blank == NULL) {
+    out_buffer = isJpegBlankEncode(width, label, labelHeight, &jpeg_len);
+    if (out_buffer == NULL) {
+      free(key);
+      is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Jpeg creation failed", id);
+      return;
+    }
+
+    blank = calloc(1, sizeof(*blank));
+    if (blank == NULL) {
+      isLogging_crit("%s: Out of memory (blank)\n", id);
+      exit (-1);
+    }
+    blank->key      = key;
+    blank->buf      = out_buffer;
+    blank->buf_size = jpeg_len;
+    blank->refs     = 2;        // one for the cache, one for our message
+    key = NULL;
+
+    pthread_mutex_lock(&wctx->blankMutex);
+    blank->next  = wctx->blanks;
+    wctx->blanks = blank;
+
+    //
+    // Drop the least recently used blanks.  They'll actually be
+    // freed once zmq is done sending them.
+    //
+    for (n=0, last=NULL, p=wctx->blanks; p != NULL; n++, last=p, p=p->next) {
+      if (n >= IS_JPEG_BLANK_CACHE_SIZE) {
+        last->next = NULL;
+        while (p != NULL) {
+          isJpegBlankType *next;
+          next = p->next;
+          isJpegBlankRelease(NULL, p);
+          p = next;
+        }
+        break;
+      }
+    }
+    pthread_mutex_unlock(&wctx->blankMutex);
+  }
+  free(key);
+
+  err = zmq_msg_init_data(&jpeg_msg, blank->buf, blank->buf_size, isJpegBlankRelease, blank);
+  if (err == -1) {
+    isLogging_err("%s: zmq_msg_init failed (jpeg): %s\n", id, zmq_strerror(errno));
+    isJpegBlankRelease(NULL, blank);
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Could not initialize reply message (jpeg)", id);
+    return;
+  }
+
+  isJpegSendMsg(wctx, tcp, job, NULL, &jpeg_msg);
   return;
 }
 
-/** Create a jpeg rendering of a diffraction image
+/** Render a reduced image as a jpeg: label, tone map, colormap, and
+ ** compress.
  **
  ** @param wctx Worker context
- **  @li @c wctx->ctxMutex  Keeps the worker theads in line
+ **  @li @c wctx->metaMutex  Keeps jansson calls in line
  **
- ** @param tcp Thread data
- **   @li @c tcp->rep  ZMQ Response socket into which the throw our response.
+ ** @param job   See isJpeg.  We set wval_used, bval_used, and colormap_used here
+ **              and isOverlayComposite sets overlay_rings and overlay_spots.
  **
- ** @param job             {Object}     - Description of what is requested
- ** @param job.contrast    {Integer}    - Image data >= this are black
- ** @param job.esaf        {Inteter}    - experiment id to which this image belongs
- ** @param job.fn          {String}     - file name
- ** @param job.frame       {Integer}    - Frame number to return
- ** @param job.label       {String}     - Text to add to the image perhaps identifying the image
- ** @param job.labelHeight {Integer}    - Height of the label in pixels
- ** @param job.segcol      {Float}      - Segment of image to return: x = segcol * image width / zoom
- ** @param job.segrow      {Float}      - Segment of image to return: y = segrow * image width / zoom
- ** @param job.tag         {String}     - ID for us to know what to do with the result
- ** @param job.type        {String}     - "JPEG"
- ** @param job.wval        {Integer}    - Image data <= this are white
- ** @param job.xsize       {Integer}    - Requested width of resulting jpeg (pixels)
- ** @param job.zoom        {Float}      - full image / zoom = size of original image to map to our jpeg
+ ** @param imb   Read locked reduced image
+ **
+ ** @param jpeg_len  returns the length of the jpeg
+ **
+ ** @returns malloc'ed jpeg or NULL if libjpeg had a problem
  */
-void isJpeg(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
-  static const char *id = FILEID "isJpeg";
-  const char *fn;                       // file name from job.
-  isImageBufType *imb;
-  unsigned char *row_buffer;
+unsigned char *isJpegEncode(isWorkerContext_t *wctx, json_t *job, isImageBufType *imb, int *jpeg_len) {
+  static const char *id = FILEID "isJpegEncode";
+  unsigned char *image_buffer;          // label and image pixels, ready for libjpeg
   int labelHeight;
-  int row, col;
-  uint16_t *bp16, v16;
-  uint32_t *bp32, v32;
-  unsigned char *red, *blue, *green;
+  int row;
+  uint16_t *bp16;
+  uint32_t *bp32;
+  const uint8_t *lut;                   // 16 bit tone map
+  uint8_t *idx;                         // palette indices for one row of 32 bit data
+  int cmap;                             // the colormap we are using
   int32_t wval, bval;
   struct jpeg_compress_struct cinfo;
   int cinfoSetup;
@@ -419,38 +467,12 @@ void isJpeg(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
   struct jpeg_error_mgr jerr;
   struct jpeg_destination_mgr dmgr;
   char label[64];
-  size_t row_buffer_size;
+  size_t image_buffer_size;
   size_t out_buffer_size;
   unsigned char *out_buffer;
   double stddev;
-
-  pthread_mutex_lock(&wctx->metaMutex);
-  fn = json_string_value(json_object_get(job, "fn"));
-  pthread_mutex_unlock(&wctx->metaMutex);
-
-  if (fn == NULL || strlen(fn) == 0) {
-    isJpegBlank(wctx, tcp, job);
-    return;
-  }
-
-  // when isReduceImage returns a buffer it is read locked
-  imb = isReduceImage(wctx, job);
-  if (imb == NULL) {
-    char *tmps;
-
-    pthread_mutex_lock(&wctx->metaMutex);
-    tmps = json_dumps(job, JSON_SORT_KEYS | JSON_COMPACT | JSON_INDENT(0));
-    pthread_mutex_unlock(&wctx->metaMutex);
-
-    isLogging_err("%s: missing data for job %s\n", id, tmps);
-    // is_zmq_error_reply(NULL, 0, tcp->rep, "%s: missing data for job %s", id, tmps);
-
-    free(tmps);
-
-    isJpegBlank(wctx, tcp, job);
-
-    return;
-  }
+  double wpct, bpct;                    // percentiles for automatic white and black values
+  double pv;                            // a percentile value
 
   pthread_mutex_lock(&wctx->metaMutex);
   labelHeight = json_integer_value(json_object_get(job, "labelHeight"));
@@ -459,13 +481,12 @@ void isJpeg(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
   labelHeight = labelHeight < 0  ?  0 : labelHeight;    // labels can't have negative height
   labelHeight = labelHeight > 64 ?  0 : labelHeight;    // ignore requests for really big labels
 
-  row_buffer_size = imb->buf_width * sizeof(*row_buffer) * 3;
+  image_buffer_size = imb->buf_width * (imb->buf_height + labelHeight) * sizeof(*image_buffer) * 3;
 
-  row_buffer = calloc(1, row_buffer_size);
-  if (row_buffer == NULL) {
-    isLogging_crit("%s: Out of memory (row_buffer)\n", id);
-    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Out of memory (row_buffer)", id);
-    pthread_exit (NULL);
+  image_buffer = malloc(image_buffer_size);
+  if (image_buffer == NULL) {
+    isLogging_crit("%s: Out of memory (image_buffer)\n", id);
+    exit (-1);
   }
 
   out_buffer_size = imb->buf_width * (imb->buf_height + labelHeight) * sizeof(*out_buffer) * 3;
@@ -476,8 +497,7 @@ void isJpeg(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
   out_buffer = calloc(1, out_buffer_size);
   if (out_buffer == NULL) {
     isLogging_crit("%s: Out of memory (out_buffer)\n", id);
-    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Out of memory (out_buffer)", id);
-    pthread_exit (NULL);
+    exit (-1);
   }
 
   //
@@ -489,21 +509,11 @@ void isJpeg(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
     if( cinfoSetup) {
       jpeg_destroy_compress( &cinfo);
     }
-    free(row_buffer);
+    free(image_buffer);
     free(out_buffer);
 
-    pthread_rwlock_unlock(&imb->buflock);
-
     isLogging_err("%s: jpeg compression error\n", id);
-    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: jpeg compression error", id);
-
-    pthread_mutex_lock(&wctx->ctxMutex);
-    imb->in_use--;
-
-    assert(imb->in_use >= 0);
-
-    pthread_mutex_unlock(&wctx->ctxMutex);
-    return;
+    return NULL;
   }
 
   void jerror_handler( j_common_ptr cp) {
@@ -567,17 +577,34 @@ void isJpeg(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
 
     pthread_mutex_unlock(&wctx->metaMutex);
 
-    isJpegLabel(label, imb->buf_width, labelHeight, &cinfo);
+    isLabelComposite(label, imb->buf_width, labelHeight, image_buffer, imb->buf_width * 3, 3);
   }
 
   pthread_mutex_lock(&wctx->metaMutex);
 
   wval = json_integer_value(json_object_get(job,"wval"));
   bval = json_integer_value(json_object_get(job, "contrast"));
+
+  cmap = isColormapFind(json_string_value(json_object_get(job, "colormap")));
+  if (cmap < 0) {
+    isLogging_warning("%s: Unknown colormap '%s', using the default\n", id, json_string_value(json_object_get(job, "colormap")));
+    cmap = 0;
+  }
   
   //
-  // Perhaps autoscale black values
+  // Perhaps autoscale the black and white values.  Use percentiles
+  // of the histogram from the reduction when we have one, otherwise
+  // fall back to the mean plus or minus a standard deviation.
   //
+  wpct = IS_AUTO_WVAL_PERCENTILE;
+  if (json_is_number(json_object_get(job, "wpercentile"))) {
+    wpct = json_number_value(json_object_get(job, "wpercentile"));
+  }
+  bpct = IS_AUTO_BVAL_PERCENTILE;
+  if (json_is_number(json_object_get(job, "bpercentile"))) {
+    bpct = json_number_value(json_object_get(job, "bpercentile"));
+  }
+
   stddev = json_number_value(json_object_get(imb->meta, "stddev"));
   if (stddev <= 0.0) {
     //
@@ -585,15 +612,23 @@ void isJpeg(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
     //
     stddev = json_number_value(json_object_get(imb->meta, "rms"));
   }
+
   if (bval <= 0) {
-    bval = json_number_value(json_object_get(imb->meta, "mean")) + json_number_value(json_object_get(imb->meta, "stddev"));
+    pv = isHistogramPercentile(imb->histogram, bpct);
+    if (pv >= 0.0) {
+      bval = ceil(pv);
+    } else {
+      bval = json_number_value(json_object_get(imb->meta, "mean")) + stddev;
+    }
   }
   
-  //
-  // Perhaps autoscale white values
-  //
   if (wval < 0) {
-    wval = json_number_value(json_object_get(imb->meta, "mean")) - json_number_value(json_object_get(imb->meta, "stddev"));
+    pv = isHistogramPercentile(imb->histogram, wpct);
+    if (pv >= 0.0) {
+      wval = floor(pv);
+    } else {
+      wval = json_number_value(json_object_get(imb->meta, "mean")) - stddev;
+    }
   }
 
   wval = wval < 0 ? 0 : wval;
@@ -601,78 +636,300 @@ void isJpeg(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
 
   set_json_object_integer(id, job, "wval_used", wval);
   set_json_object_integer(id, job, "bval_used", bval);
+  set_json_object_string(id, job, "colormap_used", "%s", isColormapName(cmap));
 
   pthread_mutex_unlock(&wctx->metaMutex);
 
+  //
+  // Tone map to a palette index then look up the color
+  //
   if (imb->buf_depth == 2) {
+    lut = isToneMapLut16(wval, bval);
     bp16 = imb->buf;
     for (row=0; row<imb->buf_height; row++) {
-      red   = row_buffer;
-      green = row_buffer + 1;
-      blue  = row_buffer + 2;
-      for (col=0; col<imb->buf_width; col++) {
-        v16 = *(bp16 + imb->buf_width * row + col);
-        if (v16 == 0xffff) {
-          *red   = 0xff;
-          *green = 0;
-          *blue  = 0;
-        } else {
-          if (v16 <= wval) {
-            *red = *green = *blue = 0xff;
-          } else {
-            if (v16 >= bval) {
-              *red = *green = *blue = 0;
-            } else {
-              *red = *green = *blue = 255.0 - (double)(v16 - wval)/(double)(bval - wval) * 255.0;
-            }
-          }
-        }
-        red   += 3;
-        green += 3;
-        blue  += 3;
-      }
-      jpeg_write_scanlines(&cinfo, &row_buffer, 1);
+      isColormapRow16(bp16 + imb->buf_width * row, imb->buf_width, lut, cmap, image_buffer + (labelHeight + row) * imb->buf_width * 3);
     }
   } else {
+    idx = malloc(imb->buf_width);
+    if (idx == NULL) {
+      isLogging_crit("%s: Out of memory (idx)\n", id);
+      exit (-1);
+    }
     bp32 = imb->buf;
     for (row=0; row<imb->buf_height; row++) {
-      red   = row_buffer;
-      green = row_buffer + 1;
-      blue  = row_buffer + 2;
-      for (col=0; col<imb->buf_width; col++) {
-        v32 = *(bp32 + imb->buf_width * row + col);
-        if (v32 == 0xffffffff) {
-          *red   = 0xff;
-          *green = 0;
-          *blue  = 0;
-        } else {
-          if (v32 <= wval) {
-            *red = *green = *blue = 0xff;
-          } else {
-            if (v32 >= bval) {
-              *red = *green = *blue = 0;
-            } else {
-              *red = *green = *blue = 255.0 - (double)(v32 - wval)/(double)(bval - wval) * 255.0;
-            }
-          }
-        }
-        red   += 3;
-        green += 3;
-        blue  += 3;
-      }
-      jpeg_write_scanlines(&cinfo, &row_buffer, 1);
+      isToneMap32(bp32 + imb->buf_width * row, imb->buf_width, wval, bval, idx);
+      isColormapApply(idx, imb->buf_width, cmap, image_buffer + (labelHeight + row) * imb->buf_width * 3);
     }
+    free(idx);
   }
 
+  isOverlayComposite(wctx, job, imb, cmap, image_buffer + labelHeight * imb->buf_width * 3);
+
+  isJpegWriteImage(&cinfo, image_buffer, imb->buf_width * 3);
   jpeg_finish_compress(&cinfo);
 
-  isJpegSend(wctx, tcp, job, imb->meta, out_buffer, (int)(cinfo.dest->next_output_byte - out_buffer));
+  *jpeg_len = (int)(cinfo.dest->next_output_byte - out_buffer);
+
+  jpeg_destroy_compress(&cinfo);
+  free(image_buffer);
+
+  return out_buffer;
+}
+
+/** Publish a quick low resolution preview of a frame.
+ **
+ ** The REQ/REP contract gives us exactly one reply per request so the
+ ** preview goes out of band on a redis channel, the same way isIndex
+ ** reports progress.  The preview is a IS_PREVIEW_WIDTH pixel wide
+ ** nearest neighbor sampling of the frame so it skips the expensive
+ ** maximum-of-box reduction of the full render.  The frame that is
+ ** read to make it stays in our buffer cache for the full render.
+ **
+ ** Nothing is published when the full render is already cached
+ ** since then the real image is on its way right away.
+ **
+ ** @param wctx Worker context
+ **
+ ** @param tcp Thread data
+ **   @li @c tcp->rc  Local redis, used when the job does not name a progress server
+ **
+ ** @param job  See isJpeg
+ **
+ ** @returns 1 if a preview was published, 0 otherwise
+ */
+int isJpegPreview(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
+  static const char *id = FILEID "isJpegPreview";
+  const char *publisher;
+  const char *progressAddress;
+  int progressPort;
+  const char *tag;
+  int xsize;
+  json_t *pjob;                 // the job for our preview
+  isImageBufType *imb;
+  unsigned char *jpeg;
+  int jpeg_len;
+  int width;
+  int height;
+  char *b64;
+  json_t *pmsg;
+  char *msg;
+  redisContext *rrc;
+  redisReply *reply;
+  int rtn;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  publisher = json_string_value(json_object_get(job, "previewPublisher"));
+  if (publisher == NULL) {
+    publisher = json_string_value(json_object_get(job, "progressPublisher"));
+  }
+  progressAddress = json_string_value(json_object_get(job,  "progressAddress"));
+  progressPort    = json_integer_value(json_object_get(job, "progressPort"));
+  tag             = json_string_value(json_object_get(job,  "tag"));
+  xsize           = json_integer_value(json_object_get(job, "xsize"));
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  if (publisher == NULL) {
+    isLogging_info("%s: preview requested without a previewPublisher or progressPublisher\n", id);
+    return 0;
+  }
 
-  free(row_buffer);
   //
-  // out_buffer is owned by zmq and will get freed whenever it is good and ready to do that.
+  // No point in a preview that's no smaller than the real thing or
+  // when the real thing is ready now
   //
-  //free(out_buffer);
+  if (xsize <= IS_PREVIEW_WIDTH || isReducedImageCached(wctx, job)) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  pjob = json_deep_copy(job);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  if (pjob == NULL) {
+    isLogging_crit("%s: Out of memory (pjob)\n", id);
+    exit (-1);
+  }
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  set_json_object_integer(id, pjob, "xsize", IS_PREVIEW_WIDTH);
+  set_json_object_integer(id, pjob, "labelHeight", 0);
+  set_json_object_string(id, pjob, "sampling", "%s", "nearest");
+  json_object_set_new(pjob, "spots", json_false());     // no waiting on the spot finder for a preview
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  // when isReduceImage returns a buffer it is read locked
+  imb = isReduceImage(wctx, pjob);
+  if (imb == NULL) {
+    pthread_mutex_lock(&wctx->metaMutex);
+    json_decref(pjob);
+    pthread_mutex_unlock(&wctx->metaMutex);
+    return 0;
+  }
+
+  jpeg   = isJpegEncode(wctx, pjob, imb, &jpeg_len);
+  width  = imb->buf_width;
+  height = imb->buf_height;
+
+  pthread_rwlock_unlock(&imb->buflock);
+
+  pthread_mutex_lock(&wctx->ctxMutex);
+  imb->in_use--;
+
+  assert(imb->in_use >= 0);
+
+  pthread_mutex_unlock(&wctx->ctxMutex);
+
+  if (jpeg == NULL) {
+    pthread_mutex_lock(&wctx->metaMutex);
+    json_decref(pjob);
+    pthread_mutex_unlock(&wctx->metaMutex);
+    return 0;
+  }
+
+  b64 = malloc(4 * ((jpeg_len + 2) / 3) + 1);
+  if (b64 == NULL) {
+    isLogging_crit("%s: Out of memory (b64)\n", id);
+    exit (-1);
+  }
+  EVP_EncodeBlock((unsigned char *)b64, jpeg, jpeg_len);
+  free(jpeg);
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  pmsg = json_pack("{s:s,s:b,s:b,s:s,s:i,s:i,s:I,s:I}",
+                   "tag",       tag ? tag : "Tag_Not_Found",
+                   "preview",   1,
+                   "done",      0,
+                   "jpeg",      b64,
+                   "width",     width,
+                   "height",    height,
+                   "wval_used", json_integer_value(json_object_get(pjob, "wval_used")),
+                   "bval_used", json_integer_value(json_object_get(pjob, "bval_used")));
+  msg = pmsg ? json_dumps(pmsg, JSON_COMPACT | JSON_INDENT(0) | JSON_SORT_KEYS) : NULL;
+  json_decref(pmsg);
+  json_decref(pjob);
+  pthread_mutex_unlock(&wctx->metaMutex);
+  free(b64);
+
+  if (msg == NULL) {
+    isLogging_err("%s: Could not build preview message\n", id);
+    return 0;
+  }
+
+  rrc = isProgressRedis(tcp, progressAddress, progressPort);
+  if (rrc == NULL) {
+    free(msg);
+    return 0;
+  }
+
+  rtn = 0;
+  reply = redisCommand(rrc, "PUBLISH %s %s", publisher, msg);
+  if (reply == NULL) {
+    isLogging_info("%s: redis preview publisher %s returned error %s", id, publisher, rrc->errstr);
+  } else {
+    rtn = 1;
+    freeReplyObject(reply);
+  }
+
+  if (rrc != tcp->rc) {
+    redisFree(rrc);
+  }
+  free(msg);
+
+  return rtn;
+}
+
+/** Create a jpeg rendering of a diffraction image
+ **
+ ** @param wctx Worker context
+ **  @li @c wctx->ctxMutex  Keeps the worker theads in line
+ **
+ ** @param tcp Thread data
+ **   @li @c tcp->rep  ZMQ Response socket into which the throw our response.
+ **
+ ** @param job             {Object}     - Description of what is requested
+ ** @param job.colormap    {String}     - "gray" (default), "inverted", "hot", or "viridis"
+ ** @param job.contrast    {Integer}    - Image data >= this are black.  Automatic when <= 0
+ ** @param job.crosshair   {Boolean}    - Mark the beam center
+ ** @param job.bpercentile {Float}      - Percentile of non-zero pixels used for an automatic contrast
+ ** @param job.esaf        {Inteter}    - experiment id to which this image belongs
+ ** @param job.fn          {String}     - file name
+ ** @param job.frame       {Integer}    - Frame number to return
+ ** @param job.label       {String}     - Text to add to the image perhaps identifying the image
+ ** @param job.labelHeight {Integer}    - Height of the label in pixels
+ ** @param job.preview     {Boolean}    - Publish a small preview before rendering the full image (see isJpegPreview)
+ ** @param job.previewPublisher {String} - Redis channel for the preview.  Defaults to job.progressPublisher
+ ** @param job.progressAddress  {String} - Redis server for the preview.  Defaults to our local redis
+ ** @param job.progressPort     {Integer} - Port of the redis server for the preview
+ ** @param job.rings       {Array}      - Resolution rings to draw, in Å (a single number is fine too)
+ ** @param job.segcol      {Float}      - Segment of image to return: x = segcol * image width / zoom
+ ** @param job.segrow      {Float}      - Segment of image to return: y = segrow * image width / zoom
+ ** @param job.spots       {Boolean}    - Mark the spots found on the full resolution frame (see isFindSpots for sigma and min_pixels)
+ ** @param job.tag         {String}     - ID for us to know what to do with the result
+ ** @param job.type        {String}     - "JPEG"
+ ** @param job.wval        {Integer}    - Image data <= this are white.  Automatic when < 0
+ ** @param job.wpercentile {Float}      - Percentile of non-zero pixels used for an automatic wval
+ ** @param job.xsize       {Integer}    - Requested width of resulting jpeg (pixels)
+ ** @param job.zoom        {Float}      - full image / zoom = size of original image to map to our jpeg
+ */
+void isJpeg(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
+  static const char *id = FILEID "isJpeg";
+  const char *fn;                       // file name from job.
+  int preview;
+  isImageBufType *imb;
+  unsigned char *out_buffer;
+  int jpeg_len;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  fn = json_string_value(json_object_get(job, "fn"));
+  preview = json_is_true(json_object_get(job, "preview"));
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  if (fn == NULL || strlen(fn) == 0) {
+    isJpegBlank(wctx, tcp, job);
+    return;
+  }
+
+  if (preview) {
+    preview = isJpegPreview(wctx, tcp, job);
+    pthread_mutex_lock(&wctx->metaMutex);
+    json_object_set_new(job, "preview_sent", json_boolean(preview));
+    pthread_mutex_unlock(&wctx->metaMutex);
+  }
+
+  // when isReduceImage returns a buffer it is read locked
+  imb = isReduceImage(wctx, job);
+  if (imb == NULL) {
+    char *tmps;
+
+    if (isSchedSuperseded(wctx)) {
+      // Whoever asked has moved on
+      is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Superseded", id);
+      return;
+    }
+
+    pthread_mutex_lock(&wctx->metaMutex);
+    tmps = json_dumps(job, JSON_SORT_KEYS | JSON_COMPACT | JSON_INDENT(0));
+    pthread_mutex_unlock(&wctx->metaMutex);
+
+    isLogging_err("%s: missing data for job %s\n", id, tmps);
+    // is_zmq_error_reply(NULL, 0, tcp->rep, "%s: missing data for job %s", id, tmps);
+
+    free(tmps);
+
+    isJpegBlank(wctx, tcp, job);
+
+    return;
+  }
+
+  out_buffer = isJpegEncode(wctx, job, imb, &jpeg_len);
+  if (out_buffer == NULL) {
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: jpeg compression error", id);
+  } else {
+    //
+    // out_buffer is owned by zmq and will get freed whenever it is good and ready to do that.
+    //
+    isJpegSend(wctx, tcp, job, imb->meta, out_buffer, jpeg_len);
+  }
 
   pthread_rwlock_unlock(&imb->buflock);
 
@@ -684,3 +941,40 @@ void isJpeg(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
   pthread_mutex_unlock(&wctx->ctxMutex);
   return;
 }
+
+/** Read and reduce a frame the user is likely to ask for next so it
+ ** is waiting in our buffer cache.  Our scheduler makes these jobs up
+ ** (see isSchedWatch) from the user's last main view request; nobody
+ ** is waiting for the reply.
+ **
+ ** Frames already cached are skipped as is everything once the cache
+ ** holds IS_DATA_CACHE_BYTES.
+ **
+ ** @param wctx Worker context
+ **
+ ** @param tcp  Thread data
+ **   @li @c tcp->rep  Our (empty) reply goes here
+ **
+ ** @param job  See isJpeg.  The reduction parameters are all we use.
+ */
+void isJpegPrefetch(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
+  static const char *id = FILEID "isJpegPrefetch";
+  isImageBufType *imb;
+
+  if (!isReducedImageCached(wctx, job) && isDataCacheBytes(wctx) < IS_DATA_CACHE_BYTES) {
+    // when isReduceImage returns a buffer it is read locked
+    imb = isReduceImage(wctx, job);
+    if (imb != NULL) {
+      pthread_rwlock_unlock(&imb->buflock);
+
+      pthread_mutex_lock(&wctx->ctxMutex);
+      imb->in_use--;
+      assert(imb->in_use >= 0);
+      pthread_mutex_unlock(&wctx->ctxMutex);
+    }
+  }
+
+  if (zmq_send(tcp->rep, "", 0, 0) == -1) {
+    isLogging_err("%s: Could not send reply: %s\n", id, zmq_strerror(errno));
+  }
+}
@@ -0,0 +1,304 @@
+/*! @file isLabel.c
+ *  @copyright 2017 by Northwestern University
+ *  @author Keith Brister
+ *  @brief Render image labels from pre-expanded bitmap fonts for the LS-CAT Image Server Version 2
+ */
+#include "is.h"
+
+/** A bitmap font expanded to one byte per pixel: 0x00 for ink and
+ ** 0xff for background.  Glyph c starts at pixels + (c - 32) * width * height.
+ */
+typedef struct isGlyphAtlasStruct {
+  int width;                    //!< glyph width in pixels
+  int height;                   //!< glyph height in pixels
+  unsigned char *pixels;        //!< IS_LABEL_N_GLYPHS glyphs, each height rows of width bytes
+} isGlyphAtlasType;
+
+/** A rendered label kept around for the next image that needs it.
+ */
+typedef struct isLabelStripStruct {
+  struct isLabelStripStruct *next;      //!< next strip in our list, most recently used first
+  char *text;                           //!< the label
+  int width;                            //!< width of the strip in pixels
+  int height;                           //!< height of the strip in pixels
+  int font;                             //!< index of the font used to render the text
+  unsigned char *pixels;                //!< width * height grayscale pixels
+} isLabelStripType;
+
+//! Characters 32 through 255 have a slot in the atlas
+#define IS_LABEL_N_GLYPHS 224
+
+static isGlyphAtlasType atlases[8];                             // one for each of isBitmapFontBitmaps
+static isLabelStripType *strips = NULL;                         // our label cache
+static pthread_mutex_t stripMutex = PTHREAD_MUTEX_INITIALIZER;  // protects strips
+static pthread_once_t labelOnce = PTHREAD_ONCE_INIT;            // expand the fonts just once
+
+/** Expand the bitmap fonts into atlases.
+ **
+ ** The font tables hold characters 32 through 126 followed by 160
+ ** through 255.  Characters without a bitmap are left blank.
+ */
+static void isLabelExpandFonts() {
+  static const char *id = FILEID "isLabelExpandFonts";
+  const isBitmapFontType *bmp;
+  const unsigned char *src;
+  unsigned char *dst;
+  int bpc;                      // bytes per character row in the font
+  int f;                        // current font
+  int c;                        // current character
+  int glyph;                    // index of the character in the font table
+  int row, col;
+
+  for (f=0; f<n_isBitmapFontBitmaps && f<(int)(sizeof(atlases)/sizeof(atlases[0])); f++) {
+    bmp = &isBitmapFontBitmaps[f];
+    bpc = bmp->width / 8 + 1;
+
+    atlases[f].width  = bmp->width;
+    atlases[f].height = bmp->height;
+    atlases[f].pixels = malloc(IS_LABEL_N_GLYPHS * bmp->width * bmp->height);
+    if (atlases[f].pixels == NULL) {
+      isLogging_crit("%s: Out of memory\n", id);
+      exit (-1);
+    }
+    memset(atlases[f].pixels, 0xff, IS_LABEL_N_GLYPHS * bmp->width * bmp->height);
+
+    for (c=32; c<256; c++) {
+      if (c < 127) {
+        glyph = c - 32;
+      } else if (c >= 160) {
+        glyph = c - 65;
+      } else {
+        continue;
+      }
+
+      dst = atlases[f].pixels + (c - 32) * bmp->width * bmp->height;
+      for (row=0; row<bmp->height; row++) {
+        src = bmp->bitmap + (bmp->height * glyph + row) * bpc;
+        for (col=0; col<bmp->width; col++) {
+          if (src[col/8] & (0x80 >> (col % 8))) {
+            dst[row * bmp->width + col] = 0;
+          }
+        }
+      }
+    }
+  }
+}
+
+/** Prepare our fonts.  Call before starting the worker threads.
+ */
+void isLabelInit() {
+  pthread_once(&labelOnce, isLabelExpandFonts);
+}
+
+/** Pick the font that best fits our label.
+ **
+ ** The tallest font that fits in height wins, preferring one that
+ ** also fits the whole text across the width.  Ties go to the later
+ ** (bold) font.  When nothing fits we use the shortest font and let
+ ** it be clipped.
+ **
+ ** @param[in] text   the label
+ **
+ ** @param[in] width  width of the label in pixels
+ **
+ ** @param[in] height height of the label in pixels
+ **
+ ** @returns index into isBitmapFontBitmaps
+ */
+static int isLabelFont(const char *text, int width, int height) {
+  int len;
+  int f;
+  int best;             // tallest font that fits in height
+  int best_wide;        // tallest font that fits in both height and width
+  int shortest;
+
+  len = strlen(text);
+  best      = -1;
+  best_wide = -1;
+  shortest  = 0;
+  for (f=0; f<n_isBitmapFontBitmaps; f++) {
+    if (atlases[f].height <= atlases[shortest].height) {
+      shortest = f;
+    }
+    if (atlases[f].height > height) {
+      continue;
+    }
+    if (best == -1 || atlases[f].height >= atlases[best].height) {
+      best = f;
+    }
+    if (atlases[f].width * len <= width && (best_wide == -1 || atlases[f].height >= atlases[best_wide].height)) {
+      best_wide = f;
+    }
+  }
+  if (best_wide != -1) {
+    return best_wide;
+  }
+  return best == -1 ? shortest : best;
+}
+
+/** Render a label strip.
+ **
+ ** Text is left justified and vertically centered.  When the text is
+ ** too long to fit we drop characters from the beginning since it's
+ ** the end of the string (the frame number) that distinguishes one
+ ** image from another.
+ **
+ ** @param[in] text   the label
+ **
+ ** @param[in] width  width of the strip in pixels
+ **
+ ** @param[in] height height of the strip in pixels
+ **
+ ** @param[in] font   index of the font to use
+ **
+ ** @returns new strip
+ */
+static isLabelStripType *isLabelRenderStrip(const char *text, int width, int height, int font) {
+  static const char *id = FILEID "isLabelRenderStrip";
+  isLabelStripType *rtn;
+  const isGlyphAtlasType *atlas;
+  const unsigned char *glyph;
+  int len;
+  int first;            // first character that we'll show
+  int rows;             // number of glyph rows that we'll show
+  int y0;               // strip row for the top of the glyph
+  int gy0;              // glyph row shown at y0
+  int cols;             // number of glyph columns for the current character
+  int ci;
+  int row;
+  unsigned char c;
+
+  rtn = calloc(1, sizeof(*rtn));
+  if (rtn == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  rtn->text   = strdup(text);
+  rtn->width  = width;
+  rtn->height = height;
+  rtn->font   = font;
+  rtn->pixels = malloc(width * height);
+  if (rtn->text == NULL || rtn->pixels == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  memset(rtn->pixels, 0xff, width * height);
+
+  atlas = &atlases[font];
+
+  len = strlen(text);
+  first = 0;
+  if (len * atlas->width > width) {
+    first = len - width / atlas->width;
+  }
+
+  if (atlas->height <= height) {
+    y0   = (height - atlas->height) / 2;
+    gy0  = 0;
+    rows = atlas->height;
+  } else {
+    y0   = 0;
+    gy0  = (atlas->height - height) / 2;
+    rows = height;
+  }
+
+  for (ci=first; ci<len; ci++) {
+    c = text[ci];
+    if (c < 32) {
+      // Ignore control characters
+      continue;
+    }
+    glyph = atlas->pixels + (c - 32) * atlas->width * atlas->height;
+    cols = atlas->width;
+    if ((ci - first) * atlas->width + cols > width) {
+      cols = width - (ci - first) * atlas->width;
+    }
+    for (row=0; row<rows; row++) {
+      memcpy(rtn->pixels + (y0 + row) * width + (ci - first) * atlas->width, glyph + (gy0 + row) * atlas->width, cols);
+    }
+  }
+  return rtn;
+}
+
+/** Composite a label into an image buffer.
+ **
+ ** Rendered strips are cached by text, width, height, and font so
+ ** that asking for the same label again is just a copy.
+ **
+ ** @param[in] text    the label
+ **
+ ** @param[in] width   width of the label in pixels
+ **
+ ** @param[in] height  height of the label in pixels
+ **
+ ** @param[out] dst    the first pixel of the label area in the image buffer
+ **
+ ** @param[in] stride  bytes from one row of dst to the next
+ **
+ ** @param[in] components  bytes per pixel in dst (1 for grayscale, 3 for RGB)
+ */
+void isLabelComposite(const char *text, int width, int height, unsigned char *dst, int stride, int components) {
+  isLabelStripType *p;
+  isLabelStripType *last;
+  unsigned char *src;
+  unsigned char *dp;
+  int font;
+  int n;
+  int row, col;
+
+  isLabelInit();
+
+  font = isLabelFont(text, width, height);
+
+  pthread_mutex_lock(&stripMutex);
+
+  for (last=NULL, p=strips; p!=NULL; last=p, p=p->next) {
+    if (p->width == width && p->height == height && p->font == font && strcmp(p->text, text) == 0) {
+      if (last != NULL) {
+        last->next = p->next;
+        p->next    = strips;
+        strips     = p;
+      }
+      break;
+    }
+  }
+
+  if (p == NULL) {
+    p = isLabelRenderStrip(text, width, height, font);
+    p->next = strips;
+    strips  = p;
+
+    // Forget the least recently used strips
+    for (n=0, last=NULL, p=strips; p!=NULL; n++, last=p, p=p->next) {
+      if (n >= IS_LABEL_CACHE_SIZE) {
+        last->next = NULL;
+        while (p != NULL) {
+          isLabelStripType *next;
+          next = p->next;
+          free(p->text);
+          free(p->pixels);
+          free(p);
+          p = next;
+        }
+        break;
+      }
+    }
+    p = strips;
+  }
+
+  src = p->pixels;
+  for (row=0; row<height; row++) {
+    dp = dst + row * stride;
+    if (components == 1) {
+      memcpy(dp, src, width);
+      src += width;
+    } else {
+      for (col=0; col<width; col++) {
+        memset(dp, *src++, components);
+        dp += components;
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&stripMutex);
+}
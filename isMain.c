@@ -32,22 +32,156 @@
  */
 #include "is.h"
 
-/** Length of the zmq poll items
+/** Requests waiting for the remote redis, oldest first            */
+static isParkedType *parked_first = NULL;
+static isParkedType **parked_last = &parked_first;
+static int parked_count = 0;
+
+/** Let go of a request and whatever of it we have not sent on
+ **
+ ** @param pk Request to free
+ */
+static void isParkedFree(isParkedType *pk) {
+  int i;
+
+  for (i=0; i<pk->n_envelope_msgs; i++) {
+    zmq_msg_close(&pk->envelope_msgs[i]);
+  }
+  for (i=0; i<pk->nparts; i++) {
+    zmq_msg_close(&pk->parts[i]);
+  }
+  free(pk->pid);
+  free(pk->reply_str);
+  free(pk->auth_str);
+  free(pk);
+}
+
+/** Is a request from this session waiting already?  Then later ones
+ ** must wait too lest they pass it.
+ */
+static int isParkedFor(const char *pid, int esaf) {
+  isParkedType *pk;
+
+  for (pk=parked_first; pk != NULL; pk=pk->next) {
+    if (pk->esaf == esaf && strcmp(pk->pid, pid) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/** The remote redis has answered for this request: send it on or
+ ** tell the user why not.
  **
- ** @todo As the name implies this should be the amount we increase
- ** the list.  Currently this list is a fixed size and this approach
- ** is probably a bad idea and should be reevaluated.
+ ** @param zctx       ZMQ context for a new process
  **
- ** @todo We only correctly deal with the case were there is only one
- ** message part after the envelope messages.  Well, we do send on
- ** additional message parts but only in the (hopefully normal case)
- ** where there are no errors.  If there is an error then these extra
- ** messages parts go unread.  Probably this is a mistake but we do
- ** not yet have a use case for these extra parts so even if we did
- ** something clever we'd not be able to test it.  Hence this little
- ** warning message.
+ ** @param rc         Remote redis, should the process list need pruning
+ **
+ ** @param err_dealer Where error replies go
+ **
+ ** @param dev_mode   Run development processes
+ **
+ ** @param pk         The request
  */
-#define N_ZPOLLITEMS_INC 128
+static void isParkedFinish(void *zctx, redisContext *rc, void *err_dealer, int dev_mode, isParkedType *pk) {
+  static const char *id = FILEID "isParkedFinish";
+  isProcessListType *pli;       // process descriptor for our user's session
+  json_t *isAuth;               // JSON object with our user's permission
+  json_error_t jerr;            // error returned from most json_ routines
+
+  if (pk->reply_type == -1) {
+    isLogging_err("%s: Lost the remote redis checking process %s\n", id, pk->pid);
+    is_zmq_error_reply(pk->envelope_msgs, pk->n_envelope_msgs, err_dealer, "%s: Could not check authorization for process %s", id, pk->pid);
+    pk->n_envelope_msgs = 0;
+    return;
+  }
+
+  if (pk->reply_type == REDIS_REPLY_ERROR) {
+    isLogging_err("%s: Reids %s produced an error: %s\n", id, pk->known ? "exists pid" : "hmget isAuth", pk->reply_str);
+    exit(-1);
+  }
+
+  if (pk->known) {
+    //
+    // Here we've authenticated this pid (perhaps some time ago).  We
+    // just needed to verify that this pid is still active.
+    //
+    if (pk->reply_type != REDIS_REPLY_INTEGER) {
+      isLogging_err("%s: Redis exists pid did not return an integer, got type %d\n", id, pk->reply_type);
+      exit (-1);
+    }
+
+    if (pk->reply_integer != 1) {
+      isAuthCacheDrop(pk->pid);
+      isLogging_err("%s: Process %s is no longer active\n", id, pk->pid);
+      is_zmq_error_reply(pk->envelope_msgs, pk->n_envelope_msgs, err_dealer, "%s: Process %s is not authorized (7)", id, pk->pid);
+      pk->n_envelope_msgs = 0;
+      //
+      // TODO: We need to periodically purge our process list of inactive processes
+      //
+      return;
+    }
+    isAuthCacheSet(pk->pid);
+
+    pli = isFindProcess(pk->pid, pk->esaf);
+    if (pli != NULL) {
+      isBrokerForward(pk, pli);
+      return;
+    }
+
+    //
+    // Pruned while we waited.  The user's next request starts over.
+    //
+    isLogging_err("%s: Process %s went away while we checked it\n", id, pk->pid);
+    is_zmq_error_reply(pk->envelope_msgs, pk->n_envelope_msgs, err_dealer, "%s: Process %s is not active", id, pk->pid);
+    pk->n_envelope_msgs = 0;
+    return;
+  }
+
+  //
+  // Here we've not yet authenticated this pid.
+  //
+  if (pk->reply_type != REDIS_REPLY_ARRAY) {
+    if (pk->reply_type == REDIS_REPLY_NIL) {
+      isLogging_err("%s: Process %s is not active\n", id, pk->pid);
+      is_zmq_error_reply(pk->envelope_msgs, pk->n_envelope_msgs, err_dealer, "%s: Process %s is not active", id, pk->pid);
+    } else {
+      isLogging_err("%s: Redis hmget isAuth isAuthSig did not return an array, got type %d\n", id, pk->reply_type);
+      is_zmq_error_reply(pk->envelope_msgs, pk->n_envelope_msgs, err_dealer, "%s: Process %s is not authorized (1)", id, pk->pid);
+    }
+    pk->n_envelope_msgs = 0;
+    return;
+  }
+
+  if (pk->auth_type != REDIS_REPLY_STRING) {
+    isLogging_err("%s: isAuth reply is not a string, got type %d\n", id, pk->auth_type);
+    is_zmq_error_reply(pk->envelope_msgs, pk->n_envelope_msgs, err_dealer, "%s: Process %s is not authorized (2)", id, pk->pid);
+    pk->n_envelope_msgs = 0;
+    return;
+  }
+
+  isAuth = json_loads(pk->auth_str, 0, &jerr);
+  if (isAuth == NULL) {
+    isLogging_err("%s: Failed to parse JSON for '%s': %s\n", id, pk->auth_str, jerr.text);
+    is_zmq_error_reply(pk->envelope_msgs, pk->n_envelope_msgs, err_dealer, "%s: Process %s is not authorized (5)", id, pk->pid);
+    pk->n_envelope_msgs = 0;
+    return;
+  }
+
+  {
+    char *tmpsp;
+
+    tmpsp=json_dumps(isAuth, JSON_INDENT(0)|JSON_COMPACT|JSON_SORT_KEYS);
+    isLogging_info("%s: isAuth: %s\n", id, tmpsp);
+    free(tmpsp);
+  }
+
+  pli = isRun(zctx, rc, isAuth, pk->esaf, dev_mode);
+  isAuthCacheSet(pk->pid);
+  json_decref(isAuth);
+
+  isBrokerForward(pk, pli);
+}
 
 /** Our entry point into this lovely world of zero mq and diffraction
  ** images.
@@ -69,9 +203,13 @@ int main(int argc, char **argv) {
   static void *router;                 // Router socket we recieve our commands on
   static void *err_dealer;             // Socket to read errors generated when a user process cannot be forked
   static void *err_rep;                // Socket to handle the above errors (We need the err sockets to keep all the code ZMQ protocol complaint)
+  static void *requests;               // Requests from is_proxy passed on by the router thread
 
-  zmq_pollitem_t *zpollitems;   // list of sockets we need to service
-  int n_zpollitems;             // number of said sockets
+  isPollerType *pp;             // the sockets we wait on
+  isPollEntryType *ready[IS_POLL_EVENTS];  // sockets with something for us
+  int n_ready;                  // number of said sockets
+  int requests_ready;           // is_proxy has sent us a request
+  int batch;                    // messages forwarded from one socket this pass
 
   zmq_msg_t zmsg;               // Move messages between various socket when we service them
   int nreceived;                // Bytes received in a ZMQ messages (or -1 on error)
@@ -79,31 +217,30 @@ int main(int argc, char **argv) {
   json_t  *isRequest;           // Request sent by the user.  Called "job" in other places in the code.
   redisContext *rc;             // connection to redis on the web server (for permission verifications)
   redisContext *rcLocal;        // connection to our local redis (for storage)
-  json_t *isAuth;               // JSON object with our user's permission
-  char *isAuth_str;             // string version of isAuth as received from redis
+  const char *remoteAddress;    // where rc goes
+  int remotePort;               // and its port
   json_error_t jerr;            // error returned from most json_ routines
-  redisReply *reply;            // reply received from redis
-  redisReply *subreply;         // sub reply returned from redis
   char *pid;                    // Process ID for our user's instance
+  const char *route_pid;        // pid found without parsing the request (not terminated)
+  int route_pid_len;            // its length
   int esaf;                     // esaf the user wants to access
   isProcessListType *pli;       // process descriptor for our user's session
   int err;                      // error code for routines that return ints
   int more;                     // indicates there are more message parts to read
   int i;                        // loop variable
-  zmq_msg_t envelope_msgs[16];  // routing messages: likely there are no more than 2, 16 is way overkill but we'll break if there are more proxies than this between us and the user.
-  int n_envelope_msgs;          // number of "envelope messages"
+  isParkedType *pk;             // request with its routing messages: likely there are no more than 2, IS_PARKED_PARTS is way overkill but we'll break if there are more proxies than this between us and the user.
   int socket_option;            // used to set ZMQ socket options
   int dev_mode;                 // flag to use development sockets instead of production sockets
+  int max_parked;               // most requests waiting for the remote redis at once
 
   //
   // Exit "elegantly" on ^C
   //
   void our_handler(int sig) {
-    int i;
-    if (router) {
-      zmq_close(router);
+    if (requests) {
+      zmq_close(requests);
     }
-    
+
     if (err_dealer) {
       zmq_close(err_dealer);
     }
@@ -112,18 +249,21 @@ int main(int argc, char **argv) {
       zmq_close(err_rep);
     }
 
-    for (i=2; i<n_zpollitems; i++) {
-      zmq_close(zpollitems[i].socket);
-    }
-
+    //
+    // The router and the user process sockets belong to the broker
+    // threads.  Waiting for them would be waiting forever.
+    //
     if (zctx) {
-      zmq_ctx_term(zctx);
+      zmq_ctx_shutdown(zctx);
     }
+    _exit(0);
   }
   sa.sa_handler = our_handler;
   sa.sa_flags     = SA_SIGINFO | SA_RESTART;
   sigfillset(&sa.sa_mask);
 
+  max_parked = isQueueSetting("IS_QUEUE_GLOBAL", IS_QUEUE_GLOBAL);
+
   dev_mode = 0;
   if (strstr(argv[0],"dev")) {
     dev_mode = 1;
@@ -140,24 +280,24 @@ int main(int argc, char **argv) {
 
   isLogging_info("Welcome to the LS-CAT Image Server by Keith Brister ©2017-2018 by Northwestern University.  All rights reserved.\n");
 
-  n_zpollitems = N_ZPOLLITEMS_INC;
-  zpollitems = calloc(n_zpollitems, sizeof(*zpollitems));
-  if (zpollitems == NULL) {
-    isLogging_crit("%s: Out of memory (zpollites)\n", id);
-    exit (-1);
-  }
-
   isProcessListInit();
 
+  // User processes are forked by a process of their own, started
+  // while we still have just this one thread.  It has some ready
+  // before anyone asks for one.
+  //
+  isForkServerInit();
+
   //
   // setup redis
   //
   // Connection to web server to access permissions and login status
   //
-  rc = redisConnect(REMOTE_SERVER_REDIS_ADDRESS, REMOTE_SERVER_REDIS_PORT);
+  isAuthRemote(&remoteAddress, &remotePort);
+  rc = redisConnect(remoteAddress, remotePort);
   if (rc == NULL || rc->err) {
     if (rc) {
-      isLogging_err("%s: Failed to connect to remote redis at %s: %s\n", id, REMOTE_SERVER_REDIS_ADDRESS, rc->errstr);
+      isLogging_err("%s: Failed to connect to remote redis at %s: %s\n", id, remoteAddress, rc->errstr);
     } else {
       isLogging_err("%s: Failed to get redis remote context\n", id);
     }
@@ -201,9 +341,10 @@ int main(int argc, char **argv) {
   }
 
   //
-  // Disable the ZMQ receiver high water mark for the router
+  // Bound the ZMQ receiver high water mark for the router: when we
+  // fall that far behind is_proxy holds on to the rest
   //
-  socket_option = 0;
+  socket_option = isQueueHwm();
   err = zmq_setsockopt(router, ZMQ_RCVHWM, &socket_option, sizeof(socket_option));
   if (err == -1) {
     isLogging_err("%s: Could not set RCVHWM for router: %s\n", id, zmq_strerror(errno));
@@ -211,9 +352,9 @@ int main(int argc, char **argv) {
   }
 
   //
-  // Disable the ZMQ sender high water mark for the router
+  // And the sender high water mark
   //
-  socket_option = 0;
+  socket_option = isQueueHwm();
   err = zmq_setsockopt(router, ZMQ_SNDHWM, &socket_option, sizeof(socket_option));
   if (err == -1) {
     isLogging_err("%s: Could not set SNDHWM for router: %s\n", id, zmq_strerror(errno));
@@ -296,9 +437,21 @@ int main(int argc, char **argv) {
     exit (-1);
   }
 
-  // No envelope messages to close yet
+  // The router and the user processes are serviced by threads of
+  // their own.  We just get the requests.
   //
-  n_envelope_msgs = 0;
+  requests = isBrokerInit(zctx, router, dev_mode);
+
+  // Our fixed sockets.  We send on the err sockets too.
+  //
+  pp = isPollerNew();
+  isPollAdd(pp, requests, 0, NULL);
+  isPollAdd(pp, err_rep, 1, NULL);
+  isPollAdd(pp, err_dealer, 1, NULL);
+
+  // Keep track of which sessions are still logged in
+  //
+  isAuthCacheInit();
 
   //
   // Here is our main loop
@@ -314,68 +467,65 @@ int main(int argc, char **argv) {
     // to say. Then we'll pass its message on to another socket (that
     // we may have to create a process to service).
     //
+    // Replies from the user processes no longer come through here:
+    // the broker threads send them back to is_proxy themselves.
+    //
+    n_ready = isPollWait(pp, ready, IS_POLL_EVENTS);
 
-    // List of sockets to listen to
-    zpollitems = isRemakeZMQPollItems(router, err_rep, err_dealer);
-    n_zpollitems = isNProcesses() + 3;
+    requests_ready = 0;
+    for (i=0; i<n_ready; i++) {
+      if (ready[i]->socket == requests) {
+        requests_ready = 1;
+        continue;
+      }
 
-    //
-    // Wait for messages to appear
-    //
-    err = zmq_poll(zpollitems, n_zpollitems, -1);
-    if (err == -1) {
-      isLogging_err("%s: zmq_poll returned error (%d poll items): %s\n", id, n_zpollitems, zmq_strerror(errno));
-      exit (-1);
-    }
-    
-    //
-    // zpollitems[0] is the router listening to is_proxy
-    //
-    // zpollitems[1] is the error responder passing messages back to the error dealer
-    //
-    // zpollitems[2] is the err_dealer sending packets to the error responder
-    //
-    // zpollitems[n] with n > 2 is the response from one of our processes destined for is_proxy
-    //
+      if (ready[i]->socket == err_rep) {
+        //
+        // Error responder (err_rep).  We'll just echo the messages.
+        //
+        do {
+          zmq_msg_init(&zmsg);
+          zmq_msg_recv(&zmsg, err_rep, 0);
+          more = zmq_msg_more(&zmsg);
+          zmq_msg_send(&zmsg, err_rep, more ? ZMQ_SNDMORE : 0);
+          zmq_msg_close(&zmsg);
+        } while(more);
+        continue;
+      }
 
-    //
-    // Error responder (err_rep).  We'll just echo the messages.
-    //
-    if (zpollitems[1].revents & ZMQ_POLLIN) {
       //
-      // Echo messages sent to our error responder.
+      // Our error messages go back to the is.js process by way of
+      // the router thread.  A batch at a time; the poller gives us
+      // the rest next time around.
       //
-      do {
-        zmq_msg_init(&zmsg);
-        zmq_msg_recv(&zmsg, err_rep, 0);
-        more = zmq_msg_more(&zmsg);
-        zmq_msg_send(&zmsg, err_rep, more ? ZMQ_SNDMORE : 0);
-        zmq_close(&zmsg);
-      } while(more);
+      for (batch=0; batch<IS_POLL_BATCH; batch++) {
+        if (isBrokerReply(err_dealer) == -1) {
+          break;
+        }
+      }
     }
 
+    // The requests.  We'll listen for new stuff and, perhaps if we
+    // feel like it, pass the job request to the appropriate child,
+    // starting it if necessary.  One request per pass: the poller
+    // keeps the requests socket on its list while it has more.
     //
-    // Transfer all the child process chatter (as well as our error
-    // messages) back to the is.js process.
     //
+    // Requests whose answer from the remote redis is in.  Redis
+    // answers in the order we ask so these come off the front.
     //
-    for (i=2; i<n_zpollitems; i++) {
-      if (zpollitems[i].revents & ZMQ_POLLIN) {
-        do {
-          zmq_msg_init(&zmsg);
-          zmq_msg_recv(&zmsg, zpollitems[i].socket, 0);
-          more = zmq_msg_more(&zmsg);
-          zmq_msg_send(&zmsg, router, more ? ZMQ_SNDMORE : 0);
-          zmq_msg_close(&zmsg);
-        } while (more);
+    while (parked_first != NULL && !parked_first->waiting) {
+      pk = parked_first;
+      parked_first = pk->next;
+      if (parked_first == NULL) {
+        parked_last = &parked_first;
       }
+      parked_count--;
+      isParkedFinish(zctx, rc, err_dealer, dev_mode, pk);
+      isParkedFree(pk);
     }
 
-    // [0] is the router.  We'll listen for new stuff and, perhaps if
-    // we feel like it, pass the job request to the appropriate child,
-    // starting it if necessary.
-    //
-    if (!(zpollitems[0].revents & ZMQ_POLLIN)) {
+    if (!requests_ready) {
       //
       // Nothing incoming from is.js.  Just keep on truckin'.
       //
@@ -398,192 +548,148 @@ int main(int argc, char **argv) {
     //
     // Find (and save) our envelope messages
     //
-    for (i=0; i<sizeof(envelope_msgs)/sizeof(envelope_msgs[0]); i++) {
-      zmq_msg_init(&envelope_msgs[i]);
-      nreceived = zmq_msg_recv(&envelope_msgs[i], router, 0);
+    pk = calloc(1, sizeof(*pk));
+    if (pk == NULL) {
+      isLogging_crit("%s: Out of memory\n", id);
+      exit (-1);
+    }
+
+    for (i=0; i<IS_PARKED_PARTS; i++) {
+      zmq_msg_init(&pk->envelope_msgs[i]);
+      nreceived = zmq_msg_recv(&pk->envelope_msgs[i], requests, 0);
       if (nreceived == -1) {
         isLogging_err("%s: Error receiving envelope from public dealer: %s\n", id, zmq_strerror(errno));
         exit (-1);
       }
-      more = zmq_msg_more(&envelope_msgs[i]);
-      if (zmq_msg_size(&envelope_msgs[i]) == 0 || !more) {
+      more = zmq_msg_more(&pk->envelope_msgs[i]);
+      if (zmq_msg_size(&pk->envelope_msgs[i]) == 0 || !more) {
         break;
       }
     }
 
-    if (i == sizeof(envelope_msgs)/sizeof(envelope_msgs[i]) || !more) {
+    if (i == IS_PARKED_PARTS || !more) {
       isLogging_err("%s: Unexpected incoming message format. Too many router/dealers?\n", id);
       exit (-1);
     }
 
-    n_envelope_msgs = i+1;
+    pk->n_envelope_msgs = i+1;
 
     //
-    // Now we'll just take a peek at the message intended for the worker.
+    // Now the message intended for the worker along with whatever
+    // parts come after it.  We only look at the first.
     //
-    zmq_msg_init(&zmsg);
-    nreceived = zmq_msg_recv(&zmsg, router, 0);
-    if (nreceived == -1) {
-      isLogging_err("%s: Error receiving message from public dealer: %s\n", id, zmq_strerror(errno));
-      exit (-1);
-    }
+    while (more) {
+      if (pk->nparts == IS_PARKED_PARTS) {
+        // More than we are prepared to pass on: drop the rest
+        isLogging_err("%s: Dropping request part beyond %d\n", id, IS_PARKED_PARTS);
+        zmq_msg_init(&zmsg);
+        zmq_msg_recv(&zmsg, requests, 0);
+        more = zmq_msg_more(&zmsg);
+        zmq_msg_close(&zmsg);
+        continue;
+      }
 
-    //
-    // If there are any more parts we'll recv & send them later
-    //
-    more = zmq_msg_more(&zmsg);
+      zmq_msg_init(&pk->parts[pk->nparts]);
+      nreceived = zmq_msg_recv(&pk->parts[pk->nparts], requests, 0);
+      if (nreceived == -1) {
+        isLogging_err("%s: Error receiving message from public dealer: %s\n", id, zmq_strerror(errno));
+        exit (-1);
+      }
+      more = zmq_msg_more(&pk->parts[pk->nparts]);
+      pk->nparts++;
+    }
 
     //
-    // Retrieve instructions from our client
+    // Where does it go?  A routing frame or a quick look at the
+    // request usually tells us.
     //
-    isRequest = json_loadb(zmq_msg_data(&zmsg), zmq_msg_size(&zmsg), 0, &jerr);
+    if (pk->nparts > 1 && isRouteFrame(zmq_msg_data(&pk->parts[0]), zmq_msg_size(&pk->parts[0]), &route_pid, &route_pid_len, &esaf) == 0) {
+      pk->pid = strndup(route_pid, route_pid_len);
 
-    if (isRequest == NULL) {
-      isLogging_err("%s: Failed to parse '%s': %s\n", id, (char *)zmq_msg_data(&zmsg), jerr.text);
-      is_zmq_error_reply(envelope_msgs, n_envelope_msgs, err_dealer, "%s: Failed to parse request: %s", id, jerr.text);
-      continue;
-    }
-
-    pid = (char *)json_string_value(json_object_get(isRequest, "pid"));
-    if (pid == NULL) {
-      char *tmpstr;
-      tmpstr = json_dumps(isRequest, JSON_SORT_KEYS | JSON_COMPACT | JSON_INDENT(0));
-      isLogging_err("%s: isRequest without pid: %s\n", id, tmpstr);
-      is_zmq_error_reply(envelope_msgs, n_envelope_msgs, err_dealer, "%s: request does not contain pid", id);
-      free(tmpstr);
-      json_decref(isRequest);
-      continue;
+      // Not for the worker
+      for (i=1; i<pk->nparts; i++) {
+        zmq_msg_move(&pk->parts[i-1], &pk->parts[i]);
+      }
+      zmq_msg_close(&pk->parts[--pk->nparts]);
+    } else if (isRouteScan(zmq_msg_data(&pk->parts[0]), zmq_msg_size(&pk->parts[0]), &route_pid, &route_pid_len, &esaf) == 0) {
+      pk->pid = strndup(route_pid, route_pid_len);
     }
 
-    esaf = json_integer_value(json_object_get(isRequest, "esaf"));
-
-    isAuth = NULL;
-    isLogging_info("%s: got pid %s  esaf %d\n", id, pid, esaf);
-    pli = isFindProcess(pid, esaf);
-    if (pli == NULL) {
+    if (pk->pid != NULL) {
+      pk->esaf = esaf;
+    } else {
       //
-      // Here we've not yet authenticated this pid.
+      // Retrieve instructions from our client the long way
       //
-      reply = redisCommand(rc, "HMGET %s isAuth isAuthSig", pid);
-      if (reply == NULL) {
-        isLogging_err("%s: Redis error (isAuth): %s\n", id, rc->errstr);
-        exit(-1);
-      }
-    
-      if (reply->type == REDIS_REPLY_ERROR) {
-        isLogging_err("%s: Reids hmget isAuth produced an error: %s\n", id, reply->str);
-        exit(-1);
-      }
-
-      if (reply->type != REDIS_REPLY_ARRAY) {
-        if (reply->type == REDIS_REPLY_NIL) {
-          isLogging_err("%s: Process %s is not active\n", id, pid);
-          is_zmq_error_reply(envelope_msgs, n_envelope_msgs, err_dealer, "%s: Process %s is not active", id, pid);
-        } else {
-          isLogging_err("%s: Redis hmget isAuth isAuthSig did not return an array, got type %d\n", id, reply->type);
-          is_zmq_error_reply(envelope_msgs, n_envelope_msgs, err_dealer, "%s: Process %s is not authorized (1)", id, pid);
-        }
+      isRequest = json_loadb(zmq_msg_data(&pk->parts[0]), zmq_msg_size(&pk->parts[0]), 0, &jerr);
 
-        json_decref(isRequest);
-        freeReplyObject(reply);
+      if (isRequest == NULL) {
+        isLogging_err("%s: Failed to parse '%.*s': %s\n", id, (int)zmq_msg_size(&pk->parts[0]), (char *)zmq_msg_data(&pk->parts[0]), jerr.text);
+        is_zmq_error_reply(pk->envelope_msgs, pk->n_envelope_msgs, err_dealer, "%s: Failed to parse request: %s", id, jerr.text);
+        pk->n_envelope_msgs = 0;
+        isParkedFree(pk);
         continue;
       }
 
-      subreply = reply->element[0];
-      if (subreply->type != REDIS_REPLY_STRING) {
-        isLogging_err("%s: isAuth reply is not a string, got type %d\n", id, subreply->type);
-        is_zmq_error_reply(envelope_msgs, n_envelope_msgs, err_dealer, "%s: Process %s is not authorized (2)", id, pid);
-        
-        json_decref(isRequest);
-        freeReplyObject(reply);
-        continue;
-      }      
-      isAuth_str = subreply->str;
-
-      isAuth = json_loads(isAuth_str, 0, &jerr);
-      if (isRequest == NULL) {
-        isLogging_err("%s: Failed to parse JSON for '%s': %s\n", id, isAuth_str, jerr.text);
-        is_zmq_error_reply(envelope_msgs, n_envelope_msgs, err_dealer, "%s: Process %s is not authorized (5)", id, pid);
-
+      pid = (char *)json_string_value(json_object_get(isRequest, "pid"));
+      if (pid == NULL) {
+        char *tmpstr;
+        tmpstr = json_dumps(isRequest, JSON_SORT_KEYS | JSON_COMPACT | JSON_INDENT(0));
+        isLogging_err("%s: isRequest without pid: %s\n", id, tmpstr);
+        is_zmq_error_reply(pk->envelope_msgs, pk->n_envelope_msgs, err_dealer, "%s: request does not contain pid", id);
+        pk->n_envelope_msgs = 0;
+        free(tmpstr);
         json_decref(isRequest);
-        freeReplyObject(reply);
+        isParkedFree(pk);
         continue;
       }
-    
-      {
-        char *tmpsp;
 
-        tmpsp=json_dumps(isAuth, JSON_INDENT(0)|JSON_COMPACT|JSON_SORT_KEYS);        
-        isLogging_info("%s: isAuth: %s\n", id, tmpsp);
-        free(tmpsp);
-      }
-
-      freeReplyObject(reply);
-
-      pli = isRun(zctx, rc, isAuth, esaf, dev_mode);
-    } else {
-      //
-      // Here we've authenticated this pid (perhaps some time ago).  We
-      // just need to verify that this pid is still active.
-      //
-      reply = redisCommand(rc, "EXISTS %s", pid);
-      if (reply == NULL) {
-        isLogging_err("%s: Redis error (exists pid): %s\n", id, rc->errstr);
-        exit(-1);
-      }
-      
-      if (reply->type == REDIS_REPLY_ERROR) {
-        isLogging_err("%s: Reids exists pid produced an error: %s\n", id, reply->str);
-        exit(-1);
-      }
+      esaf = json_integer_value(json_object_get(isRequest, "esaf"));
 
-      if (reply->type != REDIS_REPLY_INTEGER) {
-        isLogging_err("%s: Redis exists pid did not return an integer, got type %d\n", id, reply->type);
+      pk->pid = strdup(pid);
+      if (pk->pid == NULL) {
+        isLogging_crit("%s: Out of memory\n", id);
         exit (-1);
       }
-
-      if (reply->integer != 1) {
-        isLogging_err("%s: Process %s is no longer active\n", id, pid);
-        is_zmq_error_reply(envelope_msgs, n_envelope_msgs, err_dealer, "%s: Process %s is not authorized (7)", id, pid);
-        //
-        // TODO: We need to periodically purge our process list of inactive processes
-        //
-        freeReplyObject(reply);
-        json_decref(isRequest);
-        continue;
-      }
-      freeReplyObject(reply);
+      pk->esaf = esaf;
+      json_decref(isRequest);
     }
 
-    json_decref(isRequest);
+    isLogging_info("%s: got pid %s  esaf %d\n", id, pk->pid, esaf);
+    pli = isFindProcess(pk->pid, esaf);
 
     //
-    // Send our envelope messages to the supervisor (through parent_dealer)
+    // Here we've authenticated this pid (perhaps some time ago) and
+    // our cache says it is still active.  Off it goes unless an
+    // earlier request from this session is still waiting its turn.
     //
-    for (i=0; i<n_envelope_msgs; i++) {
-      zmq_msg_send(&envelope_msgs[i], pli->parent_dealer, ZMQ_SNDMORE);
-      zmq_msg_close(&envelope_msgs[i]);
+    if (pli != NULL && isAuthCacheValid(pk->pid) && !isParkedFor(pk->pid, esaf)) {
+      isBrokerForward(pk, pli);
+      isParkedFree(pk);
+      continue;
     }
 
-    zmq_msg_send(&zmsg, pli->parent_dealer, more ? ZMQ_SNDMORE : 0);
-    zmq_msg_close(&zmsg);
-
     //
-    // If there just happens to be some more message parts to pass on
-    // this is where that magic happens.
+    // Otherwise it waits here for the remote redis while everyone
+    // else's requests keep flowing, if there is room
     //
-    while (more) {
-      zmq_msg_init(&zmsg);
-      zmq_msg_recv(&zmsg, router, 0);
-      more = zmq_msg_more(&zmsg);
-      zmq_msg_send(&zmsg, pli->parent_dealer, more ? ZMQ_SNDMORE : 0);
-      zmq_msg_close(&zmsg);
+    if (parked_count >= max_parked) {
+      is_zmq_error_reply(pk->envelope_msgs, pk->n_envelope_msgs, err_dealer, "%s: Busy, please try again", id);
+      pk->n_envelope_msgs = 0;
+      isParkedFree(pk);
+      continue;
     }
 
-    if (isAuth != NULL) {
-      json_decref(isAuth);
-      isAuth = NULL;
+    pk->known = pli != NULL;
+    if (isAuthAsk(pp, pk) == -1) {
+      is_zmq_error_reply(pk->envelope_msgs, pk->n_envelope_msgs, err_dealer, "%s: Could not check authorization for process %s", id, pk->pid);
+      pk->n_envelope_msgs = 0;
+      isParkedFree(pk);
+      continue;
     }
+    *parked_last = pk;
+    parked_last  = &pk->next;
+    parked_count++;
   }
 
   return 0;
@@ -0,0 +1,413 @@
+/*! @file isOverlay.c
+ *  @copyright 2018 by Northwestern University
+ *  @author Keith Brister
+ *  @brief Resolution rings, beam center, and spot marks drawn on rendered images
+ *
+ *  Rings and the crosshair depend only on the geometry of the
+ *  rendered image so they are drawn once into an 8 bit layer, one
+ *  IS_OVERLAY_* value per pixel, that is kept in the buffer cache and
+ *  reused for every frame of the dataset shown the same way.  Spots
+ *  come from the spot finder results for the frame (also cached) and
+ *  are drawn straight onto the image.
+ */
+#include "is.h"
+
+/** Mark a pixel of a layer
+ **
+ ** @param plane   the layer
+ **
+ ** @param width   layer width
+ **
+ ** @param height  layer height
+ **
+ ** @param col     column, may be off the layer
+ **
+ ** @param row     row, may be off the layer
+ **
+ ** @param kind    IS_OVERLAY_* value
+ */
+static void isOverlayPlot(uint8_t *plane, int width, int height, int col, int row, uint8_t kind) {
+  if (col < 0 || col >= width || row < 0 || row >= height) {
+    return;
+  }
+  plane[row * width + col] = kind;
+}
+
+/** Color a pixel of a rendered image
+ **
+ ** @param rgb     the image
+ **
+ ** @param width   image width
+ **
+ ** @param height  image height
+ **
+ ** @param col     column, may be off the image
+ **
+ ** @param row     row, may be off the image
+ **
+ ** @param c       color packed as a palette entry
+ */
+static void isOverlayColor(unsigned char *rgb, int width, int height, int col, int row, uint32_t c) {
+  unsigned char *p;
+
+  if (col < 0 || col >= width || row < 0 || row >= height) {
+    return;
+  }
+  p = rgb + 3 * (row * width + col);
+  p[0] = c;
+  p[1] = c >> 8;
+  p[2] = c >> 16;
+}
+
+/** Draw the ring and crosshair layer
+ **
+ ** The layer is width * height marks followed by height flags that
+ ** are non-zero for rows with something on them.
+ **
+ ** @param width      rendered image width
+ **
+ ** @param height     rendered image height
+ **
+ ** @param cx         beam center column on the rendered image
+ **
+ ** @param cy         beam center row on the rendered image
+ **
+ ** @param rx         horizontal radius of each ring in rendered image pixels
+ **
+ ** @param ry         vertical radius of each ring in rendered image pixels
+ **
+ ** @param nrings     number of rings
+ **
+ ** @param crosshair  1 to mark the beam center
+ **
+ ** @returns malloc'ed layer
+ */
+static uint8_t *isOverlayLayer(int width, int height, double cx, double cy, const double *rx, const double *ry, int nrings, int crosshair) {
+  static const char *id = FILEID "isOverlayLayer";
+  uint8_t *plane;
+  uint8_t *rows;
+  double a;
+  double r;
+  int steps;
+  int i, j;
+  int row;
+
+  plane = calloc((size_t)width * height + height, 1);
+  if (plane == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  rows = plane + (size_t)width * height;
+
+  //
+  // Step around each ring about half a pixel at a time
+  //
+  for (i=0; i<nrings; i++) {
+    r = rx[i] > ry[i] ? rx[i] : ry[i];
+    steps = ceil(4.0 * M_PI * r);
+    steps = steps < 8 ? 8 : (steps > IS_OVERLAY_MAX_RING_STEPS ? IS_OVERLAY_MAX_RING_STEPS : steps);
+    for (j=0; j<steps; j++) {
+      a = 2.0 * M_PI * j / steps;
+      isOverlayPlot(plane, width, height, lround(cx + rx[i] * cos(a)), lround(cy + ry[i] * sin(a)), IS_OVERLAY_RING);
+    }
+  }
+
+  if (crosshair) {
+    for (j=-IS_OVERLAY_CROSSHAIR_ARM; j<=IS_OVERLAY_CROSSHAIR_ARM; j++) {
+      isOverlayPlot(plane, width, height, lround(cx) + j, lround(cy), IS_OVERLAY_CROSSHAIR);
+      isOverlayPlot(plane, width, height, lround(cx), lround(cy) + j, IS_OVERLAY_CROSSHAIR);
+    }
+  }
+
+  for (row=0; row<height; row++) {
+    for (j=0; j<width && plane[row * width + j] == IS_OVERLAY_NONE; j++);
+    rows[row] = j < width;
+  }
+
+  return plane;
+}
+
+/** Draw the resolution rings and beam center crosshair
+ **
+ ** @param wctx       Worker context
+ **
+ ** @param imb        read locked rendered image
+ **
+ ** @param rings      resolution of each ring in Å
+ **
+ ** @param nrings     number of rings
+ **
+ ** @param crosshair  1 to mark the beam center
+ **
+ ** @param cmap       colormap number from isColormapFind
+ **
+ ** @param rgb        the rendered image
+ **
+ ** @returns number of rings we could place
+ */
+static int isOverlayRings(isWorkerContext_t *wctx, isImageBufType *imb, const double *rings, int nrings, int crosshair, int cmap, unsigned char *rgb) {
+  static const char *id = FILEID "isOverlayRings";
+  double rx[IS_OVERLAY_MAX_RINGS];
+  double ry[IS_OVERLAY_MAX_RINGS];
+  double wavelength;
+  double distance;
+  double x_pixel_size;
+  double y_pixel_size;
+  double s;
+  double r;
+  json_t *v;
+  isImageBufType *layer;
+  uint8_t *plane;
+  uint8_t *rows;
+  uint32_t colors[IS_OVERLAY_KINDS];
+  char *key;
+  char *kp;
+  int keylen;
+  int n;
+  int i;
+  int row, col;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  v = json_object_get(imb->meta, "wavelength");        wavelength   = json_is_number(v) ? json_number_value(v) : 0.0;
+  v = json_object_get(imb->meta, "detector_distance"); distance     = json_is_number(v) ? json_number_value(v) : 0.0;
+  v = json_object_get(imb->meta, "x_pixel_size");      x_pixel_size = json_is_number(v) ? json_number_value(v) : 0.0;
+  v = json_object_get(imb->meta, "y_pixel_size");      y_pixel_size = json_is_number(v) ? json_number_value(v) : 0.0;
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  y_pixel_size = y_pixel_size <= 0.0 ? x_pixel_size : y_pixel_size;
+
+  //
+  // Ring radii on the rendered image.  Rings we can't reach are
+  // dropped.
+  //
+  n = 0;
+  if (wavelength > 0.0 && distance > 0.0 && x_pixel_size > 0.0 && imb->box_w > 0.0 && imb->box_h > 0.0) {
+    for (i=0; i<nrings; i++) {
+      s = rings[i] > 0.0 ? wavelength / (2.0 * rings[i]) : 1.0;
+      if (s >= 1.0 || 2.0 * asin(s) >= M_PI / 2.0) {
+        continue;
+      }
+      r = distance * tan(2.0 * asin(s));
+      rx[n] = r / (x_pixel_size * imb->box_w);
+      ry[n] = r / (y_pixel_size * imb->box_h);
+      if (rx[n] > IS_OVERLAY_MAX_RADIUS || ry[n] > IS_OVERLAY_MAX_RADIUS) {
+        continue;
+      }
+      n++;
+    }
+  } else if (nrings > 0) {
+    isLogging_info("%s: no resolution rings without wavelength, detector_distance, and x_pixel_size\n", id);
+  }
+
+  if (n == 0 && !crosshair) {
+    return 0;
+  }
+
+  //
+  // The layer's key is the geometry of the rendered image
+  //
+  keylen = 128 + n * 32;
+  key = malloc(keylen);
+  if (key == NULL) {
+    isLogging_crit("%s: Out of memory (key)\n", id);
+    exit (-1);
+  }
+  kp = key + snprintf(key, keylen, "%d:overlay-%dx%d-%0.2f-%0.2f-%d", getegid(), imb->buf_width, imb->buf_height,
+                      imb->beam_center_x, imb->beam_center_y, crosshair);
+  for (i=0; i<n && kp - key < keylen; i++) {
+    kp += snprintf(kp, keylen - (kp - key), "-%0.2f/%0.2f", rx[i], ry[i]);
+  }
+
+  //
+  // Buffer is read locked if it exists, write locked if it does not
+  //
+  layer = isGetImageBufFromKey(wctx, key);
+  free(key);
+
+  if (layer->buf == NULL) {
+    layer->buf        = isOverlayLayer(imb->buf_width, imb->buf_height, imb->beam_center_x, imb->beam_center_y, rx, ry, n, crosshair);
+    layer->buf_size   = imb->buf_width * imb->buf_height + imb->buf_height;
+    layer->buf_width  = imb->buf_width;
+    layer->buf_height = imb->buf_height;
+    layer->buf_depth  = 1;
+
+    pthread_rwlock_unlock(&layer->buflock);
+    pthread_rwlock_rdlock(&layer->buflock);
+  }
+
+  for (i=0; i<IS_OVERLAY_KINDS; i++) {
+    colors[i] = isColormapOverlayColor(cmap, i);
+  }
+
+  plane = layer->buf;
+  rows  = plane + imb->buf_width * imb->buf_height;
+  for (row=0; row<imb->buf_height; row++) {
+    if (!rows[row]) {
+      continue;
+    }
+    for (col=0; col<imb->buf_width; col++) {
+      if (plane[row * imb->buf_width + col] != IS_OVERLAY_NONE) {
+        isOverlayColor(rgb, imb->buf_width, imb->buf_height, col, row, colors[plane[row * imb->buf_width + col]]);
+      }
+    }
+  }
+
+  pthread_rwlock_unlock(&layer->buflock);
+  pthread_mutex_lock(&wctx->ctxMutex);
+  layer->in_use--;
+  assert(layer->in_use >= 0);
+  pthread_mutex_unlock(&wctx->ctxMutex);
+
+  return n;
+}
+
+/** Draw a box around each spot the spot finder found on this frame
+ **
+ ** @param wctx   Worker context
+ **
+ ** @param job    See isOverlayComposite
+ **
+ ** @param imb    read locked rendered image
+ **
+ ** @param cmap   colormap number from isColormapFind
+ **
+ ** @param rgb    the rendered image
+ **
+ ** @returns number of spots marked or -1 if we could not find the spots
+ */
+static int isOverlaySpots(isWorkerContext_t *wctx, json_t *job, isImageBufType *imb, int cmap, unsigned char *rgb) {
+  static const char *id = FILEID "isOverlaySpots";
+  const char *fn;
+  int frame;
+  double sigma;
+  int min_pixels;
+  double bcx, bcy;
+  isImageBufType *spotb;
+  isSpotType *spots;
+  int nspots;
+  json_t *meta;
+  json_t *v;
+  uint32_t c;
+  int col, row;
+  int i, j;
+
+  (void)id;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  fn    = json_string_value(json_object_get(job, "fn"));
+  frame = json_integer_value(json_object_get(job, "frame"));
+
+  sigma = IS_SPOT_FINDER_SIGMA;
+  if (json_is_number(json_object_get(job, "sigma"))) {
+    sigma = json_number_value(json_object_get(job, "sigma"));
+  }
+  min_pixels = IS_SPOT_FINDER_MIN_PIXELS;
+  if (json_is_integer(json_object_get(job, "min_pixels"))) {
+    min_pixels = json_integer_value(json_object_get(job, "min_pixels"));
+  }
+  v = json_object_get(imb->meta, "beam_center_x"); bcx = json_is_number(v) ? json_number_value(v) : 0.0;
+  v = json_object_get(imb->meta, "beam_center_y"); bcy = json_is_number(v) ? json_number_value(v) : 0.0;
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  if (fn == NULL || imb->box_w <= 0.0 || imb->box_h <= 0.0) {
+    return -1;
+  }
+
+  frame      = frame <= 0 ? 1 : frame;
+  sigma      = sigma <= 0.0 ? IS_SPOT_FINDER_SIGMA : sigma;
+  min_pixels = min_pixels < 1 ? 1 : min_pixels;
+
+  spots = isSpotsFind(wctx, job, fn, frame, sigma, min_pixels, &nspots, &meta, &spotb);
+  if (spots == NULL) {
+    return -1;
+  }
+
+  c = isColormapOverlayColor(cmap, IS_OVERLAY_SPOT);
+  nspots = nspots > IS_OVERLAY_MAX_SPOTS ? IS_OVERLAY_MAX_SPOTS : nspots;
+  for (i=0; i<nspots; i++) {
+    col = lround(imb->beam_center_x + (spots[i].x - bcx) / imb->box_w);
+    row = lround(imb->beam_center_y + (spots[i].y - bcy) / imb->box_h);
+    for (j=-IS_OVERLAY_SPOT_BOX; j<=IS_OVERLAY_SPOT_BOX; j++) {
+      isOverlayColor(rgb, imb->buf_width, imb->buf_height, col + j, row - IS_OVERLAY_SPOT_BOX, c);
+      isOverlayColor(rgb, imb->buf_width, imb->buf_height, col + j, row + IS_OVERLAY_SPOT_BOX, c);
+      isOverlayColor(rgb, imb->buf_width, imb->buf_height, col - IS_OVERLAY_SPOT_BOX, row + j, c);
+      isOverlayColor(rgb, imb->buf_width, imb->buf_height, col + IS_OVERLAY_SPOT_BOX, row + j, c);
+    }
+  }
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  json_decref(meta);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  if (spotb == NULL) {
+    free(spots);
+  } else {
+    pthread_rwlock_unlock(&spotb->buflock);
+    pthread_mutex_lock(&wctx->ctxMutex);
+    spotb->in_use--;
+    assert(spotb->in_use >= 0);
+    pthread_mutex_unlock(&wctx->ctxMutex);
+  }
+
+  return nspots;
+}
+
+/** Draw the overlays a job asks for onto a rendered image
+ **
+ ** @param wctx Worker context
+ **  @li @c wctx->metaMutex  Keeps jansson calls in line
+ **  @li @c wctx->ctxMutex   Keeps our buffer cache in line
+ **
+ ** @param job   What the user asked for.  We set overlay_rings and overlay_spots here.
+ **   @li @c rings       resolution rings to draw, a number or array of numbers in Å
+ **   @li @c crosshair   true to mark the beam center
+ **   @li @c spots       true to mark the spots found on the full resolution frame
+ **   @li @c sigma       spot finder threshold (see isFindSpots)
+ **   @li @c min_pixels  spot finder smallest spot (see isFindSpots)
+ **
+ ** @param imb   read locked rendered (reduced) image
+ **
+ ** @param cmap  colormap number from isColormapFind
+ **
+ ** @param rgb   the rendered image, imb->buf_width * imb->buf_height RGB pixels
+ */
+void isOverlayComposite(isWorkerContext_t *wctx, json_t *job, isImageBufType *imb, int cmap, unsigned char *rgb) {
+  static const char *id = FILEID "isOverlayComposite";
+  double rings[IS_OVERLAY_MAX_RINGS];
+  int nrings;
+  int crosshair;
+  int spots;
+  json_t *jrings;
+  json_t *v;
+  size_t i;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  nrings = 0;
+  jrings = json_object_get(job, "rings");
+  if (json_is_number(jrings)) {
+    rings[nrings++] = json_number_value(jrings);
+  } else if (json_is_array(jrings)) {
+    json_array_foreach(jrings, i, v) {
+      if (nrings < IS_OVERLAY_MAX_RINGS && json_is_number(v)) {
+        rings[nrings++] = json_number_value(v);
+      }
+    }
+  }
+  crosshair = json_is_true(json_object_get(job, "crosshair"));
+  spots     = json_is_true(json_object_get(job, "spots"));
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  if (nrings > 0 || crosshair) {
+    nrings = isOverlayRings(wctx, imb, rings, nrings, crosshair, cmap, rgb);
+    pthread_mutex_lock(&wctx->metaMutex);
+    set_json_object_integer(id, job, "overlay_rings", nrings);
+    pthread_mutex_unlock(&wctx->metaMutex);
+  }
+
+  if (spots) {
+    spots = isOverlaySpots(wctx, job, imb, cmap, rgb);
+    pthread_mutex_lock(&wctx->metaMutex);
+    set_json_object_integer(id, job, "overlay_spots", spots);
+    pthread_mutex_unlock(&wctx->metaMutex);
+  }
+}
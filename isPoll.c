@@ -0,0 +1,333 @@
+/*! @file isPoll.c
+ *  @copyright 2018 by Northwestern University
+ *  @author Keith Brister
+ *  @brief Wait on many ZMQ sockets (and redis connections) at a cost that does not grow with their number
+ *
+ *  Each thread of the broker that services sockets has its own
+ *  poller: an epoll set of the sockets' ZMQ_FD plus a list of sockets
+ *  that may have something to read.  Sockets are added and removed
+ *  as they come and go rather than rebuilding a zmq_pollitem_t list
+ *  every time around.
+ *
+ *  ZMQ_FD only says something may have changed, so a socket stays on
+ *  our list until ZMQ_EVENTS says it has been drained.  Sending on a
+ *  socket can eat the wake up for something that arrived meanwhile:
+ *  sockets we also send on are "sticky" and looked at every pass;
+ *  otherwise the sender should isPollList the socket.
+ *
+ *  A poller belongs to the thread that waits on it.
+ */
+#include "is.h"
+
+/** Make a poller
+ **
+ ** @returns A new, empty poller
+ */
+isPollerType *isPollerNew() {
+  static const char *id = FILEID "isPollerNew";
+  isPollerType *rtn;
+
+  rtn = calloc(1, sizeof(*rtn));
+  if (rtn == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  rtn->fd = epoll_create1(EPOLL_CLOEXEC);
+  if (rtn->fd == -1) {
+    isLogging_err("%s: Could not create epoll set: %s\n", id, strerror(errno));
+    exit (-1);
+  }
+  return rtn;
+}
+
+/** Put a socket on the list the next isPollWait looks at
+ **
+ ** @param pp Our poller
+ **
+ ** @param pe Socket to check
+ */
+void isPollList(isPollerType *pp, isPollEntryType *pe) {
+  if (pe == NULL || pe->listed) {
+    return;
+  }
+  pe->listed = 1;
+  pe->next   = pp->list;
+  pp->list   = pe;
+}
+
+/** Start watching a socket
+ **
+ ** @param pp     Our poller
+ **
+ ** @param socket ZMQ socket to read from
+ **
+ ** @param sticky Check it on every pass whether or not epoll says so.
+ **               Needed for the sockets we also send on many times
+ **               per pass since sending can eat the ZMQ_FD wake up
+ **               for something that arrived meanwhile.
+ **
+ ** @param data   Whatever the caller wants back with the socket
+ **
+ ** @returns Our record of the socket
+ */
+isPollEntryType *isPollAdd(isPollerType *pp, void *socket, int sticky, void *data) {
+  static const char *id = FILEID "isPollAdd";
+  isPollEntryType *rtn;
+  struct epoll_event ev;
+  size_t fd_size;
+  int err;
+
+  rtn = calloc(1, sizeof(*rtn));
+  if (rtn == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  rtn->poller = pp;
+  rtn->socket = socket;
+  rtn->sticky = sticky;
+  rtn->data   = data;
+
+  fd_size = sizeof(rtn->fd);
+  err = zmq_getsockopt(socket, ZMQ_FD, &rtn->fd, &fd_size);
+  if (err == -1) {
+    isLogging_err("%s: Could not get ZMQ_FD: %s\n", id, zmq_strerror(errno));
+    exit (-1);
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events   = EPOLLIN;
+  ev.data.ptr = rtn;
+  err = epoll_ctl(pp->fd, EPOLL_CTL_ADD, rtn->fd, &ev);
+  if (err == -1) {
+    isLogging_err("%s: Could not add socket to epoll set: %s\n", id, strerror(errno));
+    exit (-1);
+  }
+  rtn->registered = 1;
+
+  //
+  // Anything already waiting would not wake us up
+  //
+  isPollList(pp, rtn);
+  return rtn;
+}
+
+/** Stop watching a socket.  Call before it is closed.
+ **
+ ** @param pp Our poller
+ **
+ ** @param pe Socket returned by isPollAdd.  We free it.
+ */
+void isPollRemove(isPollerType *pp, isPollEntryType *pe) {
+  static const char *id = FILEID "isPollRemove";
+  isPollEntryType **pep;
+
+  if (pe == NULL) {
+    return;
+  }
+
+  if (epoll_ctl(pp->fd, EPOLL_CTL_DEL, pe->fd, NULL) == -1) {
+    isLogging_err("%s: Could not remove socket from epoll set: %s\n", id, strerror(errno));
+  }
+
+  for (pep=&pp->list; *pep != NULL; pep=&(*pep)->next) {
+    if (*pep == pe) {
+      *pep = pe->next;
+      break;
+    }
+  }
+  free(pe);
+}
+
+/** Bring our epoll set up to date with what hiredis wants
+ */
+static void isPollRedisWatch(isPollEntryType *pe) {
+  static const char *id = FILEID "isPollRedisWatch";
+  struct epoll_event ev;
+  int op;
+
+  if (pe->events == 0) {
+    if (pe->registered) {
+      epoll_ctl(pe->poller->fd, EPOLL_CTL_DEL, pe->fd, NULL);
+      pe->registered = 0;
+    }
+    return;
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events   = pe->events;
+  ev.data.ptr = pe;
+  op = pe->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (epoll_ctl(pe->poller->fd, op, pe->fd, &ev) == -1) {
+    isLogging_err("%s: epoll_ctl failed for fd %d: %s\n", id, pe->fd, strerror(errno));
+    return;
+  }
+  pe->registered = 1;
+}
+
+//
+// hiredis event hooks
+//
+static void isPollAddRead(void *data) {
+  isPollEntryType *pe = data;
+
+  pe->events |= EPOLLIN;
+  isPollRedisWatch(pe);
+}
+
+static void isPollDelRead(void *data) {
+  isPollEntryType *pe = data;
+
+  pe->events &= ~EPOLLIN;
+  isPollRedisWatch(pe);
+}
+
+static void isPollAddWrite(void *data) {
+  isPollEntryType *pe = data;
+
+  pe->events |= EPOLLOUT;
+  isPollRedisWatch(pe);
+}
+
+static void isPollDelWrite(void *data) {
+  isPollEntryType *pe = data;
+
+  pe->events &= ~EPOLLOUT;
+  isPollRedisWatch(pe);
+}
+
+/** hiredis is about to close the socket and free the context
+ */
+static void isPollCleanup(void *data) {
+  isPollEntryType *pe = data;
+
+  pe->events = 0;
+  isPollRedisWatch(pe);
+  pe->ac   = NULL;
+  pe->next = pe->poller->dead;
+  pe->poller->dead = pe;
+}
+
+/** Service a redis connection along with our sockets.  Its callbacks
+ ** run inside isPollWait.
+ **
+ ** @param pp Our poller
+ **
+ ** @param ac Connection fresh from redisAsyncConnect
+ */
+void isPollRedis(isPollerType *pp, redisAsyncContext *ac) {
+  static const char *id = FILEID "isPollRedis";
+  isPollEntryType *pe;
+
+  pe = calloc(1, sizeof(*pe));
+  if (pe == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  pe->poller = pp;
+  pe->ac     = ac;
+  pe->fd     = ac->c.fd;
+
+  ac->ev.data     = pe;
+  ac->ev.addRead  = isPollAddRead;
+  ac->ev.delRead  = isPollDelRead;
+  ac->ev.addWrite = isPollAddWrite;
+  ac->ev.delWrite = isPollDelWrite;
+  ac->ev.cleanup  = isPollCleanup;
+
+  // hiredis is waiting for the connection to finish
+  isPollAddWrite(pe);
+}
+
+/** Wait for sockets with something to read.  A socket stays on our list
+ ** until it has been drained so whatever is left over from one pass is
+ ** picked up by the next without waiting.
+ **
+ ** Redis connections added with isPollRedis are serviced here too;
+ ** should any of them have had something to say we return, perhaps
+ ** with no sockets at all, so the caller can act on what their
+ ** callbacks did.
+ **
+ ** @param pp    Our poller
+ **
+ ** @param ready Returned list of readable sockets
+ **
+ ** @param max   Size of ready
+ **
+ ** @returns Number of sockets in the list
+ */
+int isPollWait(isPollerType *pp, isPollEntryType **ready, int max) {
+  static const char *id = FILEID "isPollWait";
+  struct epoll_event evs[IS_POLL_EVENTS];
+  isPollEntryType **pep;
+  isPollEntryType *pe;
+  size_t events_size;
+  int events;
+  int nevs;
+  int rtn;
+  int i;
+  int serviced;                 // we ran some redis callbacks
+
+  serviced = 0;
+  while (1) {
+    rtn = 0;
+    for (pep=&pp->list; *pep != NULL; ) {
+      pe = *pep;
+      events = 0;
+      events_size = sizeof(events);
+      if (zmq_getsockopt(pe->socket, ZMQ_EVENTS, &events, &events_size) == -1) {
+        isLogging_err("%s: Could not get ZMQ_EVENTS: %s\n", id, zmq_strerror(errno));
+      }
+
+      if ((events & ZMQ_POLLIN) && rtn < max) {
+        ready[rtn++] = pe;
+      }
+
+      if ((events & ZMQ_POLLIN) || pe->sticky) {
+        pep = &pe->next;
+        continue;
+      }
+
+      //
+      // Drained: epoll will tell us when there is more
+      //
+      pe->listed = 0;
+      *pep = pe->next;
+    }
+
+    if (rtn > 0 || serviced) {
+      return rtn;
+    }
+
+    while (pp->dead != NULL) {
+      pe = pp->dead;
+      pp->dead = pe->next;
+      free(pe);
+    }
+
+    nevs = epoll_wait(pp->fd, evs, sizeof(evs)/sizeof(evs[0]), -1);
+    if (nevs == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      isLogging_err("%s: epoll_wait failed: %s\n", id, strerror(errno));
+      exit (-1);
+    }
+
+    for (i=0; i<nevs; i++) {
+      pe = evs[i].data.ptr;
+      if (pe->socket != NULL) {
+        isPollList(pp, pe);
+        continue;
+      }
+
+      serviced = 1;
+      if (pe->ac != NULL && (evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+        redisAsyncHandleRead(pe->ac);
+      }
+      if (pe->ac != NULL && (evs[i].events & EPOLLOUT)) {
+        redisAsyncHandleWrite(pe->ac);
+      }
+    }
+  }
+}
@@ -8,6 +8,14 @@
  ** we use a hash table which is rebuilt whenever necessary from the
  ** linked list.
  **
+ ** User processes are forked by the fork server, a process of its
+ ** own started while we still have only the one thread.  New
+ ** processes come from a small pool of zygotes when there is one
+ ** waiting: processes forked ahead of time that have done the slow
+ ** part of getting started (workers, redis connections) and only
+ ** need to be told whose they are.  A thread of ours keeps the pool
+ ** topped up.
+ **
  */
 
 /** All header files are placed in @c is.h to ensure consistent definitions.
@@ -25,9 +33,63 @@ static struct hsearch_data process_table;
 
 /** First process in our linked list                            */
 static isProcessListType *firstProcessListItem = NULL;
-static zmq_pollitem_t *isZMQPollItems = NULL;
+
+/** Number of user processes with a parent_dealer               */
 static int n_processes;
 
+/** A user process forked before anyone needs it                */
+typedef struct isZygoteStruct {
+  struct isZygoteStruct *next;  //!< Next zygote in the pool
+  pid_t pid;                    //!< The zygote's process id
+  int fd;                       //!< Our end of the socket it reads its identity from
+} isZygoteType;
+
+/** Who a zygote is to become                                   */
+typedef struct isZygoteIdentityStruct {
+  int uid;                      //!< setuid to this unless 0
+  int gid;                      //!< setgid to this unless 0
+  char home[PATH_MAX];          //!< chdir here unless empty
+  char key[128];                //!< Our process key (see isCreateProcessListItem)
+} isZygoteIdentityType;
+
+/** What we ask the fork server for                            */
+typedef struct isForkRequestStruct {
+  int zygote;                   //!< 1 for a zygote, 0 for a process that knows whose it is
+  isZygoteIdentityType zi;      //!< Whose it is (unless a zygote)
+} isForkRequestType;
+
+/** The fork server's answer.  A zygote's socket comes with it
+ ** (SCM_RIGHTS).                                                */
+typedef struct isForkReplyStruct {
+  pid_t pid;                    //!< The new process or -1 if there is none
+  int err;                      //!< errno when there is none
+} isForkReplyType;
+
+/** Control message big enough for one file descriptor          */
+typedef union isForkControlUnion {
+  char buf[CMSG_SPACE(sizeof(int))];    //!< The message
+  struct cmsghdr align;                 //!< Aligned as cmsghdr needs
+} isForkControlType;
+
+/** Our end of the socket to the fork server                    */
+static int fork_server = -1;
+
+/** Zygotes waiting to be used                                  */
+static isZygoteType *zygotes = NULL;
+
+/** Number of them                                              */
+static int n_zygotes = 0;
+
+/** Number we would like to have                                */
+static int zygotes_wanted = 0;
+
+/** Protects the pool and the fork server socket                */
+static pthread_mutex_t zygoteMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Wakes up isZygoteKeeper when the pool is short              */
+static pthread_cond_t zygoteCond = PTHREAD_COND_INITIALIZER;
+
+
 /** On startup ensure that other verions of this program are killed.
  */
 void isInit(int dev_mode) {
@@ -90,6 +152,11 @@ void isInit(int dev_mode) {
 
   fprintf(our_pid_file, "%d", (int)getpid());
   fclose(our_pid_file);
+
+  //
+  // Before any user processes are forked so they all share it
+  //
+  isIndexInit();
 }
 
 /** Initialize our process list and hash table
@@ -110,6 +177,508 @@ void isProcessListInit() {
 }
 
 
+/** Run as the user from here on.  Called in the child.
+ **
+ ** A user process also gets the group of the indexing slots
+ ** (isIndexSlotGroup) so it can take them.
+ **
+ ** @param uid           setuid to this unless 0
+ **
+ ** @param gid           setgid to this unless 0
+ **
+ ** @param homeDirectory chdir here unless NULL
+ */
+static void isProcessBecome(int uid, int gid, const char *homeDirectory) {
+  static const char *id = FILEID "isProcessBecome";
+  gid_t slot_gid;
+  gid_t *groups;
+  int ngroups;
+
+  slot_gid = isIndexSlotGroup();
+  if (uid && slot_gid != (gid_t)-1) {
+    groups = calloc(NGROUPS_MAX + 1, sizeof(*groups));
+    if (groups == NULL) {
+      isLogging_crit("%s: Out of memory\n", id);
+      _exit(-1);
+    }
+    ngroups = getgroups(NGROUPS_MAX, groups);
+    if (ngroups >= 0) {
+      groups[ngroups++] = slot_gid;
+      ngroups = setgroups(ngroups, groups);
+    }
+    if (ngroups < 0) {
+      isLogging_err("%s: Child process could not add group %d: %s\n", id, (int)slot_gid, strerror(errno));
+      _exit(-1);
+    }
+    free(groups);
+  }
+
+  if (gid && setgid(gid) < 0) {
+    isLogging_err("%s: Child process could not set gid to %d: %s\n", id, gid, strerror(errno));
+    _exit(-1);
+  }
+  if (uid && setuid(uid) < 0) {
+    isLogging_err("%s: Child process could not set uid to %d: %s\n", id, uid, strerror(errno));
+    _exit(-1);
+  }
+  if (homeDirectory && chdir(homeDirectory) < 0) {
+    isLogging_err("%s: Could not change working directory to %s: %s\n", id, homeDirectory, strerror(errno));
+    _exit(-1);
+  }
+}
+
+/** Fork what the fork server was asked for and send back its pid
+ ** (and a zygote's socket).  The new process never returns.
+ **
+ ** @param fd    The fork server's end of our socket
+ **
+ ** @param sfd   The fork server's signalfd
+ **
+ ** @param mask  Signal mask for the new process
+ **
+ ** @param req   What we were asked for
+ */
+static void isForkServerFork(int fd, int sfd, const sigset_t *mask, isForkRequestType *req) {
+  static const char *id = FILEID "isForkServerFork";
+  isForkReplyType reply;
+  isForkControlType control;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  pid_t server;
+  int sv[2];                    // [0] goes back with the reply, [1] to the zygote
+
+  server = getpid();
+  sv[0]  = -1;
+  sv[1]  = -1;
+  memset(&reply, 0, sizeof(reply));
+
+  if (req->zygote && socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+    reply.pid = -1;
+    reply.err = errno;
+  } else {
+    reply.pid = fork();
+    reply.err = errno;
+  }
+
+  if (reply.pid == 0) {
+    //
+    // Nothing of the fork server's comes along: a user process
+    // could ask it for anything
+    //
+    close(fd);
+    close(sfd);
+    sigprocmask(SIG_SETMASK, mask, NULL);
+
+    if (!req->zygote) {
+      req->zi.home[sizeof(req->zi.home)-1] = 0;
+      req->zi.key[sizeof(req->zi.key)-1]   = 0;
+      isProcessBecome(req->zi.uid, req->zi.gid, req->zi.home[0] ? req->zi.home : NULL);
+      isSupervisor(req->zi.key, -1);
+      _exit(0);
+    }
+
+    //
+    // Zygote.  Go when the fork server does unless we have become
+    // someone.
+    //
+    close(sv[0]);
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != server) {
+      _exit(0);
+    }
+    isSupervisor(NULL, sv[1]);
+    _exit(0);
+  }
+
+  if (reply.pid == -1) {
+    isLogging_err("%s: Could not start %s: %s\n", id, req->zygote ? "zygote" : "process", strerror(reply.err));
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base   = &reply;
+  iov.iov_len    = sizeof(reply);
+  msg.msg_iov    = &iov;
+  msg.msg_iovlen = 1;
+  if (reply.pid > 0 && sv[0] != -1) {
+    memset(&control, 0, sizeof(control));
+    msg.msg_control    = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &sv[0], sizeof(int));
+  }
+
+  if (sendmsg(fd, &msg, MSG_NOSIGNAL) == -1) {
+    isLogging_err("%s: Could not answer: %s\n", id, strerror(errno));
+    if (reply.pid > 0 && req->zygote) {
+      kill(reply.pid, SIGKILL);         // no one will ever talk to it
+    }
+  }
+
+  if (sv[0] != -1) {
+    close(sv[0]);
+    close(sv[1]);
+  }
+}
+
+/** The fork server: fork user processes on request and reap them
+ ** when they are done.  We have one thread, so whatever locks the
+ ** children inherit are free.  Never returns.
+ **
+ ** @param fd  Our end of the socket to the image server
+ */
+static void isForkServer(int fd) {
+  static const char *id = FILEID "isForkServer";
+  isForkRequestType req;
+  struct signalfd_siginfo ssi;
+  struct pollfd pfd[2];
+  sigset_t chld;                // SIGCHLD, which we read from sfd
+  sigset_t mask;                // what our children start with
+  ssize_t got;
+  int sfd;
+
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld, &mask);
+
+  sfd = signalfd(-1, &chld, SFD_CLOEXEC | SFD_NONBLOCK);
+  if (sfd == -1) {
+    isLogging_crit("%s: Could not create signalfd: %s\n", id, strerror(errno));
+    _exit(-1);
+  }
+
+  while (1) {
+    pfd[0].fd      = fd;
+    pfd[0].events  = POLLIN;
+    pfd[0].revents = 0;
+    pfd[1].fd      = sfd;
+    pfd[1].events  = POLLIN;
+    pfd[1].revents = 0;
+
+    if (poll(pfd, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      isLogging_crit("%s: poll failed: %s\n", id, strerror(errno));
+      _exit(-1);
+    }
+
+    if (pfd[1].revents & POLLIN) {
+      //
+      // SIGCHLDs merge: reap everyone who is done, zygotes that died
+      // waiting included
+      //
+      while (read(sfd, &ssi, sizeof(ssi)) == sizeof(ssi));
+      while (waitpid(-1, NULL, WNOHANG) > 0);
+    }
+
+    if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      got = recv(fd, &req, sizeof(req), 0);
+      if (got == 0 || (got == -1 && errno != EINTR)) {
+        // The image server is gone and so are we
+        _exit(0);
+      }
+      if (got == sizeof(req)) {
+        isForkServerFork(fd, sfd, &mask, &req);
+      }
+    }
+  }
+}
+
+/** Ask the fork server for a process.  Call with zygoteMutex held.
+ **
+ ** @param req  What we want
+ **
+ ** @param zfd  Returned: our end of a zygote's socket.  NULL unless req->zygote.
+ **
+ ** @returns The new process or -1 (with errno set) when there is none
+ */
+static pid_t isForkServerAsk(isForkRequestType *req, int *zfd) {
+  isForkReplyType reply;
+  isForkControlType control;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  ssize_t got;
+  int fd;
+
+  if (send(fork_server, req, sizeof(*req), MSG_NOSIGNAL) != sizeof(*req)) {
+    return -1;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  memset(&control, 0, sizeof(control));
+  iov.iov_base       = &reply;
+  iov.iov_len        = sizeof(reply);
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  do {
+    got = recvmsg(fork_server, &msg, MSG_CMSG_CLOEXEC);
+  } while (got == -1 && errno == EINTR);
+
+  fd = -1;
+  for (cmsg=CMSG_FIRSTHDR(&msg); cmsg!=NULL; cmsg=CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+  }
+
+  if (got != sizeof(reply) || reply.pid <= 0 || (req->zygote && fd == -1)) {
+    if (got == sizeof(reply) && reply.pid > 0) {
+      kill(reply.pid, SIGKILL);         // a zygote we can't talk to
+      errno = EPROTO;
+    } else if (got == sizeof(reply)) {
+      errno = reply.err;
+    } else if (got != -1) {
+      errno = EPIPE;
+    }
+    if (fd != -1) {
+      close(fd);
+    }
+    return -1;
+  }
+
+  if (zfd != NULL) {
+    *zfd = fd;
+  } else if (fd != -1) {
+    close(fd);
+  }
+  return reply.pid;
+}
+
+/** Drop zygotes that died waiting: the other end of their socket
+ ** hangs up.  The fork server has reaped them.  Call with
+ ** zygoteMutex held.
+ */
+static void isZygotePrune() {
+  static const char *id = FILEID "isZygotePrune";
+  isZygoteType **zpp;
+  isZygoteType *zp;
+  struct pollfd pfd;
+
+  zpp = &zygotes;
+  while (*zpp != NULL) {
+    zp = *zpp;
+    pfd.fd      = zp->fd;
+    pfd.events  = 0;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) != 1 || !(pfd.revents & (POLLHUP | POLLERR))) {
+      zpp = &zp->next;
+      continue;
+    }
+
+    isLogging_err("%s: Zygote %d died waiting\n", id, zp->pid);
+    *zpp = zp->next;
+    close(zp->fd);
+    free(zp);
+    n_zygotes--;
+  }
+}
+
+/** Keep the zygote pool full.  Runs in a thread of its own so
+ ** starting a zygote never holds up the main loop.
+ **
+ ** @param dummy Unused
+ */
+static void *isZygoteKeeper(void *dummy) {
+  static const char *id = FILEID "isZygoteKeeper";
+  isForkRequestType req;
+  isZygoteType *zp;
+  struct timespec ts;
+  pid_t pid;
+  int fd;
+
+  memset(&req, 0, sizeof(req));
+  req.zygote = 1;
+
+  pthread_mutex_lock(&zygoteMutex);
+  while (1) {
+    //
+    // Look in on the pool now and then for zygotes that died
+    //
+    isZygotePrune();
+    while (n_zygotes >= zygotes_wanted) {
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += IS_ZYGOTE_CHECK_SECS;
+      pthread_cond_timedwait(&zygoteCond, &zygoteMutex, &ts);
+      isZygotePrune();
+    }
+
+    pid = isForkServerAsk(&req, &fd);
+    if (pid < 0) {
+      isLogging_err("%s: Could not start zygote: %s\n", id, strerror(errno));
+      pthread_mutex_unlock(&zygoteMutex);
+      sleep(1);
+      pthread_mutex_lock(&zygoteMutex);
+      continue;
+    }
+
+    zp = calloc(1, sizeof(*zp));
+    if (zp == NULL) {
+      isLogging_crit("%s: Out of memory\n", id);
+      exit (-1);
+    }
+    zp->pid  = pid;
+    zp->fd   = fd;
+    zp->next = zygotes;
+    zygotes  = zp;
+    n_zygotes++;
+  }
+  return NULL;
+}
+
+/** Start the fork server and keep a pool of zygotes, IS_ZYGOTES of
+ ** them unless the environment variable of that name says otherwise.
+ **
+ ** Call after isInit, so user processes share what it sets up, and
+ ** before starting any threads: user processes go on to use syslog,
+ ** jansson, hiredis and zmq, and a process forked from a threaded
+ ** one can inherit a lock that a thread left behind was holding.
+ */
+void isForkServerInit() {
+  static const char *id = FILEID "isForkServerInit";
+  pthread_t keeper;
+  const char *s;
+  pid_t parent;
+  pid_t pid;
+  int sv[2];                    // [0] is ours, [1] the fork server's
+  int err;
+
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+    isLogging_crit("%s: Could not create socket pair: %s\n", id, strerror(errno));
+    exit (-1);
+  }
+
+  parent = getpid();
+  pid = fork();
+  if (pid == -1) {
+    isLogging_crit("%s: Could not start fork server: %s\n", id, strerror(errno));
+    exit (-1);
+  }
+
+  if (pid == 0) {
+    close(sv[0]);
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != parent) {
+      _exit(0);
+    }
+    isForkServer(sv[1]);
+    _exit(0);
+  }
+
+  close(sv[1]);
+  fork_server = sv[0];
+  isLogging_info("%s: Fork server is process %d\n", id, (int)pid);
+
+  s = getenv("IS_ZYGOTES");
+  zygotes_wanted = s != NULL ? atoi(s) : IS_ZYGOTES;
+  if (zygotes_wanted <= 0) {
+    isLogging_info("%s: No zygotes: user processes start from scratch\n", id);
+    zygotes_wanted = 0;
+    return;
+  }
+
+  err = pthread_create(&keeper, NULL, isZygoteKeeper, NULL);
+  if (err != 0) {
+    isLogging_err("%s: Could not start zygote keeper: %s\n", id, strerror(err));
+    zygotes_wanted = 0;
+    return;
+  }
+  pthread_detach(keeper);
+  isLogging_info("%s: Keeping %d zygotes\n", id, zygotes_wanted);
+}
+
+/** Hand a waiting zygote its identity
+ **
+ ** @param zi  Who it is to become
+ **
+ ** @returns The zygote's process id or 0 when there was none to take it
+ */
+static pid_t isZygoteTake(const isZygoteIdentityType *zi) {
+  static const char *id = FILEID "isZygoteTake";
+  isZygoteType *zp;
+  pid_t rtn;
+  ssize_t sent;
+
+  while (1) {
+    pthread_mutex_lock(&zygoteMutex);
+    zp = zygotes;
+    if (zp != NULL) {
+      zygotes = zp->next;
+      n_zygotes--;
+      pthread_cond_signal(&zygoteCond);
+    }
+    pthread_mutex_unlock(&zygoteMutex);
+
+    if (zp == NULL) {
+      return 0;
+    }
+
+    //
+    // A zygote still starting up reads this when it is ready
+    //
+    sent = send(zp->fd, zi, sizeof(*zi), MSG_NOSIGNAL);
+    close(zp->fd);
+    rtn = zp->pid;
+    free(zp);
+
+    if (sent == sizeof(*zi)) {
+      return rtn;
+    }
+
+    //
+    // Perhaps it could not get started.  Try another.  The fork
+    // server, its parent, reaps it.
+    //
+    isLogging_err("%s: Zygote %d could not take %s: %s\n", id, rtn, zi->key, sent == -1 ? strerror(errno) : "short send");
+    kill(rtn, SIGKILL);
+  }
+}
+
+/** Wait, as a zygote, to be told whose process we are and become it
+ **
+ ** @param fd Our end of the socket isZygoteTake sends to
+ **
+ ** @returns Our process key.  We exit instead should the server go away.
+ */
+char *isZygoteWait(int fd) {
+  static const char *id = FILEID "isZygoteWait";
+  isZygoteIdentityType zi;
+  ssize_t got;
+  char *rtn;
+
+  do {
+    got = recv(fd, &zi, sizeof(zi), MSG_WAITALL);
+  } while (got == -1 && errno == EINTR);
+
+  if (got != sizeof(zi)) {
+    // No one will ever need us
+    _exit(0);
+  }
+  close(fd);
+
+  zi.home[sizeof(zi.home)-1] = 0;
+  zi.key[sizeof(zi.key)-1]   = 0;
+
+  isProcessBecome(zi.uid, zi.gid, zi.home[0] ? zi.home : NULL);
+
+  // Like any other user process from here on
+  prctl(PR_SET_PDEATHSIG, 0);
+
+  rtn = strdup(zi.key);
+  if (rtn == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  return rtn;
+}
+
 /** Launch a new process.
  **
  ** The process will run as the requesting user with the group number
@@ -119,6 +688,9 @@ void isProcessListInit() {
  ** to allow access if the user is not, in fact, a member of the esaf
  ** group.
  **
+ ** A waiting zygote becomes the process if we have one.  Otherwise
+ ** the fork server starts one from scratch.
+ **
  ** @param p  Object to launch
  **  @li @c p->isAuth      Our permissions object
  **  @li @c p->isAuth->uid Our user name
@@ -132,6 +704,7 @@ void isStartProcess(isProcessListType *p) {
   int uid, gid;               // The ESAF's uid and gid in LDAP, which the child proc runs as.
   const char *homeDirectory;  // ESAF user's home directory
   char esafUser[16];          // Generated ESAF user name
+  isForkRequestType req;      // Who the process is to be
 
   if (p->esaf > 0) {
     snprintf(esafUser, sizeof(esafUser)-1, "e%d", p->esaf);
@@ -153,34 +726,34 @@ void isStartProcess(isProcessListType *p) {
     uid = 0;
     gid = 0;
     homeDirectory = NULL;
-    isLogging_info("%s: Starting sub process as root, no ESAF specified\n");
+    isLogging_info("%s: Starting sub process as root, no ESAF specified\n", id);
   }
-  
-  child = fork();
-  if (child < 0) { // fork failed (parent side)
-    isLogging_err("%s: Could not start sub process: %s\n", id, strerror(errno));
-    exit(-1);
 
-  } else if (child) { // fork succeeded (parent side)
-    n_processes++;
+  memset(&req, 0, sizeof(req));
+  req.zi.uid = uid;
+  req.zi.gid = gid;
+  if (homeDirectory != NULL) {
+    snprintf(req.zi.home, sizeof(req.zi.home)-1, "%s", homeDirectory);
+  }
+  snprintf(req.zi.key, sizeof(req.zi.key)-1, "%s", p->key);
+  free((char *)homeDirectory);
+
+  child = isZygoteTake(&req.zi);
+  if (child > 0) {
+    isLogging_info("%s: Zygote %d is now %s\n", id, child, p->key);
     p->processID = child;
+    return;
+  }
 
-  } else { // fork succeeded (child side)
-    if (gid && setgid(gid) < 0) {
-      isLogging_err("%s: Child process could not set gid to %d: %s\n", id, gid, strerror(errno));
-      _exit(-1);
-    }
-    if (uid && setuid(uid) < 0) {
-      isLogging_err("%s: Child process could not set uid to %d: %s\n", id, uid, strerror(errno));
-      _exit(-1);
-    }
-    if (homeDirectory && chdir(homeDirectory) < 0) {
-      isLogging_err("%s: Could not change working directory to %s: %s\n", id, homeDirectory, strerror(errno));
-      _exit(-1);
-    }
-    isSupervisor(p->key);
-    
+  pthread_mutex_lock(&zygoteMutex);
+  child = isForkServerAsk(&req, NULL);
+  pthread_mutex_unlock(&zygoteMutex);
+
+  if (child < 0) {
+    isLogging_err("%s: Could not start sub process: %s\n", id, strerror(errno));
+    exit(-1);
   }
+  p->processID = child;
 }
 
 
@@ -233,14 +806,14 @@ isProcessListType *isCreateProcessListItem(void *zctx, json_t *isAuth, int esaf,
     exit (-1);
   }
   
-  socket_option = 0;
+  socket_option = isQueueHwm();
   err = zmq_setsockopt(rtn->parent_dealer, ZMQ_RCVHWM, &socket_option, sizeof(socket_option));
   if (err == -1) {
     isLogging_err("%s: Could not set RCVWM for parent_dealer: %s\n", id, zmq_strerror(errno));
     exit (-1);
   }
 
-  socket_option = 0;
+  socket_option = isQueueHwm();
   err = zmq_setsockopt(rtn->parent_dealer, ZMQ_SNDHWM, &socket_option, sizeof(socket_option));
   if (err == -1) {
     isLogging_err("%s: Could not set SNDWM for parent_dealer: %s\n", id, zmq_strerror(errno));
@@ -258,97 +831,16 @@ isProcessListType *isCreateProcessListItem(void *zctx, json_t *isAuth, int esaf,
 
   rtn->next = firstProcessListItem;
   firstProcessListItem = rtn;
+  n_processes++;
 
-  isRemakeZMQPollItems(NULL, NULL, NULL);
+  // parent_dealer belongs to a forwarding thread from here on
+  isBrokerAdd(rtn);
 
   isStartProcess(rtn);
   return rtn;
 }
 
 
-/** Recreate (or initially create) the zmq pollitems we need in the main
- ** loop to service the zmq sockets on which we rely
- **
- ** @param parent_router ZMQ socket to handle communication with
- **                      is_proxy.  Set to NULL to leave parent_router
- **                      unchanged.
- **
- ** @param err_rep       ZMQ socket to handle the error response.  Set to
- **                      NULL to leave untouched.
- **
- ** @param err_dealer    ZMQ socket to receive error messages from the
- **                      supervisors.  Set to NULL to leave untouched.
- **
- ** @returns List of pollites suitable for zmq_poll.
- **
- ** @todo We should really return a structure that also includes the
- ** number of items in the poll list.  We currently do this in an
- ** adhoc way that was somewhat error prone.
- */
-zmq_pollitem_t *isRemakeZMQPollItems(void *parent_router, void *err_rep, void *err_dealer) {
-  static const char *id = FILEID "isRemakeZMQPollItems";
-  isProcessListType *plp;
-  void *saved_parent_router;
-  void *saved_err_dealer;
-  void *saved_err_rep;
-  int i;
-  
-  // Count the processes that appear to be running as indicated by a
-  // non-null parent_dealer element.  Upon closing a process the
-  // ProcessID will be non-zero while the parent_dealer should be
-  // null, at least until we've successfully "waited" for the child
-  // process to exit.
-  //
-  for (n_processes=0, plp=firstProcessListItem; plp != NULL; plp=plp->next) {
-    if (plp->parent_dealer != NULL) {
-      n_processes++;
-    }
-  }
-
-  saved_parent_router = NULL;
-  saved_err_rep       = NULL;
-  saved_err_dealer    = NULL;
-  if (isZMQPollItems != NULL) {
-    saved_parent_router = isZMQPollItems[0].socket;
-    saved_err_rep       = isZMQPollItems[1].socket;
-    saved_err_dealer    = isZMQPollItems[2].socket;
-    free (isZMQPollItems);
-  }
-
-  isZMQPollItems = calloc(3+n_processes, sizeof(*isZMQPollItems));
-  if (isZMQPollItems == NULL) {
-    isLogging_crit("%s: Out of memory\n", id);
-    exit (-1);
-  }
-
-  //
-  isZMQPollItems[0].socket = parent_router ? parent_router : saved_parent_router;
-  isZMQPollItems[0].events = ZMQ_POLLIN;
-
-  isZMQPollItems[1].socket = err_rep ? err_rep : saved_err_rep;
-  isZMQPollItems[1].events = ZMQ_POLLIN;
-
-  isZMQPollItems[2].socket = err_dealer ? err_dealer : saved_err_dealer;
-  isZMQPollItems[2].events = ZMQ_POLLIN;
-
-  for (i=3, plp=firstProcessListItem; plp != NULL; plp = plp->next) {
-    if (plp->parent_dealer != NULL) {
-      isZMQPollItems[i].socket = plp->parent_dealer;
-      isZMQPollItems[i].events = ZMQ_POLLIN;
-      i++;
-    }
-  }
-  return isZMQPollItems;
-}
-
-/** get the zmq poll items list
- **
- ** @returns Current list of poll items.
- */
-zmq_pollitem_t *isGetZMQPollItems() {
-  return isZMQPollItems;
-}
-
 /** number of processes
  **
  ** @returns Number of running processes
@@ -365,7 +857,6 @@ int isNProcesses() {
 void isDestroyProcessListItem(isProcessListType *p) {
   static const char *id = "isDestroyProcessListItem";
   isProcessListType *plp, *last;
-  int err;
 
   last = NULL;
 
@@ -382,18 +873,17 @@ void isDestroyProcessListItem(isProcessListType *p) {
     return;
   }
 
-  err = zmq_close(p->parent_dealer);
-  if (err == -1) {
-    isLogging_err("%s: Could not close parent_dealer for %s: %s\n", id, p->key, zmq_strerror(errno));
-  }
+  isBrokerRemove(p);
 
-  p->parent_dealer = NULL;
-  last->next = p->next;
+  n_processes--;
+  if (last == NULL) {
+    firstProcessListItem = p->next;
+  } else {
+    last->next = p->next;
+  }
   json_decref(p->isAuth);
   free((char *)p->key);
   free(p);
-
-  isRemakeZMQPollItems(NULL, NULL, NULL);
 }
 
 /**  Recreate the hash table from the process linked list.  We check
@@ -411,6 +901,7 @@ void remakeProcessList(redisContext *rc) {
   ENTRY *rtn_value;
   int err;
   isProcessListType *plp;
+  isProcessListType *next_plp;
   int n_entries;
   const char *pid;
   redisReply *reply;
@@ -418,17 +909,26 @@ void remakeProcessList(redisContext *rc) {
   
   //isLogging_info("%s: starting remake\n", id);
 
-  hdestroy_r(&process_table);
-  for (n_entries = 0, plp = firstProcessListItem; plp != NULL; plp = plp->next) {
+  //
+  // Ask about all the pids at once
+  //
+  for (plp = firstProcessListItem; plp != NULL; plp = plp->next) {
     pid = json_string_value(json_object_get(plp->isAuth, "pid"));
     if (pid == NULL) {
       isLogging_err("%s: Failed to find pid in process list\n", id);
       exit (-1);
     }
+    redisAppendCommand(rc, "EXISTS %s", pid);
+  }
+
+  hdestroy_r(&process_table);
+  for (n_entries = 0, plp = firstProcessListItem; plp != NULL; plp = next_plp) {
+    next_plp = plp->next;
+
     // See if the pid still exists
     //
-    reply = redisCommand(rc, "EXISTS %s", pid);
-    if (reply == NULL) {
+    reply = NULL;
+    if (redisGetReply(rc, (void **)&reply) != REDIS_OK || reply == NULL) {
       isLogging_err("%s: Redis error: %s\n", id, rc->errstr);
       exit (-1);
     }
@@ -451,14 +951,11 @@ void remakeProcessList(redisContext *rc) {
     // sigterm hasn't done the trick.
     //
 
+    // The fork server, its parent, reaps it
+    //
     err = kill(plp->processID, SIGTERM);
     if (err == -1) {
       isLogging_err("%s: Failed to kill process %d: %s\n", id, plp->processID, strerror(errno));
-    } else {
-      err = waitpid(plp->processID, NULL, WNOHANG);
-      if (err == -1) {
-        isLogging_err("%s: Failed to wait for process %d: %s\n", id, plp->processID, strerror(errno));
-      }
     }
 
     // Go ahead and destroy this process;
@@ -486,7 +983,6 @@ void remakeProcessList(redisContext *rc) {
       exit (-1);
     }
   }
-  isRemakeZMQPollItems(NULL, NULL, NULL);
 }
 
 
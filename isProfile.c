@@ -0,0 +1,733 @@
+/*! @file isProfile.c
+ *  @copyright 2018 by Northwestern University
+ *  @author Keith Brister
+ *  @brief Radial (azimuthally integrated) intensity profiles
+ *
+ *  A frame is integrated into equal steps of 1/d from the beam
+ *  center out to the farthest corner of the detector.  Which pixels
+ *  go into which bin depends only on the geometry and the pixel mask
+ *  so that is worked out once and kept in the buffer cache as a map:
+ *  for each bin, the list of (unmasked) pixels in it.  Each frame of
+ *  the dataset is then integrated by walking the map, bins split
+ *  among our threads, gathering 8 pixels at a time when we can.
+ */
+#include "is.h"
+
+/** Pixels in each resolution bin.  One malloc'ed block: this header,
+ ** the bin offsets, and then the pixel indices.
+ */
+typedef struct isProfileMapStruct {
+  int nbins;                    //!< number of resolution bins
+  int npixels;                  //!< number of unmasked pixels in the map
+  double q_max;                 //!< 1/d at the outer edge of the last bin (1/Å)
+  int32_t *offset;              //!< pixels in bin b are index[offset[b]] to index[offset[b+1]-1]
+  int32_t *index;               //!< pixel numbers, by bin and increasing within each bin
+} isProfileMapType;
+
+/** One bin of a profile as kept in the buffer cache
+ */
+typedef struct isProfileBinStruct {
+  double q;                     //!< 1/d at the center of the bin (1/Å)
+  double mean;                  //!< mean pixel value
+  int npix;                     //!< number of pixels that contributed
+} isProfileBinType;
+
+/** What each thread works on: rows when building a map, bins when integrating
+ */
+typedef struct isProfileTaskStruct {
+  const isImageBufType *raw;    //!< the frame
+  const isProfileMapType *map;  //!< the map we are integrating with
+  int row0;                     //!< first row (map building)
+  int row1;                     //!< one past the last row (map building)
+  int32_t *pixbin;              //!< bin for each pixel, -1 for masked (map building)
+  double cx;                    //!< beam center column
+  double cy;                    //!< beam center row
+  double x_pixel_size;          //!< m
+  double y_pixel_size;          //!< m
+  double distance;              //!< detector distance in m
+  double wavelength;            //!< Å
+  double bin_scale;             //!< bins per 1/Å
+  int nbins;                    //!< number of resolution bins
+  int bin0;                     //!< first bin (integrating)
+  int bin1;                     //!< one past the last bin (integrating)
+  uint64_t *sum;                //!< sum of the pixels in each bin
+  int *npix;                    //!< number of valid pixels in each bin
+} isProfileTaskType;
+
+/** 1/d for a point on the detector
+ **
+ ** @param tp   geometry
+ **
+ ** @param col  column (need not be on the detector)
+ **
+ ** @param row  row (need not be on the detector)
+ **
+ ** @returns 1/d in 1/Å
+ */
+static double isProfileQ(const isProfileTaskType *tp, double col, double row) {
+  double dx, dy;
+  double two_theta;
+
+  dx = (col - tp->cx) * tp->x_pixel_size;
+  dy = (row - tp->cy) * tp->y_pixel_size;
+  two_theta = atan2(sqrt(dx * dx + dy * dy), tp->distance);
+  return 2.0 * sin(two_theta / 2.0) / tp->wavelength;
+}
+
+/** Find the bin for each pixel in our rows
+ **
+ ** @param voidp  our isProfileTaskType
+ */
+static void *isProfileMapRows(void *voidp) {
+  isProfileTaskType *tp;
+  const uint32_t *mask;
+  int width;
+  int row, col;
+  int i;
+  int b;
+
+  tp    = voidp;
+  mask  = tp->raw->bad_pixel_map;
+  width = tp->raw->buf_width;
+
+  for (row=tp->row0; row<tp->row1; row++) {
+    for (col=0; col<width; col++) {
+      i = row * width + col;
+      if (mask && mask[i]) {
+        tp->pixbin[i] = -1;
+        continue;
+      }
+      b = isProfileQ(tp, col, row) * tp->bin_scale;
+      tp->pixbin[i] = b >= tp->nbins ? tp->nbins - 1 : b;
+    }
+  }
+  return NULL;
+}
+
+#ifdef IS_AVX2
+/** The AVX2 part of isProfileSum32: 8 pixels at a time
+ **
+ ** @param[out] sum  sum of the valid pixels done
+ **
+ ** @param[out] bad  number of invalid pixels done
+ **
+ ** @returns Number of pixels done.  The caller does the rest.
+ */
+__attribute__((target("avx2")))
+static int isProfileSum32Avx2(const uint32_t *buf, const int32_t *index, int n, uint64_t *sum, int *bad) {
+  const __m256i ones = _mm256_set1_epi32(-1);
+  __m256i acc;
+  __m256i ix, pix, inv;
+  uint64_t lanes[4];
+  int i;
+
+  acc = _mm256_setzero_si256();
+  for (i=0; i + 8 <= n; i += 8) {
+    ix    = _mm256_loadu_si256((const __m256i *)(index + i));
+    pix   = _mm256_i32gather_epi32((const int *)buf, ix, 4);
+    inv   = _mm256_cmpeq_epi32(pix, ones);
+    *bad += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(inv)));
+    pix   = _mm256_andnot_si256(inv, pix);
+    acc   = _mm256_add_epi64(acc, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(pix)));
+    acc   = _mm256_add_epi64(acc, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(pix, 1)));
+  }
+  _mm256_storeu_si256((__m256i *)lanes, acc);
+  *sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  return i;
+}
+
+/** The AVX2 part of isProfileSum16: 8 pixels at a time
+ **
+ ** It gathers the aligned 32 bit word holding each pixel.  The pixel
+ ** numbers in a bin increase so only the last one can be the last
+ ** pixel of the image, the one whose word might run past the end of
+ ** the buffer: that one is always left to the caller.
+ **
+ ** @param[out] sum  sum of the valid pixels done
+ **
+ ** @param[out] bad  number of invalid pixels done
+ **
+ ** @returns Number of pixels done.  The caller does the rest.
+ */
+__attribute__((target("avx2")))
+static int isProfileSum16Avx2(const uint16_t *buf, const int32_t *index, int n, uint64_t *sum, int *bad) {
+  const __m256i low   = _mm256_set1_epi32(0xffff);
+  const __m256i one   = _mm256_set1_epi32(1);
+  __m256i acc;
+  __m256i ix, word, pix, inv;
+  uint64_t lanes[4];
+  int i;
+
+  acc = _mm256_setzero_si256();
+  for (i=0; i + 8 < n; i += 8) {
+    ix    = _mm256_loadu_si256((const __m256i *)(index + i));
+    word  = _mm256_i32gather_epi32((const int *)buf, _mm256_srli_epi32(ix, 1), 4);
+    pix   = _mm256_and_si256(_mm256_srlv_epi32(word, _mm256_slli_epi32(_mm256_and_si256(ix, one), 4)), low);
+    inv   = _mm256_cmpeq_epi32(pix, low);
+    *bad += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(inv)));
+    pix   = _mm256_andnot_si256(inv, pix);
+    acc   = _mm256_add_epi64(acc, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(pix)));
+    acc   = _mm256_add_epi64(acc, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(pix, 1)));
+  }
+  _mm256_storeu_si256((__m256i *)lanes, acc);
+  *sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  return i;
+}
+#endif
+
+/** Sum the valid pixels of a 32 bit image in a list
+ **
+ ** @param[in]  buf    the image
+ **
+ ** @param[in]  index  pixel numbers
+ **
+ ** @param[in]  n      length of index
+ **
+ ** @param[out] nvalid number of pixels that are not 0xffffffff
+ **
+ ** @returns the sum of the valid pixels
+ */
+static uint64_t isProfileSum32(const uint32_t *buf, const int32_t *index, int n, int *nvalid) {
+  uint64_t sum;
+  uint32_t v;
+  int bad;
+  int i;
+
+  sum = 0;
+  bad = 0;
+  i   = 0;
+
+#ifdef IS_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    i = isProfileSum32Avx2(buf, index, n, &sum, &bad);
+  }
+#endif
+
+  for (; i<n; i++) {
+    v = buf[index[i]];
+    if (v == 0xffffffff) {
+      bad++;
+      continue;
+    }
+    sum += v;
+  }
+
+  *nvalid = n - bad;
+  return sum;
+}
+
+/** Sum the valid pixels of a 16 bit image in a list
+ **
+ ** @param[in]  buf    the image
+ **
+ ** @param[in]  index  pixel numbers, increasing
+ **
+ ** @param[in]  n      length of index
+ **
+ ** @param[out] nvalid number of pixels that are not 0xffff
+ **
+ ** @returns the sum of the valid pixels
+ */
+static uint64_t isProfileSum16(const uint16_t *buf, const int32_t *index, int n, int *nvalid) {
+  uint64_t sum;
+  uint16_t v;
+  int bad;
+  int i;
+
+  sum = 0;
+  bad = 0;
+  i   = 0;
+
+#ifdef IS_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    i = isProfileSum16Avx2(buf, index, n, &sum, &bad);
+  }
+#endif
+
+  for (; i<n; i++) {
+    v = buf[index[i]];
+    if (v == 0xffff) {
+      bad++;
+      continue;
+    }
+    sum += v;
+  }
+
+  *nvalid = n - bad;
+  return sum;
+}
+
+/** Integrate our bins
+ **
+ ** @param voidp  our isProfileTaskType
+ */
+static void *isProfileBins(void *voidp) {
+  isProfileTaskType *tp;
+  const isProfileMapType *map;
+  int b;
+
+  tp  = voidp;
+  map = tp->map;
+
+  for (b=tp->bin0; b<tp->bin1; b++) {
+    if (tp->raw->buf_depth == 2) {
+      tp->sum[b] = isProfileSum16(tp->raw->buf, map->index + map->offset[b], map->offset[b+1] - map->offset[b], &tp->npix[b]);
+    } else {
+      tp->sum[b] = isProfileSum32(tp->raw->buf, map->index + map->offset[b], map->offset[b+1] - map->offset[b], &tp->npix[b]);
+    }
+  }
+  return NULL;
+}
+
+/** Run our threads
+ **
+ ** @param tasks   one per thread
+ **
+ ** @param ntasks  number of threads
+ **
+ ** @param fn      what the threads do
+ */
+static void isProfileRunTasks(isProfileTaskType *tasks, int ntasks, void *(*fn)(void *)) {
+  static const char *id = FILEID "isProfileRunTasks";
+  pthread_t threads[IS_PROFILE_THREADS];
+  int i;
+  int err;
+
+  for (i=1; i<ntasks; i++) {
+    err = pthread_create(&threads[i], NULL, fn, &tasks[i]);
+    if (err != 0) {
+      isLogging_err("%s: Could not start thread: %s\n", id, strerror(err));
+      exit (-1);
+    }
+  }
+  fn(&tasks[0]);
+  for (i=1; i<ntasks; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+/** Build the pixel to bin map for a geometry
+ **
+ ** @param geom   task with the raw image and geometry filled in
+ **
+ ** @param nbins  number of resolution bins
+ **
+ ** @param sizep  returns the size of the map in bytes
+ **
+ ** @returns malloc'ed map
+ */
+static isProfileMapType *isProfileMapBuild(isProfileTaskType *geom, int nbins, int *sizep) {
+  static const char *id = FILEID "isProfileMapBuild";
+  isProfileTaskType tasks[IS_PROFILE_THREADS];
+  isProfileMapType *map;
+  int32_t *pixbin;
+  int32_t *next;
+  int width, height;
+  int npixels;
+  int ntasks;
+  int size;
+  double q;
+  int i, b;
+
+  width   = geom->raw->buf_width;
+  height  = geom->raw->buf_height;
+
+  pixbin = malloc((size_t)width * height * sizeof(*pixbin));
+  next   = calloc(nbins + 1, sizeof(*next));
+  if (pixbin == NULL || next == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  //
+  // The bins run out to the farthest corner
+  //
+  geom->nbins = nbins;
+  q = 0.0;
+  for (i=0; i<4; i++) {
+    double qc = isProfileQ(geom, i & 1 ? width : 0, i & 2 ? height : 0);
+    q = qc > q ? qc : q;
+  }
+  geom->bin_scale = q > 0.0 ? nbins / q : 0.0;
+
+  //
+  // Bin each pixel, a band of rows per thread
+  //
+  ntasks = height < IS_PROFILE_THREADS ? 1 : IS_PROFILE_THREADS;
+  for (i=0; i<ntasks; i++) {
+    tasks[i]        = *geom;
+    tasks[i].pixbin = pixbin;
+    tasks[i].row0   = (int64_t)height * i / ntasks;
+    tasks[i].row1   = (int64_t)height * (i + 1) / ntasks;
+  }
+  isProfileRunTasks(tasks, ntasks, isProfileMapRows);
+
+  //
+  // Counting sort keeps the pixels in each bin in increasing order
+  // (isProfileSum16 counts on that)
+  //
+  npixels = 0;
+  for (i=0; i<width*height; i++) {
+    if (pixbin[i] >= 0) {
+      next[pixbin[i] + 1]++;
+      npixels++;
+    }
+  }
+
+  size = sizeof(*map) + (nbins + 1) * sizeof(int32_t) + npixels * sizeof(int32_t);
+  map  = malloc(size);
+  if (map == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  map->nbins   = nbins;
+  map->npixels = npixels;
+  map->q_max   = q;
+  map->offset  = (int32_t *)(map + 1);
+  map->index   = map->offset + nbins + 1;
+
+  for (b=0; b<nbins; b++) {
+    next[b+1] += next[b];
+  }
+  memcpy(map->offset, next, (nbins + 1) * sizeof(int32_t));
+
+  for (i=0; i<width*height; i++) {
+    if (pixbin[i] >= 0) {
+      map->index[next[pixbin[i]]++] = i;
+    }
+  }
+
+  free(next);
+  free(pixbin);
+
+  isLogging_info("%s: %d bins, %d of %d pixels, 1/d to %f\n", id, nbins, npixels, width*height, q);
+
+  *sizep = size;
+  return map;
+}
+
+/** Get the read locked map for a frame's geometry and mask, building it if need be
+ **
+ ** The map is the same for every frame of a dataset so it lives in
+ ** the buffer cache under a key made of the geometry.  The pixel mask
+ ** comes with the file so when there is one the file name is part of
+ ** the key as well.
+ **
+ ** @param wctx   Worker context
+ **
+ ** @param geom   task with the raw image and geometry filled in
+ **
+ ** @param fn     file the frame came from
+ **
+ ** @param nbins  number of resolution bins
+ **
+ ** @returns read locked buffer with the map in buf
+ */
+static isImageBufType *isProfileGetMap(isWorkerContext_t *wctx, isProfileTaskType *geom, const char *fn, int nbins) {
+  static const char *id = FILEID "isProfileGetMap";
+  isImageBufType *mapb;
+  char *key;
+  int size;
+
+  if (asprintf(&key, "%d:profile-map-%s-%dx%d-%d-%0.3f-%0.3f-%0.6f-%0.9f-%0.9f-%0.6f",
+               getegid(), geom->raw->bad_pixel_map ? fn : "",
+               geom->raw->buf_width, geom->raw->buf_height, nbins,
+               geom->cx, geom->cy, geom->distance, geom->x_pixel_size, geom->y_pixel_size, geom->wavelength) == -1) {
+    isLogging_crit("%s: Out of memory (key)\n", id);
+    exit (-1);
+  }
+
+  mapb = isGetImageBufFromKey(wctx, key);
+  free(key);
+
+  if (mapb->buf == NULL) {
+    //
+    // New buffer: we hold its write lock.  Fill it and trade for a
+    // read lock.
+    //
+    mapb->buf        = isProfileMapBuild(geom, nbins, &size);
+    mapb->buf_size   = size;
+    mapb->buf_width  = nbins;
+    mapb->buf_height = 1;
+    mapb->buf_depth  = 1;
+
+    pthread_rwlock_unlock(&mapb->buflock);
+    pthread_rwlock_rdlock(&mapb->buflock);
+  }
+  return mapb;
+}
+
+/** Integrate a frame
+ **
+ ** @param wctx   Worker context
+ **
+ ** @param raw    read locked frame
+ **
+ ** @param fn     file the frame came from
+ **
+ ** @param nbins  number of resolution bins
+ **
+ ** @param errp   returns a static explanation when we can't do it
+ **
+ ** @returns malloc'ed array of nbins profile bins or NULL if the geometry is missing
+ */
+static isProfileBinType *isProfileFrame(isWorkerContext_t *wctx, isImageBufType *raw, const char *fn, int nbins, const char **errp) {
+  static const char *id = FILEID "isProfileFrame";
+  isProfileTaskType geom;
+  isProfileTaskType tasks[IS_PROFILE_THREADS];
+  isImageBufType *mapb;
+  isProfileMapType *map;
+  isProfileBinType *rtn;
+  uint64_t *sum;
+  int *npix;
+  json_t *v;
+  int ntasks;
+  int target;
+  int i, b;
+
+  (void)id;
+
+  memset(&geom, 0, sizeof(geom));
+  geom.raw = raw;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  v = json_object_get(raw->meta, "beam_center_x");     geom.cx           = json_is_number(v) ? json_number_value(v) : -1.0;
+  v = json_object_get(raw->meta, "beam_center_y");     geom.cy           = json_is_number(v) ? json_number_value(v) : -1.0;
+  v = json_object_get(raw->meta, "detector_distance"); geom.distance     = json_is_number(v) ? json_number_value(v) : 0.0;
+  v = json_object_get(raw->meta, "x_pixel_size");      geom.x_pixel_size = json_is_number(v) ? json_number_value(v) : 0.0;
+  v = json_object_get(raw->meta, "y_pixel_size");      geom.y_pixel_size = json_is_number(v) ? json_number_value(v) : 0.0;
+  v = json_object_get(raw->meta, "wavelength");        geom.wavelength   = json_is_number(v) ? json_number_value(v) : 0.0;
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  if (geom.y_pixel_size <= 0.0) {
+    geom.y_pixel_size = geom.x_pixel_size;
+  }
+
+  if (geom.distance <= 0.0 || geom.x_pixel_size <= 0.0 || geom.wavelength <= 0.0 || raw->buf == NULL ||
+      (raw->buf_depth != 2 && raw->buf_depth != 4)) {
+    *errp = "needs an image with wavelength, detector_distance, and x_pixel_size";
+    return NULL;
+  }
+
+  mapb = isProfileGetMap(wctx, &geom, fn, nbins);
+  map  = mapb->buf;
+
+  sum  = calloc(nbins, sizeof(*sum));
+  npix = calloc(nbins, sizeof(*npix));
+  rtn  = calloc(nbins, sizeof(*rtn));
+  if (sum == NULL || npix == NULL || rtn == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  //
+  // Give each thread a run of bins with about the same number of pixels
+  //
+  ntasks = nbins < IS_PROFILE_THREADS ? 1 : IS_PROFILE_THREADS;
+  b = 0;
+  for (i=0; i<ntasks; i++) {
+    tasks[i]      = geom;
+    tasks[i].map  = map;
+    tasks[i].sum  = sum;
+    tasks[i].npix = npix;
+    tasks[i].bin0 = b;
+    target = (int64_t)map->npixels * (i + 1) / ntasks;
+    while (b < nbins && (i == ntasks - 1 || map->offset[b+1] <= target)) {
+      b++;
+    }
+    tasks[i].bin1 = b;
+  }
+  isProfileRunTasks(tasks, ntasks, isProfileBins);
+
+  for (b=0; b<nbins; b++) {
+    rtn[b].q    = (b + 0.5) * map->q_max / nbins;
+    rtn[b].npix = npix[b];
+    rtn[b].mean = npix[b] > 0 ? (double)sum[b] / npix[b] : 0.0;
+  }
+
+  free(sum);
+  free(npix);
+
+  pthread_rwlock_unlock(&mapb->buflock);
+  pthread_mutex_lock(&wctx->ctxMutex);
+  mapb->in_use--;
+  assert(mapb->in_use >= 0);
+  pthread_mutex_unlock(&wctx->ctxMutex);
+
+  return rtn;
+}
+
+/** Radial profile of a frame: mean intensity in equal steps of 1/d.
+ **
+ ** The reply is the frame's meta data with the profile added as
+ ** profile_list, one [d, q, mean, pixels] row per bin where q = 1/d
+ ** at the center of the bin.  Profiles are kept in the buffer cache.
+ **
+ ** @param wctx Worker context
+ **  @li @c wctx->metaMutex  Keeps jansson calls in line
+ **  @li @c wctx->ctxMutex   Keeps our buffer cache in line
+ **
+ ** @param tcp Thread data
+ **   @li @c tcp->rep  ZMQ Response socket into which to throw our response.
+ **
+ ** @param job   What the user asked us to do
+ **   @li @c fn      file name
+ **   @li @c frame   frame number
+ **   @li @c bins    number of resolution bins (default IS_PROFILE_BINS)
+ */
+void isProfile(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
+  static const char *id = FILEID "isProfile";
+  const char *fn;               // file name from job
+  int frame;                    // frame number from job
+  int nbins;                    // number of resolution bins
+  char *key;                    // buffer cache key for our profile
+  isImageBufType *imb;          // our cached profile
+  isImageBufType *raw;          // the frame
+  isProfileBinType *bins;       // the profile
+  const char *why;              // why we could not integrate the frame
+  int cached;                   // 1 if imb holds our profile
+  json_t *meta;                 // what we send back
+  json_t *list;                 // the profile list
+  int i;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  fn    = json_string_value(json_object_get(job, "fn"));
+  frame = json_integer_value(json_object_get(job, "frame"));
+
+  nbins = IS_PROFILE_BINS;
+  if (json_is_integer(json_object_get(job, "bins"))) {
+    nbins = json_integer_value(json_object_get(job, "bins"));
+  }
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  if (fn == NULL || strlen(fn) == 0) {
+    char *tmps;
+
+    pthread_mutex_lock(&wctx->metaMutex);
+    tmps = json_dumps(job, JSON_SORT_KEYS | JSON_COMPACT | JSON_INDENT(0));
+    pthread_mutex_unlock(&wctx->metaMutex);
+
+    isLogging_err("%s: missing filename for job %s\n", id, tmps);
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Missing filename for job %s", id, tmps);
+    free(tmps);
+
+    return;
+  }
+
+  frame = frame <= 0 ? 1 : frame;
+  nbins = nbins < 1 ? 1 : (nbins > IS_PROFILE_MAX_BINS ? IS_PROFILE_MAX_BINS : nbins);
+
+  if (asprintf(&key, "%d:%s-%d-profile-%d", getegid(), fn, frame, nbins) == -1) {
+    isLogging_crit("%s: Out of memory (key)\n", id);
+    exit (-1);
+  }
+
+  //
+  // Buffer is read locked if it exists, write locked if it does not.
+  // As with isFindSpots a negative depth marks a buffer we could not
+  // fill: integrate again without caching the result.
+  //
+  imb = isGetImageBufFromKey(wctx, key);
+  free(key);
+
+  meta   = NULL;
+  bins   = NULL;
+  cached = imb->buf != NULL;
+  if (!cached) {
+    raw = isGetRawImageBuf(wctx, job);
+    why = "missing data";
+    if (raw != NULL) {
+      bins = isProfileFrame(wctx, raw, fn, nbins, &why);
+      if (bins != NULL) {
+        pthread_mutex_lock(&wctx->metaMutex);
+        meta = json_copy(raw->meta);
+        set_json_object_integer(id, meta, "frame", frame);
+        set_json_object_integer(id, meta, "profile_bins", nbins);
+        pthread_mutex_unlock(&wctx->metaMutex);
+      }
+
+      pthread_rwlock_unlock(&raw->buflock);
+      pthread_mutex_lock(&wctx->ctxMutex);
+      raw->in_use--;
+      assert(raw->in_use >= 0);
+      pthread_mutex_unlock(&wctx->ctxMutex);
+    }
+
+    if (bins == NULL) {
+      if (imb->buf_depth == 0) {
+        imb->buf_depth = -1;
+      }
+      pthread_rwlock_unlock(&imb->buflock);
+      pthread_mutex_lock(&wctx->ctxMutex);
+      imb->in_use--;
+      assert(imb->in_use >= 0);
+      pthread_mutex_unlock(&wctx->ctxMutex);
+
+      isLogging_err("%s: %s for %s frame %d\n", id, why, fn, frame);
+      is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Radial profile %s for %s frame %d", id, why, fn, frame);
+      return;
+    }
+
+    if (imb->buf_depth == 0) {
+      //
+      // We created imb and hold its write lock: fill it and trade
+      // for a read lock.
+      //
+      imb->meta       = meta;
+      imb->buf        = bins;
+      imb->buf_size   = nbins * sizeof(*bins);
+      imb->buf_width  = nbins;
+      imb->buf_height = 1;
+      imb->buf_depth  = sizeof(*bins);
+      imb->frame      = frame;
+      cached = 1;
+
+      pthread_rwlock_unlock(&imb->buflock);
+      pthread_rwlock_rdlock(&imb->buflock);
+    }
+  }
+
+  if (cached) {
+    bins  = imb->buf;
+    nbins = imb->buf_width;
+    pthread_mutex_lock(&wctx->metaMutex);
+    meta = json_copy(imb->meta);
+    pthread_mutex_unlock(&wctx->metaMutex);
+  }
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  list = json_array();
+  if (meta == NULL || list == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  for (i=0; i<nbins; i++) {
+    json_array_append_new(list, json_pack("[f,f,f,i]",
+                                          round(1000.0 / bins[i].q) / 1000.0,
+                                          bins[i].q,
+                                          round(bins[i].mean * 100.0) / 100.0,
+                                          bins[i].npix));
+  }
+  json_object_set_new(meta, "profile_list", list);
+  json_object_set_new(meta, "profile_list_columns", json_pack("[s,s,s,s]", "d", "q", "mean", "pixels"));
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  isSpotsReply(wctx, tcp, job, meta);
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  json_decref(meta);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  if (!cached) {
+    free(bins);
+  }
+
+  pthread_rwlock_unlock(&imb->buflock);
+
+  pthread_mutex_lock(&wctx->ctxMutex);
+  imb->in_use--;
+
+  assert(imb->in_use >= 0);
+
+  pthread_mutex_unlock(&wctx->ctxMutex);
+}
@@ -5,9 +5,183 @@
  */
 #include "is.h"
 
-/**
+//
+// Resolution ranges (Å) of the strong hexagonal ice rings, the same
+// ranges XDS suggests for EXCLUDE_RESOLUTION_RANGE.
+//
+static const ice_ring_t ice_rings[] = {
+  { 3.930, 3.870},      // 3.897
+  { 3.700, 3.640},      // 3.669
+  { 3.470, 3.410},      // 3.441
+  { 2.700, 2.640},      // 2.671
+  { 2.280, 2.220},      // 2.249
+  { 2.102, 2.042},      // 2.072
+  { 1.978, 1.918},      // 1.948
+  { 1.948, 1.888},      // 1.918
+  { 1.913, 1.853},      // 1.883
+  { 1.751, 1.691}       // 1.721
+};
+
+/** Optional number from our meta data
  **
+ ** @param meta   Image meta data
  **
+ ** @param key    Name of the value we'd like
+ **
+ ** @returns the value or 0 if it is missing or not a number
+ */
+static double optional_meta_double(json_t *meta, const char *key) {
+  json_t *v;
+
+  v = json_object_get(meta, key);
+  return json_is_number(v) ? json_number_value(v) : 0.0;
+}
+
+/** Squared distance, in output image pixels, from the beam center to
+ ** a given d-spacing.
+ **
+ ** @param d           d-spacing in Å
+ **
+ ** @param wavelength  in Å
+ **
+ ** @param distance    detector distance in m
+ **
+ ** @param pixel_size  output image pixel size in m
+ **
+ ** @returns distance^2 or -1 if the d-spacing is out of reach
+ */
+static double ice_ring_dist2(double d, double wavelength, double distance, double pixel_size) {
+  double s;
+  double two_theta;
+  double r;
+
+  s = wavelength / (2.0 * d);
+  if (s >= 1.0) {
+    return -1.0;
+  }
+
+  two_theta = 2.0 * asin(s);
+  if (two_theta >= M_PI/2.0) {
+    return -1.0;
+  }
+
+  r = distance * tan(two_theta) / pixel_size;
+  return r * r;
+}
+
+/** Put the ice rings that fall on the output image into the bins'
+ ** ice ring lists and fill in the bin lookup table.
+ **
+ ** get_bin_number finds a pixel's bin by looking up its squared
+ ** distance in dst->bin_lut.  Cells wholly inside a ring hold
+ ** IS_OUTPUT_IMAGE_BINS, cells that are partly inside a ring hold
+ ** IS_BIN_LUT_MIXED so only those pixels walk the bin's ice ring list.
+ **
+ ** @param src        Full sized source image (for its meta data)
+ **
+ ** @param dst        Reduced image with bins, beam center, and distance range set
+ **
+ ** @param box_w      Source pixels per output pixel horizontally
+ */
+static void set_up_ice_rings(isImageBufType *src, isImageBufType *dst, double box_w) {
+  static const char *id = FILEID "set_up_ice_rings";
+  double wavelength;
+  double distance;
+  double pixel_size;
+  double dist2_low;
+  double dist2_high;
+  double cell_width;
+  double cell_low;
+  double cell_high;
+  ice_ring_list_t *irp;
+  int n_nodes;
+  int cells_per_bin;
+  int i;
+  int j;
+  int on_image;
+  uint8_t entry;
+
+  dst->n_ice_rings = 0;
+  cells_per_bin    = IS_BIN_LUT_SIZE / IS_OUTPUT_IMAGE_BINS;
+  for (i=0; i<IS_BIN_LUT_SIZE; i++) {
+    dst->bin_lut[i] = i / cells_per_bin;
+  }
+
+  wavelength = optional_meta_double(src->meta, "wavelength");
+  distance   = optional_meta_double(src->meta, "detector_distance");
+  pixel_size = optional_meta_double(src->meta, "x_pixel_size") * box_w;
+
+  if (wavelength <= 0.0 || distance <= 0.0 || pixel_size <= 0.0) {
+    isLogging_info("%s: no ice ring detection without wavelength, detector_distance, and x_pixel_size\n", id);
+    return;
+  }
+
+  n_nodes = 0;
+  for (i=0; i<(int)(sizeof(ice_rings)/sizeof(ice_rings[0])); i++) {
+    dist2_low  = ice_ring_dist2(ice_rings[i].high, wavelength, distance, pixel_size);
+    dist2_high = ice_ring_dist2(ice_rings[i].low,  wavelength, distance, pixel_size);
+    if (dist2_low < 0.0 || dist2_high < 0.0) {
+      continue;
+    }
+    if (dist2_high < dst->min_dist2 || dist2_low > dst->max_dist2) {
+      continue;
+    }
+
+    on_image = 0;
+    for (j=0; j<IS_OUTPUT_IMAGE_BINS; j++) {
+      if (dist2_high < dst->bins[j].dist2_low || dist2_low > dst->bins[j].dist2_high) {
+        continue;
+      }
+      if (n_nodes >= IS_ICE_RING_NODES) {
+        isLogging_err("%s: out of ice ring list entries\n", id);
+        break;
+      }
+      irp = &(dst->ice_ring_nodes[n_nodes++]);
+      irp->dist2_low  = dist2_low;
+      irp->dist2_high = dist2_high;
+      irp->next = dst->bins[j].ice_ring_list;
+      dst->bins[j].ice_ring_list = irp;
+      on_image = 1;
+    }
+    dst->n_ice_rings += on_image;
+  }
+
+  if (n_nodes == 0) {
+    return;
+  }
+
+  cell_width = (dst->max_dist2 - dst->min_dist2) / IS_BIN_LUT_SIZE;
+  for (i=0; i<IS_BIN_LUT_SIZE; i++) {
+    cell_low  = dst->min_dist2 + i * cell_width;
+    cell_high = cell_low + cell_width;
+    entry     = dst->bin_lut[i];
+    for (irp=dst->bins[i / cells_per_bin].ice_ring_list; irp != NULL; irp = irp->next) {
+      if (irp->dist2_low <= cell_low && irp->dist2_high >= cell_high) {
+        entry = IS_OUTPUT_IMAGE_BINS;
+        break;
+      }
+      if (irp->dist2_low <= cell_high && irp->dist2_high >= cell_low) {
+        entry = IS_BIN_LUT_MIXED;
+      }
+    }
+    dst->bin_lut[i] = entry;
+  }
+}
+
+/** Set up the radial bins used for the image statistics and spot
+ ** counts along with the ice rings that fall on the output image.
+ **
+ ** @param src        Full sized source image
+ **
+ ** @param dst        Reduced image
+ **
+ ** @param winWidth   Width of the portion of the source mapped to dst
+ **
+ ** @param winHeight  Height of the portion of the source mapped to dst
+ **
+ ** @param x          Left edge on source image
+ **
+ ** @param y          Top of source image
  */
 void set_up_bins(isImageBufType *src, isImageBufType *dst, double winWidth, double winHeight, int x, int y) {
   static const char *id = FILEID "set_up_bins";
@@ -49,6 +223,8 @@ void set_up_bins(isImageBufType *src, isImageBufType *dst, double winWidth, doub
 
   dst->beam_center_x = dst_center_x;
   dst->beam_center_y = dst_center_y;
+  dst->box_w         = box_w;
+  dst->box_h         = box_h;
 
   //
   // Find the range of distances on the destination images.  First
@@ -116,25 +292,46 @@ void set_up_bins(isImageBufType *src, isImageBufType *dst, double winWidth, doub
     bp->sum     = 0.0;
     bp->sum2    = 0.0;
   }
+
+  memset(dst->histogram, 0, sizeof(dst->histogram));
+
+  set_up_ice_rings(src, dst, box_w);
 }
 
+/** Find the bin a pixel of the output image belongs to.
+ **
+ ** @param dst   Output image set up by set_up_bins
+ **
+ ** @param col   Pixel column
+ **
+ ** @param row   Pixel row
+ **
+ ** @returns radial bin number or IS_OUTPUT_IMAGE_BINS for a pixel in an ice ring
+ */
 int get_bin_number( isImageBufType *dst, int col, int row) {
   ice_ring_list_t *irp;
   int rtn;
+  int cell;
   double dist2;
 
   dist2 = ( col - dst->beam_center_x) * (col - dst->beam_center_x) + (row - dst->beam_center_y) * (row - dst->beam_center_y);
   
-  rtn = (double)(IS_OUTPUT_IMAGE_BINS) / (dst->max_dist2 - dst->min_dist2) * (dist2 - dst->min_dist2);
+  cell = (double)(IS_BIN_LUT_SIZE) / (dst->max_dist2 - dst->min_dist2) * (dist2 - dst->min_dist2);
   
-  if (rtn < 0) {
-    rtn = 0;
+  if (cell < 0) {
+    cell = 0;
   }
 
-  if (rtn >= IS_OUTPUT_IMAGE_BINS) {
-    rtn = IS_OUTPUT_IMAGE_BINS - 1;
+  if (cell >= IS_BIN_LUT_SIZE) {
+    cell = IS_BIN_LUT_SIZE - 1;
   }
 
+  rtn = dst->bin_lut[cell];
+  if (rtn != IS_BIN_LUT_MIXED) {
+    return rtn;
+  }
+
+  rtn = cell / (IS_BIN_LUT_SIZE / IS_OUTPUT_IMAGE_BINS);
   for (irp=dst->bins[rtn].ice_ring_list; irp != NULL; irp = irp->next) {
     if (dist2 >= irp->dist2_low && dist2 <= irp->dist2_high) {
       rtn = IS_OUTPUT_IMAGE_BINS;  // special bin reserved for ice rings
@@ -146,6 +343,90 @@ int get_bin_number( isImageBufType *dst, int col, int row) {
 }
 
 
+/** Histogram bin for a pixel value.
+ **
+ ** Bin 0 holds zeros.  After that there are
+ ** IS_HISTOGRAM_BINS_PER_OCTAVE bins for each power of 2 so small
+ ** values get bins of their own and large values share bins of
+ ** roughly constant relative width.
+ **
+ ** @param v  pixel value
+ **
+ ** @returns bin number from 0 to IS_HISTOGRAM_BINS-1
+ */
+int histogram_bin(uint32_t v) {
+  int e;        // position of the most significant bit
+  int sub;      // the next 3 bits
+
+  if (v == 0) {
+    return 0;
+  }
+  e = 31 - __builtin_clz(v);
+  sub = (e >= 3 ? v >> (e - 3) : v << (3 - e)) & (IS_HISTOGRAM_BINS_PER_OCTAVE - 1);
+
+  return 1 + e * IS_HISTOGRAM_BINS_PER_OCTAVE + sub;
+}
+
+/** Smallest value that falls in a histogram bin
+ **
+ ** @param bin  bin number from 1 to IS_HISTOGRAM_BINS-1
+ */
+double histogram_bin_low(int bin) {
+  int e;
+  int sub;
+
+  e   = (bin - 1) / IS_HISTOGRAM_BINS_PER_OCTAVE;
+  sub = (bin - 1) % IS_HISTOGRAM_BINS_PER_OCTAVE;
+
+  return ldexp(IS_HISTOGRAM_BINS_PER_OCTAVE + sub, e - 3);
+}
+
+/** Estimate a percentile of the non-zero pixel values from a histogram
+ **
+ ** Zeros are left out as they are mostly module gaps and masked
+ ** pixels rather than data.  We interpolate linearly within the bin
+ ** holding the percentile.
+ **
+ ** @param histogram  counts from the reduction pass
+ **
+ ** @param pct        percentile, 0 to 100
+ **
+ ** @returns pixel value or -1 if there are no non-zero pixels
+ */
+double isHistogramPercentile(const uint32_t *histogram, double pct) {
+  double total;
+  double target;
+  double cum;
+  double low;
+  double high;
+  int bin;
+
+  total = 0.0;
+  for (bin=1; bin<IS_HISTOGRAM_BINS; bin++) {
+    total += histogram[bin];
+  }
+  if (total <= 0.0) {
+    return -1.0;
+  }
+
+  pct = pct < 0.0 ? 0.0 : (pct > 100.0 ? 100.0 : pct);
+  target = pct / 100.0 * total;
+
+  cum = 0.0;
+  for (bin=1; bin<IS_HISTOGRAM_BINS; bin++) {
+    if (histogram[bin] == 0) {
+      continue;
+    }
+    if (cum + histogram[bin] >= target) {
+      low  = histogram_bin_low(bin);
+      high = bin + 1 < IS_HISTOGRAM_BINS ? histogram_bin_low(bin + 1) : 4294967295.0;
+      return low + (target - cum) / histogram[bin] * (high - low);
+    }
+    cum += histogram[bin];
+  }
+  return histogram_bin_low(IS_HISTOGRAM_BINS - 1);
+}
+
 void add_to_stats(isImageBufType *dst, int row, int col, uint32_t pix) {
   static const char *id = FILEID "add_to_stats";
   int bin;
@@ -154,6 +435,8 @@ void add_to_stats(isImageBufType *dst, int row, int col, uint32_t pix) {
 
   bin = get_bin_number(dst, col, row);
 
+  dst->histogram[histogram_bin(pix)]++;
+
   dst->bins[bin].n++;
   dst->bins[bin].sum += pix;
   dst->bins[bin].sum2 += pix*pix;
@@ -182,6 +465,12 @@ void calc_stats(isImageBufType *dst) {
   double sum2;
   uint32_t min;
   uint32_t max;
+  json_t *hist;
+  int last;
+  bin_t *ice;
+  double bg_n;
+  double bg_sum;
+  double ice_ratio;
 
   n    = 0;
   mean = 0.0;
@@ -237,6 +526,47 @@ void calc_stats(isImageBufType *dst) {
   set_json_object_integer(id, dst->meta, "max",    max);
   set_json_object_real(id, dst->meta,    "rms",    rms);
   set_json_object_real(id, dst->meta,    "stddev", sd);
+
+  //
+  // Ice ring statistics.  Compare the pixels in the rings with the
+  // rest of the radial bins the rings fall in.
+  //
+  ice    = &(dst->bins[IS_OUTPUT_IMAGE_BINS]);
+  bg_n   = 0.0;
+  bg_sum = 0.0;
+  for (i=0; i < IS_OUTPUT_IMAGE_BINS; i++) {
+    if (dst->bins[i].ice_ring_list != NULL) {
+      bg_n   += dst->bins[i].n;
+      bg_sum += dst->bins[i].sum;
+    }
+  }
+  ice_ratio = 0.0;
+  if (ice->n > 0 && bg_n > 0 && bg_sum > 0) {
+    ice_ratio = ice->mean / (bg_sum / bg_n);
+  }
+
+  set_json_object_integer(id, dst->meta, "ice_rings",  dst->n_ice_rings);
+  set_json_object_integer(id, dst->meta, "ice_n",      ice->n);
+  set_json_object_real(id, dst->meta,    "ice_mean",   ice->mean);
+  set_json_object_integer(id, dst->meta, "ice_max",    ice->n > 0 ? ice->max : 0);
+  set_json_object_real(id, dst->meta,    "ice_stddev", ice->sd);
+  set_json_object_real(id, dst->meta,    "ice_ratio",  ice_ratio);
+
+  //
+  // Send the histogram along, leaving off the empty bins at the top
+  //
+  for (last=IS_HISTOGRAM_BINS-1; last > 0 && dst->histogram[last] == 0; last--);
+
+  hist = json_array();
+  if (hist == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  for (i=0; i<=last; i++) {
+    json_array_append_new(hist, json_integer(dst->histogram[i]));
+  }
+  json_object_set_new(dst->meta, "histogram", hist);
+  set_json_object_integer(id, dst->meta, "histogram_bins_per_octave", IS_HISTOGRAM_BINS_PER_OCTAVE);
 }
 
 /** For 16 bit images, this returns the maximum value of ha xa by ya box centered on (k,l).
@@ -476,7 +806,31 @@ uint32_t nearest32( uint32_t *badPixels, uint32_t *minp, int *nsatp, void *buf,
   return rtn;
 }
 
+/** Should we give up on a reduction?  Only when its job has been
+ ** superseded and no one else is waiting for the result.
+ **
+ ** @param wctx Worker context
+ **
+ ** @param dst  Buffer we are filling (write locked)
+ **
+ ** @returns 1 to give up, 0 to carry on
+ */
+static int reduceAbandon(isWorkerContext_t *wctx, isImageBufType *dst) {
+  int rtn;
+
+  if (!isSchedSuperseded(wctx)) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&wctx->ctxMutex);
+  rtn = dst->in_use == 1;
+  pthread_mutex_unlock(&wctx->ctxMutex);
+  return rtn;
+}
+
 /** Reduce the given 16 bit image
+ **
+ ** @param  wctx      Worker context
  **
  ** @param  src       Full sized source image
  **
@@ -489,8 +843,12 @@ uint32_t nearest32( uint32_t *badPixels, uint32_t *minp, int *nsatp, void *buf,
  ** @param  winWidth  Width of portion of the source we want to look at
  **
  ** @param  winHeight Height of the portion of the source we want to look at
+ **
+ ** @param  nearest   Sample the nearest pixel rather than the maximum of each box
+ **
+ ** @returns 0 on success, -1 if we gave up on a superseded job (see reduceAbandon)
  */
-void reduceImage16( isImageBufType *src, isImageBufType *dst, int x, int y, int winWidth, int winHeight) {
+int reduceImage16( isWorkerContext_t *wctx, isImageBufType *src, isImageBufType *dst, int x, int y, int winWidth, int winHeight, int nearest) {
   static const char *id = FILEID "reduceImage16";
 
   uint32_t (*cvtFunc)(uint32_t *, uint32_t *, int *, void *, int, int, double, double, int, int, int, int);
@@ -539,7 +897,7 @@ void reduceImage16( isImageBufType *src, isImageBufType *dst, int x, int y, int
     yau++;
 
   cvtFunc = NULL;
-  if (xa <= 1 || ya <= 1) {
+  if (nearest || xa <= 1 || ya <= 1) {
     cvtFunc = nearest16;
   } else {
     cvtFunc = maxBox16;
@@ -548,6 +906,10 @@ void reduceImage16( isImageBufType *src, isImageBufType *dst, int x, int y, int
   nsat = 0;
 
   for (row=0; row<dstHeight; row++) {
+    if (row % IS_REDUCE_BAND_ROWS == 0 && reduceAbandon(wctx, dst)) {
+      return -1;
+    }
+
     // "index" of vertical position on original image
     d_row = row * winHeight/(double)(dstHeight) + y;
 
@@ -609,9 +971,13 @@ void reduceImage16( isImageBufType *src, isImageBufType *dst, int x, int y, int
   }
 
   set_json_object_integer(id, dst->meta, "spots", spots);
+  set_json_object_integer(id, dst->meta, "ice_spots", ice_spots);
+  return 0;
 }
 
 /** Reduce the given 32 bit image
+ **
+ ** @param  wctx      Worker context
  **
  ** @param  src       Full sized source image
  **
@@ -624,8 +990,12 @@ void reduceImage16( isImageBufType *src, isImageBufType *dst, int x, int y, int
  ** @param  winWidth  Width of portion of the source we want to look at
  **
  ** @param  winHeight Height of the portion of the source we want to look at
+ **
+ ** @param  nearest   Sample the nearest pixel rather than the maximum of each box
+ **
+ ** @returns 0 on success, -1 if we gave up on a superseded job (see reduceAbandon)
  */
-void reduceImage32( isImageBufType *src, isImageBufType *dst, int x, int y, int winWidth, int winHeight) {
+int reduceImage32( isWorkerContext_t *wctx, isImageBufType *src, isImageBufType *dst, int x, int y, int winWidth, int winHeight, int nearest) {
   static const char *id = FILEID "reduceImage32";
   uint32_t (*cvtFunc)(uint32_t *, uint32_t *, int *, void *, int, int, double, double, int, int, int, int);
 
@@ -671,7 +1041,7 @@ void reduceImage32( isImageBufType *src, isImageBufType *dst, int x, int y, int
     yau++;
 
   cvtFunc = NULL;
-  if (xa <= 1 || ya <= 1) {
+  if (nearest || xa <= 1 || ya <= 1) {
     cvtFunc = nearest32;
   } else {
     cvtFunc = maxBox32;
@@ -680,6 +1050,10 @@ void reduceImage32( isImageBufType *src, isImageBufType *dst, int x, int y, int
   nsat = 0;
   min  = 0xffffffff;
   for (row=0; row<dstHeight; row++) {
+    if (row % IS_REDUCE_BAND_ROWS == 0 && reduceAbandon(wctx, dst)) {
+      return -1;
+    }
+
     // "index" of vertical position on original image
     d_row = row * (double)winHeight/(double)(dstHeight) + y;
 
@@ -739,64 +1113,38 @@ void reduceImage32( isImageBufType *src, isImageBufType *dst, int x, int y, int
   }
 
   set_json_object_integer(id, dst->meta, "spots", spots);
+  set_json_object_integer(id, dst->meta, "ice_spots", ice_spots);
+  return 0;
 }
 
             
-/** Image reduction is defined by a "zoom" and a "sector".
- **
- **  The width and height of the original image are divided by "zoom"
- **  and the resulting segments addressed by column and row indices
- **  starting with the upper left hand corner.  For example:
+/** Work out the reduction parameters and the buffer cache key for a job.
  **
- **  Zoom: 4 gives 16 segments from [0,0] to [3,3].  Zoom: 1.5 gives 4
- **  segments from [0,0] to [1,1] where the right half of [0,1] is
- **  blank, the bottom half of [0,1] is blank, and only the upper left
- **  hand quadrant of [1,1] is potentially non-blank.
- **
- **
- **  Call with
- **
- **    @param wctx        Our worker contex:
- **      @li @c wctx->ctxMutex  Keep our parallel worlds from colliding
+ ** @param job   Request from user (see isReduceImage)
  **
- **    @param rc          Open redis context to local redis server
+ ** @param fnp       returns file name
+ ** @param framep    returns frame number
+ ** @param zoomp     returns zoom rounded to the nearest 0.1
+ ** @param segcolp   returns segment column
+ ** @param segrowp   returns segment row
+ ** @param dstWidthp returns width of the reduced image
+ ** @param nearestp  returns 1 when job.sampling is "nearest"
  **
- **    @param job         Request from user.  We use the following properties here
- **      @li @c job->fn     File name of the data we are interested in
- **      @li @c job->frame  Requested frame.  Default is 1
- **      @li @c job->zoom   Ratio of full source image to the portion of the source image we are processing. Zoom will be rounded to the nearest 0.1
- **      @li @c job->segcol See above for discussion of col/row/zoom
- **      @li @c job->segrow See above for discussion of col/row/zoom
- **      @li @c job->xsize  Width of output image in pixels
- **      @li @c job->ysize  Height of output image in pixels
- **
- **
- **  Return with
- **
- **    read locked buffer
+ ** @returns malloc'ed key or NULL if the job can't be reduced
  */
-isImageBufType *isReduceImage(isWorkerContext_t *wctx, json_t *job) {
-  static const char *id = FILEID "isReducedImage";
-  isImageBufType *rtn;
-  isImageBufType *raw;
+static char *reducedImageKey(json_t *job, const char **fnp, int *framep, double *zoomp, double *segcolp, double *segrowp, int *dstWidthp, int *nearestp) {
+  static const char *id = FILEID "reducedImageKey";
   double zoom;
   double segcol;
   double segrow;
   //  double seglen;
   const char *fn;
+  const char *sampling;
   int frame;
+  int nearest;
   char *reducedKey;
   int reducedKeyStrlen;
-
-  int srcWidth;
-  int srcHeight;
-  int image_depth;
-  int x;
-  int y;
-  int winWidth;                                                         // width of input image to map to output image
-  int winHeight;                                                        // height of input image to map to output image
   int dstWidth  = json_integer_value(json_object_get(job, "xsize"));    // width, in pixels, of output image
-  int dstHeight;                                                        // height, in pixels, calculated once we know the source image dimensions
 
   fn    = json_string_value(json_object_get(job, "fn"));
   frame = json_integer_value(json_object_get(job, "frame"));
@@ -804,7 +1152,10 @@ isImageBufType *isReduceImage(isWorkerContext_t *wctx, json_t *job) {
   zoom   = json_number_value(json_object_get(job, "zoom"));
   segcol = json_number_value(json_object_get(job, "segcol"));
   segrow = json_number_value(json_object_get(job, "segrow"));
-  
+
+  sampling = json_string_value(json_object_get(job, "sampling"));
+  nearest  = sampling != NULL && strcasecmp(sampling, "nearest") == 0;
+
   //
   // Reality check on zoom
   //
@@ -814,7 +1165,7 @@ isImageBufType *isReduceImage(isWorkerContext_t *wctx, json_t *job) {
     segcol = 0.;
     segrow = 0.;
   }
-  
+
   //
   // Reality check on segcol and segrow
   //
@@ -857,10 +1208,125 @@ isImageBufType *isReduceImage(isWorkerContext_t *wctx, json_t *job) {
     isLogging_crit("%s: Out of memory (reducedKey)\n", id);
     exit (-1);
   }
-  snprintf(reducedKey, reducedKeyStrlen, "%d:%s-%d-%0.1f-%0.3f-%0.3f-%d",
-           getegid(), fn, frame, zoom, segcol, segrow, dstWidth);
+  snprintf(reducedKey, reducedKeyStrlen, "%d:%s-%d-%0.1f-%0.3f-%0.3f-%d%s",
+           getegid(), fn, frame, zoom, segcol, segrow, dstWidth, nearest ? "-n" : "");
   reducedKey[reducedKeyStrlen] = 0;
- 
+
+  *fnp       = fn;
+  *framep    = frame;
+  *zoomp     = zoom;
+  *segcolp   = segcol;
+  *segrowp   = segrow;
+  *dstWidthp = dstWidth;
+  *nearestp  = nearest;
+
+  return reducedKey;
+}
+
+/** See if the reduced image a job asks for is already in our buffer cache.
+ **
+ **    @param wctx        Our worker contex:
+ **      @li @c wctx->ctxMutex  Keep our parallel worlds from colliding
+ **
+ **    @param job         Request from user (see isReduceImage)
+ **
+ **    @returns 1 if the reduced image is ready to go, 0 otherwise
+ */
+int isReducedImageCached(isWorkerContext_t *wctx, json_t *job) {
+  const char *fn;
+  int frame;
+  double zoom;
+  double segcol;
+  double segrow;
+  int dstWidth;
+  int nearest;
+  char *reducedKey;
+  ENTRY item;
+  ENTRY *return_item;
+  int rtn;
+
+  reducedKey = reducedImageKey(job, &fn, &frame, &zoom, &segcol, &segrow, &dstWidth, &nearest);
+  if (reducedKey == NULL) {
+    return 0;
+  }
+
+  rtn = 0;
+  item.key  = reducedKey;
+  item.data = NULL;
+
+  pthread_mutex_lock(&wctx->ctxMutex);
+  if (hsearch_r(item, FIND, &return_item, &wctx->bufTable) != 0) {
+    rtn = ((isImageBufType *)return_item->data)->buf != NULL;
+  }
+  pthread_mutex_unlock(&wctx->ctxMutex);
+
+  free(reducedKey);
+  return rtn;
+}
+
+/** Image reduction is defined by a "zoom" and a "sector".
+ **
+ **  The width and height of the original image are divided by "zoom"
+ **  and the resulting segments addressed by column and row indices
+ **  starting with the upper left hand corner.  For example:
+ **
+ **  Zoom: 4 gives 16 segments from [0,0] to [3,3].  Zoom: 1.5 gives 4
+ **  segments from [0,0] to [1,1] where the right half of [0,1] is
+ **  blank, the bottom half of [0,1] is blank, and only the upper left
+ **  hand quadrant of [1,1] is potentially non-blank.
+ **
+ **
+ **  Call with
+ **
+ **    @param wctx        Our worker contex:
+ **      @li @c wctx->ctxMutex  Keep our parallel worlds from colliding
+ **
+ **    @param rc          Open redis context to local redis server
+ **
+ **    @param job         Request from user.  We use the following properties here
+ **      @li @c job->fn     File name of the data we are interested in
+ **      @li @c job->frame  Requested frame.  Default is 1
+ **      @li @c job->zoom   Ratio of full source image to the portion of the source image we are processing. Zoom will be rounded to the nearest 0.1
+ **      @li @c job->segcol See above for discussion of col/row/zoom
+ **      @li @c job->segrow See above for discussion of col/row/zoom
+ **      @li @c job->xsize  Width of output image in pixels
+ **      @li @c job->ysize  Height of output image in pixels
+ **      @li @c job->sampling "nearest" to sample single pixels rather than box maxima (used for quick previews)
+ **
+ **
+ **  Return with
+ **
+ **    read locked buffer, or NULL on failure or when the job was
+ **    superseded part way through (isSchedSuperseded)
+ */
+isImageBufType *isReduceImage(isWorkerContext_t *wctx, json_t *job) {
+  static const char *id = FILEID "isReducedImage";
+  isImageBufType *rtn;
+  isImageBufType *raw;
+  double zoom;
+  double segcol;
+  double segrow;
+  const char *fn;
+  int frame;
+  int nearest;
+  char *reducedKey;
+
+  int srcWidth;
+  int srcHeight;
+  int image_depth;
+  int x;
+  int y;
+  int winWidth;                                                         // width of input image to map to output image
+  int winHeight;                                                        // height of input image to map to output image
+  int dstWidth;                                                         // width, in pixels, of output image
+  int dstHeight;                                                        // height, in pixels, calculated once we know the source image dimensions
+  int err;
+
+  reducedKey = reducedImageKey(job, &fn, &frame, &zoom, &segcol, &segrow, &dstWidth, &nearest);
+  if (reducedKey == NULL) {
+    return NULL;
+  }
+
   rtn = isGetImageBufFromKey(wctx, reducedKey);
 
   if (rtn == NULL || rtn->buf != NULL) {
@@ -938,11 +1404,11 @@ isImageBufType *isReduceImage(isWorkerContext_t *wctx, json_t *job) {
 
   switch (image_depth) {
   case 2:
-    reduceImage16(raw, rtn, x, y, winWidth, winHeight);
+    err = reduceImage16(wctx, raw, rtn, x, y, winWidth, winHeight, nearest);
     break;
 
   case 4:
-    reduceImage32(raw, rtn, x, y, winWidth, winHeight);
+    err = reduceImage32(wctx, raw, rtn, x, y, winWidth, winHeight, nearest);
     break;
 
   default:
@@ -952,11 +1418,36 @@ isImageBufType *isReduceImage(isWorkerContext_t *wctx, json_t *job) {
 
   pthread_rwlock_unlock(&raw->buflock);
 
-  // We don't need the raw buffer anymore  pthread_mutex_lock(&wctx->ctxMutex);
+  // We don't need the raw buffer anymore
+  pthread_mutex_lock(&wctx->ctxMutex);
   raw->in_use--;
   assert(raw->in_use >= 0);
   pthread_mutex_unlock(&wctx->ctxMutex);
 
+  if (err != 0) {
+    //
+    // Superseded.  Leave the buffer empty for whoever wants it next,
+    // as though we had never started.
+    //
+    isLogging_debug("%s: gave up on superseded %s\n", id, rtn->key);
+    free(rtn->buf);
+    rtn->buf = NULL;
+    pthread_mutex_lock(&wctx->metaMutex);
+    json_decref(rtn->meta);     // json_copy
+    json_decref(rtn->meta);     // and json_incref above
+    pthread_mutex_unlock(&wctx->metaMutex);
+    rtn->meta = NULL;
+
+    pthread_rwlock_unlock(&rtn->buflock);
+    pthread_mutex_lock(&wctx->ctxMutex);
+    rtn->in_use--;
+    assert(rtn->in_use >= 0);
+    pthread_mutex_unlock(&wctx->ctxMutex);
+
+    free(reducedKey);
+    return NULL;
+  }
+
   //
   // Exchange our write lock for a read lock to let our other threads get to work.
   //
@@ -0,0 +1,257 @@
+/*! @file isRoute.c
+ *  @copyright 2018 by Northwestern University
+ *  @author Keith Brister
+ *  @brief Find where a request goes without parsing all of it
+ *
+ *  The main loop only needs "pid" and "esaf" to route a request; the
+ *  worker parses the whole thing anyway.  So we look for them in
+ *  this order:
+ *
+ *  @li A routing frame ahead of the request: "is-route <pid> <esaf>".
+ *  It is not passed on to the worker.
+ *
+ *  @li The top level keys of the request, found by scanning the JSON
+ *  text without building anything.
+ *
+ *  Anything the scanner is not sure about (escaped characters in the
+ *  pid, say) goes back to the main loop for a full json_loadb as
+ *  before.
+ */
+#include "is.h"
+
+/** Skip white space
+ */
+static const char *isRouteSpace(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+    p++;
+  }
+  return p;
+}
+
+/** Read a decimal integer that runs up to end
+ **
+ ** @returns 0 on success, -1 if it is anything else or too big for an int
+ */
+static int isRouteInt(const char *p, const char *end, int *value) {
+  int neg;
+  int v;
+
+  neg = p < end && *p == '-';
+  if (neg) {
+    p++;
+  }
+  if (p == end) {
+    return -1;
+  }
+  for (v=0; p < end; p++) {
+    if (*p < '0' || *p > '9' || v > (INT_MAX - 9) / 10) {
+      return -1;
+    }
+    v = 10 * v + (*p - '0');
+  }
+  *value = neg ? -v : v;
+  return 0;
+}
+
+/** Skip past a string.  p points at its opening quote.
+ **
+ ** @param escaped Returned 1 if the string has escapes in it
+ **
+ ** @returns Just past the closing quote or NULL if there is none
+ */
+static const char *isRouteString(const char *p, const char *end, int *escaped) {
+  *escaped = 0;
+  for (p++; p < end; p++) {
+    if (*p == '\\') {
+      *escaped = 1;
+      p++;
+      continue;
+    }
+    if (*p == '"') {
+      return p + 1;
+    }
+  }
+  return NULL;
+}
+
+/** Skip past a value of any kind
+ **
+ ** @returns Just past the value or NULL if it does not end
+ */
+static const char *isRouteValue(const char *p, const char *end) {
+  int depth;
+  int escaped;
+
+  if (p < end && *p == '"') {
+    return isRouteString(p, end, &escaped);
+  }
+
+  depth = 0;
+  while (p < end) {
+    switch (*p) {
+    case '"':
+      p = isRouteString(p, end, &escaped);
+      if (p == NULL) {
+        return NULL;
+      }
+      continue;
+
+    case '{':
+    case '[':
+      depth++;
+      break;
+
+    case '}':
+    case ']':
+      if (depth == 0) {
+        return p;       // end of the enclosing object
+      }
+      if (--depth == 0) {
+        return p + 1;
+      }
+      break;
+
+    case ',':
+      if (depth == 0) {
+        return p;
+      }
+      break;
+    }
+    p++;
+  }
+  return depth == 0 ? p : NULL;
+}
+
+/** Find pid and esaf among the top level keys of a JSON request.  As
+ ** with jansson a missing or non-integer esaf is 0 and the last of
+ ** repeated keys wins.
+ **
+ ** @param buf     The request
+ **
+ ** @param len     Its length
+ **
+ ** @param pid     Returned start of the pid in buf (not terminated)
+ **
+ ** @param pid_len Returned length of the pid
+ **
+ ** @param esaf    Returned esaf
+ **
+ ** @returns 0 on success, -1 if the caller should parse the request itself
+ */
+int isRouteScan(const char *buf, size_t len, const char **pid, int *pid_len, int *esaf) {
+  const char *p;
+  const char *end;
+  const char *key;
+  const char *value;
+  const char *value_end;
+  int key_len;
+  int key_escaped;
+  int escaped;
+  const char *num_end;
+
+  *pid     = NULL;
+  *pid_len = 0;
+  *esaf    = 0;
+
+  end = buf + len;
+  p   = isRouteSpace(buf, end);
+  if (p == end || *p != '{') {
+    return -1;
+  }
+  p = isRouteSpace(p + 1, end);
+
+  while (p < end && *p != '}') {
+    //
+    // "key"
+    //
+    if (*p != '"') {
+      return -1;
+    }
+    key = p + 1;
+    p   = isRouteString(p, end, &key_escaped);
+    if (p == NULL) {
+      return -1;
+    }
+    key_len = p - key - 1;
+
+    p = isRouteSpace(p, end);
+    if (p == end || *p != ':') {
+      return -1;
+    }
+    p = isRouteSpace(p + 1, end);
+
+    //
+    // value
+    //
+    value     = p;
+    value_end = isRouteValue(p, end);
+    if (value_end == NULL || value_end == value) {
+      return -1;
+    }
+
+    if (!key_escaped && key_len == 3 && memcmp(key, "pid", 3) == 0) {
+      if (*value != '"') {
+        return -1;      // let jansson decide what to make of it
+      }
+      isRouteString(value, end, &escaped);
+      if (escaped) {
+        return -1;
+      }
+      *pid     = value + 1;
+      *pid_len = value_end - value - 2;
+    }
+
+    if (!key_escaped && key_len == 4 && memcmp(key, "esaf", 4) == 0) {
+      for (num_end = value_end; num_end > value && (num_end[-1] == ' ' || num_end[-1] == '\t' || num_end[-1] == '\n' || num_end[-1] == '\r'); num_end--);
+      if (isRouteInt(value, num_end, esaf) == -1) {
+        *esaf = 0;
+      }
+    }
+
+    p = isRouteSpace(value_end, end);
+    if (p < end && *p == ',') {
+      p = isRouteSpace(p + 1, end);
+    }
+  }
+
+  return *pid == NULL ? -1 : 0;
+}
+
+/** Is this a routing frame?  "is-route <pid> <esaf>"
+ **
+ ** @param buf     Frame data
+ **
+ ** @param len     Its length
+ **
+ ** @param pid     Returned start of the pid in buf (not terminated)
+ **
+ ** @param pid_len Returned length of the pid
+ **
+ ** @param esaf    Returned esaf
+ **
+ ** @returns 0 if so, -1 if not
+ */
+int isRouteFrame(const char *buf, size_t len, const char **pid, int *pid_len, int *esaf) {
+  const char *p;
+  const char *end;
+  int plen;
+
+  plen = strlen(IS_ROUTE_PREFIX);
+  if (len <= plen || memcmp(buf, IS_ROUTE_PREFIX, plen) != 0) {
+    return -1;
+  }
+
+  end = buf + len;
+  p   = buf + plen;
+
+  *pid = p;
+  while (p < end && *p != ' ') {
+    p++;
+  }
+  *pid_len = p - *pid;
+  if (*pid_len == 0 || p == end) {
+    return -1;
+  }
+
+  return isRouteInt(p + 1, end, esaf);
+}
@@ -0,0 +1,1084 @@
+/*! @file isSched.c
+ *  @copyright 2018 by Northwestern University
+ *  @author Keith Brister
+ *  @brief Hand jobs to the worker threads by priority rather than in the order they came in
+ *
+ *  The supervisor's proxy used to deal jobs straight to the workers
+ *  round robin.  A burst of thumbnails then held up the image the
+ *  user is actually looking at.  Now the proxy hands every job to our
+ *  thread, which queues it by class:
+ *
+ *  @li IS_SCHED_VIEW      The main view and anything quick (cancels, async results, headers)
+ *  @li IS_SCHED_THUMBNAIL jpegs no larger than IS_SCHED_THUMBNAIL_SIZE
+ *  @li IS_SCHED_SPOTS     Spot finding
+ *  @li IS_SCHED_INDEX     Indexing and sweeps
+ *  @li IS_SCHED_IDLE      Prefetches: anything else goes first
+ *
+ *  A request may name its own class with "priority": "view",
+ *  "thumbnail", "spots", "index", or "idle".
+ *
+ *  Idle workers get the oldest job of the best class waiting.  Long
+ *  jobs (isAsyncIsLong) wait while IS_WORKER_MAX_LONG of them are
+ *  running rather than being refused.
+ *
+ *  A request may also carry "deadline": the milliseconds it is willing
+ *  to wait for a worker.  Thumbnails get IS_SCHED_THUMBNAIL_DEADLINE_MS
+ *  unless they say otherwise.  A job still waiting at its deadline
+ *  gets an error reply right away instead.
+ *
+ *  Dragging the frame slider sends a stream of jpegs with the same
+ *  "tag" of which only the last will be shown.  A new request
+ *  supersedes the ones waiting with its tag and type, or with the tag
+ *  it names in "supersedes": they get a short "Superseded" error
+ *  reply right away.  A worker already on one is told so through
+ *  wctx->superseded; isReduceImage gives up between row bands when no
+ *  one else is waiting on the image.
+ *
+ *  We also watch the main view for a user stepping through a run one
+ *  frame (or one numbered file) at a time, either way.  After
+ *  IS_PREFETCH_RUN steps we queue "prefetch" jobs (isJpegPrefetch)
+ *  for the next IS_PREFETCH_FRAMES frames, reduced as the last
+ *  request was, so they are in the buffer cache when asked for.  No
+ *  more than IS_PREFETCH_WORKERS workers prefetch at once.  Any other
+ *  main view request drops the prefetches still waiting and tells
+ *  the workers on one to give up.
+ *
+ *  The workers' REP sockets connect to our ROUTER with identities we
+ *  know (isSchedWorkerId) so we can pick which one gets a job.
+ */
+#include "is.h"
+
+/** A job waiting for a worker                                     */
+typedef struct isSchedJobStruct {
+  struct isSchedJobStruct *next;        //!< Next job in our class
+  zmq_msg_t msgs[IS_SCHED_PARTS];       //!< Routing messages, the empty delimiter, the request and any parts after it
+  int nmsgs;                            //!< Number of messages
+  int request;                          //!< Index of the request in msgs
+  int class;                            //!< Our priority class
+  int is_long;                          //!< Counts against IS_WORKER_MAX_LONG
+  int has_deadline;                     //!< There is a deadline
+  struct timespec deadline;             //!< Reply with an error if not started by now
+  char *type;                           //!< Job type, NULL for async submissions (they are never superseded)
+  char *tag;                            //!< The request's tag, if any
+  char *supersedes;                     //!< Tag of the jobs this one replaces, if any
+  int prefetch;                         //!< One of our prefetches: no one waits for the reply
+} isSchedJobType;
+
+/** What we know about a worker                                   */
+typedef struct isSchedWorkerStruct {
+  int idle;                             //!< Waiting for a job
+  int is_long;                          //!< Its job counts against IS_WORKER_MAX_LONG
+  char *type;                           //!< Type of its job
+  char *tag;                            //!< and tag
+  int prefetch;                         //!< Its job is a prefetch
+  struct timespec retry;                //!< Not connected yet: try again after this
+} isSchedWorkerType;
+
+/** Our thread's state                                             */
+typedef struct isSchedStruct {
+  isWorkerContext_t *wctx;              //!< Our worker context
+  void *front;                          //!< DEALER: jobs from the proxy, replies back to it
+  void *back;                           //!< ROUTER: the workers
+  isSchedJobType *first[IS_SCHED_CLASSES]; //!< Oldest job of each class
+  isSchedJobType **last[IS_SCHED_CLASSES]; //!< Where the next one goes
+  isSchedWorkerType workers[N_WORKER_THREADS];
+  int running_long;                     //!< Long jobs with a worker
+  int running_idle;                     //!< Prefetches with a worker
+  json_t *pf_job;                       //!< The last main view request, the pattern for our prefetches
+  int pf_step;                          //!< +1 or -1 while the user steps through the run, 0 otherwise
+  int pf_files;                         //!< Stepping through numbered files rather than the frames of one
+  int pf_run;                           //!< Steps in a row so far
+  int pf_ahead;                         //!< Steps ahead of the user we have queued prefetches for
+} isSchedType;
+
+static const char *sched_class_names[IS_SCHED_CLASSES] = { "view", "thumbnail", "spots", "index", "idle" };
+
+//! Which worker this thread is (see isSchedSetWorker), -1 for any other thread
+static __thread int sched_worker = -1;
+
+/** Milliseconds from now until then (negative once it has passed)
+ */
+static long isSchedMsUntil(const struct timespec *then) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (then->tv_sec - now.tv_sec) * 1000 + (then->tv_nsec - now.tv_nsec) / 1000000;
+}
+
+/** A moment this many milliseconds from now
+ */
+static void isSchedMsFromNow(struct timespec *ts, long ms) {
+  clock_gettime(CLOCK_MONOTONIC, ts);
+  ts->tv_sec  += ms / 1000;
+  ts->tv_nsec += (ms % 1000) * 1000000;
+  if (ts->tv_nsec >= 1000000000) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
+}
+
+/** Routing identity of worker n.  isWorker uses it for its REP socket.
+ **
+ ** @param n   Worker number
+ **
+ ** @param buf Returned identity
+ **
+ ** @param len Size of buf
+ */
+void isSchedWorkerId(int n, char *buf, int len) {
+  snprintf(buf, len-1, "w%d", n);
+  buf[len-1] = 0;
+}
+
+/** Tell isSchedSuperseded which worker the calling thread is
+ **
+ ** @param n Worker number, as given to isSchedWorkerId
+ */
+void isSchedSetWorker(int n) {
+  sched_worker = n;
+}
+
+/** Has the job the calling thread is working on been superseded?
+ ** Only worker threads are ever told so.
+ **
+ ** @param wctx Worker context
+ **
+ ** @returns 1 if the reply is no longer wanted, 0 otherwise
+ */
+int isSchedSuperseded(isWorkerContext_t *wctx) {
+  if (sched_worker < 0 || sched_worker >= N_WORKER_THREADS) {
+    return 0;
+  }
+  return __sync_add_and_fetch(&wctx->superseded[sched_worker], 0);
+}
+
+/** Let go of a job and whatever of it we still hold
+ */
+static void isSchedJobFree(isSchedJobType *jp) {
+  int i;
+
+  for (i=0; i<jp->nmsgs; i++) {
+    zmq_msg_close(&jp->msgs[i]);
+  }
+  free(jp->type);
+  free(jp->tag);
+  free(jp->supersedes);
+  free(jp);
+}
+
+/** Take a job off its class's list
+ **
+ ** @param sp  Our state
+ **
+ ** @param jpp Where the job is linked in
+ */
+static void isSchedUnlink(isSchedType *sp, isSchedJobType **jpp) {
+  isSchedJobType *jp;
+
+  jp   = *jpp;
+  *jpp = jp->next;
+  if (sp->last[jp->class] == &jp->next) {
+    sp->last[jp->class] = jpp;
+  }
+}
+
+/** Copy a string for a job
+ */
+static char *isSchedStrdup(const char *s) {
+  static const char *id = FILEID "isSchedStrdup";
+  char *rtn;
+
+  if (s == NULL || *s == 0) {
+    return NULL;
+  }
+  rtn = strdup(s);
+  if (rtn == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  return rtn;
+}
+
+/** Where the number is in a numbered file name such as
+ ** test_1_00017.cbf: the last run of digits after the last slash.
+ **
+ ** @param fn   The file name
+ **
+ ** @param lenp Returned number of digits
+ **
+ ** @returns Offset of the number in fn, -1 if there is none
+ */
+static int isSchedFileNumber(const char *fn, int *lenp) {
+  const char *base;
+  const char *end;
+
+  base = strrchr(fn, '/');
+  base = base == NULL ? fn : base + 1;
+
+  for (end=fn+strlen(fn); end > base && (end[-1] < '0' || end[-1] > '9'); end--);
+  if (end == base) {
+    return -1;
+  }
+
+  for (*lenp=0; end-*lenp > base && end[-*lenp-1] >= '0' && end[-*lenp-1] <= '9'; (*lenp)++);
+  return end - *lenp - fn;
+}
+
+/** How far apart are two files of the same numbered run?
+ **
+ ** @returns The difference of their numbers, 0 if they are not of one run
+ */
+static int isSchedFileStep(const char *a, const char *b) {
+  int ia;
+  int ib;
+  int la;
+  int lb;
+
+  ia = isSchedFileNumber(a, &la);
+  ib = isSchedFileNumber(b, &lb);
+  if (ia < 0 || ia != ib || la != lb || strncmp(a, b, ia) != 0 || strcmp(a+ia+la, b+ib+lb) != 0) {
+    return 0;
+  }
+  return atoi(b+ib) - atoi(a+ia);
+}
+
+/** Name of the file step files along a numbered run from fn
+ **
+ ** @returns The name (free it), NULL if there is no such file name
+ */
+static char *isSchedFileName(const char *fn, int step) {
+  static const char *id = FILEID "isSchedFileName";
+  char *rtn;
+  int len;
+  int i;
+  int n;
+
+  i = isSchedFileNumber(fn, &len);
+  if (i < 0) {
+    return NULL;
+  }
+  n = atoi(fn + i) + step;
+  if (n < 0) {
+    return NULL;
+  }
+
+  rtn = malloc(strlen(fn) + 16);
+  if (rtn == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  sprintf(rtn, "%.*s%0*d%s", i, fn, len, n, fn + i + len);
+  if (strlen(rtn) != strlen(fn)) {
+    // Ran out of digits
+    free(rtn);
+    return NULL;
+  }
+  return rtn;
+}
+
+/** Do two main view requests reduce their frames the same way?  Call
+ ** with metaMutex locked.
+ */
+static int isSchedSameReduction(json_t *a, json_t *b) {
+  static const char *keys[] = { "xsize", "zoom", "segcol", "segrow", "sampling", NULL };
+  json_t *va;
+  json_t *vb;
+  int i;
+
+  for (i=0; keys[i] != NULL; i++) {
+    va = json_object_get(a, keys[i]);
+    vb = json_object_get(b, keys[i]);
+    if (va == NULL && vb == NULL) {
+      continue;
+    }
+    if (va == NULL || vb == NULL || !json_equal(va, vb)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/** Frame a request asks for (call with metaMutex locked)
+ */
+static int isSchedFrame(json_t *job) {
+  json_t *frame;
+
+  frame = json_object_get(job, "frame");
+  return frame == NULL ? 1 : json_integer_value(frame);
+}
+
+/** Drop the prefetches still waiting and tell the workers on one to
+ ** give up.  The user has gone elsewhere.
+ */
+static void isSchedPrefetchCancel(isSchedType *sp) {
+  isSchedJobType **jpp;
+  isSchedJobType *jp;
+  int w;
+
+  for (jpp=&sp->first[IS_SCHED_IDLE]; *jpp != NULL; ) {
+    jp = *jpp;
+    if (!jp->prefetch) {
+      jpp = &jp->next;
+      continue;
+    }
+    isSchedUnlink(sp, jpp);
+    isSchedJobFree(jp);
+  }
+
+  for (w=0; w<N_WORKER_THREADS; w++) {
+    if (!sp->workers[w].idle && sp->workers[w].prefetch) {
+      __sync_fetch_and_or(&sp->wctx->superseded[w], 1);
+    }
+  }
+
+  sp->pf_step  = 0;
+  sp->pf_files = 0;
+  sp->pf_run   = 0;
+  sp->pf_ahead = 0;
+}
+
+/** Queue prefetches up to IS_PREFETCH_FRAMES steps ahead of the user's
+ ** last request.  Call with metaMutex locked.
+ */
+static void isSchedPrefetch(isSchedType *sp) {
+  static const char *id = FILEID "isSchedPrefetch";
+  isSchedJobType *jp;
+  json_t *pjob;
+  const char *fn;
+  char *next_fn;
+  char *pstr;
+  int frame;
+  int step;
+
+  fn    = json_string_value(json_object_get(sp->pf_job, "fn"));
+  frame = isSchedFrame(sp->pf_job);
+
+  while (sp->pf_ahead < IS_PREFETCH_FRAMES) {
+    step = (sp->pf_ahead + 1) * sp->pf_step;
+
+    pjob = json_deep_copy(sp->pf_job);
+    if (pjob == NULL) {
+      isLogging_crit("%s: Out of memory\n", id);
+      exit (-1);
+    }
+    if (sp->pf_files) {
+      next_fn = isSchedFileName(fn, step);
+      if (next_fn == NULL) {
+        json_decref(pjob);
+        break;
+      }
+      json_object_set_new(pjob, "fn", json_string(next_fn));
+      free(next_fn);
+    } else {
+      if (frame + step < 1) {
+        json_decref(pjob);
+        break;
+      }
+      json_object_set_new(pjob, "frame", json_integer(frame + step));
+    }
+    json_object_set_new(pjob, "type", json_string("prefetch"));
+    json_object_del(pjob, "tag");
+    json_object_del(pjob, "preview");
+    json_object_del(pjob, "supersedes");
+    json_object_del(pjob, "deadline");
+    json_object_del(pjob, "priority");
+
+    pstr = json_dumps(pjob, JSON_COMPACT | JSON_INDENT(0));
+    json_decref(pjob);
+    if (pstr == NULL) {
+      isLogging_crit("%s: Out of memory\n", id);
+      exit (-1);
+    }
+
+    jp = calloc(1, sizeof(*jp));
+    if (jp == NULL) {
+      isLogging_crit("%s: Out of memory\n", id);
+      exit (-1);
+    }
+
+    //
+    // No envelope: the reply is ours
+    //
+    zmq_msg_init_size(&jp->msgs[0], 0);
+    zmq_msg_init_size(&jp->msgs[1], strlen(pstr));
+    memcpy(zmq_msg_data(&jp->msgs[1]), pstr, strlen(pstr));
+    free(pstr);
+    jp->nmsgs    = 2;
+    jp->request  = 1;
+    jp->class    = IS_SCHED_IDLE;
+    jp->prefetch = 1;
+
+    *sp->last[IS_SCHED_IDLE] = jp;
+    sp->last[IS_SCHED_IDLE]  = &jp->next;
+    sp->pf_ahead++;
+  }
+}
+
+/** Watch the main view for a user stepping through a run and keep our
+ ** prefetches ahead of them.  Call with metaMutex locked.
+ **
+ ** @param sp  Our state
+ **
+ ** @param job A main view jpeg request
+ */
+static void isSchedWatch(isSchedType *sp, json_t *job) {
+  static const char *id = FILEID "isSchedWatch";
+  const char *fn;
+  const char *last_fn;
+  int frame;
+  int last_frame;
+  int files;
+  int step;
+
+  fn = json_string_value(json_object_get(job, "fn"));
+  if (fn == NULL) {
+    return;
+  }
+  frame = isSchedFrame(job);
+
+  step  = 0;
+  files = 0;
+  if (sp->pf_job != NULL && isSchedSameReduction(sp->pf_job, job)) {
+    last_fn    = json_string_value(json_object_get(sp->pf_job, "fn"));
+    last_frame = isSchedFrame(sp->pf_job);
+    if (strcmp(last_fn, fn) == 0) {
+      if (frame == last_frame) {
+        // Same image again (new contrast, say): our prefetches still hold
+        return;
+      }
+      step = frame - last_frame;
+    } else if (frame == last_frame) {
+      step  = isSchedFileStep(last_fn, fn);
+      files = 1;
+    }
+  }
+
+  if ((step == 1 || step == -1) && (sp->pf_run == 0 || (step == sp->pf_step && files == sp->pf_files))) {
+    sp->pf_step  = step;
+    sp->pf_files = files;
+    sp->pf_run++;
+    if (sp->pf_ahead > 0) {
+      // We are one step closer to the user
+      sp->pf_ahead--;
+    }
+  } else if (sp->pf_run > 0 || sp->pf_ahead > 0) {
+    isLogging_debug("%s: %s: not browsing in order any more\n", id, sp->wctx->key);
+    isSchedPrefetchCancel(sp);
+  }
+
+  if (sp->pf_job != NULL) {
+    json_decref(sp->pf_job);
+  }
+  sp->pf_job = json_deep_copy(job);
+  if (sp->pf_job == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  if (sp->pf_run >= IS_PREFETCH_RUN) {
+    isSchedPrefetch(sp);
+  }
+}
+
+/** Decide the class and deadline of a job from its request
+ **
+ ** @param sp Our state
+ **
+ ** @param jp The job
+ */
+static void isSchedClassify(isSchedType *sp, isSchedJobType *jp) {
+  isWorkerContext_t *wctx;
+  json_t *job;
+  json_error_t jerr;
+  const char *job_type;
+  const char *priority;
+  const char *tag;
+  const char *supersedes;
+  json_t *deadline;
+  long deadline_ms;
+  int xsize;
+  int ysize;
+  int async;
+  int i;
+
+  wctx = sp->wctx;
+  jp->class = IS_SCHED_VIEW;
+  if (jp->request >= jp->nmsgs) {
+    return;
+  }
+
+  //
+  // The worker parses it again.  Anything it cannot parse gets a
+  // quick error reply so it goes first.
+  //
+  pthread_mutex_lock(&wctx->metaMutex);
+  job = json_loadb(zmq_msg_data(&jp->msgs[jp->request]), zmq_msg_size(&jp->msgs[jp->request]), 0, &jerr);
+  if (job == NULL) {
+    pthread_mutex_unlock(&wctx->metaMutex);
+    return;
+  }
+  job_type = json_string_value(json_object_get(job, "type"));
+  priority = json_string_value(json_object_get(job, "priority"));
+  deadline = json_object_get(job, "deadline");
+  xsize    = json_integer_value(json_object_get(job, "xsize"));
+  ysize    = json_integer_value(json_object_get(job, "ysize"));
+  async    = json_is_true(json_object_get(job, "async"));
+  tag      = json_string_value(json_object_get(job, "tag"));
+  supersedes = json_string_value(json_object_get(job, "supersedes"));
+
+  deadline_ms = -1;
+  if (json_is_number(deadline)) {
+    deadline_ms = json_number_value(deadline);
+  }
+
+  if (job_type == NULL || async) {
+    // Error replies and async submissions are quick
+    jp->class = IS_SCHED_VIEW;
+  } else if (strcasecmp(job_type, "jpeg") == 0) {
+    jp->class = IS_SCHED_VIEW;
+    if (xsize > 0 && xsize <= IS_SCHED_THUMBNAIL_SIZE && ysize <= IS_SCHED_THUMBNAIL_SIZE) {
+      jp->class = IS_SCHED_THUMBNAIL;
+      if (deadline_ms < 0) {
+        deadline_ms = IS_SCHED_THUMBNAIL_DEADLINE_MS;
+      }
+    }
+  } else if (strcasecmp(job_type, "spots") == 0 || strcasecmp(job_type, "findspots") == 0) {
+    jp->class = IS_SCHED_SPOTS;
+  } else if (isAsyncIsLong(job_type)) {
+    jp->class = IS_SCHED_INDEX;
+  }
+  jp->is_long = job_type != NULL && !async && isAsyncIsLong(job_type);
+
+  if (job_type != NULL && !async) {
+    jp->type       = isSchedStrdup(job_type);
+    jp->tag        = isSchedStrdup(tag);
+    jp->supersedes = isSchedStrdup(supersedes);
+  }
+
+  if (priority != NULL) {
+    for (i=0; i<IS_SCHED_CLASSES; i++) {
+      if (strcasecmp(priority, sched_class_names[i]) == 0) {
+        jp->class = i;
+        break;
+      }
+    }
+  }
+
+  if (jp->class == IS_SCHED_VIEW && job_type != NULL && !async && strcasecmp(job_type, "jpeg") == 0) {
+    isSchedWatch(sp, job);
+  }
+  json_decref(job);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  if (deadline_ms >= 0) {
+    jp->has_deadline = 1;
+    isSchedMsFromNow(&jp->deadline, deadline_ms);
+  }
+}
+
+/** Does a new job replace one with this tag and type?
+ **
+ ** @param jp   The new job
+ **
+ ** @param tag  The other job's tag
+ **
+ ** @param type and type
+ **
+ ** @returns 1 if it does
+ */
+static int isSchedSupersedes(isSchedJobType *jp, const char *tag, const char *type) {
+  if (tag == NULL) {
+    return 0;
+  }
+  if (jp->supersedes != NULL && strcmp(jp->supersedes, tag) == 0) {
+    return 1;
+  }
+  return jp->tag != NULL && jp->type != NULL && type != NULL && strcmp(jp->tag, tag) == 0 && strcasecmp(jp->type, type) == 0;
+}
+
+/** Answer a job without a worker
+ **
+ ** @param sp  Our state
+ **
+ ** @param jp  The job, off its list.  We free it.
+ **
+ ** @param why The error reply
+ */
+static void isSchedAnswer(isSchedType *sp, isSchedJobType *jp, const char *why) {
+  int i;
+
+  if (jp->request == 0) {
+    // No envelope, nowhere to send a reply
+    isSchedJobFree(jp);
+    return;
+  }
+
+  is_zmq_error_reply(jp->msgs, jp->request, sp->front, "%s", why);
+  for (i=jp->request; i<jp->nmsgs; i++) {
+    zmq_msg_close(&jp->msgs[i]);
+  }
+  jp->nmsgs = 0;
+  isSchedJobFree(jp);
+
+  // Answered without a worker, as far as the statistics go
+  __sync_add_and_fetch(&sp->wctx->jobsTaken, 1);
+  __sync_add_and_fetch(&sp->wctx->jobsDone, 1);
+}
+
+/** Answer the waiting jobs a new one replaces and tell the workers
+ ** on one to give up
+ **
+ ** @param sp Our state
+ **
+ ** @param jp The new job, not queued yet
+ */
+static void isSchedSupersede(isSchedType *sp, isSchedJobType *jp) {
+  static const char *id = FILEID "isSchedSupersede";
+  isSchedJobType **jpp;
+  isSchedJobType *old;
+  char why[128];
+  int n;
+  int c;
+  int w;
+
+  if (jp->tag == NULL && jp->supersedes == NULL) {
+    return;
+  }
+
+  snprintf(why, sizeof(why)-1, "%s: Superseded", id);
+  why[sizeof(why)-1] = 0;
+
+  n = 0;
+  for (c=0; c<IS_SCHED_CLASSES; c++) {
+    for (jpp=&sp->first[c]; *jpp != NULL; ) {
+      old = *jpp;
+      if (!isSchedSupersedes(jp, old->tag, old->type)) {
+        jpp = &old->next;
+        continue;
+      }
+      isSchedUnlink(sp, jpp);
+      isSchedAnswer(sp, old, why);
+      n++;
+    }
+  }
+
+  for (w=0; w<N_WORKER_THREADS; w++) {
+    if (!sp->workers[w].idle && isSchedSupersedes(jp, sp->workers[w].tag, sp->workers[w].type)) {
+      __sync_fetch_and_or(&sp->wctx->superseded[w], 1);
+    }
+  }
+
+  if (n) {
+    isLogging_debug("%s: %s: %d waiting job%s superseded\n", id, sp->wctx->key, n, n == 1 ? "" : "s");
+  }
+}
+
+/** Take a job from the proxy and queue it
+ **
+ ** @returns 0 if there was a job, -1 if not
+ */
+static int isSchedTake(isSchedType *sp) {
+  static const char *id = FILEID "isSchedTake";
+  isSchedJobType *jp;
+  zmq_msg_t zmsg;
+  int delimiter;
+  int more;
+
+  zmq_msg_init(&zmsg);
+  if (zmq_msg_recv(&zmsg, sp->front, ZMQ_DONTWAIT) == -1) {
+    zmq_msg_close(&zmsg);
+    return -1;
+  }
+
+  jp = calloc(1, sizeof(*jp));
+  if (jp == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  delimiter = -1;
+  while (1) {
+    more = zmq_msg_more(&zmsg);
+    if (jp->nmsgs == IS_SCHED_PARTS) {
+      // More than we are prepared to pass on: drop the rest
+      isLogging_err("%s: Dropping request part beyond %d\n", id, IS_SCHED_PARTS);
+      zmq_msg_close(&zmsg);
+    } else {
+      if (delimiter == -1 && zmq_msg_size(&zmsg) == 0) {
+        delimiter = jp->nmsgs;
+      }
+      zmq_msg_init(&jp->msgs[jp->nmsgs]);
+      zmq_msg_move(&jp->msgs[jp->nmsgs], &zmsg);
+      zmq_msg_close(&zmsg);
+      jp->nmsgs++;
+    }
+    if (!more) {
+      break;
+    }
+    zmq_msg_init(&zmsg);
+    zmq_msg_recv(&zmsg, sp->front, 0);
+  }
+
+  jp->request = delimiter + 1;
+  isSchedClassify(sp, jp);
+  isSchedSupersede(sp, jp);
+
+  *sp->last[jp->class] = jp;
+  sp->last[jp->class]  = &jp->next;
+  return 0;
+}
+
+/** Answer a job that waited too long
+ */
+static void isSchedExpire(isSchedType *sp, isSchedJobType *jp) {
+  static const char *id = FILEID "isSchedExpire";
+  char why[128];
+
+  isLogging_info("%s: %s: dropping a %s job that did not start by its deadline\n", id, sp->wctx->key, sched_class_names[jp->class]);
+
+  snprintf(why, sizeof(why)-1, "%s: Not started within its deadline", id);
+  why[sizeof(why)-1] = 0;
+  isSchedAnswer(sp, jp, why);
+}
+
+/** Answer the jobs whose deadline has passed
+ **
+ ** @returns Milliseconds until the next deadline, -1 if there is none
+ */
+static long isSchedExpireAll(isSchedType *sp) {
+  isSchedJobType **jpp;
+  isSchedJobType *jp;
+  long rtn;
+  long ms;
+  int c;
+
+  rtn = -1;
+  for (c=0; c<IS_SCHED_CLASSES; c++) {
+    for (jpp=&sp->first[c]; *jpp != NULL; ) {
+      jp = *jpp;
+      if (!jp->has_deadline) {
+        jpp = &jp->next;
+        continue;
+      }
+
+      ms = isSchedMsUntil(&jp->deadline);
+      if (ms > 0) {
+        if (rtn == -1 || ms < rtn) {
+          rtn = ms;
+        }
+        jpp = &jp->next;
+        continue;
+      }
+
+      isSchedUnlink(sp, jpp);
+      isSchedExpire(sp, jp);
+    }
+  }
+  return rtn;
+}
+
+/** Give the idle workers the best jobs waiting
+ **
+ ** @returns Milliseconds until we should try a worker that was not
+ ** connected yet, -1 if none
+ */
+static long isSchedDispatch(isSchedType *sp) {
+  static const char *id = FILEID "isSchedDispatch";
+  isSchedJobType **jpp;
+  isSchedJobType *jp;
+  isSchedWorkerType *wp;
+  char wid[16];
+  long rtn;
+  long ms;
+  int w;
+  int c;
+  int i;
+
+  rtn = -1;
+  for (w=0; w<N_WORKER_THREADS; w++) {
+    wp = &sp->workers[w];
+    if (!wp->idle) {
+      continue;
+    }
+
+    ms = isSchedMsUntil(&wp->retry);
+    if (ms > 0) {
+      if (rtn == -1 || ms < rtn) {
+        rtn = ms;
+      }
+      continue;
+    }
+
+    //
+    // Best class first, oldest first within it.  Long jobs and
+    // prefetches wait their turn.
+    //
+    jp  = NULL;
+    jpp = NULL;
+    for (c=0; c<IS_SCHED_CLASSES && jp == NULL; c++) {
+      for (jpp=&sp->first[c]; *jpp != NULL; jpp=&(*jpp)->next) {
+        if ((*jpp)->is_long && sp->running_long >= IS_WORKER_MAX_LONG) {
+          continue;
+        }
+        if ((*jpp)->prefetch && sp->running_idle >= IS_PREFETCH_WORKERS) {
+          continue;
+        }
+        jp = *jpp;
+        break;
+      }
+    }
+    if (jp == NULL) {
+      break;
+    }
+
+    isSchedWorkerId(w, wid, sizeof(wid));
+    if (zmq_send(sp->back, wid, strlen(wid), ZMQ_SNDMORE) == -1) {
+      if (errno != EHOSTUNREACH) {
+        isLogging_err("%s: Could not send to worker %d: %s\n", id, w, zmq_strerror(errno));
+      }
+      //
+      // Not connected yet.  Leave the job where it is.
+      //
+      isSchedMsFromNow(&wp->retry, IS_SCHED_RETRY_MS);
+      if (rtn == -1 || IS_SCHED_RETRY_MS < rtn) {
+        rtn = IS_SCHED_RETRY_MS;
+      }
+      continue;
+    }
+
+    isSchedUnlink(sp, jpp);
+
+    // Whatever its last job was, this one is wanted
+    __sync_fetch_and_and(&sp->wctx->superseded[w], 0);
+
+    for (i=0; i<jp->nmsgs; i++) {
+      zmq_msg_send(&jp->msgs[i], sp->back, i < jp->nmsgs-1 ? ZMQ_SNDMORE : 0);
+      zmq_msg_close(&jp->msgs[i]);
+    }
+    jp->nmsgs = 0;
+
+    wp->idle    = 0;
+    wp->is_long = jp->is_long;
+    wp->type    = jp->type;
+    wp->tag     = jp->tag;
+    wp->prefetch = jp->prefetch;
+    jp->type    = NULL;
+    jp->tag     = NULL;
+    if (jp->is_long) {
+      sp->running_long++;
+    }
+    if (jp->prefetch) {
+      sp->running_idle++;
+    }
+    isSchedJobFree(jp);
+  }
+  return rtn;
+}
+
+/** Pass a worker's reply back to the proxy and note the worker is free
+ **
+ ** @returns 0 if there was a reply, -1 if not
+ */
+static int isSchedReply(isSchedType *sp) {
+  static const char *id = FILEID "isSchedReply";
+  zmq_msg_t zmsg;
+  char wid[16];
+  int nreceived;
+  int prefetch;
+  int more;
+  int w;
+
+  nreceived = zmq_recv(sp->back, wid, sizeof(wid)-1, ZMQ_DONTWAIT);
+  if (nreceived == -1) {
+    return -1;
+  }
+  wid[nreceived < sizeof(wid) ? nreceived : sizeof(wid)-1] = 0;
+
+  w = -1;
+  prefetch = 0;
+  if (wid[0] == 'w') {
+    w = atoi(wid+1);
+  }
+  if (w < 0 || w >= N_WORKER_THREADS) {
+    isLogging_err("%s: Reply from unknown worker '%s'\n", id, wid);
+  } else {
+    if (sp->workers[w].is_long) {
+      sp->running_long--;
+    }
+    prefetch = sp->workers[w].prefetch;
+    if (prefetch) {
+      sp->running_idle--;
+    }
+    sp->workers[w].idle    = 1;
+    sp->workers[w].is_long = 0;
+    sp->workers[w].prefetch = 0;
+    free(sp->workers[w].type);
+    free(sp->workers[w].tag);
+    sp->workers[w].type    = NULL;
+    sp->workers[w].tag     = NULL;
+  }
+
+  do {
+    zmq_msg_init(&zmsg);
+    zmq_msg_recv(&zmsg, sp->back, 0);
+    more = zmq_msg_more(&zmsg);
+    if (!prefetch) {
+      zmq_msg_send(&zmsg, sp->front, more ? ZMQ_SNDMORE : 0);
+    }
+    zmq_msg_close(&zmsg);
+  } while (more);
+
+  if (prefetch) {
+    // Not a request, as far as the statistics go
+    __sync_sub_and_fetch(&sp->wctx->jobsTaken, 1);
+    __sync_sub_and_fetch(&sp->wctx->jobsDone, 1);
+  }
+
+  return 0;
+}
+
+/** Our thread.  Runs until the supervisor shuts the zmq context down.
+ **
+ ** @param voidp Our isSchedType
+ */
+static void *isSched(void *voidp) {
+  static const char *id = FILEID "isSched";
+  isSchedType *sp;
+  isSchedJobType *jp;
+  zmq_pollitem_t zpollitems[2];
+  long timeout;
+  long ms;
+  int err;
+  int c;
+
+  sp = voidp;
+
+  zpollitems[0].socket = sp->back;
+  zpollitems[0].events = ZMQ_POLLIN;
+  zpollitems[1].socket = sp->front;
+  zpollitems[1].events = ZMQ_POLLIN;
+
+  timeout = -1;
+  while (1) {
+    err = zmq_poll(zpollitems, 2, timeout);
+    if (err == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != ETERM) {
+        isLogging_err("%s: zmq_poll error: %s\n", id, zmq_strerror(errno));
+      }
+      break;
+    }
+
+    //
+    // Replies first: they free up workers
+    //
+    if (zpollitems[0].revents & ZMQ_POLLIN) {
+      while (isSchedReply(sp) == 0);
+    }
+
+    if (zpollitems[1].revents & ZMQ_POLLIN) {
+      while (isSchedTake(sp) == 0);
+    }
+
+    //
+    // Idle workers get what they can first: only jobs still waiting
+    // can miss their deadline
+    //
+    timeout = isSchedDispatch(sp);
+    ms      = isSchedExpireAll(sp);
+    if (ms != -1 && (timeout == -1 || ms < timeout)) {
+      timeout = ms;
+    }
+  }
+
+  for (c=0; c<IS_SCHED_CLASSES; c++) {
+    while (sp->first[c] != NULL) {
+      jp = sp->first[c];
+      sp->first[c] = jp->next;
+      isSchedJobFree(jp);
+    }
+  }
+  for (c=0; c<N_WORKER_THREADS; c++) {
+    free(sp->workers[c].type);
+    free(sp->workers[c].tag);
+  }
+  if (sp->pf_job != NULL) {
+    pthread_mutex_lock(&sp->wctx->metaMutex);
+    json_decref(sp->pf_job);
+    pthread_mutex_unlock(&sp->wctx->metaMutex);
+  }
+  zmq_close(sp->front);
+  zmq_close(sp->back);
+  free(sp);
+  return NULL;
+}
+
+/** Start our thread.  Called by isSupervisor before it starts the
+ ** workers so they have something to connect to.
+ **
+ ** @param wctx Worker context.  wctx->dealer must be bound already.
+ */
+void isSchedInit(isWorkerContext_t *wctx) {
+  static const char *id = FILEID "isSchedInit";
+  isSchedType *sp;
+  char endpoint[256];
+  int socket_option;
+  int err;
+  int c;
+
+  sp = calloc(1, sizeof(*sp));
+  if (sp == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  sp->wctx = wctx;
+  for (c=0; c<IS_SCHED_CLASSES; c++) {
+    sp->last[c] = &sp->first[c];
+  }
+  for (c=0; c<N_WORKER_THREADS; c++) {
+    sp->workers[c].idle = 1;
+  }
+
+  sp->front = zmq_socket(wctx->zctx, ZMQ_DEALER);
+  sp->back  = zmq_socket(wctx->zctx, ZMQ_ROUTER);
+  if (sp->front == NULL || sp->back == NULL) {
+    isLogging_err("%s: Could not create scheduler sockets: %s\n", id, zmq_strerror(errno));
+    exit (-1);
+  }
+
+  socket_option = isQueueHwm();
+  zmq_setsockopt(sp->front, ZMQ_RCVHWM, &socket_option, sizeof(socket_option));
+  zmq_setsockopt(sp->front, ZMQ_SNDHWM, &socket_option, sizeof(socket_option));
+  zmq_setsockopt(sp->back,  ZMQ_RCVHWM, &socket_option, sizeof(socket_option));
+  zmq_setsockopt(sp->back,  ZMQ_SNDHWM, &socket_option, sizeof(socket_option));
+
+  //
+  // Tell us when a worker is not there rather than dropping its job
+  //
+  socket_option = 1;
+  zmq_setsockopt(sp->back, ZMQ_ROUTER_MANDATORY, &socket_option, sizeof(socket_option));
+
+  snprintf(endpoint, sizeof(endpoint)-1, "inproc://#%s", wctx->inprocKey);
+  endpoint[sizeof(endpoint)-1] = 0;
+  err = zmq_connect(sp->front, endpoint);
+  if (err == -1) {
+    isLogging_err("%s: Failed to connect to %s: %s\n", id, endpoint, zmq_strerror(errno));
+    exit (-1);
+  }
+
+  snprintf(endpoint, sizeof(endpoint)-1, "inproc://#%s-workers", wctx->inprocKey);
+  endpoint[sizeof(endpoint)-1] = 0;
+  err = zmq_bind(sp->back, endpoint);
+  if (err == -1) {
+    isLogging_err("%s: Could not bind %s: %s\n", id, endpoint, zmq_strerror(errno));
+    exit (-1);
+  }
+
+  err = pthread_create(&wctx->schedThread, NULL, isSched, sp);
+  if (err != 0) {
+    isLogging_err("%s: Could not start scheduler: %s\n", id, strerror(err));
+    exit (-1);
+  }
+}
@@ -0,0 +1,470 @@
+/*! @file isSpotFinder.c
+ *  @copyright 2018 by Northwestern University
+ *  @author Keith Brister
+ *  @brief Find and measure spots on full resolution images
+ *
+ *  The frame is split into bands of rows, one per thread.  Each band
+ *  first accumulates background statistics in rings around the beam
+ *  center.  The rings get a threshold of mean + sigma * sd computed
+ *  after clipping the brightest pixels (the spots themselves) from
+ *  the statistics.  Each band then finds runs of pixels above the
+ *  threshold and joins touching runs (8-connected) with a union-find.
+ *  Runs that touch across band boundaries are joined at the end and
+ *  each connected component becomes a spot with a centroid and a
+ *  background subtracted intensity.
+ */
+#include "is.h"
+
+/** Statistics for one ring around the beam center, one per thread per ring
+ */
+typedef struct isSpotRingStruct {
+  double n;                     //!< number of pixels
+  double sum;                   //!< sum of pixel values
+  double sum2;                  //!< sum of squares of pixel values
+} isSpotRingType;
+
+/** A horizontal run of pixels above threshold.  Runs are joined into spots.
+ */
+typedef struct isSpotRunStruct {
+  int row;                      //!< row the run is on
+  int start;                    //!< first column in the run
+  int end;                      //!< last column in the run
+  int npix;                     //!< pixels in the run (after joining: in the spot)
+  uint32_t peak;                //!< largest pixel value
+  double sum;                   //!< background subtracted intensity
+  double sumx;                  //!< intensity weighted column
+  double sumy;                  //!< intensity weighted row
+} isSpotRunType;
+
+/** Everything a band thread needs and everything it finds
+ */
+typedef struct isSpotBandStruct {
+  isImageBufType *raw;          //!< the image (read locked by our caller)
+  int width;                    //!< image width
+  int row0;                     //!< first row of our band
+  int row1;                     //!< one past the last row of our band
+  double cx;                    //!< beam center column
+  double cy;                    //!< beam center row
+  double bin_scale;             //!< ring number = distance^2 * bin_scale
+  const double *clip;           //!< pixel values above clip[ring] are left out of the background (NULL for no clipping)
+  const uint32_t *thresh;       //!< pixels above thresh[ring] are spot pixels
+  const double *background;     //!< mean background for each ring
+  isSpotRingType rings[IS_SPOT_FINDER_BINS];    //!< our contribution to the ring statistics
+  isSpotRunType *runs;          //!< runs found in our band, in row order
+  int *parent;                  //!< union-find parent for each run (index into runs)
+  int nruns;                    //!< number of runs found
+  int maxruns;                  //!< size of the runs and parent arrays
+  int first_row_end;            //!< runs[0..first_row_end-1] are on row0
+  int last_row_start;           //!< runs[last_row_start..nruns-1] are on row1-1
+} isSpotBandType;
+
+/** Is this pixel one we can use?  Bad pixels, detector gaps, and
+ ** saturated pixels are not.
+ */
+static inline int isSpotPixel(const isImageBufType *raw, int i, uint32_t *v) {
+  if (raw->bad_pixel_map && ((const uint32_t *)raw->bad_pixel_map)[i]) {
+    return 0;
+  }
+  if (raw->buf_depth == 2) {
+    *v = ((const uint16_t *)raw->buf)[i];
+    return *v != 0xffff;
+  }
+  *v = ((const uint32_t *)raw->buf)[i];
+  return *v != 0xffffffff;
+}
+
+/** Ring number for a pixel
+ */
+static inline int isSpotRing(const isSpotBandType *bp, int row, int col) {
+  double dx, dy;
+  int rtn;
+
+  dx = col - bp->cx;
+  dy = row - bp->cy;
+  rtn = (dx * dx + dy * dy) * bp->bin_scale;
+  return rtn >= IS_SPOT_FINDER_BINS ? IS_SPOT_FINDER_BINS - 1 : rtn;
+}
+
+/** Accumulate ring statistics for our band.
+ **
+ ** @param voidp  our isSpotBandType
+ */
+static void *isSpotBandStats(void *voidp) {
+  isSpotBandType *bp;
+  int row, col;
+  int ring;
+  uint32_t v;
+
+  bp = voidp;
+  memset(bp->rings, 0, sizeof(bp->rings));
+
+  for (row=bp->row0; row<bp->row1; row++) {
+    for (col=0; col<bp->width; col++) {
+      if (!isSpotPixel(bp->raw, row * bp->width + col, &v)) {
+        continue;
+      }
+      ring = isSpotRing(bp, row, col);
+      if (bp->clip != NULL && v > bp->clip[ring]) {
+        continue;
+      }
+      bp->rings[ring].n    += 1.0;
+      bp->rings[ring].sum  += v;
+      bp->rings[ring].sum2 += (double)v * (double)v;
+    }
+  }
+  return NULL;
+}
+
+/** Union-find: the root of a run
+ */
+static int isSpotFind(int *parent, int i) {
+  int root;
+  int next;
+
+  for (root=i; parent[root] != root; root = parent[root]);
+
+  // Path compression
+  while (parent[i] != root) {
+    next = parent[i];
+    parent[i] = root;
+    i = next;
+  }
+  return root;
+}
+
+/** Union-find: join two runs into the same spot
+ */
+static void isSpotUnion(int *parent, int a, int b) {
+  a = isSpotFind(parent, a);
+  b = isSpotFind(parent, b);
+  if (a < b) {
+    parent[b] = a;
+  } else if (b < a) {
+    parent[a] = b;
+  }
+}
+
+/** Find the runs in our band and join the ones that touch.
+ **
+ ** @param voidp  our isSpotBandType
+ */
+static void *isSpotBandLabel(void *voidp) {
+  static const char *id = FILEID "isSpotBandLabel";
+  isSpotBandType *bp;
+  isSpotRunType *rp;
+  int row, col;
+  int ring;
+  int prev_start;               // first run on the previous row
+  int prev_end;                 // one past the last run on the previous row
+  int this_start;               // first run on this row
+  int j;
+  uint32_t v;
+  double d;
+
+  bp = voidp;
+  bp->nruns = 0;
+  bp->first_row_end  = 0;
+  bp->last_row_start = 0;
+
+  prev_start = prev_end = 0;
+  for (row=bp->row0; row<bp->row1; row++) {
+    this_start = bp->nruns;
+    rp = NULL;
+    for (col=0; col<bp->width; col++) {
+      if (!isSpotPixel(bp->raw, row * bp->width + col, &v)) {
+        rp = NULL;
+        continue;
+      }
+      ring = isSpotRing(bp, row, col);
+      if (v <= bp->thresh[ring]) {
+        rp = NULL;
+        continue;
+      }
+
+      if (rp == NULL) {
+        // Start a new run
+        if (bp->nruns >= bp->maxruns) {
+          bp->maxruns = bp->maxruns == 0 ? 1024 : 2 * bp->maxruns;
+          bp->runs   = realloc(bp->runs,   bp->maxruns * sizeof(*bp->runs));
+          bp->parent = realloc(bp->parent, bp->maxruns * sizeof(*bp->parent));
+          if (bp->runs == NULL || bp->parent == NULL) {
+            isLogging_crit("%s: Out of memory\n", id);
+            exit (-1);
+          }
+        }
+        bp->parent[bp->nruns] = bp->nruns;
+        rp = &bp->runs[bp->nruns++];
+        memset(rp, 0, sizeof(*rp));
+        rp->row   = row;
+        rp->start = col;
+      }
+
+      d = v - bp->background[ring];
+      rp->end   = col;
+      rp->npix++;
+      rp->peak  = v > rp->peak ? v : rp->peak;
+      rp->sum  += d;
+      rp->sumx += d * (col + 0.5);
+      rp->sumy += d * (row + 0.5);
+    }
+
+    //
+    // Join with the runs on the previous row that touch, including
+    // diagonally.  Both rows are sorted by column so we can walk them
+    // together.
+    //
+    j = prev_start;
+    for (rp=&bp->runs[this_start]; rp<&bp->runs[bp->nruns]; rp++) {
+      while (j < prev_end && bp->runs[j].end < rp->start - 1) {
+        j++;
+      }
+      while (j < prev_end && bp->runs[j].start <= rp->end + 1) {
+        isSpotUnion(bp->parent, j, rp - bp->runs);
+        if (bp->runs[j].end > rp->end) {
+          break;        // this previous run may touch the next run too
+        }
+        j++;
+      }
+    }
+
+    if (row == bp->row0) {
+      bp->first_row_end = bp->nruns;
+    }
+    bp->last_row_start = this_start;
+    prev_start = this_start;
+    prev_end   = bp->nruns;
+  }
+  return NULL;
+}
+
+/** Sort spots by decreasing intensity
+ */
+static int isSpotCompare(const void *a, const void *b) {
+  const isSpotRunType *sa = a;
+  const isSpotRunType *sb = b;
+
+  return sa->sum < sb->sum ? 1 : (sa->sum > sb->sum ? -1 : 0);
+}
+
+/** Run the threads for one pass over the image
+ */
+static void isSpotRunBands(isSpotBandType *bands, int nbands, void *(*fn)(void *)) {
+  static const char *id = FILEID "isSpotRunBands";
+  pthread_t threads[IS_SPOT_FINDER_THREADS];
+  int i;
+  int err;
+
+  for (i=1; i<nbands; i++) {
+    err = pthread_create(&threads[i], NULL, fn, &bands[i]);
+    if (err != 0) {
+      isLogging_err("%s: Could not start thread: %s\n", id, strerror(err));
+      exit (-1);
+    }
+  }
+  fn(&bands[0]);
+  for (i=1; i<nbands; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+/** Find the spots on a full resolution image.
+ **
+ ** @param raw        Read locked raw image
+ **
+ ** @param sigma      Pixels more than sigma standard deviations above their ring's background are spot pixels
+ **
+ ** @param min_pixels Smallest number of pixels in a spot
+ **
+ ** @param spotsp     Returns a malloc'ed array of spots, brightest first.  Never NULL, even when there are no spots.
+ **
+ ** @returns the number of spots found
+ */
+int isSpotFinder(isImageBufType *raw, double sigma, int min_pixels, isSpotType **spotsp) {
+  static const char *id = FILEID "isSpotFinder";
+  isSpotBandType bands[IS_SPOT_FINDER_THREADS];
+  isSpotRingType rings[IS_SPOT_FINDER_BINS];
+  double clip[IS_SPOT_FINDER_BINS];
+  double background[IS_SPOT_FINDER_BINS];
+  uint32_t thresh[IS_SPOT_FINDER_BINS];
+  double mean, sd;
+  double max_dist2, d2;
+  int width, height;
+  int nbands;
+  int pass;
+  int i, j, b;
+  int total;            // total number of runs
+  int *offset;          // first global run number for each band
+  int *parent;          // global union-find
+  isSpotRunType *runs;  // all the runs
+  isSpotRunType *rp;
+  isSpotType *spots;
+  int nspots;
+  int root;
+
+  width  = raw->buf_width;
+  height = raw->buf_height;
+
+  memset(bands, 0, sizeof(bands));
+
+  nbands = height < IS_SPOT_FINDER_THREADS ? 1 : IS_SPOT_FINDER_THREADS;
+
+  bands[0].raw = raw;
+  bands[0].cx  = get_double_from_json_object(id, raw->meta, "beam_center_x");
+  bands[0].cy  = get_double_from_json_object(id, raw->meta, "beam_center_y");
+
+  //
+  // Rings are equally spaced in distance squared so that each holds
+  // about the same number of pixels.
+  //
+  max_dist2 = 0.0;
+  for (i=0; i<4; i++) {
+    double dx = (i & 1 ? width  : 0) - bands[0].cx;
+    double dy = (i & 2 ? height : 0) - bands[0].cy;
+    d2 = dx * dx + dy * dy;
+    max_dist2 = d2 > max_dist2 ? d2 : max_dist2;
+  }
+  bands[0].bin_scale = max_dist2 > 0.0 ? IS_SPOT_FINDER_BINS / max_dist2 : 0.0;
+
+  for (b=0; b<nbands; b++) {
+    bands[b]            = bands[0];
+    bands[b].width      = width;
+    bands[b].row0       = (int64_t)height * b / nbands;
+    bands[b].row1       = (int64_t)height * (b + 1) / nbands;
+    bands[b].thresh     = thresh;
+    bands[b].background = background;
+  }
+
+  //
+  // Background: once with everything, once again without the
+  // pixels that are clearly not background.
+  //
+  for (pass=0; pass<2; pass++) {
+    for (b=0; b<nbands; b++) {
+      bands[b].clip = pass == 0 ? NULL : clip;
+    }
+    isSpotRunBands(bands, nbands, isSpotBandStats);
+
+    memset(rings, 0, sizeof(rings));
+    for (b=0; b<nbands; b++) {
+      for (i=0; i<IS_SPOT_FINDER_BINS; i++) {
+        rings[i].n    += bands[b].rings[i].n;
+        rings[i].sum  += bands[b].rings[i].sum;
+        rings[i].sum2 += bands[b].rings[i].sum2;
+      }
+    }
+
+    for (i=0; i<IS_SPOT_FINDER_BINS; i++) {
+      mean = 0.0;
+      sd   = 0.0;
+      if (rings[i].n > 0) {
+        mean = rings[i].sum / rings[i].n;
+        sd   = rings[i].sum2 / rings[i].n - mean * mean;
+        sd   = sd > 0.0 ? sqrt(sd) : 0.0;
+      }
+      clip[i]       = mean + IS_SPOT_FINDER_CLIP * sd;
+      background[i] = mean;
+      d2            = floor(mean + sigma * sd);
+      thresh[i]     = d2 > (double)0xfffffffe ? 0xfffffffe : (uint32_t)d2;
+    }
+  }
+
+  //
+  // Find and join the runs in each band
+  //
+  isSpotRunBands(bands, nbands, isSpotBandLabel);
+
+  offset = calloc(nbands + 1, sizeof(*offset));
+  if (offset == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  for (b=0; b<nbands; b++) {
+    offset[b+1] = offset[b] + bands[b].nruns;
+  }
+  total = offset[nbands];
+
+  runs   = malloc((total + 1) * sizeof(*runs));
+  parent = malloc((total + 1) * sizeof(*parent));
+  if (runs == NULL || parent == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  for (b=0; b<nbands; b++) {
+    for (i=0; i<bands[b].nruns; i++) {
+      runs[offset[b] + i]   = bands[b].runs[i];
+      parent[offset[b] + i] = offset[b] + isSpotFind(bands[b].parent, i);
+    }
+  }
+
+  //
+  // Join the runs that touch across band boundaries
+  //
+  for (b=1; b<nbands; b++) {
+    int a0, a1;         // runs on the last row of the band above
+    int b0, b1;         // runs on the first row of this band
+
+    a0 = offset[b-1] + bands[b-1].last_row_start;
+    a1 = offset[b];
+    b0 = offset[b];
+    b1 = offset[b] + bands[b].first_row_end;
+    for (i=a0; i<a1; i++) {
+      for (j=b0; j<b1; j++) {
+        if (runs[j].start <= runs[i].end + 1 && runs[j].end >= runs[i].start - 1) {
+          isSpotUnion(parent, i, j);
+        }
+      }
+    }
+  }
+
+  //
+  // Roll the runs up into their roots
+  //
+  for (i=0; i<total; i++) {
+    root = isSpotFind(parent, i);
+    if (root == i) {
+      continue;
+    }
+    rp = &runs[root];
+    rp->npix += runs[i].npix;
+    rp->peak  = runs[i].peak > rp->peak ? runs[i].peak : rp->peak;
+    rp->sum  += runs[i].sum;
+    rp->sumx += runs[i].sumx;
+    rp->sumy += runs[i].sumy;
+  }
+
+  nspots = 0;
+  for (i=0; i<total; i++) {
+    if (parent[i] == i && runs[i].npix >= min_pixels && runs[i].sum > 0.0) {
+      runs[nspots++] = runs[i];
+    }
+  }
+
+  qsort(runs, nspots, sizeof(*runs), isSpotCompare);
+
+  spots = malloc((nspots + 1) * sizeof(*spots));
+  if (spots == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  for (i=0; i<nspots; i++) {
+    spots[i].x         = runs[i].sumx / runs[i].sum;
+    spots[i].y         = runs[i].sumy / runs[i].sum;
+    spots[i].intensity = runs[i].sum;
+    spots[i].npix      = runs[i].npix;
+    spots[i].peak      = runs[i].peak;
+  }
+
+  isLogging_info("%s: found %d spots from %d runs\n", id, nspots, total);
+
+  for (b=0; b<nbands; b++) {
+    free(bands[b].runs);
+    free(bands[b].parent);
+  }
+  free(offset);
+  free(runs);
+  free(parent);
+
+  *spotsp = spots;
+  return nspots;
+}
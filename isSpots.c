@@ -5,6 +5,95 @@
  */
 #include "is.h"
 
+/** Send our 3 part reply: an empty error frame, the job, and the meta data
+ **
+ ** @param wctx Worker context
+ **  @li @c wctx->metaMutex  Keeps jansson calls in line
+ **
+ ** @param tcp Thread data
+ **   @li @c tcp->rep  ZMQ Response socket into which to throw our response.
+ **
+ ** @param job   What the user asked us to do
+ **
+ ** @param meta  What we found
+ */
+void isSpotsReply(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job, json_t *meta) {
+  static const char *id = FILEID "isSpotsReply";
+  char *job_str;                // stringified version of job
+  char *meta_str;               // stringified version of meta
+  int err;                      // error code from routies that return integers
+  zmq_msg_t err_msg;            // error message to send via zmq
+  zmq_msg_t job_msg;            // the job message to send via zmq
+  zmq_msg_t meta_msg;           // the metadata to send via zmq
+
+  // Compose messages
+
+  // Err
+  zmq_msg_init(&err_msg);
+
+  // Job
+  job_str = NULL;
+  if (job != NULL) {
+    pthread_mutex_lock(&wctx->metaMutex);
+    job_str = json_dumps(job, JSON_SORT_KEYS | JSON_INDENT(0) | JSON_COMPACT);
+    pthread_mutex_unlock(&wctx->metaMutex);
+  }
+  if (job_str == NULL) {
+    job_str = strdup("");
+  }
+
+  err = zmq_msg_init_data(&job_msg, job_str, strlen(job_str), is_zmq_free_fn, NULL);
+  if (err != 0) {
+    isLogging_err("%s: zmq_msg_init failed (job_str): %s\n", id, zmq_strerror(errno));
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Could not initialize reply message (job_str)", id);
+    pthread_exit (NULL);
+  }
+
+  // Meta
+  meta_str = NULL;
+  if (meta != NULL) {
+    pthread_mutex_lock(&wctx->metaMutex);
+     meta_str = json_dumps(meta, JSON_SORT_KEYS | JSON_INDENT(0) | JSON_COMPACT);
+    pthread_mutex_unlock(&wctx->metaMutex);
+  }
+  if (meta_str == NULL) {
+    meta_str = strdup("");
+  }
+
+  err = zmq_msg_init_data(&meta_msg, meta_str, strlen(meta_str), is_zmq_free_fn, NULL);
+  if (err == -1) {
+    isLogging_err("%s: zmq_msg_init failed (meta_str): %s\n", id, zmq_strerror(errno));
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Could not initialize reply message (meta_str)", id);
+    pthread_exit (NULL);
+  }
+
+  isLogging_info("%s: returning meta data %s", id, meta_str);
+
+  // Send them out
+  do {
+    // Error Message
+    err = zmq_msg_send(&err_msg, tcp->rep, ZMQ_SNDMORE);
+    if (err == -1) {
+      isLogging_err("%s: Could not send empty error frame: %s\n", id, zmq_strerror(errno));
+      break;
+    }
+
+    // Job 
+    err = zmq_msg_send(&job_msg, tcp->rep, ZMQ_SNDMORE);
+    if (err < 0) {
+      isLogging_err("%s: sending job_str failed: %s\n", id, zmq_strerror(errno));
+      break;
+    }
+
+    // Meta
+    err = zmq_msg_send(&meta_msg, tcp->rep, 0);
+    if (err == -1) {
+      isLogging_err("%s: sending meta_str failed: %s\n", id, zmq_strerror(errno));
+      break;
+    }
+  } while (0);
+}
+
 /** Count the spots in an image
  **
  ** @param wctx Worker context
@@ -28,12 +117,6 @@ void isSpots(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
   static const char *id = FILEID "isSpots";
   const char *fn;                       // file name from job.
   isImageBufType *imb;
-  char *job_str;                // stringified version of job
-  char *meta_str;               // stringified version of meta
-  int err;                      // error code from routies that return integers
-  zmq_msg_t err_msg;            // error message to send via zmq
-  zmq_msg_t job_msg;            // the job message to send via zmq
-  zmq_msg_t meta_msg;           // the metadata to send via zmq
   json_t *jxsize;               // xsize entry in job
 
   pthread_mutex_lock(&wctx->metaMutex);
@@ -72,6 +155,11 @@ void isSpots(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
   if (imb == NULL) {
     char *tmps;
 
+    if (isSchedSuperseded(wctx)) {
+      is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Superseded", id);
+      return;
+    }
+
     pthread_mutex_lock(&wctx->metaMutex);
     tmps = json_dumps(job, JSON_SORT_KEYS | JSON_COMPACT | JSON_INDENT(0));
     pthread_mutex_unlock(&wctx->metaMutex);
@@ -83,72 +171,267 @@ void isSpots(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
     return;
   }
 
-  // Compose messages
+  isSpotsReply(wctx, tcp, job, imb->meta);
 
-  // Err
-  zmq_msg_init(&err_msg);
+  pthread_rwlock_unlock(&imb->buflock);
+
+  pthread_mutex_lock(&wctx->ctxMutex);
+  imb->in_use--;
+
+  assert(imb->in_use >= 0);
+
+  pthread_mutex_unlock(&wctx->ctxMutex);
+}
+
+/** Spots for a frame, from our buffer cache when we can.
+ **
+ ** Results are kept in our image buffer cache under a key made from
+ ** the frame and the finder parameters.
+ **
+ ** @param wctx Worker context
+ **  @li @c wctx->ctxMutex   Keeps the worker theads in line
+ **  @li @c wctx->metaMutex  Keeps jansson calls in line
+ **
+ ** @param job         Used to read the frame (fn and frame)
+ **
+ ** @param fn          File name
+ **
+ ** @param frame       Frame number
+ **
+ ** @param sigma       Standard deviations above background for a spot pixel
+ **
+ ** @param min_pixels  Smallest spot in pixels
+ **
+ ** @param nspotsp     Returns the number of spots
+ **
+ ** @param metap       Returns a copy of the frame's meta data along with the spot finder settings.  Caller decrefs it.
+ **
+ ** @param imbp        Returns the read locked cache buffer holding the
+ **                    spots.  NULL when the spots could not be cached,
+ **                    in which case they are malloc'ed for the caller
+ **                    to free.
+ **
+ ** @returns the spots, brightest first, or NULL if the frame could not be read
+ */
+isSpotType *isSpotsFind(isWorkerContext_t *wctx, json_t *job, const char *fn, int frame, double sigma, int min_pixels, int *nspotsp, json_t **metap, isImageBufType **imbp) {
+  static const char *id = FILEID "isSpotsFind";
+  char *key;                    // buffer cache key for our results
+  isImageBufType *imb;          // our cached results
+  isImageBufType *raw;          // the frame
+  isSpotType *spots;            // spots we found
+  int nspots;                   // number of spots
+  json_t *meta;                 // frame meta data
+
+  if (asprintf(&key, "%d:%s-%d-spots-%0.2f-%d", getegid(), fn, frame, sigma, min_pixels) == -1) {
+    isLogging_crit("%s: Out of memory (key)\n", id);
+    exit (-1);
+  }
+
+  //
+  // Buffer is read locked if it exists, write locked if it does not.
+  // A buffer with no spots and a negative depth is one where an
+  // earlier search failed: we can't fill it while others may be
+  // reading it so search again without caching the result.
+  //
+  imb = isGetImageBufFromKey(wctx, key);
+  free(key);
+
+  if (imb->buf == NULL) {
+    raw = isGetRawImageBuf(wctx, job);
+    if (raw == NULL) {
+      if (imb->buf_depth == 0) {
+        imb->buf_depth = -1;
+      }
+      pthread_rwlock_unlock(&imb->buflock);
+      pthread_mutex_lock(&wctx->ctxMutex);
+      imb->in_use--;
+      assert(imb->in_use >= 0);
+      pthread_mutex_unlock(&wctx->ctxMutex);
+
+      *imbp = NULL;
+      return NULL;
+    }
+
+    nspots = isSpotFinder(raw, sigma, min_pixels, &spots);
 
-  // Job
-  job_str = NULL;
-  if (job != NULL) {
     pthread_mutex_lock(&wctx->metaMutex);
-    job_str = json_dumps(job, JSON_SORT_KEYS | JSON_INDENT(0) | JSON_COMPACT);
+    meta = json_copy(raw->meta);
+    set_json_object_integer(id, meta, "frame", frame);
+    set_json_object_integer(id, meta, "spot_count", nspots);
+    set_json_object_real(id, meta, "spot_sigma", sigma);
+    set_json_object_integer(id, meta, "spot_min_pixels", min_pixels);
     pthread_mutex_unlock(&wctx->metaMutex);
+
+    pthread_rwlock_unlock(&raw->buflock);
+    pthread_mutex_lock(&wctx->ctxMutex);
+    raw->in_use--;
+    assert(raw->in_use >= 0);
+    pthread_mutex_unlock(&wctx->ctxMutex);
+
+    if (imb->buf_depth != 0) {
+      //
+      // Not ours to fill: let it go and hand back our private copy
+      //
+      pthread_rwlock_unlock(&imb->buflock);
+      pthread_mutex_lock(&wctx->ctxMutex);
+      imb->in_use--;
+      assert(imb->in_use >= 0);
+      pthread_mutex_unlock(&wctx->ctxMutex);
+
+      *nspotsp = nspots;
+      *metap   = meta;
+      *imbp    = NULL;
+      return spots;
+    }
+
+    //
+    // We created imb and hold its write lock: fill it and trade
+    // for a read lock.
+    //
+    imb->meta       = meta;
+    imb->buf        = spots;
+    imb->buf_size   = nspots * sizeof(*spots);
+    imb->buf_width  = nspots;
+    imb->buf_height = 1;
+    imb->buf_depth  = sizeof(*spots);
+    imb->frame      = frame;
+
+    pthread_rwlock_unlock(&imb->buflock);
+    pthread_rwlock_rdlock(&imb->buflock);
   }
-  if (job_str == NULL) {
-    job_str = strdup("");
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  meta = json_copy(imb->meta);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  if (meta == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
   }
 
-  err = zmq_msg_init_data(&job_msg, job_str, strlen(job_str), is_zmq_free_fn, NULL);
-  if (err != 0) {
-    isLogging_err("%s: zmq_msg_init failed (job_str): %s\n", id, zmq_strerror(errno));
-    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Could not initialize reply message (job_str)", id);
-    pthread_exit (NULL);
+  *nspotsp = imb->buf_width;
+  *metap   = meta;
+  *imbp    = imb;
+  return imb->buf;
+}
+
+/** Find the spots on the full resolution image.
+ **
+ ** Unlike isSpots, which counts bright pixels on a reduced image,
+ ** this labels connected groups of pixels above a background
+ ** threshold on the raw frame (see isSpotFinder) and reports where
+ ** they are.  Results are kept in our image buffer cache (see
+ ** isSpotsFind).
+ **
+ ** @param wctx Worker context
+ **  @li @c wctx->ctxMutex  Keeps the worker theads in line
+ **
+ ** @param tcp Thread data
+ **   @li @c tcp->rep  ZMQ Response socket into which to throw our response.
+ **
+ ** @param job  What the user asked us to do
+ ** @param job.fn          {String}     - file name
+ ** @param job.frame       {Integer}    - Frame number to search
+ ** @param job.max_spots   {Integer}    - Longest spot list to return (brightest first).  Default IS_SPOT_FINDER_MAX_LIST
+ ** @param job.min_pixels  {Integer}    - Smallest spot in pixels.  Default IS_SPOT_FINDER_MIN_PIXELS
+ ** @param job.sigma       {Float}      - Standard deviations above background for a spot pixel.  Default IS_SPOT_FINDER_SIGMA
+ ** @param job.tag         {String}     - ID for us to know what to do with the result
+ ** @param job.type        {String}     - "FINDSPOTS"
+ **
+ ** The reply meta data is the image meta data plus spot_count,
+ ** spot_list (one [x, y, intensity, pixels, peak] array per spot),
+ ** spot_list_columns, and spot_list_truncated.
+ */
+void isFindSpots(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
+  static const char *id = FILEID "isFindSpots";
+  const char *fn;               // file name from job
+  int frame;                    // frame number from job
+  double sigma;                 // spot threshold
+  int min_pixels;               // smallest spot
+  int max_list;                 // longest list
+  isImageBufType *imb;          // our cached results
+  isSpotType *spots;            // spots we found
+  int nspots;                   // number of spots
+  json_t *meta;                 // what we send back
+  json_t *list;                 // the spot list
+  int i;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  fn    = json_string_value(json_object_get(job, "fn"));
+  frame = json_integer_value(json_object_get(job, "frame"));
+
+  sigma = IS_SPOT_FINDER_SIGMA;
+  if (json_is_number(json_object_get(job, "sigma"))) {
+    sigma = json_number_value(json_object_get(job, "sigma"));
   }
+  min_pixels = IS_SPOT_FINDER_MIN_PIXELS;
+  if (json_is_integer(json_object_get(job, "min_pixels"))) {
+    min_pixels = json_integer_value(json_object_get(job, "min_pixels"));
+  }
+  max_list = IS_SPOT_FINDER_MAX_LIST;
+  if (json_is_integer(json_object_get(job, "max_spots"))) {
+    max_list = json_integer_value(json_object_get(job, "max_spots"));
+  }
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  if (fn == NULL || strlen(fn) == 0) {
+    char *tmps;
 
-  // Meta
-  meta_str = NULL;
-  if (imb->meta != NULL) {
     pthread_mutex_lock(&wctx->metaMutex);
-     meta_str = json_dumps(imb->meta, JSON_SORT_KEYS | JSON_INDENT(0) | JSON_COMPACT);
+    tmps = json_dumps(job, JSON_SORT_KEYS | JSON_COMPACT | JSON_INDENT(0));
     pthread_mutex_unlock(&wctx->metaMutex);
+
+    isLogging_err("%s: missing filename for job %s\n", id, tmps);
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Missing filename for job %s", id, tmps);
+    free(tmps);
+
+    return;
   }
-  if (meta_str == NULL) {
-    meta_str = strdup("");
+
+  frame      = frame <= 0 ? 1 : frame;
+  sigma      = sigma <= 0.0 ? IS_SPOT_FINDER_SIGMA : sigma;
+  min_pixels = min_pixels < 1 ? 1 : min_pixels;
+  max_list   = max_list < 0 ? 0 : max_list;
+
+  spots = isSpotsFind(wctx, job, fn, frame, sigma, min_pixels, &nspots, &meta, &imb);
+  if (spots == NULL) {
+    isLogging_err("%s: missing data for %s frame %d\n", id, fn, frame);
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Missing data for %s frame %d", id, fn, frame);
+    return;
   }
 
-  err = zmq_msg_init_data(&meta_msg, meta_str, strlen(meta_str), is_zmq_free_fn, NULL);
-  if (err == -1) {
-    isLogging_err("%s: zmq_msg_init failed (meta_str): %s\n", id, zmq_strerror(errno));
-    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Could not initialize reply message (meta_str)", id);
-    pthread_exit (NULL);
+  //
+  // The compact list: brightest first, positions to a tenth of a pixel
+  //
+  pthread_mutex_lock(&wctx->metaMutex);
+  list = json_array();
+  if (list == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  for (i=0; i<nspots && i<max_list; i++) {
+    json_array_append_new(list, json_pack("[f,f,f,i,I]",
+                                          round(spots[i].x * 10.0) / 10.0,
+                                          round(spots[i].y * 10.0) / 10.0,
+                                          round(spots[i].intensity),
+                                          spots[i].npix,
+                                          (json_int_t)spots[i].peak));
   }
+  json_object_set_new(meta, "spot_list", list);
+  json_object_set_new(meta, "spot_list_columns", json_pack("[s,s,s,s,s]", "x", "y", "intensity", "pixels", "peak"));
+  json_object_set_new(meta, "spot_list_truncated", json_boolean(nspots > max_list));
+  pthread_mutex_unlock(&wctx->metaMutex);
 
-  isLogging_info("%s: returning meta data %s", id, meta_str);
+  isSpotsReply(wctx, tcp, job, meta);
 
-  // Send them out
-  do {
-    // Error Message
-    err = zmq_msg_send(&err_msg, tcp->rep, ZMQ_SNDMORE);
-    if (err == -1) {
-      isLogging_err("%s: Could not send empty error frame: %s\n", id, zmq_strerror(errno));
-      break;
-    }
-
-    // Job 
-    err = zmq_msg_send(&job_msg, tcp->rep, ZMQ_SNDMORE);
-    if (err < 0) {
-      isLogging_err("%s: sending job_str failed: %s\n", id, zmq_strerror(errno));
-      break;
-    }
+  pthread_mutex_lock(&wctx->metaMutex);
+  json_decref(meta);
+  pthread_mutex_unlock(&wctx->metaMutex);
 
-    // Meta
-    err = zmq_msg_send(&meta_msg, tcp->rep, 0);
-    if (err == -1) {
-      isLogging_err("%s: sending meta_str failed: %s\n", id, zmq_strerror(errno));
-      break;
-    }
-  } while (0);
+  if (imb == NULL) {
+    free(spots);
+    return;
+  }
 
   pthread_rwlock_unlock(&imb->buflock);
 
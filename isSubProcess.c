@@ -7,247 +7,710 @@
  ** recurring theme.  This is an attempt to corral this into one
  ** place.
  **
+ ** One reactor thread per process looks after every child: an epoll
+ ** set holds the children's pipes, a pidfd for each child (so we
+ ** hear about its exit without polling waitpid), and the redis
+ ** connections used for control, status and progress.  isSubProcess
+ ** forks, hands the child to the reactor, and returns: the caller
+ ** hears back through spt's callbacks, all made on the reactor
+ ** thread, the last of them being onExit.
+ **
  */
 
 /** All hail single include file
  */
 #include "is.h"
 
-/** isSubProcess
- **
- **     Fatal errors kill program
- **
- ** @param[in]  cid   id of calling process to add to logging messages
- **
- ** 
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+//
+// What an epoll registration is for
+//
+#define IS_SP_WATCH_PIPE  0
+#define IS_SP_WATCH_PID   1
+#define IS_SP_WATCH_REDIS 2
+
+typedef struct isSubProcessChildStruct isSubProcessChildType;
+
+/** One file descriptor in the reactor's epoll set
  */
-void isSubProcess(const char *cid, isSubProcess_type *spt, pthread_mutex_t *mutex) {
-  static const char *id = FILEID "isSubProcess";
-  redisAsyncContext *subac;  
-  redisAsyncContext *statac;
-  struct pollfd subfd;
-  struct pollfd statfd;
-  int c;                 // process id of child process
-  
-  int max_fd;                   // largest file descriptor
-  int err;                      // return value
-  int keep_on_truckin;          // flag to stay in the poll loop
-  int pollstat;                 // result of poll command
-  struct pollfd *polllist;      // list of fd's to send to poll
-  int npoll;                    // number of active fd's in polllist
-  int i;                        // loop index
-  int status;                   // return value from waitpid
-  isSubProcessFD_type *fd_servers;      // Lookup table of isSubProcessFD's
-  isSubProcessFD_type *spfdp;   // pointo into the fd_server array
-  char tmp[256];                // temporary buffer to read data into
-  int bytes_read;               // number of bytes read in the read statement
-  time_t status_refresh_timer;  // Reminds us to update the redis status key
-  int progress;
+typedef struct isSubProcessWatchStruct {
+  int kind;                             //!< IS_SP_WATCH_PIPE, IS_SP_WATCH_PID, or IS_SP_WATCH_REDIS
+  int fd;                               //!< The file descriptor (-1 when closed)
+  uint32_t events;                      //!< The events we want
+  int registered;                       //!< 1 once fd is in the epoll set
+  isSubProcessChildType *child;         //!< Whose fd this is
+  isSubProcessFD_type *spfd;            //!< For pipes: the caller's view of it
+  redisAsyncContext *ac;                //!< For redis: the connection (NULL once freed)
+} isSubProcessWatchType;
+
+/** A child the reactor is looking after
+ */
+struct isSubProcessChildStruct {
+  isSubProcessChildType *next;          //!< Next child in the reactor's list
+  const char *cid;                      //!< Caller's id for the logs
+  isSubProcess_type *spt;               //!< What the caller asked for (NULL once onExit is called)
+  char *controlPublisher;               //!< Copy of spt->controlPublisher: we use it after onExit
+  char *progressPublisher;              //!< Copy of spt->progressPublisher
+  pid_t pid;                            //!< The child
+  int polled;                           //!< No pidfd: we check on the child with waitpid
+  int exited;                           //!< Child has been reaped
+  time_t exit_time;                     //!< When
+  time_t status_refresh_timer;          //!< Reminds us to update the redis status key
+  redisAsyncContext *subac;             //!< Listens for {"sig":n}
+  redisAsyncContext *statac;            //!< Keeps the status key
+  redisAsyncContext *progac;            //!< Publishes for isSubProcessPublish
+  isSubProcessWatchType pidw;           //!< pidfd
+  isSubProcessWatchType subw;           //!< subac's socket
+  isSubProcessWatchType statw;          //!< statac's socket
+  isSubProcessWatchType progw;          //!< progac's socket
+  isSubProcessWatchType *pipew;         //!< One per spt->fds
+};
+
+static pthread_mutex_t reactor_mutex = PTHREAD_MUTEX_INITIALIZER;     //!< Everything the reactor touches
+static pthread_once_t reactor_once = PTHREAD_ONCE_INIT;
+static int reactor_epfd = -1;                                           //!< Our epoll set
+static int reactor_polling = 0;                                         //!< Children without a pidfd: check them with waitpid
+static isSubProcessChildType *reactor_children = NULL;                  //!< Children we are looking after
+static char *reactor_buf = NULL;                                        //!< Read buffer (IS_SUBPROCESS_READ_SIZE bytes)
+
+/** Bring the epoll set in line with w->events
+ */
+static void isSubProcessWatch(isSubProcessWatchType *w) {
+  static const char *id = FILEID "isSubProcessWatch";
+  struct epoll_event ev;
 
+  if (w->fd < 0) {
+    return;
+  }
 
-  void connectCB(const redisAsyncContext *ac, int status) {
-    static const char *id = FILEID "isSubProcess->connectCB";
-    isLogging_debug( "%s: status=%d", id, status);
+  memset(&ev, 0, sizeof(ev));
+  ev.events   = w->events;
+  ev.data.ptr = w;
+  if (epoll_ctl(reactor_epfd, w->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, w->fd, &ev) == -1) {
+    isLogging_err("%s: epoll_ctl failed for fd %d: %s\n", id, w->fd, strerror(errno));
+    return;
   }
+  w->registered = 1;
+}
 
+/** Take fd out of the epoll set and close it
+ */
+static void isSubProcessUnwatch(isSubProcessWatchType *w) {
+  if (w->fd < 0) {
+    return;
+  }
+  if (w->registered) {
+    epoll_ctl(reactor_epfd, EPOLL_CTL_DEL, w->fd, NULL);
+  }
+  if (w->kind != IS_SP_WATCH_REDIS) {
+    close(w->fd);       // hiredis closes its own
+  }
+  w->fd = -1;
+  w->registered = 0;
+}
 
-  /** call back in case a redis server becomes disconnected
-   *  TODO: maybe reconnect
-   */
-  void disconnectCB(const redisAsyncContext *ac, int status) {
-    static const char *id = FILEID "isSubProcess->disconnectCB";
-    char *whoiam;
+//
+// hiredis event hooks
+//
+static void addRead(void *data) {
+  isSubProcessWatchType *w = data;
 
-    if (ac == subac) {
-      whoiam = "subac";
-    } else {
-      whoiam = "statac";
-    }
+  w->events |= EPOLLIN;
+  isSubProcessWatch(w);
+}
 
-    if( status != REDIS_OK) {
-      isLogging_err( "%s: Disconnected %s with status %d: %s", id, whoiam, status, ac->errstr);
-    } else {
-      isLogging_debug( "%s: redis disconnected %s with status %d", id, whoiam, status);
-    }
+static void delRead(void *data) {
+  isSubProcessWatchType *w = data;
+
+  w->events &= ~EPOLLIN;
+  isSubProcessWatch(w);
+}
+
+static void addWrite(void *data) {
+  isSubProcessWatchType *w = data;
+
+  w->events |= EPOLLOUT;
+  isSubProcessWatch(w);
+}
+
+static void delWrite(void *data) {
+  isSubProcessWatchType *w = data;
+
+  w->events &= ~EPOLLOUT;
+  isSubProcessWatch(w);
+}
+
+/** hiredis is about to close the socket and free the context
+ */
+static void cleanup(void *data) {
+  isSubProcessWatchType *w = data;
+
+  isSubProcessUnwatch(w);
+  w->ac = NULL;
+}
+
+/** Forget a redis connection hiredis is done with
+ */
+static void isSubProcessForget(const redisAsyncContext *ac) {
+  isSubProcessChildType *c;
+
+  c = ac->data;
+  if (ac == c->subac) {
+    c->subac = NULL;
+  }
+  if (ac == c->statac) {
+    c->statac = NULL;
+  }
+  if (ac == c->progac) {
+    c->progac = NULL;
+  }
+}
+
+static void connectCB(const redisAsyncContext *ac, int status) {
+  static const char *id = FILEID "isSubProcess->connectCB";
+
+  isLogging_debug( "%s: status=%d", id, status);
+  if (status != REDIS_OK) {
     //
-    // Indicate to the rest of the routine that we are not talking to
-    // redis anymore
-    if (ac == subac) {
-      subac = NULL;
-    }
+    // hiredis frees ac after this without calling disconnectCB
+    //
+    isLogging_err("%s: Could not connect to redis: %s", id, ac->errstr);
+    isSubProcessForget(ac);
+  }
+}
 
-    if (ac == statac) {
-      statac = NULL;
-    }
+/** call back in case a redis server becomes disconnected
+ */
+static void disconnectCB(const redisAsyncContext *ac, int status) {
+  static const char *id = FILEID "isSubProcess->disconnectCB";
+  isSubProcessChildType *c;
+  char *whoiam;
+
+  c = ac->data;
+  whoiam = ac == c->subac ? "subac" : (ac == c->statac ? "statac" : "progac");
+
+  if( status != REDIS_OK) {
+    isLogging_err( "%s: Disconnected %s with status %d: %s", id, whoiam, status, ac->errstr);
+  } else {
+    isLogging_debug( "%s: redis disconnected %s with status %d", id, whoiam, status);
+  }
+  //
+  // Indicate to the rest of the routine that we are not talking to
+  // redis anymore
+  isSubProcessForget(ac);
+}
+
+//
+// Currently hiredis does not call this callback.  Instead an
+// unsubscribe message is sent to subCB.
+//
+static void unSubCB(redisAsyncContext *ac, void *reply, void *privdata) {
+  static const char *id = FILEID "isSubProcess->unSubDB";
+
+  isLogging_debug("%s: unsubscribed", id);
+}
+
+static void statCB(redisAsyncContext *ac, void *reply, void *privedata) {
+  static const char *id = FILEID "isSubProcess->statCB";
+  redisReply *r;
+
+  if (reply == NULL) {
+    return;
+  }
+
+  r = reply;
+  if (r->type == REDIS_REPLY_ERROR) {
+    isLogging_debug("%s: error: %s", id, r->str);
+  } else {
+    isLogging_debug("%s: got reply type %d", id, r->type);
+  }
+}
+
+/** Use the publication to request the new value
+ */
+static void subCB(redisAsyncContext *ac, void *reply, void *privdata) {
+  static const char *id = FILEID "isSubProcess->subCB";
+  isSubProcessChildType *c;
+  json_t *msg;
+  json_t *jsig;
+  json_error_t loads_err;
+  int sig;
+  redisReply *r;
+  char *k;
+
+  c = privdata;
+
+  if (reply == NULL) {
+    //
+    // we're called with a null reply ondis connect.  Nothing for us to do.
+    //
+    return;
+  }
+
+  r = (redisReply *)reply;
+
+  isLogging_debug("%s: got reply type %d", id, r->type);
+
+  // Ignore our subscribe reply
+  //
+  if( r->type == REDIS_REPLY_ARRAY && r->elements == 3 && r->element[0]->type == REDIS_REPLY_STRING && strcmp( r->element[0]->str, "subscribe")==0) {
+    isLogging_debug("%s: Ignoring subscribe message: %s", id, r->element[0]->str);
+    return;
+  }
+
+  // Log stuff we don't understand
+  //
+  if( r->type != REDIS_REPLY_ARRAY ||
+      r->elements != 3 ||
+      r->element[1]->type != REDIS_REPLY_STRING ||
+      r->element[2]->type != REDIS_REPLY_STRING) {
+
+    isLogging_debug( "%s: unexpected reply", id);
+    return;
   }
 
-  /** hook to mange read events
-   */
-  void addRead( void *data) {
-    struct pollfd *pfd;
-    pfd = (struct pollfd *)data;
+  //
+  // Ignore obvious junk
+  //
+  k = r->element[2]->str;
+
+  if( k == NULL || *k == 0) {
+    return;
+  }
 
-    if( (pfd->events & POLLIN) == 0) {
-      pfd->events |= POLLIN;
+  isLogging_debug("%s: message received: \"%s\"", id, k);
+
+  msg = json_loads(r->element[2]->str, 0, &loads_err);
+  if (msg == NULL) {
+    isLogging_err("%s: bad json message: %s from %s", id, loads_err.text, k);
+    return;
+  }
+
+  if (c->pid > 0 && !c->exited) {
+    jsig = json_object_get(msg, "sig");
+    if (jsig) {
+      sig = json_integer_value(jsig);
+      if( sig > 0) {
+        kill(c->pid, sig);
+      }
     }
   }
+  json_decref(msg);
+}
 
-  /** hook to manage "don't need to read" events
-   */
-  void delRead( void *data) {
-    struct pollfd *pfd;
-    pfd = (struct pollfd *)data;
+/** Connect to a redis server with our hooks in place
+ */
+static redisAsyncContext *isSubProcessRedis(isSubProcessChildType *c, isSubProcessWatchType *w, const char *address, int port) {
+  static const char *id = FILEID "isSubProcessRedis";
+  redisAsyncContext *ac;
 
-    if( (pfd->events & POLLIN) != 0) {
-      pfd->events &= ~POLLIN;
+  ac = redisAsyncConnect(address, port);
+  if (ac == NULL || ac->err) {
+    //
+    // This is not an indication that the connection failed since we
+    // haven't actually tried to connect yet
+    //
+    isLogging_err( "%s->%s: redisAsyncConnect Error: %s", c->cid, id, ac ? ac->errstr : "no context");
+    if (ac != NULL) {
+      redisAsyncFree(ac);
     }
+    return NULL;
   }
 
-  /** hook to manage write events
-   */
-  void addWrite( void *data) {
-    struct pollfd *pfd;
-    pfd = (struct pollfd *)data;
+  w->kind        = IS_SP_WATCH_REDIS;
+  w->fd          = ac->c.fd;
+  w->child       = c;
+  w->ac          = ac;
+  ac->data       = c;
+  ac->ev.data     = w;
+  ac->ev.addRead  = addRead;
+  ac->ev.delRead  = delRead;
+  ac->ev.addWrite = addWrite;
+  ac->ev.delWrite = delWrite;
+  ac->ev.cleanup  = cleanup;
+
+  redisAsyncSetConnectCallback(ac, connectCB);
+  redisAsyncSetDisconnectCallback(ac, disconnectCB);
+  return ac;
+}
+
+/** Pass new output on to the caller's onProgress
+ */
+static void isSubProcessProgress(isSubProcessChildType *c, isSubProcessFD_type *spfdp) {
+  int progress;
+  int i;
+  char *sp1, *sp2;
 
-    if( (pfd->events & POLLOUT) == 0) {
-      pfd->events |= POLLOUT;
+  if (spfdp->onProgress == NULL) {
+    return;
+  }
+
+  if (spfdp->read_lines == 0) {
+    // Easy as π
+    progress = spfdp->onProgress(c->spt->data, spfdp->_buf);
+    if (progress >= 0 && c->statac != NULL) {
+      redisAsyncCommand(c->statac, statCB, NULL, "HSET %s PROGRESS {\"progress\":%d}", c->controlPublisher, progress);
     }
+    spfdp->_buf_size = 0;
+    spfdp->_buf[0]   = 0;
+  } else {
+    //
+    // line mode: parse out each line and send them one at a
+    // time.  Save the residue (non \r or \n endings) for next
+    // time around or for the very end when we clean things
+    // up.
+    //
+    sp1 = sp2 = spfdp->_buf;
+    for (i=0; i<spfdp->_buf_size; i++, sp2++) {
+      if (*sp2 == '\r' || *sp2 == '\n') {
+        *sp2 = 0;
+        if (strlen(sp1)) {
+          progress=spfdp->onProgress(c->spt->data, sp1);
+          if (progress >= 0 && c->statac != NULL) {
+            redisAsyncCommand(c->statac, statCB, NULL, "HSET %s PROGRESS {\"progress\":%d}", c->controlPublisher, progress);
+          }
+        }
+        sp1 = sp2 + 1;
+      }
+    }
+    memmove(spfdp->_buf, sp1, strlen(sp1)+1);
+    spfdp->_buf_size = strlen(spfdp->_buf);
   }
+}
 
-  /** hook to manage "don't need to write anymore" events 
-   */
-  void delWrite( void *data) {
-    struct pollfd *pfd;
-    pfd = (struct pollfd *)data;
+/** Read everything waiting on a pipe.  Closes the pipe at end of file.
+ */
+static void isSubProcessRead(isSubProcessWatchType *w) {
+  static const char *id = FILEID "isSubProcessRead";
+  isSubProcessFD_type *spfdp;
+  int bytes_read;
+  int got;
+
+  spfdp = w->spfd;
+  got   = 0;
+  while (w->fd >= 0) {
+    bytes_read = read(w->fd, reactor_buf, IS_SUBPROCESS_READ_SIZE);
+
+    if (bytes_read == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        break;
+      }
+      isLogging_err("%s->%s: error reading fd=%d  (child fd=%d): %s", w->child->cid, id, w->fd, spfdp->fd, strerror(errno));
+      isSubProcessUnwatch(w);
+      break;
+    }
 
-    if( (pfd->events & POLLOUT) != 0) {
-      pfd->events &= ~POLLOUT;
+    if (bytes_read == 0) {
+      isLogging_debug("%s->%s: end of file on fd %d (child fd=%d)", w->child->cid, id, w->fd, spfdp->fd);
+      isSubProcessUnwatch(w);
+      break;
     }
+
+    //
+    // Make room for incomming bytes plus our null
+    //
+    spfdp->_buf = realloc(spfdp->_buf, spfdp->_buf_size + bytes_read + 1);
+    if (spfdp->_buf == NULL) {
+      isLogging_err("%s->%s: Out of memory (realloc %d bytes): %s", w->child->cid, id, spfdp->_buf_size+bytes_read+1, strerror(errno));
+      exit(-1);
+    }
+    spfdp->_buf_end = spfdp->_buf + spfdp->_buf_size;
+    memcpy(spfdp->_buf_end, reactor_buf, bytes_read);
+    spfdp->_buf_size += bytes_read;
+    spfdp->_buf[spfdp->_buf_size] = 0;
+    got = 1;
   }
-  /** hook to clean up
-   * TODO: figure out what we are supposed to do here and do it
-   */
-  void cleanup( void *data) {
-    struct pollfd *pfd;
 
-    pfd = (struct pollfd *)data;
+  if (got) {
+    isSubProcessProgress(w->child, spfdp);
+  }
+}
 
-    pfd->fd = -1;
+/** The child is gone: collect what it left in its pipes, hand it to
+ ** the caller, and wrap up with redis.
+ */
+static void isSubProcessExited(isSubProcessChildType *c, int status, int reaped) {
+  static const char *id = FILEID "isSubProcessExited";
+  isSubProcess_type *spt;
+  isSubProcessFD_type *spfdp;
+  int i;
+
+  spt = c->spt;
+  c->exited    = 1;
+  c->exit_time = time(NULL);
+  isSubProcessUnwatch(&c->pidw);
 
-    if( (pfd->events & (POLLOUT | POLLIN)) != 0) {
-      pfd->events &= ~(POLLOUT | POLLIN);
+  if (reaped) {
+    if (WIFEXITED(status)) {
+      spt->rtn = WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+      spt->rtn = 128 + WTERMSIG(status);
     }
   }
+  isLogging_debug("%s->%s: child %d exited, rtn=%d", c->cid, id, c->pid, spt->rtn);
 
   //
-  // Currently hiredis does not call this callback.  Instead an
-  // unsubscribe message is sent to subCB.
+  // The child may have written its last words just now.  Take what
+  // is there but don't wait for end of file: a grandchild could
+  // still be holding the other end open.
   //
-  void unSubCB(redisAsyncContext *ac, void *reply, void *privdata) {
-    static const char *id = FILEID "isSubProcess->unSubDB";
-
-    isLogging_debug("%s: unsubscribed", id);
+  for (i=0; i<spt->nfds; i++) {
+    isSubProcessRead(&c->pipew[i]);
+    isSubProcessUnwatch(&c->pipew[i]);
   }
 
-  void statCB(redisAsyncContext *ac, void *reply, void *privedata) {
-    static const char *id = FILEID "isSubProcess->statCB";
-    redisReply *r;
-
-    if (reply == NULL) {
-      return;
+  //
+  // Send our results
+  //
+  for (i=0; i<spt->nfds; i++) {
+    spfdp = &spt->fds[i];
+    if (spfdp->onProgress && spfdp->_buf_size > 0) {
+      spfdp->onProgress(spt->data, spfdp->_buf);        // whatever did not end in a new line
+    }
+    if (spfdp->onDone) {
+      spfdp->onDone(spt->data, spfdp->_buf);
     }
+    free(spfdp->_buf);
+    spfdp->_buf = NULL;
+    spfdp->_buf_size = 0;
+  }
 
-    r = reply;
-    if (r->type == REDIS_REPLY_ERROR) {
-      isLogging_debug("%s: error: %s", id, r->str);
+  if (c->statac != NULL) {
+    if (!reaped) {
+      redisAsyncCommand(c->statac, statCB, NULL, "HSET %s STATUS {\"status\":\"Error\"}", c->controlPublisher);
+    } else if (spt->rtn) {
+      redisAsyncCommand(c->statac, statCB, NULL, "HSET %s STATUS {\"status\":\"Done\"}", c->controlPublisher);
     } else {
-      isLogging_debug("%s: got reply type %d", id, r->type);
+      redisAsyncCommand(c->statac, statCB, NULL, "HMSET %s STATUS {\"status\":\"Done\"} PROGRESS {\"progress\":100}", c->controlPublisher);
     }
+    redisAsyncCommand(c->statac, statCB, NULL, "EXPIRE %s %d", c->controlPublisher, IS_SUBPROCESS_STATUS_TTL);
+    redisAsyncDisconnect(c->statac);    // Don't need to talk to redis after sub process has ended
   }
 
+  if (c->subac != NULL) {
+    redisAsyncCommand(c->subac, unSubCB, NULL, "UNSUBSCRIBE");
+    redisAsyncDisconnect(c->subac);     // Don't need to listen to redis after sub process has ended
+  }
 
-  /** Use the publication to request the new value
-   */
-  void subCB(redisAsyncContext *ac, void *reply, void *privdata) {
-    static const char *id = FILEID "isSubProcess->subCB";
-    json_t *msg;
-    json_t *jsig;
-    json_error_t loads_err;
-    int sig;
-    redisReply *r;
-    //lsredis_obj_t *p;
-    char *k;
+  //
+  // The caller may still publish from onExit and may free spt
+  // there: we are done with it either way.
+  //
+  if (spt->onExit) {
+    spt->onExit(spt->data);
+  }
+  c->spt = NULL;
 
-    isLogging_debug("%s: start of cb  keep_on_truckin=%d", id, keep_on_truckin);
+  if (c->progac != NULL) {
+    redisAsyncDisconnect(c->progac);    // after anything onExit sent
+  }
+}
 
-    if (reply == NULL) {
-      // 
-      // we're called with a null reply ondis connect.  Nothing for us to do.
-      //
-      return;
-    }
+/** Has the child exited?  For children without a pidfd.
+ */
+static void isSubProcessCheck(isSubProcessChildType *c) {
+  static const char *id = FILEID "isSubProcessCheck";
+  int status;
+  int err;
+
+  err = waitpid(c->pid, &status, WNOHANG);
+  if (err == c->pid) {
+    isSubProcessExited(c, status, 1);
+  }
+  if (err == -1) {
+    //
+    // Likely our command was not found.  Sounds like one of those
+    // very rare programming errors.
+    //
+    isLogging_info("%s->%s: waitpid failed: %s\n", c->cid, id, strerror(errno));
+    isSubProcessExited(c, 0, 0);
+  }
+}
 
-    r = (redisReply *)reply;
+/** Housekeeping after each round of events: status refreshes,
+ ** children without pidfds, and forgetting children redis is done
+ ** with.
+ */
+static void isSubProcessTick() {
+  static const char *id = FILEID "isSubProcessTick";
+  isSubProcessChildType **cp;
+  isSubProcessChildType *c;
+  time_t now;
 
-    isLogging_debug("%s: got reply type %d", id, r->type);
+  now = time(NULL);
+  cp  = &reactor_children;
+  while (*cp != NULL) {
+    c = *cp;
 
-    // Ignore our subscribe reply
-    //
-    if( r->type == REDIS_REPLY_ARRAY && r->elements == 3 && r->element[0]->type == REDIS_REPLY_STRING && strcmp( r->element[0]->str, "subscribe")==0) {
-      isLogging_debug("%s: Ignoring subscribe message: %s", id, r->element[0]->str);
-      return;
+    if (!c->exited && c->polled) {
+      isSubProcessCheck(c);
     }
 
-    // Log stuff we don't understand
-    //
-    if( r->type != REDIS_REPLY_ARRAY ||
-        r->elements != 3 ||
-        r->element[1]->type != REDIS_REPLY_STRING ||
-        r->element[2]->type != REDIS_REPLY_STRING) {
-
-      isLogging_debug( "%s: unexpected reply", id);
-      return;
+    if (!c->exited && c->statac != NULL && (c->status_refresh_timer + 60 <= now)) {
+      redisAsyncCommand(c->statac, statCB, NULL, "EXPIRE %s 100", c->controlPublisher);
+      c->status_refresh_timer = now;
     }
 
-    isLogging_debug("%s: got reply string", id, r->element[2]->str);
-
     //
-    // Ignore obvious junk
+    // Don't wait forever for redis to say goodbye
     //
-    k = r->element[2]->str;
+    if (c->exited && c->exit_time + IS_SUBPROCESS_REDIS_GRACE <= now) {
+      if (c->subac != NULL) {
+        redisAsyncFree(c->subac);
+        c->subac = NULL;
+      }
+      if (c->statac != NULL) {
+        redisAsyncFree(c->statac);
+        c->statac = NULL;
+      }
+      if (c->progac != NULL) {
+        redisAsyncFree(c->progac);
+        c->progac = NULL;
+      }
+    }
+
+    if (!c->exited || c->subac != NULL || c->statac != NULL || c->progac != NULL) {
+      cp = &c->next;
+      continue;
+    }
 
-    if( k == NULL || *k == 0) {
-      return;
+    if (c->polled) {
+      reactor_polling--;
     }
 
-    isLogging_debug("%s: message received: \"%s\"", id, k);
+    isLogging_debug("%s->%s: child %d done", c->cid, id, c->pid);
 
-    msg = json_loads(r->element[2]->str, 0, &loads_err); 
-    if (msg == NULL) {
-      isLogging_err("%s: bad json message: %s from %s", id, loads_err.text, k);
-      return;
+    *cp = c->next;
+    free(c->controlPublisher);
+    free(c->progressPublisher);
+    free(c->pipew);
+    free(c);
+  }
+}
+
+/** The reactor: wait for something to happen to any of our children
+ */
+static void *isSubProcessReactor(void *arg) {
+  static const char *id = FILEID "isSubProcessReactor";
+  struct epoll_event events[IS_SUBPROCESS_EVENTS];
+  isSubProcessWatchType *w;
+  redisAsyncContext *ac;
+  int status;
+  int n;
+  int i;
+
+  while (1) {
+    n = epoll_wait(reactor_epfd, events, IS_SUBPROCESS_EVENTS, reactor_polling ? 100 : 1000);
+    if (n == -1) {
+      if (errno != EINTR) {
+        isLogging_err("%s: epoll_wait failed: %s", id, strerror(errno));
+        sleep(1);
+      }
+      n = 0;
     }
 
-    if (c > 0) {
-      jsig = json_object_get(msg, "sig");
-      if (jsig) {
-        sig = json_integer_value(jsig);
-        if( sig > 0) {
-          kill(c, sig);
+    pthread_mutex_lock(&reactor_mutex);
+    for (i=0; i<n; i++) {
+      w = events[i].data.ptr;
+      if (w->fd < 0) {
+        continue;       // closed earlier in this round
+      }
+
+      switch (w->kind) {
+      case IS_SP_WATCH_PIPE:
+        isSubProcessRead(w);
+        break;
+
+      case IS_SP_WATCH_PID:
+        if (waitpid(w->child->pid, &status, WNOHANG) == w->child->pid) {
+          isSubProcessExited(w->child, status, 1);
         }
+        break;
+
+      case IS_SP_WATCH_REDIS:
+        ac = w->ac;
+        if (ac != NULL && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+          redisAsyncHandleRead(ac);
+        }
+        //
+        // Reading may have freed the context
+        //
+        if (w->ac != NULL && (events[i].events & EPOLLOUT)) {
+          redisAsyncHandleWrite(w->ac);
+        }
+        break;
       }
     }
-    json_decref(msg);
+    isSubProcessTick();
+    pthread_mutex_unlock(&reactor_mutex);
+  }
+  return NULL;
+}
+
+/** Start the reactor, once per process
+ */
+static void isSubProcessReactorStart() {
+  static const char *id = FILEID "isSubProcessReactorStart";
+  pthread_t thread;
+  int err;
+
+  reactor_epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (reactor_epfd == -1) {
+    isLogging_crit("%s: Could not create epoll set: %s\n", id, strerror(errno));
+    exit (-1);
   }
 
+  reactor_buf = malloc(IS_SUBPROCESS_READ_SIZE);
+  if (reactor_buf == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  err = pthread_create(&thread, NULL, isSubProcessReactor, NULL);
+  if (err != 0) {
+    isLogging_crit("%s: Could not start reactor: %s\n", id, strerror(err));
+    exit (-1);
+  }
+  pthread_detach(thread);
+}
+
+/** isSubProcess
+ **
+ **     Fatal errors kill program
+ **
+ ** Returns as soon as the child is started.  Its output goes to the
+ ** onProgress and onDone callbacks and then onExit is called, all
+ ** from the reactor thread.  spt (and cid) must last until onExit:
+ ** after that the reactor leaves spt alone.  Should the fork fail
+ ** onLaunch and onExit are called before we return.
+ **
+ ** @param[in]  cid   id of calling process to add to logging messages
+ **
+ ** @param[in,out] spt  What to run and what to do with its output
+ */
+void isSubProcess(const char *cid, isSubProcess_type *spt) {
+  static const char *id = FILEID "isSubProcess";
+  isSubProcessChildType *c;
+  int child_fd_floor;           // child moves its pipe ends above this before dup2
+  int err;                      // errno from fork
+  int i;                        // loop index
+
+  pthread_once(&reactor_once, isSubProcessReactorStart);
 
   //
   // Set up pipes.  Automatically close the new fds in the child after
-  // execve.  All this activity here should make things simpler in the
-  // polling loop.
+  // execve.  Our ends don't block: the reactor reads until EAGAIN.
   //
-  max_fd = 0;
+  child_fd_floor = 2;
   for (i=0; i < spt->nfds; i++) {
+    if (spt->fds[i].fd > child_fd_floor) {
+      child_fd_floor = spt->fds[i].fd;
+    }
+
     //
     // make sure at least we have a valid pointer to an empty string
     //
@@ -258,33 +721,67 @@ void isSubProcess(const char *cid, isSubProcess_type *spt, pthread_mutex_t *mute
     pipe2(spt->fds[i]._pipe, O_CLOEXEC);               // auto close parent end of pipe in child
     if (spt->fds[i].is_out) {
       spt->fds[i]._piped_fd = spt->fds[i]._pipe[0];     // copy to ease polling loop logic
-      spt->fds[i]._event = POLLIN;                      // the event we'll be polling for
+      spt->fds[i]._event = EPOLLIN;                     // the event we'll be waiting for
     } else {
       spt->fds[i]._piped_fd = spt->fds[i]._pipe[1];     // copy to ease polling loop logic
-      spt->fds[i]._event = POLLOUT;                     // the event we'll be polling for
-    }
-    if (spt->fds[i]._piped_fd > max_fd) {
-      max_fd = spt->fds[i]._piped_fd;
+      spt->fds[i]._event = EPOLLOUT;                    // the event we'll be waiting for
     }
+    fcntl(spt->fds[i]._piped_fd, F_SETFL, fcntl(spt->fds[i]._piped_fd, F_GETFL) | O_NONBLOCK);
   }
 
-  c = fork();
-  if (c == -1) {
+  c = calloc(1, sizeof(*c));
+  if (c != NULL) {
+    c->pipew = calloc(spt->nfds + 1, sizeof(*c->pipew));
+  }
+  if (c == NULL || c->pipew == NULL) {
+    isLogging_crit("%s->%s: Out of memory", cid, id);
+    exit (-1);
+  }
+
+  c->pid = fork();
+  if (c->pid == -1) {
     // fork failed
-    isLogging_err( "%s->%s: Fork failed", cid, id);
+    err = errno;
+    isLogging_err( "%s->%s: Fork failed: %s", cid, id, strerror(err));
+    for (i=0; i < spt->nfds; i++) {
+      close(spt->fds[i]._pipe[0]);
+      close(spt->fds[i]._pipe[1]);
+      free(spt->fds[i]._buf);
+      spt->fds[i]._buf = NULL;
+    }
+    free(c->pipew);
+    free(c);
+
+    spt->rtn = 1;
     if (spt->onLaunch) {
-      spt->rtn = 1;
-      spt->onLaunch(strerror(errno), c);
+      spt->onLaunch(spt->data, strerror(err), -1);
+    }
+    if (spt->onExit) {
+      spt->onExit(spt->data);
     }
     return;
   }
 
-  if (c == 0) {
+  if (c->pid == 0) {
     //
     // In Child
     //
     int ii;
     int old_errno;
+    sigset_t signals;
+
+    //
+    // The signal mask survives fork and execve, and isSupervisor
+    // blocks SIGTERM and friends for its signalfd.  Give the child a
+    // clean slate so {"sig":15} and index_cancel can stop it.
+    //
+    sigemptyset(&signals);
+    pthread_sigmask(SIG_SETMASK, &signals, NULL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT,  SIG_DFL);
+    signal(SIGUSR1, SIG_DFL);
+    signal(SIGUSR2, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
 
     isLogging_debug("%s->%s: cmd: '%s'", cid, id, spt->cmd);
 
@@ -298,6 +795,18 @@ void isSubProcess(const char *cid, isSubProcess_type *spt, pthread_mutex_t *mute
       isLogging_debug("%s->%s: %d  %s", cid, id, ii, spt->envp[ii]);
     }
 
+    //
+    // Two passes: first move our ends of the pipes above every fd
+    // number the child is to see so that no dup2 below clobbers a
+    // pipe we have yet to hand over.  This also means dup2 never
+    // gets the same fd twice, which would leave O_CLOEXEC set and
+    // the child would lose the fd at execve.
+    //
+    for (i=0; i < spt->nfds; i++) {
+      ii = spt->fds[i].is_out ? 1 : 0;
+      spt->fds[i]._pipe[ii] = fcntl(spt->fds[i]._pipe[ii], F_DUPFD_CLOEXEC, child_fd_floor + 1);
+    }
+
     for (i=0; i < spt->nfds; i++) {
       if (spt->fds[i].is_out) {
         dup2(spt->fds[i]._pipe[1], spt->fds[i].fd);       // duplicate the child's fd to read from
@@ -306,6 +815,11 @@ void isSubProcess(const char *cid, isSubProcess_type *spt, pthread_mutex_t *mute
       }
     }
 
+    if (spt->cwd != NULL && chdir(spt->cwd) == -1) {
+      fprintf(stderr, "Could not change to directory %s: %s\n", spt->cwd, strerror(errno));
+      _exit (-1);
+    }
+
     execve( spt->cmd, spt->argv, spt->envp);
     //
     // execve never returns except on error
@@ -325,375 +839,105 @@ void isSubProcess(const char *cid, isSubProcess_type *spt, pthread_mutex_t *mute
   }
 
   // In parent
-  
+
   //
   // No way to tell here if execve was (or will be) successful.
   // Caller should have asked to listen to stderr so we can at least
   // learn why things failed (if the did in fact fail)
   //
+  spt->rtn = 0;
   if (spt->onLaunch) {
-    spt->rtn = 0;
-    spt->onLaunch(NULL, c);
+    spt->onLaunch(spt->data, NULL, c->pid);
   }
 
-  isLogging_debug("%s->%s: about to connect to redis", cid, id);
-
-  subac = redisAsyncConnect(spt->controlAddress, spt->controlPort);
-  if( subac->err) {
-    //
-    // This is not an indication that the connection failed since we
-    // haven't actually tried to connect yet
-    //
-    isLogging_err( "%s: redisAsyncConnect Error: %s", id, subac->errstr);
-    subac = NULL;
-  }
-  if (subac != NULL) {
-    subfd.fd           = subac->c.fd;
-    subfd.events       = 0;
-    subac->ev.data     = &subfd;
-    subac->ev.addRead  = addRead;
-    subac->ev.delRead  = delRead;
-    subac->ev.addWrite = addWrite;
-    subac->ev.delWrite = delWrite;
-    subac->ev.cleanup  = cleanup;
-  
-    redisAsyncSetConnectCallback(subac, connectCB);
-    redisAsyncSetDisconnectCallback(subac, disconnectCB);
-    // Set up redis subscriber
-    
-    redisAsyncCommand(subac, subCB, NULL, "SUBSCRIBE %s", spt->controlPublisher);
-  }    
-
+  c->cid = cid;
+  c->spt = spt;
+  c->controlPublisher  = spt->controlPublisher  ? strdup(spt->controlPublisher)  : NULL;
+  c->progressPublisher = spt->progressPublisher ? strdup(spt->progressPublisher) : NULL;
+  if ((spt->controlPublisher && c->controlPublisher == NULL) || (spt->progressPublisher && c->progressPublisher == NULL)) {
+    isLogging_crit("%s->%s: Out of memory", cid, id);
+    exit (-1);
+  }
+  c->status_refresh_timer = time(NULL);
+  spt->_child = c;
+
+  c->pidw.kind  = IS_SP_WATCH_PID;
+  c->pidw.child = c;
+  c->pidw.fd    = syscall(SYS_pidfd_open, c->pid, 0);
+  c->pidw.events = EPOLLIN;
+  if (c->pidw.fd == -1) {
+    isLogging_debug("%s->%s: no pidfd for %d, will poll: %s", cid, id, c->pid, strerror(errno));
+  }
 
-  statac = redisAsyncConnect(spt->controlAddress, spt->controlPort);
-  if( statac->err) {
+  for (i=0; i < spt->nfds; i++) {
     //
-    // This is not an indication that the connection failed since we
-    // haven't actually tried to connect yet
+    // Close the child's ends.  We've no use for writing to the
+    // child yet so it gets end of file on any fd it reads.
     //
-    isLogging_err( "%s: redisAsyncConnect (stat) Error: %s", id, statac->errstr);
-    statac = NULL;
-  }
-  if (statac != NULL) {
-    statfd.fd          = statac->c.fd;
-    statfd.events       = 0;
-    statac->ev.data     = &statfd;
-    statac->ev.addRead  = addRead;
-    statac->ev.delRead  = delRead;
-    statac->ev.addWrite = addWrite;
-    statac->ev.delWrite = delWrite;
-    statac->ev.cleanup  = cleanup;
-  
-    redisAsyncSetConnectCallback(statac, connectCB);
-    redisAsyncSetDisconnectCallback(statac, disconnectCB);
-
-    redisAsyncCommand(statac, statCB, NULL, "HSET %s STATUS {\"status\":\"Running\"}", spt->controlPublisher);
-    redisAsyncCommand(statac, statCB, NULL, "EXPIRE %s 100", spt->controlPublisher);
-  }
-
-  isLogging_debug("%s->%s: max_fd=%d", cid, id, max_fd);
-
-  fd_servers = calloc(max_fd+2, sizeof(*fd_servers));
-  if (fd_servers == NULL) {
-    isLogging_crit("%s->%s: Out of memory (fd_servers)", cid, id);
-    _exit(-1);
-  }  
-
-  polllist = calloc(spt->nfds+2, sizeof (*polllist));
-  if (polllist == NULL) {
-    isLogging_crit("%s->%s: Out of memory (pollist)", cid, id);
-    _exit(-1);
-  }
-  
-  polllist[0].fd     = subfd.fd;
-  polllist[1].fd     = statfd.fd;
-  for (npoll=2; npoll < spt->nfds + 2; npoll++) {
-    isLogging_debug("%s->%s: event=%d  piped_fd=%d  child_fd=%d", cid, id, spt->fds[npoll-2]._event, spt->fds[npoll-2]._piped_fd, spt->fds[npoll-2].fd);
-    fd_servers[spt->fds[npoll-2]._piped_fd] = spt->fds[npoll-2];  // find fds structure from file descriptor
-    polllist[npoll].fd     = spt->fds[npoll-2]._piped_fd;
-    polllist[npoll].events = spt->fds[npoll-2]._event;
-  }
-  isLogging_debug("%s->%s: npoll=%d", cid, id, npoll);
-
-  //
-  // Verify that our child is not prematurely dead
-  //
-
-  keep_on_truckin = 1;
-  status_refresh_timer = time(NULL);
-
-  isLogging_debug("%s->%s: starting poll loop", cid, id);
-
-  pthread_mutex_lock(mutex);
-  while(keep_on_truckin || subac != NULL || statac != NULL) {
-    // set redis events
-    if (subac != NULL) {
-      polllist[0].events = subfd.events;
-    } else {
-      polllist[0].events = 0;
-    }
-
-    if (statac != NULL) {
-      polllist[1].events = statfd.events;
+    if (spt->fds[i].is_out) {
+      close(spt->fds[i]._pipe[1]);
     } else {
-      polllist[1].events = 0;
-    }
-
-    pthread_mutex_unlock(mutex);
-    pollstat = poll(polllist, npoll, 100);
-    pthread_mutex_lock(mutex);
-    if (pollstat == -1) {
-      isLogging_err("%s->%s: poll failed: %s", cid, id, strerror(errno));
-      exit (-1);
-    }
-    
-    //isLogging_debug("%s->%s: pollstat=%d", cid, id, pollstat);
-
-    //
-    // Don't check on child if it's alread done for
-    //
-    if (keep_on_truckin && (pollstat == 0)) {
-      //
-      // Check to see if our process is still running
-      //
-      err = waitpid(c, &status, WNOHANG);
-      if (err == c) {
-        //
-        // Normal way we expect to exit
-        //
-        if (WIFEXITED(status)) {
-          spt->rtn = WEXITSTATUS(status);
-        }
-        keep_on_truckin = 0;
-        isLogging_debug("%s: child exited, disconnecting redis", id);
-        //
-        if (statac != NULL) {
-          if (spt->rtn) {
-            redisAsyncCommand(statac, statCB, NULL, "HSET %s STATUS {\"status\":\"Done\"}", spt->controlPublisher);
-          } else {
-            redisAsyncCommand(statac, statCB, NULL, "HMSET %s STATUS {\"status\":\"Done\"} PROGRESS {\"progress\":100}", spt->controlPublisher);
-          }
-          redisAsyncCommand(statac, statCB, NULL, "PERSIST %s", spt->controlPublisher);
-          redisAsyncDisconnect(statac);    // Don't need to talk to redis after sub process has ended
-        }
-
-        if (subac != NULL) {
-          redisAsyncCommand(subac, unSubCB, NULL, "UNSUBSCRIBE");
-          redisAsyncDisconnect(subac);    // Don't need to listen to redis after sub process has ended
-        }
-      }
-      if (err == -1) {
-        //
-        // Likely our command was not found.  Sounds like one of those
-        // very rare programming errors.
-        //
-        isLogging_info("%s: waitpid 2 failed: %s\n", id, strerror(errno));
-        keep_on_truckin = 0;
-        
-        if (statac != NULL) {
-          redisAsyncCommand(statac, statCB, NULL, "HSET %s STATUS {\"status\":\"Error\"}", spt->controlPublisher);
-          redisAsyncCommand(statac, statCB, NULL, "PERSIST %s", spt->controlPublisher);
-          redisAsyncDisconnect(statac);    // Don't need to talk to redis after sub process has ended
-        }
-
-        if (subac != NULL) {
-          redisAsyncCommand(subac, unSubCB, NULL, "UNSUBSCRIBE");
-          redisAsyncDisconnect(subac);    // Don't need to listen to redis after sub process has ended
-        }
-      }
-      //isLogging_debug("%s->%s: waitpid status %0x  keep_on_truckin: %d", cid, id, status, keep_on_truckin);
-      continue;
-    }
-    
-    if (statac != NULL && (status_refresh_timer + 60  <= time(NULL))) {
-      redisAsyncCommand(statac, statCB, NULL, "EXPIRE %s 100", spt->controlPublisher);
-      status_refresh_timer = time(NULL);
-    }
-
-
-    // polllist[0] is the redis subscriber
-    
-    if (subac != NULL) {
-      if (pollstat && polllist[0].revents) {
-        isLogging_debug("%s->%s: redis subscriber event(s) %d", cid, id, polllist[0].revents);
-        pollstat--;
-        if (polllist[0].revents & POLLIN) {
-          redisAsyncHandleRead(subac);
-        }
-        if (polllist[0].revents & POLLOUT) {
-          redisAsyncHandleWrite(subac);
-        }
-      }
-    }
-    // polllist[1] is the redis writer
-    
-    if (statac != NULL) {
-      if (pollstat && polllist[1].revents) {
-        isLogging_debug("%s->%s: redis status event(s) %d", cid, id, polllist[0].revents);
-        pollstat--;
-        if (polllist[1].revents & POLLIN) {
-          redisAsyncHandleRead(statac);
-        }
-        if (polllist[1].revents & POLLOUT) {
-          redisAsyncHandleWrite(statac);
-        }
-      }
-    }
-
-    for (i=2; pollstat && i<npoll; i++) {
-      if (polllist[i].revents) {
-        //isLogging_debug("%s->%s: fd: %d  revent: %d", cid, id, polllist[i].fd, polllist[i].revents);
-        pollstat--;
-      }
+      close(spt->fds[i]._pipe[0]);
+      close(spt->fds[i]._pipe[1]);
+      spt->fds[i]._piped_fd = -1;
+    }
+    c->pipew[i].kind   = IS_SP_WATCH_PIPE;
+    c->pipew[i].fd     = spt->fds[i]._piped_fd;
+    c->pipew[i].events = EPOLLIN;
+    c->pipew[i].child  = c;
+    c->pipew[i].spfd   = &spt->fds[i];
+  }
 
-      // check for errors
-      if (polllist[i].revents & (POLLERR | POLLHUP)) {
-        isLogging_info("%s->%s: Error or hangup on fd %d\n", cid, id, polllist[i].fd);
+  isLogging_debug("%s->%s: handing child %d to the reactor", cid, id, c->pid);
 
-        close(polllist[i].fd);
-        polllist[i].fd = (polllist[i].fd < 0 ? polllist[i].fd : -polllist[i].fd);  // ignore this fd in the future
-      }
-
-      // we are reading something
-      // 
-      if (polllist[i].revents & POLLIN) {
-        //isLogging_debug("%s->%s: POLLIN on fd=%d", cid, id, polllist[i].fd);
-
-        spfdp = &fd_servers[abs(polllist[i].fd)];
-        do {
-          bytes_read = read(polllist[i].fd, tmp, sizeof(tmp)-1);
-
-          //isLogging_debug("%s->%s: fd=%d read %d bytes: '%.*s'", cid, id, polllist[i].fd, bytes_read, bytes_read, tmp);
-
-          if (bytes_read == -1) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-              break;
-            }
-            isLogging_err("%s->%s: error reading fd=%d  (child fd=%d): %s", cid, id, spfdp->_piped_fd, spfdp->fd, strerror(errno));
-            //
-            // Probably this is a programming error with no recovery.
-            break;
-          }
-          //
-          // Nulls are good.
-          tmp[sizeof(tmp)-1] = 0;       // Just good form
-
-          if (bytes_read > 0) {
-            tmp[bytes_read] = 0;          // Really all the nullification that's needed
-
-            //
-            // Make room for incomming bytes
-            //
-            // New size includes temporary null byte
-            //
-            errno = 0;
-            spfdp->_buf = realloc(spfdp->_buf, spfdp->_buf_size + bytes_read + 1);
-            if (spfdp->_buf == NULL) {
-              isLogging_err("%s->%s: Out of memory (realloc %d bytes): %s", cid, id, spfdp->_buf_size+bytes_read+1, strerror(errno));
-              exit(-1);
-            }
-            //
-            // point to next location to write to
-            //
-            spfdp->_buf_end = spfdp->_buf + spfdp->_buf_size;
-            //
-            // and write there (include our stray null)
-            //
-            memmove(spfdp->_buf_end, tmp, bytes_read + 1);
-            //
-            // finally fix up size of buffer
-            // 
-            // Note we ignore our artifically added null so that it
-            // will get overwritten next time we get a string
-            //
-            spfdp->_buf_size += bytes_read;
-          }
-        } while(0);     // shouldn't we be able to do this while nbytes > 0 if we set non-blocking?
-
-        if (bytes_read > 0 && spfdp->onProgress) {
-          if (spfdp->read_lines == 0) {
-            // Easy as π
-            progress = spfdp->onProgress(spfdp->_buf);
-            if (progress >= 0) {
-              redisAsyncCommand(statac, statCB, NULL, "HSET %s PROGRESS {\"progress\":%d}", spt->controlPublisher, progress);
-            }
-            spfdp->_buf_size = 0;
-          } else {
-            //
-            // line mode: parse out each line and send them one at a
-            // time.  Save the residue (non \r or \n endings) for next
-            // time around or for the very end when we clean things
-            // up.
-            //
-            int i;
-            char *sp1, *sp2;
-
-            sp1 = sp2 = spfdp->_buf;
-            for (i=0; i<spfdp->_buf_size; i++, sp2++) {
-              if (*sp2 == '\r' || *sp2 == '\n') {
-                *sp2 = 0;
-                if (strlen(sp1)) {
-                  progress=spfdp->onProgress(sp1);
-                  if (progress >= 0) {
-                    redisAsyncCommand(statac, statCB, NULL, "HSET %s PROGRESS {\"progress\":%d}", spt->controlPublisher, progress);
-                  }
-                }
-                sp1 = sp2 + 1;
-              }
-            }
-            memmove(spfdp->_buf, sp1, strlen(sp1)+1);
-            spfdp->_buf_size = strlen(spfdp->_buf);
+  pthread_mutex_lock(&reactor_mutex);
+  c->subac = isSubProcessRedis(c, &c->subw, spt->controlAddress, spt->controlPort);
+  if (c->subac != NULL) {
+    // Set up redis subscriber
+    redisAsyncCommand(c->subac, subCB, c, "SUBSCRIBE %s", c->controlPublisher);
+  }
 
-          }
-        }
-      }
+  c->statac = isSubProcessRedis(c, &c->statw, spt->controlAddress, spt->controlPort);
+  if (c->statac != NULL) {
+    redisAsyncCommand(c->statac, statCB, NULL, "HSET %s STATUS {\"status\":\"Running\"}", c->controlPublisher);
+    redisAsyncCommand(c->statac, statCB, NULL, "EXPIRE %s 100", c->controlPublisher);
+  }
 
-      if (polllist[i].revents & POLLOUT) {
-        // Note that we do not have a use case for this yet.  Once we
-        // do then this section can get filled out.
-      }
+  if (c->progressPublisher != NULL) {
+    if (spt->progressAddress != NULL && spt->progressPort > 0) {
+      c->progac = isSubProcessRedis(c, &c->progw, spt->progressAddress, spt->progressPort);
+    } else {
+      c->progac = isSubProcessRedis(c, &c->progw, "127.0.0.1", 6379);
     }
   }
-  pthread_mutex_unlock(mutex);
-
-  isLogging_debug("%s->%s: End of polling", cid, id);
 
-  //
-  // Send our results
-  //
-  for (i=2; i<npoll; i++) {
-    if (polllist[i].fd > 0) {
-      close(polllist[i].fd);
-      //
-      // set fd negative to get poll to ignore this one
-      //
-      // Practically fd is never zero since it comes from dup2 and
-      // fd=0 is taken (stdin) hence anything returned by dup2 likely
-      // starts at 3.  We can always subtract max_fd+1 to ensure a
-      // negative number here if for some reasone dup2 starts
-      // returning 0 fd's.
-      //
-      polllist[i].fd = -polllist[i].fd;
-    }
-    spfdp = &fd_servers[abs(polllist[i].fd)];
-    if (spfdp->onProgress) {
-      spfdp->onProgress(spfdp->_buf);
-    }
-    if (spfdp->onDone) {
-      spfdp->onDone(spfdp->_buf);
-    }
-    free(spfdp->_buf);
-    spfdp->_buf_size = 0;
+  for (i=0; i < spt->nfds; i++) {
+    isSubProcessWatch(&c->pipew[i]);
   }
 
-  //
-  // Return memory allocations
+  if (c->pidw.fd >= 0) {
+    isSubProcessWatch(&c->pidw);
+  } else {
+    c->polled = 1;
+    reactor_polling++;
+  }
 
-  free(polllist);
-  polllist = NULL;
+  c->next = reactor_children;
+  reactor_children = c;
+  pthread_mutex_unlock(&reactor_mutex);
+}
 
-  free(fd_servers);
-  fd_servers = NULL;
+/** Publish msg on spt->progressPublisher without waiting on redis.
+ ** Only from spt's onProgress, onDone, or onExit callbacks: they run
+ ** on the reactor thread, which owns the connection.  Messages are
+ ** dropped should we have no connection.
+ */
+void isSubProcessPublish(isSubProcess_type *spt, const char *msg) {
+  isSubProcessChildType *c;
 
-  return;
+  c = spt->_child;
+  if (c == NULL || c->progac == NULL) {
+    return;
+  }
+  redisAsyncCommand(c->progac, statCB, NULL, "PUBLISH %s %s", c->progressPublisher, msg);
 }
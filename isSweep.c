@@ -0,0 +1,589 @@
+/*! @file isSweep.c
+ *  @copyright 2018 by Northwestern University
+ *  @author Keith Brister
+ *  @brief Spot and statistics sweep over all the frames of a dataset
+ *
+ *  A few reader threads, each with its own private image buffer,
+ *  take frames in turn, read them, find the spots, and hand back a
+ *  small per-frame result.  The private buffers bypass the image
+ *  buffer cache so a sweep does not evict the frames that the users
+ *  are looking at.  The thread that received the job publishes each
+ *  result as it comes in and saves it in our local redis so that the
+ *  next sweep with the same parameters is just a lookup.
+ */
+#include "is.h"
+
+/** What we learn about a frame
+ */
+typedef struct isSweepFrameStruct {
+  int state;                    //!< IS_SWEEP_TODO, IS_SWEEP_DONE, or IS_SWEEP_FAILED
+  int published;                //!< 1 once the result is on its way to the user
+  int cached;                   //!< 1 if the result came from redis
+  int spots;                    //!< number of spots
+  double mean;                  //!< mean of the usable pixels
+  uint32_t max;                 //!< largest unsaturated pixel
+  int nsat;                     //!< number of saturated pixels
+} isSweepFrameType;
+
+//! Frame still needs to be read
+#define IS_SWEEP_TODO      0
+//! Frame has a result
+#define IS_SWEEP_DONE      1
+//! Frame could not be read
+#define IS_SWEEP_FAILED    2
+
+/** Shared by the reader threads and the thread that started the sweep
+ */
+typedef struct isSweepStateStruct {
+  const char *fn;               //!< the dataset
+  json_t *meta;                 //!< meta data for the dataset.  Read only once the readers start.
+  int first;                    //!< first frame to sweep
+  int last;                     //!< last frame to sweep
+  double sigma;                 //!< spot finder threshold
+  int min_pixels;               //!< spot finder minimum spot size
+  isSweepType *sweep;           //!< our entry in wctx->sweeps (for the cancel flag)
+  pthread_mutex_t mutex;        //!< protects the rest of this structure
+  pthread_cond_t cond;          //!< signaled when a frame is done or a reader quits
+  int next;                     //!< next frame for a reader to take
+  int readers;                  //!< reader threads still running
+  isSweepFrameType *frames;     //!< results, indexed by frame - first
+} isSweepStateType;
+
+/** Frame statistics for the sweep.
+ **
+ ** @param imb   the frame
+ **
+ ** @param fp    where the results go
+ */
+static void isSweepStats(isImageBufType *imb, isSweepFrameType *fp) {
+  const uint32_t *bad;
+  double sum;
+  int n;
+  int i;
+  int npix;
+  uint32_t v;
+  uint32_t sat;
+
+  bad  = imb->bad_pixel_map;
+  npix = imb->buf_width * imb->buf_height;
+  sat  = imb->buf_depth == 2 ? 0xffff : 0xffffffff;
+
+  sum = 0.0;
+  n   = 0;
+  fp->max  = 0;
+  fp->nsat = 0;
+  for (i=0; i<npix; i++) {
+    if (bad && bad[i]) {
+      continue;
+    }
+    v = imb->buf_depth == 2 ? ((uint16_t *)imb->buf)[i] : ((uint32_t *)imb->buf)[i];
+    if (v == sat) {
+      fp->nsat++;
+      continue;
+    }
+    sum += v;
+    n++;
+    fp->max = v > fp->max ? v : fp->max;
+  }
+  fp->mean = n > 0 ? sum / n : 0.0;
+}
+
+/** Reader thread: take frames until there are none left or we are cancelled.
+ **
+ ** @param voidp our isSweepStateType
+ */
+static void *isSweepReader(void *voidp) {
+  static const char *id = FILEID "isSweepReader";
+  isSweepStateType *ss;
+  isImageBufType imb;           // our private buffer
+  isSweepFrameType result;
+  isSpotType *spots;
+  int frame;
+  int err;
+
+  ss = voidp;
+
+  memset(&imb, 0, sizeof(imb));
+  imb.key  = ss->fn;
+  imb.meta = ss->meta;
+
+  while (1) {
+    pthread_mutex_lock(&ss->mutex);
+    while (ss->next <= ss->last && ss->frames[ss->next - ss->first].state != IS_SWEEP_TODO) {
+      ss->next++;
+    }
+    if (ss->sweep->cancelled || ss->next > ss->last) {
+      pthread_mutex_unlock(&ss->mutex);
+      break;
+    }
+    frame = ss->next++;
+    pthread_mutex_unlock(&ss->mutex);
+
+    memset(&result, 0, sizeof(result));
+
+    imb.frame = frame;
+    err = isImageFileData(ss->fn, &imb);
+    if (err == 0 && imb.buf != NULL) {
+      isSweepStats(&imb, &result);
+      result.spots = isSpotFinder(&imb, ss->sigma, ss->min_pixels, &spots);
+      free(spots);
+      result.state = IS_SWEEP_DONE;
+    } else {
+      isLogging_err("%s: could not read frame %d of %s\n", id, frame, ss->fn);
+      result.state = IS_SWEEP_FAILED;
+    }
+    free(imb.buf);
+    imb.buf = NULL;
+
+    pthread_mutex_lock(&ss->mutex);
+    ss->frames[frame - ss->first] = result;
+    pthread_cond_signal(&ss->cond);
+    pthread_mutex_unlock(&ss->mutex);
+  }
+
+  //
+  // The bad pixel map and the file layout were kept from one frame to the next
+  //
+  if (imb.extra && imb.destroy_extra) {
+    imb.destroy_extra(imb.extra);
+  }
+  free(imb.bad_pixel_map);
+
+  pthread_mutex_lock(&ss->mutex);
+  ss->readers--;
+  pthread_cond_signal(&ss->cond);
+  pthread_mutex_unlock(&ss->mutex);
+
+  return NULL;
+}
+
+/** Make a message into the string we publish and save
+ **
+ ** @param wctx Worker context
+ **
+ ** @param msg  The message.  We take the reference.
+ **
+ ** @returns The string, which the caller frees
+ */
+static char *isSweepString(isWorkerContext_t *wctx, json_t *msg) {
+  static const char *id = FILEID "isSweepString";
+  char *rtn;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  rtn = msg ? json_dumps(msg, JSON_COMPACT) : NULL;
+  json_decref(msg);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  if (rtn == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  return rtn;
+}
+
+/** Per-frame result as the JSON string we publish and save
+ */
+static char *isSweepFrameString(isWorkerContext_t *wctx, const char *tag, int frame, const isSweepFrameType *fp) {
+  json_t *msg;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  if (fp->state == IS_SWEEP_FAILED) {
+    msg = json_pack("{s:s,s:b,s:b,s:i,s:b}", "tag", tag, "sweep", 1, "done", 0, "frame", frame, "failed", 1);
+  } else {
+    msg = json_pack("{s:s,s:b,s:b,s:i,s:i,s:f,s:I,s:i,s:b}", "tag", tag, "sweep", 1, "done", 0, "frame", frame,
+                    "spots", fp->spots, "mean", round(fp->mean * 1000.0) / 1000.0, "max", (json_int_t)fp->max,
+                    "nSaturated", fp->nsat, "cached", fp->cached);
+  }
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  return isSweepString(wctx, msg);
+}
+
+/** Our last message: the sweep is over
+ */
+static char *isSweepDoneString(isWorkerContext_t *wctx, const char *tag, int cancelled) {
+  json_t *msg;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  msg = json_pack("{s:s,s:b,s:b,s:b}", "tag", tag, "sweep", 1, "done", 1, "cancelled", cancelled);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  return isSweepString(wctx, msg);
+}
+
+/** Sweep the spot finder over a range of frames
+ **
+ ** Every frame's result is published on job.progressPublisher as
+ ** soon as it's ready:
+ **   {"tag":..., "sweep":true, "done":false, "frame":N, "spots":..., "mean":..., "max":..., "nSaturated":..., "cached":...}
+ ** followed by
+ **   {"tag":..., "sweep":true, "done":true, "cancelled":...}
+ **
+ ** The reply (err, job, meta) comes when the sweep is finished or
+ ** cancelled and has all the results as arrays indexed by frame -
+ ** first_frame.  Frames we could not read are null.
+ **
+ ** @param wctx Worker context
+ **
+ ** @param tcp Thread data
+ **   @li @c tcp->rep  ZMQ Response socket into which to throw our response.
+ **   @li @c tcp->rc   Local redis where we keep our results
+ **
+ ** @param job  What the user asked us to do
+ ** @param job.fn                {String}  - the dataset
+ ** @param job.first_frame       {Integer} - first frame to sweep.  Default 1
+ ** @param job.last_frame        {Integer} - last frame to sweep.  Default is the last frame in the dataset
+ ** @param job.min_pixels        {Integer} - spot finder minimum spot size.  Default IS_SPOT_FINDER_MIN_PIXELS
+ ** @param job.progressAddress   {String}  - redis server for our results.  Default is our local redis
+ ** @param job.progressPort      {Integer} - redis port for our results
+ ** @param job.progressPublisher {String}  - channel for our results.  Results are not streamed without one
+ ** @param job.sigma             {Float}   - spot finder threshold.  Default IS_SPOT_FINDER_SIGMA
+ ** @param job.tag               {String}  - ID for us to know what to do with the result and to cancel the sweep
+ ** @param job.type              {String}  - "SWEEP"
+ */
+void isSweep(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
+  static const char *id = FILEID "isSweep";
+  isSweepStateType ss;
+  isSweepType *sweep;
+  isSweepType **spp;
+  pthread_t threads[IS_SWEEP_THREADS];
+  int nthreads;
+  const char *tag;
+  const char *publisher;
+  const char *progressAddress;
+  int progressPort;
+  redisContext *rrc;            // where we publish
+  redisReply *reply;
+  struct stat st;
+  char *hkey;                   // redis hash with our saved results
+  char *msg;
+  json_t *meta;
+  json_t *jspots, *jmean, *jmax, *jnsat;
+  json_error_t jerr;
+  json_t *saved;
+  int nframes;
+  int published;
+  int cancelled;
+  int i;
+  int err;
+
+  memset(&ss, 0, sizeof(ss));
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  ss.fn     = json_string_value(json_object_get(job, "fn"));
+  ss.first  = json_integer_value(json_object_get(job, "first_frame"));
+  ss.last   = json_integer_value(json_object_get(job, "last_frame"));
+  ss.sigma  = IS_SPOT_FINDER_SIGMA;
+  if (json_is_number(json_object_get(job, "sigma"))) {
+    ss.sigma = json_number_value(json_object_get(job, "sigma"));
+  }
+  ss.min_pixels = IS_SPOT_FINDER_MIN_PIXELS;
+  if (json_is_integer(json_object_get(job, "min_pixels"))) {
+    ss.min_pixels = json_integer_value(json_object_get(job, "min_pixels"));
+  }
+  tag             = json_string_value(json_object_get(job, "tag"));
+  publisher       = json_string_value(json_object_get(job, "progressPublisher"));
+  progressAddress = json_string_value(json_object_get(job, "progressAddress"));
+  progressPort    = json_integer_value(json_object_get(job, "progressPort"));
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  tag = tag ? tag : "Tag_Not_Found";
+  ss.sigma      = ss.sigma <= 0.0 ? IS_SPOT_FINDER_SIGMA : ss.sigma;
+  ss.min_pixels = ss.min_pixels < 1 ? 1 : ss.min_pixels;
+
+  if (ss.fn == NULL || strlen(ss.fn) == 0 || stat(ss.fn, &st) != 0) {
+    isLogging_err("%s: missing or unreadable file for sweep %s\n", id, tag);
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Missing or unreadable file for sweep %s", id, tag);
+    return;
+  }
+
+  ss.meta = isImageFileMeta(ss.fn);
+  if (ss.meta == NULL) {
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Could not read meta data from %s", id, ss.fn);
+    return;
+  }
+
+  ss.first = ss.first <= 0 ? 1 : ss.first;
+  if (ss.last <= 0) {
+    ss.last = json_integer_value(json_object_get(ss.meta, "last_frame"));
+    ss.last = ss.last <= 0 ? ss.first : ss.last;
+  }
+  nframes = ss.last - ss.first + 1;
+  if (nframes <= 0 || nframes > IS_SWEEP_MAX_FRAMES) {
+    pthread_mutex_lock(&wctx->metaMutex);
+    json_decref(ss.meta);
+    pthread_mutex_unlock(&wctx->metaMutex);
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Bad frame range %d to %d", id, ss.first, ss.last);
+    return;
+  }
+
+  ss.frames = calloc(nframes, sizeof(*ss.frames));
+  if (ss.frames == NULL) {
+    isLogging_crit("%s: Out of memory (frames)\n", id);
+    exit (-1);
+  }
+
+  //
+  // Let sweep_cancel find us
+  //
+  sweep = calloc(1, sizeof(*sweep));
+  if (sweep == NULL) {
+    isLogging_crit("%s: Out of memory (sweep)\n", id);
+    exit (-1);
+  }
+  sweep->tag = strdup(tag);
+  if (sweep->tag == NULL) {
+    isLogging_crit("%s: Out of memory (tag)\n", id);
+    exit (-1);
+  }
+  pthread_mutex_lock(&wctx->sweepMutex);
+  sweep->next  = wctx->sweeps;
+  wctx->sweeps = sweep;
+  pthread_mutex_unlock(&wctx->sweepMutex);
+  ss.sweep = sweep;
+
+  //
+  // Pick up what we saved from the last time.  The file's
+  // modification time is part of the key so a dataset that is still
+  // growing doesn't give us stale results.
+  //
+  if (asprintf(&hkey, "%d:%s-%ld-sweep-%0.2f-%d", getegid(), ss.fn, (long)st.st_mtime, ss.sigma, ss.min_pixels) == -1) {
+    isLogging_crit("%s: Out of memory (hkey)\n", id);
+    exit (-1);
+  }
+
+  reply = redisCommand(tcp->rc, "HGETALL %s", hkey);
+  if (reply != NULL && reply->type == REDIS_REPLY_ARRAY) {
+    for (i=0; i+1<(int)reply->elements; i+=2) {
+      int frame;
+      isSweepFrameType *fp;
+
+      frame = atoi(reply->element[i]->str);
+      if (frame < ss.first || frame > ss.last) {
+        continue;
+      }
+      pthread_mutex_lock(&wctx->metaMutex);
+      saved = json_loads(reply->element[i+1]->str, 0, &jerr);
+      if (saved != NULL && json_is_integer(json_object_get(saved, "spots"))) {
+        fp = &ss.frames[frame - ss.first];
+        fp->state  = IS_SWEEP_DONE;
+        fp->cached = 1;
+        fp->spots  = json_integer_value(json_object_get(saved, "spots"));
+        fp->mean   = json_number_value(json_object_get(saved, "mean"));
+        fp->max    = json_integer_value(json_object_get(saved, "max"));
+        fp->nsat   = json_integer_value(json_object_get(saved, "nSaturated"));
+      }
+      json_decref(saved);
+      pthread_mutex_unlock(&wctx->metaMutex);
+    }
+  }
+  if (reply != NULL) {
+    freeReplyObject(reply);
+  }
+
+  rrc = NULL;
+  if (publisher != NULL) {
+    rrc = isProgressRedis(tcp, progressAddress, progressPort);
+  }
+
+  //
+  // Start the readers
+  //
+  pthread_mutex_init(&ss.mutex, NULL);
+  pthread_cond_init(&ss.cond, NULL);
+  ss.next = ss.first;
+
+  nthreads = nframes < IS_SWEEP_THREADS ? nframes : IS_SWEEP_THREADS;
+  for (i=0; i<nthreads; i++) {
+    err = pthread_create(&threads[i], NULL, isSweepReader, &ss);
+    if (err != 0) {
+      isLogging_err("%s: Could not start sweep reader: %s\n", id, strerror(err));
+      break;
+    }
+  }
+  nthreads = i;
+  ss.readers = nthreads;
+
+  //
+  // Publish and save results as they come in
+  //
+  published = 0;
+  pthread_mutex_lock(&ss.mutex);
+  while (1) {
+    int any;            // published something on this pass
+
+    any = 0;
+    for (i=0; i<nframes; i++) {
+      isSweepFrameType result;
+
+      if (ss.frames[i].state == IS_SWEEP_TODO || ss.frames[i].published) {
+        continue;
+      }
+      ss.frames[i].published = 1;
+      result = ss.frames[i];
+      published++;
+      any = 1;
+      pthread_mutex_unlock(&ss.mutex);
+
+      msg = isSweepFrameString(wctx, tag, ss.first + i, &result);
+      if (rrc != NULL) {
+        reply = redisCommand(rrc, "PUBLISH %s %s", publisher, msg);
+        if (reply == NULL) {
+          isLogging_info("%s: redis sweep publisher %s returned error %s", id, publisher, rrc->errstr);
+        } else {
+          freeReplyObject(reply);
+        }
+      }
+      if (result.state == IS_SWEEP_DONE && !result.cached) {
+        reply = redisCommand(tcp->rc, "HSET %s %d %s", hkey, ss.first + i, msg);
+        if (reply != NULL) {
+          freeReplyObject(reply);
+        }
+      }
+      free(msg);
+
+      pthread_mutex_lock(&ss.mutex);
+    }
+
+    if (any) {
+      continue;
+    }
+    if (published >= nframes || ss.readers == 0) {
+      break;
+    }
+    pthread_cond_wait(&ss.cond, &ss.mutex);
+  }
+  pthread_mutex_unlock(&ss.mutex);
+
+  for (i=0; i<nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  reply = redisCommand(tcp->rc, "EXPIRE %s %d", hkey, IS_SWEEP_TTL);
+  if (reply != NULL) {
+    freeReplyObject(reply);
+  }
+
+  pthread_mutex_lock(&wctx->sweepMutex);
+  cancelled = sweep->cancelled;
+  for (spp=&wctx->sweeps; *spp!=NULL; spp=&(*spp)->next) {
+    if (*spp == sweep) {
+      *spp = sweep->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&wctx->sweepMutex);
+  free(sweep->tag);
+  free(sweep);
+
+  if (rrc != NULL) {
+    msg = isSweepDoneString(wctx, tag, cancelled);
+    reply = redisCommand(rrc, "PUBLISH %s %s", publisher, msg);
+    if (reply != NULL) {
+      freeReplyObject(reply);
+    }
+    free(msg);
+    if (rrc != tcp->rc) {
+      redisFree(rrc);
+    }
+  }
+
+  //
+  // The reply has everything
+  //
+  pthread_mutex_lock(&wctx->metaMutex);
+  jspots = json_array();
+  jmean  = json_array();
+  jmax   = json_array();
+  jnsat  = json_array();
+  for (i=0; i<nframes; i++) {
+    if (ss.frames[i].state == IS_SWEEP_DONE) {
+      json_array_append_new(jspots, json_integer(ss.frames[i].spots));
+      json_array_append_new(jmean,  json_real(round(ss.frames[i].mean * 1000.0) / 1000.0));
+      json_array_append_new(jmax,   json_integer(ss.frames[i].max));
+      json_array_append_new(jnsat,  json_integer(ss.frames[i].nsat));
+    } else {
+      json_array_append_new(jspots, json_null());
+      json_array_append_new(jmean,  json_null());
+      json_array_append_new(jmax,   json_null());
+      json_array_append_new(jnsat,  json_null());
+    }
+  }
+  meta = json_pack("{s:o,s:i,s:i,s:b,s:f,s:i,s:o,s:o,s:o,s:o}",
+                   "detector_meta", ss.meta,
+                   "first_frame",   ss.first,
+                   "last_frame",    ss.last,
+                   "cancelled",     cancelled,
+                   "spot_sigma",    ss.sigma,
+                   "spot_min_pixels", ss.min_pixels,
+                   "spots",         jspots,
+                   "mean",          jmean,
+                   "max",           jmax,
+                   "nSaturated",    jnsat);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  isSpotsReply(wctx, tcp, job, meta);
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  json_decref(meta);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  pthread_mutex_destroy(&ss.mutex);
+  pthread_cond_destroy(&ss.cond);
+  free(ss.frames);
+  free(hkey);
+}
+
+/** Cancel a sweep
+ **
+ ** The sweep stops taking new frames right away and replies to its
+ ** own job once the frames being read are done.
+ **
+ ** @param wctx Worker context
+ **
+ ** @param tcp Thread data
+ **   @li @c tcp->rep  ZMQ Response socket into which to throw our response.
+ **
+ ** @param job  What the user asked us to do
+ ** @param job.sweep_tag  {String}  - tag of the sweep to cancel
+ ** @param job.type       {String}  - "SWEEP_CANCEL"
+ */
+void isSweepCancel(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
+  static const char *id = FILEID "isSweepCancel";
+  const char *sweep_tag;
+  isSweepType *sp;
+  json_t *meta;
+  int n;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  sweep_tag = json_string_value(json_object_get(job, "sweep_tag"));
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  if (sweep_tag == NULL) {
+    isLogging_err("%s: No sweep_tag in job\n", id);
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: No sweep_tag in job", id);
+    return;
+  }
+
+  n = 0;
+  pthread_mutex_lock(&wctx->sweepMutex);
+  for (sp=wctx->sweeps; sp!=NULL; sp=sp->next) {
+    if (strcmp(sp->tag, sweep_tag) == 0) {
+      sp->cancelled = 1;
+      n++;
+    }
+  }
+  pthread_mutex_unlock(&wctx->sweepMutex);
+
+  isLogging_info("%s: cancelled %d sweep(s) with tag %s\n", id, n, sweep_tag);
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  meta = json_pack("{s:i}", "cancelled", n);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  isSpotsReply(wctx, tcp, job, meta);
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  json_decref(meta);
+  pthread_mutex_unlock(&wctx->metaMutex);
+}
@@ -482,6 +482,33 @@ double get_double_from_json_object(const char *cid,  const json_t *j, const char
 
 
 
+/** A queue limit from the environment
+ **
+ ** @param name Environment variable
+ **
+ ** @param def  Our default
+ **
+ ** @returns The variable's value if it is a positive number, def otherwise
+ */
+int isQueueSetting(const char *name, int def) {
+  const char *s;
+
+  s = getenv(name);
+  return (s != NULL && atoi(s) > 0) ? atoi(s) : def;
+}
+
+/** High water mark for the sockets requests queue on
+ **
+ ** ZMQ's default of 0 let a burst of requests take all our memory.
+ ** Admission control (isBrokerForward) should keep the queues well
+ ** short of this; it is here in case something gets past it.
+ **
+ ** @returns IS_QUEUE_HWM unless the environment says otherwise
+ */
+int isQueueHwm() {
+  return isQueueSetting("IS_QUEUE_HWM", IS_QUEUE_HWM);
+}
+
 /** ZMQ needs us to pass a free routine to free data whenever it is done with it.
  **
  ** @param data   data to free
@@ -620,3 +647,43 @@ char *file_name_component(const char *parent_id, const char *path) {
   return rtn;
 }
 
+
+/** Find the redis server to publish progress on.
+ **
+ ** Jobs that name a server with progressAddress and progressPort get
+ ** a new connection to it.  Everyone else gets our local redis.
+ ** Don't let a slow server hold up the real work.
+ **
+ ** @param tcp      Thread data
+ **   @li @c tcp->rc  Local redis
+ **
+ ** @param address  Remote redis server or NULL
+ **
+ ** @param port     Remote redis port
+ **
+ ** @returns redis context or NULL if we could not connect.  Call
+ ** redisFree on the result when it is not tcp->rc.
+ */
+redisContext *isProgressRedis(isThreadContextType *tcp, const char *address, int port) {
+  static const char *id = FILEID "isProgressRedis";
+  redisContext *rtn;
+  struct timeval timeout;
+
+  if (address == NULL || port <= 0) {
+    return tcp->rc;
+  }
+
+  timeout.tv_sec  = 0;
+  timeout.tv_usec = IS_PROGRESS_CONNECT_TIMEOUT_MS * 1000;
+  rtn = redisConnectWithTimeout(address, port, timeout);
+  if (rtn == NULL || rtn->err) {
+    if (rtn) {
+      isLogging_info("%s: Failed to connect to remote redis %s:%d: %s", id, address, port, rtn->errstr);
+      redisFree(rtn);
+    } else {
+      isLogging_info("%s: Failed to connect to remote redis %s:%d", id, address, port);
+    }
+    return NULL;
+  }
+  return rtn;
+}
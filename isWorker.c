@@ -4,19 +4,70 @@
  *  @brief Routines to parse instructions from the user and fire off the appropriate actions.
  */
 #include "is.h"
-static int running = 0;
 
-/** handle signals by lowering the running flag.
- ** 
- ** @param sig the signal number
+/** What the supervisor's statistics thread needs                */
+typedef struct isSupervisorStatsStruct {
+  isWorkerContext_t *wctx;      //!< Our worker context
+  void *capture;                //!< SUB: a copy of every frame through our proxy
+  void *control;                //!< PAIR: commands for our proxy
+  int sfd;                      //!< signalfd for the signals we handle
+} isSupervisorStatsType;
+
+/** Run a job of the given type.  Used by the workers and by the
+ ** async executors.
+ **
+ ** @param wctx      Worker context
+ **
+ ** @param tcp       Thread data
+ **   @li @c tcp->rep  Where the job sends its reply
  **
- ** @param si  siginfo struction
+ ** @param job       What the user asked us to do
  **
- ** @param dummy unused user data
+ ** @param job_type  The job's type
+ **
+ ** @param jobstr    The job as a string for the logs
  */
-void signal_action(int sig, siginfo_t *si, void *dummy) {
-  if (sig == SIGTERM || sig == SIGINT) {
-    running = 0;
+void isWorkerDispatch(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job, const char *job_type, const char *jobstr) {
+  static const char *id = FILEID "isWorkerDispatch";
+
+  // The string comparisons are done in order of most likely to
+  // least likely match. This is a reasonable algorithm for such
+  // a small command set.
+  if (strcasecmp("jpeg", job_type) == 0) {
+    isJpeg(wctx, tcp, job);
+  } else if (strcasecmp("prefetch", job_type) == 0) {
+    isJpegPrefetch(wctx, tcp, job);
+  } else if (strcasecmp("spots", job_type) == 0) {
+    isSpots(wctx, tcp, job);
+  } else if (strcasecmp("findspots", job_type) == 0) {
+    isFindSpots(wctx, tcp, job);
+  } else if (strcasecmp("profile", job_type) == 0) {
+    isProfile(wctx, tcp, job);
+  } else if (strcasecmp("sweep", job_type) == 0) {
+    isSweep(wctx, tcp, job);
+  } else if (strcasecmp("sweep_cancel", job_type) == 0) {
+    isSweepCancel(wctx, tcp, job);
+  } else if (strcasecmp("index", job_type) == 0) {
+    isIndex(wctx, tcp, job);
+  } else if (strcasecmp("index_cancel", job_type) == 0) {
+    isIndexCancel(wctx, tcp, job);
+  } else if (strcasecmp("rsync_host_test", job_type) == 0 ||
+             strcasecmp("rsync_connection_test", job_type) == 0 ||
+             strcasecmp("local_dir_stats", job_type) == 0 ||
+             strcasecmp("rsync_transfer", job_type) == 0) {
+    // Rsync-related jobs and any other discontinued message types are
+    // caught and handled here.
+    isLogging_err("%s: Obsolete job type '%s' in job '%s'\n",
+                  id, job_type, jobstr);
+    is_zmq_error_reply(NULL, 0, tcp->rep,
+                       "%s: Obsolete job type '%s' in job '%s'",
+                       id, job_type, jobstr);
+  } else {
+    isLogging_err("%s: Unknown job type '%s' in job '%s'\n",
+                  id, job_type, jobstr);
+    is_zmq_error_reply(NULL, 0, tcp->rep,
+                       "%s: Unknown job type '%s' in job '%s'",
+                       id, job_type, jobstr);
   }
 }
 
@@ -33,9 +84,12 @@ void *isWorker(void *voidp) {
   char *jobstr;
   const char *job_type;
   char dealer_endpoint[128];
+  char worker_id[16];
   zmq_msg_t zmsg;
   int err;
   int socket_option;
+  int worker;                   // our number
+  int async;                    // run this job on an executor
 
   wctx = (isWorkerContext_t*)voidp;
 
@@ -45,23 +99,35 @@ void *isWorker(void *voidp) {
     exit (-1);
   }
 
-  socket_option = 0;
+  socket_option = isQueueHwm();
   err = zmq_setsockopt(tc.rep, ZMQ_RCVHWM, &socket_option, sizeof(socket_option));
   if (err == -1) {
     isLogging_err("%s: Could not set RCVHWM for rc.rep: %s\n", id, zmq_strerror(errno));
     exit (-1);
   }
 
-  socket_option = 0;
+  socket_option = isQueueHwm();
   err = zmq_setsockopt(tc.rep, ZMQ_SNDHWM, &socket_option, sizeof(socket_option));
   if (err == -1) {
     isLogging_err("%s: Could not set SNDHWM for rc.rep: %s\n", id, zmq_strerror(errno));
     exit (-1);
   }
 
-  snprintf(dealer_endpoint, sizeof(dealer_endpoint)-1, "inproc://#%s", wctx->key);
+  //
+  // The scheduler picks us by name
+  //
+  worker = __sync_fetch_and_add(&wctx->workerSerial, 1);
+  isSchedSetWorker(worker);
+  isSchedWorkerId(worker, worker_id, sizeof(worker_id));
+  err = zmq_setsockopt(tc.rep, ZMQ_IDENTITY, worker_id, strlen(worker_id));
+  if (err == -1) {
+    isLogging_err("%s: Could not set identity for rc.rep: %s\n", id, zmq_strerror(errno));
+    exit (-1);
+  }
+
+  snprintf(dealer_endpoint, sizeof(dealer_endpoint)-1, "inproc://#%s-workers", wctx->inprocKey);
   dealer_endpoint[sizeof(dealer_endpoint)-1] = 0;
-  
+
   err = zmq_connect(tc.rep, dealer_endpoint);
   if (err == -1) {
     isLogging_err("%s: Failed to connect to dealer endpoint %s: %s\n", id, dealer_endpoint, zmq_strerror(errno));
@@ -89,8 +155,14 @@ void *isWorker(void *voidp) {
     zmq_msg_init(&zmsg);
     err = zmq_msg_recv(&zmsg, tc.rep, 0);
     if (err == -1) {
-      isLogging_err("%s: problem receiving message: %s\n", id, zmq_strerror(errno));
       zmq_msg_close(&zmsg);
+      if (errno == ETERM) {
+        //
+        // Our supervisor is shutting down
+        //
+        break;
+      }
+      isLogging_err("%s: problem receiving message: %s\n", id, zmq_strerror(errno));
       if (errno == EFSM) {
         //
         // Trick to get socket back to the right state
@@ -100,9 +172,10 @@ void *isWorker(void *voidp) {
         // is_zmq_error_reply?
         //
         is_zmq_error_reply(NULL, 0, tc.rep, "%s: Socket in wrong state", id);
-        continue;
       }
+      continue;
     }
+    __sync_add_and_fetch(&wctx->jobsTaken, 1);
 
     pthread_mutex_lock(&wctx->metaMutex);
     job = json_loadb(zmq_msg_data(&zmsg), zmq_msg_size(&zmsg), 0, &jerr);
@@ -113,6 +186,7 @@ void *isWorker(void *voidp) {
     if (job == NULL) {
       isLogging_err("%s: Failed to parse request: %s\n", id, jerr.text);
       is_zmq_error_reply(NULL, 0, tc.rep, "%s: Could not parse request: %s", id, jerr.text);
+      __sync_add_and_fetch(&wctx->jobsDone, 1);
       continue;
     }
 
@@ -121,129 +195,377 @@ void *isWorker(void *voidp) {
     job_type = json_string_value(json_object_get(job, "type"));
     pthread_mutex_unlock(&wctx->metaMutex);
 
+    pthread_mutex_lock(&wctx->metaMutex);
+    async = json_is_true(json_object_get(job, "async"));
+    pthread_mutex_unlock(&wctx->metaMutex);
+
     if (job_type == NULL) {
       isLogging_err("%s: No type parameter in job %s\n", id, jobstr);
       is_zmq_error_reply(NULL, 0, tc.rep, "%s: No type parameter in job %s", id, jobstr);
+    } else if (strcasecmp("result", job_type) == 0) {
+      isAsyncResult(wctx, &tc, job);
+    } else if (async) {
+      isAsyncSubmit(wctx, &tc, job, job_type);
     } else {
-      // The string comparisons are done in order of most likely to
-      // least likely match. This is a reasonable algorithm for such
-      // a small command set.
-      if (strcasecmp("jpeg", job_type) == 0) {
-        isJpeg(wctx, &tc, job);
-      } else if (strcasecmp("spots", job_type) == 0) {
-        isSpots(wctx, &tc, job);
-      } else if (strcasecmp("index", job_type) == 0) {
-        isIndex(wctx, &tc, job);
-      } else if (strcasecmp("rsync_host_test", job_type) == 0 ||
-		 strcasecmp("rsync_connection_test", job_type) == 0 ||
-		 strcasecmp("local_dir_stats", job_type) == 0 ||
-		 strcasecmp("rsync_transfer", job_type) == 0) {
-	// Rsync-related jobs and any other discontinued message types are
-	// caught and handled here.
-	isLogging_err("%s: Obsolete job type '%s' in job '%s'\n",
-		      id, job_type, jobstr);
-        is_zmq_error_reply(NULL, 0, tc.rep,
-			   "%s: Obsolete job type '%s' in job '%s'",
-			   id, job_type, jobstr);
-      } else {
-        isLogging_err("%s: Unknown job type '%s' in job '%s'\n",
-		      id, job_type, jobstr);
-        is_zmq_error_reply(NULL, 0, tc.rep,
-			   "%s: Unknown job type '%s' in job '%s'",
-			   id, job_type, jobstr);
-      }
+      isWorkerDispatch(wctx, &tc, job, job_type, jobstr);
     }
     free(jobstr);
     pthread_mutex_lock(&wctx->metaMutex);
     json_decref(job);
     pthread_mutex_unlock(&wctx->metaMutex);
+    __sync_add_and_fetch(&wctx->jobsDone, 1);
   }
+
+  zmq_close(tc.rep);
+  redisFree(tc.rc);
   return NULL;
 }
 
-/** Dispatch workers and pass to them the jobs we receive.
- ** 
- ** @param key  Unique identifer for this user in this ESAF group
+/** Send our proxy a command
+ **
+ ** @param control Our end of the proxy's control socket
+ **
+ ** @param cmd     PAUSE, RESUME, or TERMINATE
  */
-void isSupervisor(const char *key) {
-  static const char *id = FILEID "isSupervisor";
-  static struct sigaction si;
-  //
-  // In child process running as user in home directory
-  //
-  zmq_pollitem_t zpollitems[2];
-  isWorkerContext_t *wctx;
-  int i;
-  int err;
-  pthread_t threads[N_WORKER_THREADS];
-  zmq_msg_t zmsg;
-  int more;
+static void isSupervisorControl(void *control, const char *cmd) {
+  static const char *id = FILEID "isSupervisorControl";
 
-  mtrace();
+  if (zmq_send(control, cmd, strlen(cmd), 0) == -1) {
+    isLogging_err("%s: Could not send %s to our proxy: %s\n", id, cmd, zmq_strerror(errno));
+  }
+}
 
-  si.sa_sigaction = signal_action;
-  sigemptyset(&si.sa_mask);
-  sigaction( SIGTERM, &si, NULL);
-  sigaction( SIGINT,  &si, NULL);
+/** Keep an eye on the supervisor's proxy: count what goes through it
+ ** and tell it when to pause, resume, or stop.
+ **
+ ** Every IS_SUPERVISOR_STATS_SECONDS the figures go to the hash
+ ** KEY-stats in our local redis:
+ **   @li @c requests_per_s Requests from the broker
+ **   @li @c bytes_per_s    Bytes through the proxy, both ways
+ **   @li @c queue_depth    Requests no worker has picked up yet
+ **   @li @c busy           Workers with a job
+ **
+ ** SIGTERM and SIGINT stop the proxy, SIGUSR1 pauses it and SIGUSR2
+ ** resumes it.
+ **
+ ** @param voidp Our isSupervisorStatsType
+ */
+static void *isSupervisorStats(void *voidp) {
+  static const char *id = FILEID "isSupervisorStats";
+  isSupervisorStatsType *sp;
+  isWorkerContext_t *wctx;
+  zmq_pollitem_t zpollitems[2];
+  struct signalfd_siginfo ssi;
+  struct timespec last;
+  struct timespec now;
+  redisContext *rc;
+  redisReply *reply;
+  zmq_msg_t zmsg;
+  char stats_key[256];
+  long long messages;           // whole messages seen since last time
+  long long bytes;              // and their size
+  long long total_messages;     // ever
+  long long requests;           // requests that have come in, ever
+  long long last_requests;      // as of last time
+  long taken;
+  long done;
+  double elapsed;
+  int timeout;
+  int running;
+  int err;
 
-  running = 1;
-  wctx = isDataInit(key);
+  sp   = voidp;
+  wctx = sp->wctx;
 
-  // Start up some workers
-  for (i=0; i<N_WORKER_THREADS; i++) {
-    err = pthread_create(&(threads[i]), NULL, isWorker, wctx);
+  snprintf(stats_key, sizeof(stats_key)-1, "%s-stats", wctx->key);
+  stats_key[sizeof(stats_key)-1] = 0;
 
-    if (err != 0) {
-      isLogging_err("%s: Could not start worker for %s because %s\n",
-              id, key, err==EAGAIN ? "Insufficient resources" : (err==EINVAL ? "Bad attributes" : (err==EPERM ? "No permission" : "Unknown Reasons")));
-      return;
+  //
+  // Without redis we still log our figures
+  //
+  rc = redisConnect("127.0.0.1", 6379);
+  if (rc == NULL || rc->err) {
+    isLogging_err("%s: Failed to connect to redis: %s\n", id, rc ? rc->errstr : "no context");
+    if (rc != NULL) {
+      redisFree(rc);
+      rc = NULL;
     }
   }
 
-  zpollitems[0].socket = wctx->dealer;
+  zpollitems[0].socket = sp->capture;
+  zpollitems[0].fd     = 0;
   zpollitems[0].events = ZMQ_POLLIN;
 
-  zpollitems[1].socket = wctx->router;;
+  zpollitems[1].socket = NULL;
+  zpollitems[1].fd     = sp->sfd;
   zpollitems[1].events = ZMQ_POLLIN;
 
-  while(running) {
-    err = zmq_poll(zpollitems, 2, -1);
+  messages       = 0;
+  bytes          = 0;
+  total_messages = 0;
+  last_requests  = 0;
+  clock_gettime(CLOCK_MONOTONIC, &last);
+
+  running = 1;
+  while (running) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) * 1.0e-9;
+    timeout = (IS_SUPERVISOR_STATS_SECONDS - elapsed) * 1000;
+    if (timeout < 0) {
+      timeout = 0;
+    }
+
+    err = zmq_poll(zpollitems, 2, timeout);
     if (err == -1) {
       if (errno == EINTR) {
-        break;
+        continue;
       }
       isLogging_err("%s: zmq_poll error: %s\n", id, zmq_strerror(errno));
-      exit (-1);
+      isSupervisorControl(sp->control, "TERMINATE");
+      break;
     }
 
     if (zpollitems[0].revents & ZMQ_POLLIN) {
-      while(1) {
+      while (1) {
         zmq_msg_init(&zmsg);
-        zmq_msg_recv(&zmsg, wctx->dealer, 0);
-        more = zmq_msg_more(&zmsg);
-        zmq_msg_send(&zmsg, wctx->router, more ? ZMQ_SNDMORE : 0);
-        zmq_msg_close(&zmsg);
-        if (!more) {
+        if (zmq_msg_recv(&zmsg, sp->capture, ZMQ_DONTWAIT) == -1) {
+          zmq_msg_close(&zmsg);
           break;
         }
+        bytes += zmq_msg_size(&zmsg);
+        if (!zmq_msg_more(&zmsg)) {
+          messages++;
+        }
+        zmq_msg_close(&zmsg);
       }
     }
 
-    if (zpollitems[1].revents & ZMQ_POLLIN) {
-      while(1) {
-        zmq_msg_init(&zmsg);
-        zmq_msg_recv(&zmsg, wctx->router, 0);
-        more = zmq_msg_more(&zmsg);
-        zmq_msg_send(&zmsg, wctx->dealer, more ? ZMQ_SNDMORE : 0);
-        zmq_msg_close(&zmsg);
-        if (!more) {
+    if ((zpollitems[1].revents & ZMQ_POLLIN) && read(sp->sfd, &ssi, sizeof(ssi)) == sizeof(ssi)) {
+      switch (ssi.ssi_signo) {
+      case SIGUSR1:
+        isLogging_info("%s: %s: pausing\n", id, wctx->key);
+        isSupervisorControl(sp->control, "PAUSE");
+        break;
+
+      case SIGUSR2:
+        isLogging_info("%s: %s: resuming\n", id, wctx->key);
+        isSupervisorControl(sp->control, "RESUME");
+        break;
+
+      default:
+        isLogging_info("%s: %s: shutting down on signal %d\n", id, wctx->key, ssi.ssi_signo);
+        isSupervisorControl(sp->control, "TERMINATE");
+        running = 0;
+        break;
+      }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) * 1.0e-9;
+    if (elapsed < IS_SUPERVISOR_STATS_SECONDS) {
+      continue;
+    }
+
+    //
+    // Every request through the proxy gets exactly one reply so what
+    // we saw less what the workers answered is what came in.  Those
+    // the workers have not taken yet are still queued.
+    //
+    total_messages += messages;
+    done  = __sync_add_and_fetch(&wctx->jobsDone, 0);
+    taken = __sync_add_and_fetch(&wctx->jobsTaken, 0);
+
+    requests = total_messages - done;
+    if (requests < taken) {
+      requests = taken;         // replies still on their way to us
+    }
+
+    if (messages) {
+      isLogging_info("%s: %s: %.1f requests/s  %.0f bytes/s  %lld queued  %ld busy\n",
+                     id, wctx->key, (requests - last_requests) / elapsed, bytes / elapsed, requests - taken, taken - done);
+    }
+
+    if (rc != NULL) {
+      redisAppendCommand(rc, "HMSET %s requests_per_s %f bytes_per_s %f queue_depth %lld busy %ld",
+                         stats_key, (requests - last_requests) / elapsed, bytes / elapsed, requests - taken, taken - done);
+      redisAppendCommand(rc, "EXPIRE %s %d", stats_key, 3 * IS_SUPERVISOR_STATS_SECONDS);
+      for (err=0; err<2; err++) {
+        if (redisGetReply(rc, (void **)&reply) != REDIS_OK) {
+          isLogging_err("%s: Lost redis: %s\n", id, rc->errstr);
+          redisFree(rc);
+          rc = NULL;
           break;
         }
+        freeReplyObject(reply);
       }
     }
+
+    messages      = 0;
+    bytes         = 0;
+    last_requests = requests;
+    last          = now;
+  }
+
+  zmq_close(sp->capture);
+  zmq_close(sp->control);
+  if (rc != NULL) {
+    redisFree(rc);
+  }
+  return NULL;
+}
+
+/** Make one of the supervisor's inproc sockets
+ **
+ ** @param wctx     Worker context with our zmq context
+ **
+ ** @param type     Socket type
+ **
+ ** @param what     capture or control
+ **
+ ** @param bind     Bind if true, otherwise connect
+ */
+static void *isSupervisorSocket(isWorkerContext_t *wctx, int type, const char *what, int bind) {
+  static const char *id = FILEID "isSupervisorSocket";
+  char endpoint[256];
+  void *rtn;
+  int socket_option;
+  int err;
+
+  rtn = zmq_socket(wctx->zctx, type);
+  if (rtn == NULL) {
+    isLogging_err("%s: Could not create %s socket: %s\n", id, what, zmq_strerror(errno));
+    exit (-1);
+  }
+
+  socket_option = isQueueHwm();
+  zmq_setsockopt(rtn, ZMQ_RCVHWM, &socket_option, sizeof(socket_option));
+  zmq_setsockopt(rtn, ZMQ_SNDHWM, &socket_option, sizeof(socket_option));
+  if (type == ZMQ_SUB) {
+    zmq_setsockopt(rtn, ZMQ_SUBSCRIBE, "", 0);
+  }
+
+  snprintf(endpoint, sizeof(endpoint)-1, "inproc://#%s-%s", what, wctx->inprocKey);
+  endpoint[sizeof(endpoint)-1] = 0;
+
+  err = bind ? zmq_bind(rtn, endpoint) : zmq_connect(rtn, endpoint);
+  if (err == -1) {
+    isLogging_err("%s: Could not %s %s: %s\n", id, bind ? "bind" : "connect to", endpoint, zmq_strerror(errno));
+    exit (-1);
+  }
+  return rtn;
+}
+
+/** Dispatch workers and pass to them the jobs we receive.
+ **
+ ** A zygote gets everything ready, workers and all, before it knows
+ ** whose process it is, then waits for isZygoteWait to tell it.
+ **
+ ** @param key       Unique identifer for this user in this ESAF group.
+ **                  NULL for a zygote.
+ **
+ ** @param zygote_fd A zygote's end of the socket its identity comes
+ **                  over, -1 otherwise
+ */
+void isSupervisor(const char *key, int zygote_fd) {
+  static const char *id = FILEID "isSupervisor";
+  //
+  // In child process running as user in home directory or, for a
+  // zygote, as root until we know who the user is
+  //
+  isWorkerContext_t *wctx;
+  char zygote_key[32];
+  isSupervisorStatsType stats;
+  sigset_t signals;
+  int i;
+  int err;
+  pthread_t threads[N_WORKER_THREADS];
+  pthread_t stats_thread;
+  void *capture;                // our proxy's end of stats.capture
+  void *control;                // and of stats.control
+
+  mtrace();
+
+  //
+  // Our statistics thread reads the signals we care about from a
+  // signalfd.  Block them before starting any threads so none of
+  // them is interrupted instead.
+  //
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGUSR1);
+  sigaddset(&signals, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  stats.sfd = signalfd(-1, &signals, SFD_CLOEXEC);
+  if (stats.sfd == -1) {
+    isLogging_err("%s: Could not create signalfd: %s\n", id, strerror(errno));
+    exit (-1);
+  }
+
+  if (zygote_fd != -1) {
+    snprintf(zygote_key, sizeof(zygote_key)-1, "zygote-%d", (int)getpid());
+    zygote_key[sizeof(zygote_key)-1] = 0;
+    key = zygote_key;
+  }
+
+  wctx = isDataInit(key);
+  isLabelInit();
+
+  // Jobs go through our scheduler, by priority
+  isSchedInit(wctx);
+
+  // Start up some workers
+  for (i=0; i<N_WORKER_THREADS; i++) {
+    err = pthread_create(&(threads[i]), NULL, isWorker, wctx);
+
+    if (err != 0) {
+      isLogging_err("%s: Could not start worker for %s because %s\n",
+              id, key, err==EAGAIN ? "Insufficient resources" : (err==EINVAL ? "Bad attributes" : (err==EPERM ? "No permission" : "Unknown Reasons")));
+      //
+      // The workers we did start and the scheduler are running on
+      // our context: there is no going back from here
+      //
+      exit (-1);
+    }
   }
 
-  // TODO: do we need to send a signal to the threads (pthreads_kill)?
+  //
+  // The capture socket never blocks our proxy: PUB drops what no
+  // one is reading
+  //
+  capture       = isSupervisorSocket(wctx, ZMQ_PUB,  "capture", 1);
+  stats.capture = isSupervisorSocket(wctx, ZMQ_SUB,  "capture", 0);
+  control       = isSupervisorSocket(wctx, ZMQ_PAIR, "control", 1);
+  stats.control = isSupervisorSocket(wctx, ZMQ_PAIR, "control", 0);
+  stats.wctx    = wctx;
+
+  if (zygote_fd != -1) {
+    key = isZygoteWait(zygote_fd);
+  }
+  isDataConnect(wctx, key);
+
+  err = pthread_create(&stats_thread, NULL, isSupervisorStats, &stats);
+  if (err != 0) {
+    isLogging_err("%s: Could not start statistics thread for %s: %s\n", id, key, strerror(err));
+    exit (-1);
+  }
+
+  //
+  // Requests from our parent go to the scheduler and the workers'
+  // replies go back until the statistics thread tells the proxy to
+  // stop
+  //
+  err = zmq_proxy_steerable(wctx->router, wctx->dealer, capture, control);
+  if (err == -1) {
+    isLogging_err("%s: zmq_proxy_steerable error: %s\n", id, zmq_strerror(errno));
+  }
+
+  //
+  // Workers waiting for a job find the context shut down.  Those with
+  // one finish it first.
+  //
+  zmq_ctx_shutdown(wctx->zctx);
 
   // Wait for the workers to stop
   for (i=0; i<N_WORKER_THREADS; i++) {
@@ -261,7 +583,19 @@ void isSupervisor(const char *key) {
     }
   }
 
+  pthread_join(wctx->schedThread, NULL);
+  pthread_join(stats_thread, NULL);
+  zmq_close(capture);
+  zmq_close(control);
+  zmq_close(wctx->router);
+  zmq_close(wctx->dealer);
+  close(stats.sfd);
+
   // free up the image buffers
   isDataDestroy(wctx);
+
+  if (zygote_fd != -1) {
+    free((char *)key);
+  }
   return;
 }
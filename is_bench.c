@@ -0,0 +1,114 @@
+/*! @file is_bench.c
+ *  @copyright 2018 by Northwestern University
+ *  @author Keith Brister
+ *  @brief Time how long the main loop takes to find where a request goes
+ *
+ *  Compares a full json_loadb (what the main loop used to do for
+ *  every request) with isRouteScan and isRouteFrame on requests like
+ *  the ones is.js sends.  Each answer is checked against jansson's.
+ *
+ *  make is_bench && ./is_bench [iterations]
+ */
+#include "is.h"
+
+/** Requests as is.js sends them plus a few less friendly ones */
+static const char *bench_requests[] = {
+  "{\"type\":\"jpeg\",\"pid\":\"a3f9c1e27b6d4e0f8a9b1c2d3e4f5a6b\",\"esaf\":72641,\"fn\":\"/pf/esaf/e72641/2018-05-04/mx/test_1_00001.cbf\",\"frame\":1,\"xsize\":1024,\"ysize\":1024,\"contrast\":-1,\"wval\":-1,\"x\":0,\"y\":0,\"width\":4096,\"height\":4096,\"zoom\":1,\"tag\":\"jpeg-17\",\"labelHeight\":24,\"colormap\":\"gray\"}",
+  "{\"fn\":\"/pf/esaf/e72641/2018-05-04/mx/test_1_master.h5\",\"frame\":120,\"xsize\":512,\"ysize\":512,\"contrast\":-1,\"wval\":-1,\"x\":0,\"y\":0,\"width\":4150,\"height\":4371,\"zoom\":1,\"overlay\":{\"rings\":[3.5,2.5,1.8],\"spots\":true},\"tag\":\"jpeg-18\",\"type\":\"jpeg\",\"esaf\":72641,\"pid\":\"a3f9c1e27b6d4e0f8a9b1c2d3e4f5a6b\"}",
+  "{ \"type\" : \"spots\" , \"esaf\" : 0 , \"pid\" : \"b17e\" , \"fn\" : \"/tmp/x \\\"quoted\\\".cbf\" }",
+  "{\"type\":\"index\",\"pid\":\"c\\u0030ffee\",\"esaf\":1}",
+  "{\"type\":\"header\",\"esaf\":\"72641\",\"pid\":\"d00d\"}",
+  NULL
+};
+
+static double bench_now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1.0e-9;
+}
+
+int main(int argc, char **argv) {
+  const char *req;
+  const char *pid;
+  const char *jpid;
+  json_t *j;
+  json_error_t jerr;
+  char frame[128];
+  double t0;
+  double t_json;
+  double t_scan;
+  double t_frame;
+  long iterations;
+  long k;
+  int pid_len;
+  int esaf;
+  int jesaf;
+  int fallbacks;
+  int bad;
+  int i;
+
+  iterations = argc > 1 ? atol(argv[1]) : 200000;
+
+  bad = 0;
+  for (i=0; bench_requests[i] != NULL; i++) {
+    req = bench_requests[i];
+
+    //
+    // Does the scanner agree with jansson?
+    //
+    j     = json_loads(req, 0, &jerr);
+    jpid  = json_string_value(json_object_get(j, "pid"));
+    jesaf = json_integer_value(json_object_get(j, "esaf"));
+
+    if (isRouteScan(req, strlen(req), &pid, &pid_len, &esaf) == 0) {
+      if (jpid == NULL || strlen(jpid) != pid_len || strncmp(jpid, pid, pid_len) != 0 || esaf != jesaf) {
+        printf("request %d: scanner says %.*s %d, jansson says %s %d\n", i, pid_len, pid, esaf, jpid ? jpid : "(null)", jesaf);
+        bad++;
+      }
+      fallbacks = 0;
+    } else {
+      fallbacks = 1;
+    }
+
+    snprintf(frame, sizeof(frame), "%s%s %d", IS_ROUTE_PREFIX, jpid ? jpid : "x", jesaf);
+
+    //
+    // Full parse
+    //
+    t0 = bench_now();
+    for (k=0; k<iterations; k++) {
+      j = json_loadb(req, strlen(req), 0, &jerr);
+      jpid  = json_string_value(json_object_get(j, "pid"));
+      jesaf = json_integer_value(json_object_get(j, "esaf"));
+      json_decref(j);
+    }
+    t_json = bench_now() - t0;
+
+    //
+    // Scanner
+    //
+    t0 = bench_now();
+    for (k=0; k<iterations; k++) {
+      isRouteScan(req, strlen(req), &pid, &pid_len, &esaf);
+    }
+    t_scan = bench_now() - t0;
+
+    //
+    // Routing frame
+    //
+    t0 = bench_now();
+    for (k=0; k<iterations; k++) {
+      isRouteFrame(frame, strlen(frame), &pid, &pid_len, &esaf);
+    }
+    t_frame = bench_now() - t0;
+
+    printf("request %d (%d bytes): json_loadb %8.1f ns  isRouteScan %8.1f ns%s  isRouteFrame %8.1f ns\n",
+           i, (int)strlen(req),
+           t_json  * 1.0e9 / iterations,
+           t_scan  * 1.0e9 / iterations, fallbacks ? " (falls back)" : "",
+           t_frame * 1.0e9 / iterations);
+  }
+
+  return bad ? 1 : 0;
+}
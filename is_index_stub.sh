@@ -0,0 +1,41 @@
+#! /usr/bin/bash
+#
+# Stand in for rapd.index when trying out the indexing service:
+#
+#   IS_INDEX_COMMAND=/path/to/is_index_stub.sh
+#
+# Takes the same arguments, reports progress, and writes a small
+# json result.  IS_INDEX_STUB_SECONDS (export it from the setup script,
+# the stub sees that environment, not ours) sets how long it pretends
+# to work, default 5, so there is time to try index_cancel.
+#
+json_fd=1
+progress_fd=2
+files=()
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+        --json)             ;;
+        --json-fd)          json_fd=$2; shift ;;
+        --progress-fd)      progress_fd=$2; shift ;;
+        --detector)         detector=$2; shift ;;
+        --hdf5_image_range) range=$2; shift ;;
+        *)                  files+=("$1") ;;
+    esac
+    shift
+done
+
+seconds=${IS_INDEX_STUB_SECONDS:-5}
+
+for ((i=1; i<=seconds; i++)); do
+    echo "Stub indexing ${files[*]}: $((100*i/seconds))%" >&${progress_fd}
+    sleep 1
+done
+
+list=""
+for f in "${files[@]}"; do
+    list="${list:+${list},}\"${f}\""
+done
+
+printf '{"stub":true,"files":[%s],"detector":"%s","range":"%s","cwd":"%s"}\n' \
+       "${list}" "${detector}" "${range}" "$(pwd)" >&${json_fd}